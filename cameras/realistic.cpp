@@ -28,11 +28,11 @@
 // realistic.ccp
 #include "realistic.h"
 #include "sampling.h"
-#include "shape.h"
 #include "film.h"
+#include "bxdf.h"
 #include "dynload.h"
 #include "paramset.h"
-#include "dynload.h"
+#include "error.h"
 #include "luxrays/utils/mc.h"
 
 #include <fstream>
@@ -41,6 +41,74 @@ using std::ifstream;
 using namespace luxrays;
 using namespace lux;
 
+class RealisticBSDF : public BSDF {
+public:
+	// RealisticBSDF Public Methods
+	RealisticBSDF(const DifferentialGeometry &dgs, const Normal &ngeom,
+		const Volume *exterior, const Volume *interior,
+		const RealisticCamera &cam, float u, float v) :
+		BSDF(dgs, ngeom, exterior, interior), camera(cam),
+		lensU(u), lensV(v) { }
+	virtual inline u_int NumComponents() const { return 1; }
+	virtual inline u_int NumComponents(BxDFType flags) const {
+		return (flags & (BSDF_REFLECTION | BSDF_DIFFUSE)) ==
+			(BSDF_REFLECTION | BSDF_DIFFUSE) ? 1U : 0U;
+	}
+	virtual bool SampleF(const SpectrumWavelengths &sw, const Vector &woW,
+		Vector *wiW, float u1, float u2, float u3,
+		SWCSpectrum *const f_, float *pdf, BxDFType flags = BSDF_ALL,
+		BxDFType *sampledType = NULL, float *pdfBack = NULL,
+		bool reverse = false) const {
+		if (!reverse || NumComponents(flags) == 0)
+			return false;
+		Point o;
+		Vector d;
+		float weight;
+		if (!camera.SampleLensRay(u1, u2, lensU, lensV, &o, &d,
+			&weight))
+			return false;
+		// The ray leaves the lens system somewhere on the front
+		// element, the eye vertex stays on its vertex as the offset
+		// is within the front aperture
+		*wiW = Normalize(camera.CameraToWorld * d);
+		*pdf = 1.f;
+		if (pdfBack)
+			*pdfBack = 0.f;
+		*f_ = SWCSpectrum(weight);
+		if (sampledType)
+			*sampledType = BxDFType(BSDF_REFLECTION | BSDF_DIFFUSE);
+		return true;
+	}
+	// The lens system can't be connected to from a given direction
+	virtual float Pdf(const SpectrumWavelengths &sw, const Vector &woW,
+		const Vector &wiW, BxDFType flags = BSDF_ALL) const {
+		return 0.f;
+	}
+	virtual SWCSpectrum F(const SpectrumWavelengths &sw, const Vector &woW,
+		const Vector &wiW, bool reverse, BxDFType flags = BSDF_ALL) const {
+		return SWCSpectrum(0.f);
+	}
+	virtual SWCSpectrum rho(const SpectrumWavelengths &sw,
+		BxDFType flags = BSDF_ALL) const { return SWCSpectrum(1.f); }
+	virtual SWCSpectrum rho(const SpectrumWavelengths &sw,
+		const Vector &woW, BxDFType flags = BSDF_ALL) const {
+		return SWCSpectrum(1.f);
+	}
+
+protected:
+	// RealisticBSDF Private Methods
+	virtual ~RealisticBSDF() { }
+	const RealisticCamera &camera;
+	float lensU, lensV;
+};
+
+// Number of film distance ranges with their own exit pupil bounds
+#define EXIT_PUPIL_BINS 64U
+// Film points per range and back lens points per axis traced to find
+// the exit pupil bounds
+#define EXIT_PUPIL_FILM_SAMPLES 16U
+#define EXIT_PUPIL_LENS_SAMPLES 48U
+
 RealisticCamera::RealisticCamera(const MotionSystem &world2cam,
                  const float Screen[4],
 				 float hither, float yon, 
@@ -68,65 +136,291 @@ RealisticCamera::RealisticCamera(const MotionSystem &world2cam,
     RasterToFilm = Inverse(FilmToRaster);
     FilmToCamera = Translate(Vector(0.f, 0.f, -filmDistance - distToBack));
     RasterToCamera =  FilmToCamera * RasterToFilm;
+
+    ComputeExitPupil();
 }   
 RealisticCamera::~RealisticCamera(void) {
 }
-float RealisticCamera::GenerateRay(const Sample &sample, Ray *ray) const {
+
+bool RealisticCamera::SampleLensRay(float imageX, float imageY,
+    float lensU, float lensV, Point *o, Vector *d, float *weight) const {
     // Generate raster and back lens samples
-    Point Pras(sample.imageX, sample.imageY, 0.f);
+    Point Pras(imageX, imageY, 0.f);
     Point PCamera(RasterToCamera * Pras);
-    float lensU, lensV;
-    ConcentricSampleDisk(sample.lensU, sample.lensV, &lensU, &lensV);
-    lensU *= backAperture;
-    lensV *= backAperture;
-    Point PBack(lensU, lensV, -distToBack);
-
-    ray->o = PCamera;
-    ray->d = Normalize(PBack - PCamera);
-    ray->time = GetTime(sample.time);
-    ray->mint = 0.;
-    ray->maxt = INFINITY;
-
-    float cos4 = ray->d.z;
+
+    // Sample the back lens within the exit pupil bounds of the film
+    // point distance, rotated around the axis toward the film point
+    const float rFilm = sqrtf(PCamera.x * PCamera.x + PCamera.y * PCamera.y);
+    const u_int bin = min(Floor2UInt(rFilm * 2.f / filmDiag * EXIT_PUPIL_BINS),
+        EXIT_PUPIL_BINS - 1);
+    const ExitPupilBounds &bounds(exitPupil[bin]);
+    if (bounds.xMin > bounds.xMax)
+        return false;
+    const float u = Lerp(lensU, bounds.xMin, bounds.xMax);
+    const float v = Lerp(lensV, bounds.yMin, bounds.yMax);
+    if (u * u + v * v > backAperture * backAperture)
+        return false;
+    const float cosPhi = rFilm > 0.f ? PCamera.x / rFilm : 1.f;
+    const float sinPhi = rFilm > 0.f ? PCamera.y / rFilm : 0.f;
+    Point PBack(cosPhi * u - sinPhi * v, sinPhi * u + cosPhi * v,
+        -distToBack);
+
+    *o = PCamera;
+    *d = Normalize(PBack - PCamera);
+
+    float cos4 = d->z;
     cos4 *= cos4;
     cos4 *= cos4;
 
-    // Iterate over the lens components, and intersect
-    DifferentialGeometry dg;
-    float thit;
-    for (int i = (int)lenses.size() -1 ; i >= 0; --i) {
-        if (lenses[i]->shape->Intersect(*ray, &thit, &dg)) {
-            // intersection, compute refracted ray
-            Normal n = (lenses[i]->entering == true) ? dg.nn : -dg.nn;
-            float eta = lenses[i]->eta;
-            float cos_i = Dot(-ray->d, n);
-            float sint2 = (eta * eta * (1 - cos_i*cos_i));
-            if (sint2 > 1.) { // total internal reflection, return dead ray
-                ray->mint = 1.f;
-                ray->maxt = 0.f;
-                return 1.f;
+    if (!TraceLenses(o, d))
+        return false;
+
+    // The back lens is only sampled within the bounds instead of
+    // its whole disk
+    const float pupilScale = (bounds.xMax - bounds.xMin) *
+        (bounds.yMax - bounds.yMin) /
+        (M_PI * backAperture * backAperture);
+    *weight = cos4 / filmDist2 * pupilScale;
+    return true;
+}
+
+float RealisticCamera::GenerateRay(const Scene &scene, const Sample &sample,
+    Ray *ray, float *x, float *y) const {
+    // The ray is traced directly instead of going through SampleW
+    // to keep the vignetting weight
+    // Callers still add the null contribution of a blocked ray to the
+    // film, so the position and the ray are always set
+    *x = sample.imageX;
+    *y = sample.imageY;
+    Point o;
+    Vector d;
+    float weight;
+    if (!SampleLensRay(sample.imageX, sample.imageY, sample.lensU,
+        sample.lensV, &o, &d, &weight)) {
+        *ray = Ray(Point(0.f, 0.f, 0.f), Vector(0.f, 0.f, 1.f));
+        ray->mint = 0.f;
+        ray->maxt = 0.f;
+        *ray *= CameraToWorld;
+        ray->time = sample.realTime;
+        return 0.f;
+    }
+
+    *ray = Ray(o, d);
+    ray->mint = 0.f;
+    ray->maxt = (ClipYon - ClipHither) / d.z;
+    *ray *= CameraToWorld;
+    ray->time = sample.realTime;
+    return weight;
+}
+
+bool RealisticCamera::SampleW(MemoryArena &arena,
+    const SpectrumWavelengths &sw, const Scene &scene,
+    float u1, float u2, float u3, BSDF **bsdf, float *pdf,
+    SWCSpectrum *We) const {
+    // The ray origin depends on both the lens and the film samples,
+    // the eye vertex is put on the front vertex and RealisticBSDF
+    // only samples the direction leaving the lens system
+    const Point ps(CameraToWorld * Point(0.f, 0.f, 0.f));
+    const Normal normal(CameraToWorld * Normal(0.f, 0.f, 1.f));
+    DifferentialGeometry dg(ps, normal, CameraToWorld * Vector(1, 0, 0),
+        CameraToWorld * Vector(0, 1, 0), Normal(0, 0, 0),
+        Normal(0, 0, 0), 0, 0, NULL);
+    const Volume *v = GetVolume();
+    *bsdf = ARENA_ALLOC(arena, RealisticBSDF)(dg, normal, v, v, *this,
+        u1, u2);
+    *pdf = 1.f;
+    *We = SWCSpectrum(1.f);
+    return true;
+}
+
+bool RealisticCamera::SampleW(MemoryArena &arena,
+    const SpectrumWavelengths &sw, const Scene &scene,
+    const Point &p, const Normal &n, float u1, float u2, float u3,
+    BSDF **bsdf, float *pdf, float *pdfDirect, SWCSpectrum *We) const {
+    if (!SampleW(arena, sw, scene, u1, u2, u3, bsdf, pdf, We))
+        return false;
+    *pdfDirect = *pdf;
+    return true;
+}
+
+bool RealisticCamera::GetSamplePosition(const Point &p, const Vector &wi,
+    float distance, float *x, float *y) const {
+    const Transform WorldToCamera(Inverse(CameraToWorld));
+    const Vector wC(Normalize(WorldToCamera * wi));
+    const float cosi = wC.z;
+    if (cosi <= 0.f || (!isinf(distance) && (distance * cosi < ClipHither ||
+        distance * cosi > ClipYon)))
+        return false;
+
+    // Step back in front of the first element so that a point lying
+    // on its surface still hits it, then trace toward the film
+    float zFront = 0.f;
+    if (!lenses.empty() && lenses[0].radius < 0.f)
+        zFront = -lenses[0].radius - sqrtf(max(0.f,
+            lenses[0].radius * lenses[0].radius - lenses[0].apRadius2));
+    Point o(WorldToCamera * p);
+    o += wC * (max(0.f, zFront - o.z) / cosi + 1e-3f);
+    Vector d(-wC);
+    if (!TraceLensesBack(&o, &d) || d.z >= 0.f)
+        return false;
+    const float zFilm = -filmDistance - distToBack;
+    const Point pRaster(Inverse(RasterToCamera) *
+        (o + d * ((zFilm - o.z) / d.z)));
+    *x = pRaster.x;
+    *y = pRaster.y;
+    return true;
+}
+
+bool RealisticCamera::TraceLenses(Point *o, Vector *d) const {
+    // Iterate over the lens components from the back, rays travel
+    // toward +z
+    for (int i = (int)lenses.size() - 1; i >= 0; --i) {
+        const Lens &lens(lenses[i]);
+        if (lens.radius == 0.f) {
+            // The stop doesn't bend rays
+            if (d->z <= 0.f)
+                return false;
+            const float thit = (lens.center - o->z) / d->z;
+            if (thit < 0.f)
+                return false;
+            *o += thit * *d;
+            if (o->x * o->x + o->y * o->y > lens.apRadius2)
+                return false;
+            continue;
+        }
+
+        // Intersect the sphere, an element with a positive radius is
+        // convex toward the scene so it is hit on the far side
+        const Vector oc(o->x, o->y, o->z - lens.center);
+        const float b = Dot(oc, *d);
+        const float c = Dot(oc, oc) - lens.radius * lens.radius;
+        const float delta = b * b - c;
+        if (delta < 0.f)
+            return false;
+        const float thit = lens.radius > 0.f ? -b + sqrtf(delta) :
+            -b - sqrtf(delta);
+        if (thit < 0.f)
+            return false;
+        const Point p(*o + thit * *d);
+        if (p.x * p.x + p.y * p.y > lens.apRadius2)
+            return false;
+
+        // Compute refracted ray, the normal faces the incoming ray
+        Vector n(Vector(p.x, p.y, p.z - lens.center) / lens.radius);
+        if (Dot(n, *d) > 0.f)
+            n = -n;
+        const float eta = lens.eta;
+        const float cos_i = -Dot(*d, n);
+        const float sint2 = eta * eta * (1.f - cos_i * cos_i);
+        if (sint2 > 1.f) // total internal reflection
+            return false;
+        // use snell's law
+        const float cost = sqrtf(max(0.f, 1.f - sint2));
+        *o = p;
+        *d = Normalize(eta * *d + (eta * cos_i - cost) * n);
+    }
+    return true;
+}
+
+bool RealisticCamera::TraceLensesBack(Point *o, Vector *d) const {
+    // Iterate over the lens components from the front, rays travel
+    // toward -z
+    for (u_int i = 0; i < lenses.size(); ++i) {
+        const Lens &lens(lenses[i]);
+        if (lens.radius == 0.f) {
+            if (d->z >= 0.f)
+                return false;
+            const float thit = (lens.center - o->z) / d->z;
+            if (thit < 0.f)
+                return false;
+            *o += thit * *d;
+            if (o->x * o->x + o->y * o->y > lens.apRadius2)
+                return false;
+            continue;
+        }
+
+        // Coming from the scene, an element with a positive radius
+        // is hit on the near side
+        const Vector oc(o->x, o->y, o->z - lens.center);
+        const float b = Dot(oc, *d);
+        const float c = Dot(oc, oc) - lens.radius * lens.radius;
+        const float delta = b * b - c;
+        if (delta < 0.f)
+            return false;
+        const float thit = lens.radius > 0.f ? -b - sqrtf(delta) :
+            -b + sqrtf(delta);
+        if (thit < 0.f)
+            return false;
+        const Point p(*o + thit * *d);
+        if (p.x * p.x + p.y * p.y > lens.apRadius2)
+            return false;
+
+        // The relative index is inverted when leaving the element
+        Vector n(Vector(p.x, p.y, p.z - lens.center) / lens.radius);
+        if (Dot(n, *d) > 0.f)
+            n = -n;
+        const float eta = 1.f / lens.eta;
+        const float cos_i = -Dot(*d, n);
+        const float sint2 = eta * eta * (1.f - cos_i * cos_i);
+        if (sint2 > 1.f)
+            return false;
+        const float cost = sqrtf(max(0.f, 1.f - sint2));
+        *o = p;
+        *d = Normalize(eta * *d + (eta * cos_i - cost) * n);
+    }
+    return true;
+}
+
+void RealisticCamera::ComputeExitPupil() {
+    exitPupil.resize(EXIT_PUPIL_BINS);
+    const float filmRadius = filmDiag / 2.f;
+    const float zFilm = -filmDistance - distToBack;
+    const float step = 2.f * backAperture / EXIT_PUPIL_LENS_SAMPLES;
+    const float backAperture2 = backAperture * backAperture;
+    u_int emptyBins = 0;
+    for (u_int i = 0; i < EXIT_PUPIL_BINS; ++i) {
+        ExitPupilBounds &bounds(exitPupil[i]);
+        bounds.xMin = bounds.yMin = INFINITY;
+        bounds.xMax = bounds.yMax = -INFINITY;
+        const float r0 = filmRadius * i / EXIT_PUPIL_BINS;
+        const float r1 = filmRadius * (i + 1) / EXIT_PUPIL_BINS;
+
+        // Trace a grid of back lens points from film points on the
+        // positive x axis spanning the distance range
+        for (u_int f = 0; f <= EXIT_PUPIL_FILM_SAMPLES; ++f) {
+            const Point pFilm(Lerp(static_cast<float>(f) /
+                EXIT_PUPIL_FILM_SAMPLES, r0, r1), 0.f, zFilm);
+            for (u_int v = 0; v < EXIT_PUPIL_LENS_SAMPLES; ++v) {
+                const float y = -backAperture + (v + .5f) * step;
+                for (u_int u = 0; u < EXIT_PUPIL_LENS_SAMPLES; ++u) {
+                    const float x = -backAperture + (u + .5f) * step;
+                    if (x * x + y * y > backAperture2)
+                        continue;
+                    Point o(pFilm);
+                    Vector d(Normalize(Point(x, y, -distToBack) - pFilm));
+                    if (!TraceLenses(&o, &d))
+                        continue;
+                    bounds.xMin = min(bounds.xMin, x);
+                    bounds.xMax = max(bounds.xMax, x);
+                    bounds.yMin = min(bounds.yMin, y);
+                    bounds.yMax = max(bounds.yMax, y);
+                }
             }
-            // use snell's law
-            float cost = sqrtf(max(0.f, 1.f - sint2));
-            float nscale = eta * cos_i - cost;
-            Vector d(n.x * nscale + eta * ray->d.x, 
-                     n.y * nscale + eta * ray->d.y, 
-                     n.z * nscale + eta * ray->d.z);
-
-            ray->o = (*ray)(thit);
-            ray->d = Normalize(d);
-            ray->mint = 0.f;
-            ray->maxt = INFINITY;
         }
-        else { // no intersection, return dead ray
-            ray->mint = 1.f;
-            ray->maxt = 0.f;
-            return 1.f;
+
+        if (bounds.xMin > bounds.xMax) {
+            ++emptyBins;
+            continue;
         }
+        // Extend the bounds to cover the space between the grid points
+        bounds.xMin = max(bounds.xMin - step, -backAperture);
+        bounds.xMax = min(bounds.xMax + step, backAperture);
+        bounds.yMin = max(bounds.yMin - step, -backAperture);
+        bounds.yMax = min(bounds.yMax + step, backAperture);
     }
-    ray->maxt = (ClipYon - ClipHither) / ray->d.z;
-    *ray *= CameraToWorld;
-    return cos4 / filmDist2;
+    if (emptyBins > 0)
+        LOG(LUX_WARNING, LUX_NOERROR) << "Realistic camera: no ray leaves the lens system for " <<
+            (100 * emptyBins / EXIT_PUPIL_BINS) << "% of the film radius";
 }
 
 float RealisticCamera::ParseLensData(const string& specfile) {
@@ -136,9 +430,8 @@ float RealisticCamera::ParseLensData(const string& specfile) {
     if (!file)
         printf("Couldn't open camera specfile...");
     string lineread;
-    float r, sep, nt, aperture, ni = 1.f;
+    float r, sep, nt, aperture = 0.f, ni = 1.f;
     float accumdist = 0.;
-    bool entering;
     lenses.clear();
     
     while (std::getline(file, lineread))
@@ -148,39 +441,15 @@ float RealisticCamera::ParseLensData(const string& specfile) {
         {
             // stop is a disc instead of a sphere
             if (r == 0.0) {
-                ParamSet paramSet;
-                float height = -accumdist;
-                float radius = apertureDiameter / 2.0f;
-                float innerradius = 0.f;
-                paramSet.AddFloat("height", &height);
-                paramSet.AddFloat("radius", &radius);
-                paramSet.AddFloat("innerradius", &innerradius);
-                boost::shared_ptr<Shape> shape = 
-                    MakeShape("disk", Transform(), false, paramSet);
-				boost::shared_ptr<Lens> o (new Lens(false, 1.f, aperture, shape));
-                lenses.push_back(o);
+                lenses.push_back(Lens(0.f, -accumdist, 1.f,
+                    apertureDiameter));
                 ni = 1.f;
             }
             else {
-                // camera to lens object transform
-                float radius = fabsf(r);
-                Transform lensToCam;
-                if (r > 0) {
-                    lensToCam = Translate(Vector(0., 0., -accumdist - radius));
-                    entering = false;
-                }
-                else {
-                    lensToCam = Translate(Vector(0., 0., -accumdist + radius));
-                    entering = true;
-                }
-                ParamSet paramSet;
-                paramSet.AddFloat("radius", &radius);
-                paramSet.AddFloat("aperture", &aperture);
-                boost::shared_ptr<Shape> shape = 
-                    MakeShape("lenscomponent", lensToCam, false, 
-                    paramSet);
-				boost::shared_ptr<Lens> o (new Lens(entering, nt/ni, aperture, shape));
-                lenses.push_back(o);
+                // the center of the sphere is behind the vertex
+                // for positive radii
+                lenses.push_back(Lens(r, -accumdist - r, nt / ni,
+                    aperture));
                 ni = nt;
             }
             accumdist += sep;
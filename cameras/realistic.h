@@ -27,14 +27,24 @@
 namespace lux
 {
 
+// A spherical lens element, or the aperture stop when radius is 0.
+// Elements are centered on the z axis of the camera space.
 struct Lens {
-    Lens(const bool ent, const float n, const float ap,
-        boost::shared_ptr<Shape> shape) 
-        : entering(ent), eta(n), aperture(ap), shape(shape) { }
-    bool entering;
+    Lens(const float r, const float c, const float n, const float ap)
+        : radius(r), center(c), eta(n), apRadius2(ap * ap / 4.f) { }
+    // Signed curvature radius
+    float radius;
+    // z of the center of the sphere, or of the plane of the stop
+    float center;
     float eta;
-    float aperture;
-    boost::shared_ptr<Shape> shape;
+    // Squared radius of the element aperture
+    float apRadius2;
+};
+
+// Bounds of the region of the back element through which rays leave the
+// lens system, for film points in a range of distances to the lens axis
+struct ExitPupilBounds {
+    float xMin, xMax, yMin, yMax;
 };
 
 class RealisticCamera : public Camera {
@@ -45,18 +55,17 @@ public:
 		float filmdistance, float aperture_diameter, string specfile,
 		float filmdiag, Film *film);
 	virtual ~RealisticCamera(void);
-	virtual float GenerateRay(const Sample &sample, Ray *) const;
+	virtual float GenerateRay(const Scene &scene, const Sample &sample,
+		Ray *ray, float *x, float *y) const;
 	virtual bool SampleW(luxrays::MemoryArena &arena, const SpectrumWavelengths &sw,
 		const Scene &scene, float u1, float u2, float u3,
-		BSDF **bsdf, float *pdf, SWCSpectrum *We) const {
-		return false;
-	}
+		BSDF **bsdf, float *pdf, SWCSpectrum *We) const;
 	virtual bool SampleW(luxrays::MemoryArena &arena, const SpectrumWavelengths &sw,
 		const Scene &scene, const Point &p, const Normal &n,
 		float u1, float u2, float u3, BSDF **bsdf, float *pdf,
-		float *pdfDirect, SWCSpectrum *We) const { return false; }
+		float *pdfDirect, SWCSpectrum *We) const;
 	virtual bool GetSamplePosition(const Point &p, const Vector &wi,
-		float distance, float *x, float *y) const { return false; }
+		float distance, float *x, float *y) const;
 	virtual bool IsDelta() const { return apertureDiameter == 0.f; }
 	virtual bool IsLensBased() const { return true; }
 	virtual BBox Bounds() const { return BBox(); }
@@ -67,14 +76,26 @@ public:
 
 	static Camera *CreateCamera(const MotionSystem &world2cam,
 		const ParamSet &params, Film *film);
-  
+
+	// Traces a ray from the raster position through the back lens
+	// point sampled within the exit pupil, the returned camera space
+	// ray leaves the front element
+	bool SampleLensRay(float imageX, float imageY, float lensU,
+		float lensV, Point *o, Vector *d, float *weight) const;
+
 private:
 	float ParseLensData(const string& specfile);
+	bool TraceLenses(Point *o, Vector *d) const;
+	bool TraceLensesBack(Point *o, Vector *d) const;
+	void ComputeExitPupil();
 
 	float filmDistance, filmDist2, filmDiag;
 	float apertureDiameter, distToBack, backAperture;
  
-	vector<boost::shared_ptr<Lens> > lenses;
+	vector<Lens> lenses;
+	// Exit pupil bounds for film points on the positive x axis,
+	// sampled at regular distances to the axis
+	vector<ExitPupilBounds> exitPupil;
 
 	Transform RasterToFilm, RasterToCamera, FilmToCamera;
 };
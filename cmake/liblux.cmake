@@ -37,12 +37,17 @@ IF (NOT BISON_NOT_AVAILABLE AND NOT FLEX_NOT_AVAILABLE)
 	FLEX_TARGET(LuxLexer ${CMAKE_SOURCE_DIR}/core/luxlex.l ${CMAKE_BINARY_DIR}/luxlex.cpp COMPILE_FLAGS "${FLEX_FLAGS}")
 	SET_SOURCE_FILES_PROPERTIES(${CMAKE_BINARY_DIR}/luxlex.cpp GENERATED)
 	#SOURCE_GROUP("Parser Files" FILES core/luxlex.l)
+	# Reentrant build of the same lexer, used to parse the included
+	# files in the background (see core/includeprefetch.cpp)
+	FLEX_TARGET(LuxPrefetchLexer ${CMAKE_SOURCE_DIR}/core/luxlex.l ${CMAKE_BINARY_DIR}/luxprefetchlex.cpp COMPILE_FLAGS "${FLEX_FLAGS} --reentrant --prefix=luxprefetch")
+	SET_SOURCE_FILES_PROPERTIES(${CMAKE_BINARY_DIR}/luxprefetchlex.cpp PROPERTIES GENERATED TRUE COMPILE_DEFINITIONS LUX_PREFETCH_LEXER)
 	SET(lux_parser_src
 		core/luxparse.y
 		core/luxlex.l)
 	SOURCE_GROUP("Parser Files" FILES ${lux_core_parser_src})
 
 	ADD_FLEX_BISON_DEPENDENCY(LuxLexer LuxParser)
+	ADD_FLEX_BISON_DEPENDENCY(LuxPrefetchLexer LuxParser)
 ENDIF (NOT BISON_NOT_AVAILABLE AND NOT FLEX_NOT_AVAILABLE)
 #############################################################################
 #############################################################################
@@ -53,12 +58,14 @@ ENDIF (NOT BISON_NOT_AVAILABLE AND NOT FLEX_NOT_AVAILABLE)
 SET(lux_core_generated_src
 	${CMAKE_BINARY_DIR}/luxparse.cpp
 	${CMAKE_BINARY_DIR}/luxlex.cpp
+	${CMAKE_BINARY_DIR}/luxprefetchlex.cpp
 	)
 SOURCE_GROUP("Source Files\\Core\\Generated" FILES ${lux_core_generated_src})
 
 SET(lux_core_src
 	core/api.cpp
 	core/asyncstream.cpp
+	core/binaryscene.cpp
 	core/camera.cpp
 	core/cameraresponse.cpp
 	core/context.cpp
@@ -71,8 +78,10 @@ SET(lux_core_src
 	core/exrio.cpp
 	core/filedata.cpp
 	core/film.cpp
+	core/hierarchicaldistribution.cpp
 	core/igiio.cpp
 	core/imagereader.cpp
+	core/includeprefetch.cpp
 	core/light.cpp
 	core/material.cpp
 	core/osfunc.cpp
@@ -87,9 +96,11 @@ SET(lux_core_src
 	core/scene.cpp
 	core/shape.cpp
 	core/texture.cpp
+	core/texturecache.cpp
 	core/tgaio.cpp
 	core/timer.cpp
 	core/tigerhash.cpp
+	core/tonecurve.cpp
 	core/transport.cpp
 	core/util.cpp
 	core/volume.cpp
@@ -479,6 +490,7 @@ SOURCE_GROUP("Source Files\\C++ API" FILES ${lux_cpp_api_src})
 SET(lux_core_hdr
 	core/api.h
 	core/asyncstream.h
+	core/binaryscene.h
 	core/bsh.h
 	core/camera.h
 	core/cameraresponse.h
@@ -492,13 +504,17 @@ SET(lux_core_hdr
 	core/filedata.h
 	core/film.h
 	core/filter.h
+	core/hierarchicaldistribution.h
 	core/igiio.h
 	core/imagereader.h
+	core/includeprefetch.h
 	core/kdtree.h
 	core/light.h
 	core/lux.h
 	core/material.h
 	core/mipmap.h
+	core/mipmaptiled.h
+	core/numparse.h
 	core/octree.h
 	core/osfunc.h
 	core/paramset.h
@@ -515,10 +531,12 @@ SET(lux_core_hdr
 	core/shape.h
 	core/streamio.h
 	core/texture.h
+	core/texturecache.h
 	core/texturecolor.h
 	core/tgaio.h
 	core/timer.h
 	core/tigerhash.h
+	core/tonecurve.h
 	core/tonemap.h
 	core/transport.h
 	core/version.h
@@ -28,6 +28,9 @@
 #include "error.h"
 #include "version.h"
 #include "osfunc.h"
+#include "film.h"
+#include "binaryscene.h"
+#include "includeprefetch.h"
 
 #include "boost/date_time/posix_time/posix_time.hpp"
 #include <boost/thread/mutex.hpp>
@@ -538,6 +541,10 @@ bool parseFile(const char *filename) {
 
 	bool parse_success = false;
 
+	// Binary scenes are mapped and replayed directly
+	if (IsBinarySceneFile(filename))
+		return ParseBinaryScene(filename);
+
 	if (strcmp(filename, "-") == 0)
 		yyin = stdin;
 	else
@@ -551,11 +558,13 @@ bool parseFile(const char *filename) {
 		// before parsing
 		include_clear();
 		yyrestart(yyin);
+		StartIncludePrefetch(filename);
 		try {
 			parse_success = (yyparse() == 0);
 		} catch (std::runtime_error& e) {
 			LOG(LUX_SEVERE, LUX_SYSTEM)  << "Exception during parsing (file '" << currentFile << "', line: " << lineNum << "): " << e.what();
 		}
+		StopIncludePrefetch();
 		
 		if (yyin != stdin)
 			fclose(yyin);
@@ -596,6 +605,24 @@ int luxParsePartial(const char *filename)
 	return parseFile(filename);
 }
 
+int luxExportBinaryScene(const char *filename, const char *binaryFilename)
+{
+	BinarySceneWriter writer(binaryFilename);
+	if (!writer.IsOpen()) {
+		LOG(LUX_SEVERE, LUX_NOFILE) << "Unable to write binary scene file '" << binaryFilename << "'";
+		return false;
+	}
+	Context::GetActive()->SetSceneExport(&writer);
+	const bool parse_success = parseFile(filename);
+	Context::GetActive()->SetSceneExport(NULL);
+	if (!writer.Close()) {
+		LOG(LUX_SEVERE, LUX_SYSTEM) << "Error while writing binary scene file '" << binaryFilename << "'";
+		return false;
+	}
+
+	return parse_success;
+}
+
 void luxStartRenderingAfterParse(const bool start) {
 	Context::GetActive()->StartRenderingAfterParse(start);
 }
@@ -726,6 +753,37 @@ extern "C" float* luxAlphaBuffer()
 	return Context::GetActive()->AlphaBuffer();
 }
 
+extern "C" unsigned int luxFramebufferVersion()
+{
+	return Context::GetActive()->FramebufferVersion();
+}
+
+extern "C" bool luxMapFramebuffer(FramebufferMapping *mapping)
+{
+	boost::shared_ptr<const FramebufferSnapshot> snapshot(Context::GetActive()->GetFramebufferSnapshot());
+	if (!snapshot) {
+		mapping->handle = NULL;
+		return false;
+	}
+
+	mapping->version = snapshot->version;
+	mapping->width = snapshot->width;
+	mapping->height = snapshot->height;
+	mapping->pixels = &(snapshot->pixels[0]);
+	mapping->floatPixels = &(snapshot->floatPixels[0]);
+	mapping->dirtyRectCount = snapshot->dirtyRects.size() / 4;
+	mapping->dirtyRects = snapshot->dirtyRects.empty() ? NULL : &(snapshot->dirtyRects[0]);
+	// The reference keeps the buffers alive until the mapping is released
+	mapping->handle = new boost::shared_ptr<const FramebufferSnapshot>(snapshot);
+	return true;
+}
+
+extern "C" void luxUnmapFramebuffer(FramebufferMapping *mapping)
+{
+	delete static_cast<boost::shared_ptr<const FramebufferSnapshot> *>(mapping->handle);
+	mapping->handle = NULL;
+}
+
 //histogram access
 extern "C" void luxGetHistogramImage(unsigned char *outPixels,
 	unsigned int width, unsigned int height, int options)
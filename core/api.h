@@ -54,6 +54,9 @@ LUX_EXPORT void luxInit();
 LUX_EXPORT int luxParse(const char *filename);
 /* allows for parsing of partial files, caller does error handling */
 LUX_EXPORT int luxParsePartial(const char *filename);
+/* parses a scene file and records its API calls to a binary scene file (.lxb)
+ * instead of executing them */
+LUX_EXPORT int luxExportBinaryScene(const char *filename, const char *binaryFilename);
 // Set if to start the rendering after the end of parsing phase (default is true)
 // NOTE: this feature is not currently supported by network rendering
 LUX_EXPORT void luxStartRenderingAfterParse(const bool start);
@@ -164,6 +167,27 @@ LUX_EXPORT unsigned char* luxFramebuffer();
 LUX_EXPORT float* luxFloatFramebuffer();
 LUX_EXPORT float* luxAlphaBuffer();
 
+/* Shared framebuffer access
+ * luxMapFramebuffer gives read-only access to the last published display
+ * image without copying it, its buffers remain valid and unchanged until
+ * luxUnmapFramebuffer is called. The version is incremented each time a
+ * new image is published, luxFramebufferVersion is cheap enough to be
+ * polled. */
+struct FramebufferMapping {
+	unsigned int version;
+	unsigned int width, height;
+	const unsigned char *pixels; // RGB, 8 bits gamma corrected
+	const float *floatPixels; // RGB, linear
+	// Regions that changed since the previous version,
+	// as x, y, width, height tuples
+	unsigned int dirtyRectCount;
+	const unsigned int *dirtyRects;
+	void *handle;
+};
+LUX_EXPORT unsigned int luxFramebufferVersion();
+LUX_EXPORT bool luxMapFramebuffer(FramebufferMapping *mapping);
+LUX_EXPORT void luxUnmapFramebuffer(FramebufferMapping *mapping);
+
 /* User defined sampling */
 LUX_EXPORT void luxSetUserSamplingMap(const float *map);
 // NOTE: returns a copy of the map, it is up to the caller to free the allocated memory !
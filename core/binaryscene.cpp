@@ -0,0 +1,717 @@
+/***************************************************************************
+ *   Copyright (C) 1998-2013 by authors (see AUTHORS.txt)                  *
+ *                                                                         *
+ *   This file is part of LuxRender.                                       *
+ *                                                                         *
+ *   Lux Renderer is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   Lux Renderer is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+ *                                                                         *
+ *   This project is based on PBRT ; see http://www.pbrt.org               *
+ *   Lux Renderer website : http://www.luxrender.net                       *
+ ***************************************************************************/
+
+// binaryscene.cpp*
+#include "binaryscene.h"
+#include "context.h"
+#include "osfunc.h"
+#include "error.h"
+
+#include <cstring>
+#include <boost/filesystem.hpp>
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/iostreams/device/mapped_file.hpp>
+#include <boost/scoped_array.hpp>
+#include <boost/shared_ptr.hpp>
+
+using namespace lux;
+
+static const char binarySceneMagic[8] = { 'L', 'U', 'X', 'S', 'C', 'N', 'B', '\0' };
+static const u_int binarySceneVersion = 1;
+// Alignment of the numeric arrays, relative to the start of the file
+#define BINARY_SCENE_ALIGNMENT 16
+
+bool lux::IsBinarySceneFile(const string &filename)
+{
+	return boost::iequals(boost::filesystem::path(filename).extension().string(),
+		".lxb");
+}
+
+//------------------------------------------------------------------------------
+// BinarySceneWriter
+//------------------------------------------------------------------------------
+
+BinarySceneWriter::BinarySceneWriter(const string &filename) :
+	out(filename.c_str(), std::ios::out | std::ios::binary | std::ios::trunc)
+{
+	if (!out.is_open())
+		return;
+	// The header is the only part written with a fixed byte order, the
+	// flag allows to detect files generated on a different architecture
+	const bool isLittleEndian = osIsLittleEndian();
+	out.write(binarySceneMagic, sizeof(binarySceneMagic));
+	osWriteLittleEndianUInt(isLittleEndian, out, binarySceneVersion);
+	osWriteLittleEndianUInt(isLittleEndian, out, isLittleEndian ? 1 : 0);
+	osWriteLittleEndianUInt(isLittleEndian, out, sizeof(float));
+	osWriteLittleEndianUInt(isLittleEndian, out, sizeof(int));
+}
+
+BinarySceneWriter::~BinarySceneWriter()
+{
+	Close();
+}
+
+bool BinarySceneWriter::Close()
+{
+	if (!out.is_open())
+		return true;
+	out.flush();
+	const bool ok = out.good();
+	out.close();
+	return ok;
+}
+
+void BinarySceneWriter::WriteUInt(u_int value)
+{
+	out.write(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+void BinarySceneWriter::WriteString(const string &value)
+{
+	WriteUInt(value.size());
+	out.write(value.data(), value.size());
+}
+
+void BinarySceneWriter::Align()
+{
+	static const char zeros[BINARY_SCENE_ALIGNMENT] = { 0 };
+	const u_int offset = static_cast<u_int>(static_cast<std::streamoff>(out.tellp()) %
+		BINARY_SCENE_ALIGNMENT);
+	if (offset > 0)
+		out.write(zeros, BINARY_SCENE_ALIGNMENT - offset);
+}
+
+// Numeric items: element size followed by the aligned raw array
+template <class T> void BinarySceneWriter::WriteItems(u_int type,
+	const vector<ParamSetItem<T> *> &items)
+{
+	for (u_int i = 0; i < items.size(); ++i) {
+		WriteUInt(type);
+		WriteString(items[i]->name);
+		WriteUInt(items[i]->nItems);
+		WriteUInt(sizeof(T));
+		Align();
+		out.write(reinterpret_cast<const char *>(items[i]->data),
+			sizeof(T) * items[i]->nItems);
+	}
+}
+namespace lux {
+template <> void BinarySceneWriter::WriteItems(u_int type,
+	const vector<ParamSetItem<bool> *> &items)
+{
+	for (u_int i = 0; i < items.size(); ++i) {
+		WriteUInt(type);
+		WriteString(items[i]->name);
+		WriteUInt(items[i]->nItems);
+		for (u_int j = 0; j < items[i]->nItems; ++j)
+			out.put(items[i]->data[j] ? 1 : 0);
+	}
+}
+template <> void BinarySceneWriter::WriteItems(u_int type,
+	const vector<ParamSetItem<string> *> &items)
+{
+	for (u_int i = 0; i < items.size(); ++i) {
+		WriteUInt(type);
+		WriteString(items[i]->name);
+		WriteUInt(items[i]->nItems);
+		for (u_int j = 0; j < items[i]->nItems; ++j)
+			WriteString(items[i]->data[j]);
+	}
+}
+}//namespace lux
+
+void BinarySceneWriter::WriteParams(const ParamSet &params)
+{
+	WriteUInt(params.ints.size() + params.bools.size() +
+		params.floats.size() + params.points.size() +
+		params.vectors.size() + params.normals.size() +
+		params.spectra.size() + params.strings.size() +
+		params.textures.size());
+	WriteItems(PARAM_TYPE_INT, params.ints);
+	WriteItems(PARAM_TYPE_BOOL, params.bools);
+	WriteItems(PARAM_TYPE_FLOAT, params.floats);
+	WriteItems(PARAM_TYPE_POINT, params.points);
+	WriteItems(PARAM_TYPE_VECTOR, params.vectors);
+	WriteItems(PARAM_TYPE_NORMAL, params.normals);
+	WriteItems(PARAM_TYPE_COLOR, params.spectra);
+	WriteItems(PARAM_TYPE_STRING, params.strings);
+	WriteItems(PARAM_TYPE_TEXTURE, params.textures);
+}
+
+void BinarySceneWriter::WriteCall(const string &command, u_int nStrings,
+	const string *strings, u_int nFloats, const float *floats,
+	const ParamSet *params)
+{
+	if (!IsOpen())
+		return;
+	WriteString(command);
+	WriteUInt(nStrings);
+	for (u_int i = 0; i < nStrings; ++i)
+		WriteString(strings[i]);
+	WriteUInt(nFloats);
+	out.write(reinterpret_cast<const char *>(floats),
+		sizeof(float) * nFloats);
+	WriteUInt(params ? 1 : 0);
+	if (params)
+		WriteParams(*params);
+}
+
+void BinarySceneWriter::Write(const string &command)
+{
+	WriteCall(command, 0, NULL, 0, NULL, NULL);
+}
+
+void BinarySceneWriter::Write(const string &command, const string &name,
+	const ParamSet &params)
+{
+	WriteCall(command, 1, &name, 0, NULL, &params);
+}
+
+void BinarySceneWriter::Write(const string &command, const string &id,
+	const string &name, const ParamSet &params)
+{
+	const string strings[2] = { id, name };
+	WriteCall(command, 2, strings, 0, NULL, &params);
+}
+
+void BinarySceneWriter::Write(const string &command, const string &name)
+{
+	WriteCall(command, 1, &name, 0, NULL, NULL);
+}
+
+void BinarySceneWriter::Write(const string &command, float x, float y)
+{
+	const float floats[2] = { x, y };
+	WriteCall(command, 0, NULL, 2, floats, NULL);
+}
+
+void BinarySceneWriter::Write(const string &command, float x, float y,
+	float z)
+{
+	const float floats[3] = { x, y, z };
+	WriteCall(command, 0, NULL, 3, floats, NULL);
+}
+
+void BinarySceneWriter::Write(const string &command, float a, float x,
+	float y, float z)
+{
+	const float floats[4] = { a, x, y, z };
+	WriteCall(command, 0, NULL, 4, floats, NULL);
+}
+
+void BinarySceneWriter::Write(const string &command, float ex, float ey,
+	float ez, float lx, float ly, float lz, float ux, float uy, float uz)
+{
+	const float floats[9] = { ex, ey, ez, lx, ly, lz, ux, uy, uz };
+	WriteCall(command, 0, NULL, 9, floats, NULL);
+}
+
+void BinarySceneWriter::Write(const string &command, float tr[16])
+{
+	WriteCall(command, 0, NULL, 16, tr, NULL);
+}
+
+void BinarySceneWriter::Write(const string &command, u_int n, float *d)
+{
+	WriteCall(command, 0, NULL, n, d, NULL);
+}
+
+void BinarySceneWriter::Write(const string &command, const string &name,
+	const string &type, const string &texname, const ParamSet &params)
+{
+	const string strings[3] = { name, type, texname };
+	WriteCall(command, 3, strings, 0, NULL, &params);
+}
+
+void BinarySceneWriter::Write(const string &command, const string &name,
+	float a, float b, const string &transform)
+{
+	const string strings[2] = { name, transform };
+	const float floats[2] = { a, b };
+	WriteCall(command, 2, strings, 2, floats, NULL);
+}
+
+//------------------------------------------------------------------------------
+// ParseBinaryScene
+//------------------------------------------------------------------------------
+
+namespace {
+
+enum BinarySceneCall {
+	BINARY_IDENTITY, BINARY_TRANSLATE, BINARY_TRANSFORM,
+	BINARY_CONCATTRANSFORM, BINARY_ROTATE, BINARY_SCALE, BINARY_LOOKAT,
+	BINARY_COORDINATESYSTEM, BINARY_COORDSYSTRANSFORM, BINARY_SETEPSILON,
+	BINARY_PIXELFILTER, BINARY_FILM, BINARY_SAMPLER, BINARY_ACCELERATOR,
+	BINARY_SURFACEINTEGRATOR, BINARY_VOLUMEINTEGRATOR, BINARY_CAMERA,
+	BINARY_WORLDBEGIN, BINARY_ATTRIBUTEBEGIN, BINARY_ATTRIBUTEEND,
+	BINARY_TRANSFORMBEGIN, BINARY_TRANSFORMEND, BINARY_MOTIONBEGIN,
+	BINARY_MOTIONEND, BINARY_TEXTURE, BINARY_MATERIAL,
+	BINARY_MAKENAMEDMATERIAL, BINARY_MAKENAMEDVOLUME, BINARY_NAMEDMATERIAL,
+	BINARY_LIGHTGROUP, BINARY_LIGHTSOURCE, BINARY_AREALIGHTSOURCE,
+	BINARY_PORTALSHAPE, BINARY_SHAPE, BINARY_RENDERER,
+	BINARY_REVERSEORIENTATION, BINARY_VOLUME, BINARY_EXTERIOR,
+	BINARY_INTERIOR, BINARY_OBJECTBEGIN, BINARY_OBJECTEND,
+	BINARY_OBJECTINSTANCE, BINARY_PORTALINSTANCE, BINARY_MOTIONINSTANCE,
+	BINARY_WORLDEND
+};
+
+struct BinarySceneCommand {
+	const char *name;
+	BinarySceneCall call;
+	u_int nStrings;
+	int nFloats; // -1 for any count
+	bool hasParams;
+};
+
+const BinarySceneCommand binarySceneCommands[] = {
+	{ "luxIdentity", BINARY_IDENTITY, 0, 0, false },
+	{ "luxTranslate", BINARY_TRANSLATE, 0, 3, false },
+	{ "luxTransform", BINARY_TRANSFORM, 0, 16, false },
+	{ "luxConcatTransform", BINARY_CONCATTRANSFORM, 0, 16, false },
+	{ "luxRotate", BINARY_ROTATE, 0, 4, false },
+	{ "luxScale", BINARY_SCALE, 0, 3, false },
+	{ "luxLookAt", BINARY_LOOKAT, 0, 9, false },
+	{ "luxCoordinateSystem", BINARY_COORDINATESYSTEM, 1, 0, false },
+	{ "luxCoordSysTransform", BINARY_COORDSYSTRANSFORM, 1, 0, false },
+	{ "luxSetEpsilon", BINARY_SETEPSILON, 0, 2, false },
+	{ "luxPixelFilter", BINARY_PIXELFILTER, 1, 0, true },
+	{ "luxFilm", BINARY_FILM, 1, 0, true },
+	{ "luxSampler", BINARY_SAMPLER, 1, 0, true },
+	{ "luxAccelerator", BINARY_ACCELERATOR, 1, 0, true },
+	{ "luxSurfaceIntegrator", BINARY_SURFACEINTEGRATOR, 1, 0, true },
+	{ "luxVolumeIntegrator", BINARY_VOLUMEINTEGRATOR, 1, 0, true },
+	{ "luxCamera", BINARY_CAMERA, 1, 0, true },
+	{ "luxWorldBegin", BINARY_WORLDBEGIN, 0, 0, false },
+	{ "luxAttributeBegin", BINARY_ATTRIBUTEBEGIN, 0, 0, false },
+	{ "luxAttributeEnd", BINARY_ATTRIBUTEEND, 0, 0, false },
+	{ "luxTransformBegin", BINARY_TRANSFORMBEGIN, 0, 0, false },
+	{ "luxTransformEnd", BINARY_TRANSFORMEND, 0, 0, false },
+	{ "luxMotionBegin", BINARY_MOTIONBEGIN, 0, -1, false },
+	{ "luxMotionEnd", BINARY_MOTIONEND, 0, 0, false },
+	{ "luxTexture", BINARY_TEXTURE, 3, 0, true },
+	{ "luxMaterial", BINARY_MATERIAL, 1, 0, true },
+	{ "luxMakeNamedMaterial", BINARY_MAKENAMEDMATERIAL, 1, 0, true },
+	{ "luxMakeNamedVolume", BINARY_MAKENAMEDVOLUME, 2, 0, true },
+	{ "luxNamedMaterial", BINARY_NAMEDMATERIAL, 1, 0, false },
+	{ "luxLightGroup", BINARY_LIGHTGROUP, 1, 0, true },
+	{ "luxLightSource", BINARY_LIGHTSOURCE, 1, 0, true },
+	{ "luxAreaLightSource", BINARY_AREALIGHTSOURCE, 1, 0, true },
+	{ "luxPortalShape", BINARY_PORTALSHAPE, 1, 0, true },
+	{ "luxShape", BINARY_SHAPE, 1, 0, true },
+	{ "luxRenderer", BINARY_RENDERER, 1, 0, true },
+	{ "luxReverseOrientation", BINARY_REVERSEORIENTATION, 0, 0, false },
+	{ "luxVolume", BINARY_VOLUME, 1, 0, true },
+	{ "luxExterior", BINARY_EXTERIOR, 1, 0, false },
+	{ "luxInterior", BINARY_INTERIOR, 1, 0, false },
+	{ "luxObjectBegin", BINARY_OBJECTBEGIN, 1, 0, false },
+	{ "luxObjectEnd", BINARY_OBJECTEND, 0, 0, false },
+	{ "luxObjectInstance", BINARY_OBJECTINSTANCE, 1, 0, false },
+	{ "luxPortalInstance", BINARY_PORTALINSTANCE, 1, 0, false },
+	{ "luxMotionInstance", BINARY_MOTIONINSTANCE, 2, 2, false },
+	{ "luxWorldEnd", BINARY_WORLDEND, 0, 0, false }
+};
+
+// Bounds checked cursor over the mapped file
+class BinarySceneReader {
+public:
+	BinarySceneReader(const char *data, size_t size) : start(data),
+		pos(data), end(data + size), ok(true) { }
+
+	bool Good() const { return ok; }
+	bool AtEnd() const { return pos >= end; }
+
+	const char *Read(size_t size) {
+		if (!ok || size > static_cast<size_t>(end - pos)) {
+			ok = false;
+			return NULL;
+		}
+		const char *data = pos;
+		pos += size;
+		return data;
+	}
+	void Align() {
+		const size_t offset = (pos - start) % BINARY_SCENE_ALIGNMENT;
+		if (offset > 0)
+			Read(BINARY_SCENE_ALIGNMENT - offset);
+	}
+	u_int ReadUInt() {
+		u_int value = 0;
+		const char *data = Read(sizeof(value));
+		if (data)
+			memcpy(&value, data, sizeof(value));
+		return value;
+	}
+	string ReadString() {
+		const u_int size = ReadUInt();
+		const char *data = Read(size);
+		return data ? string(data, size) : string();
+	}
+	// Returns the aligned array in place, NULL on error
+	template <class T> const T *ReadArray(u_int n) {
+		if (ReadUInt() != sizeof(T) ||
+			n > static_cast<size_t>(end - pos) / sizeof(T)) {
+			ok = false;
+			return NULL;
+		}
+		Align();
+		return reinterpret_cast<const T *>(Read(sizeof(T) * n));
+	}
+
+private:
+	const char *start, *pos, *end;
+	bool ok;
+};
+
+// Numeric arrays are referenced in place, the items and their copies
+// keep the mapping alive through storage
+bool ReadParams(BinarySceneReader &reader, ParamSet &params,
+	const boost::shared_ptr<const void> &storage)
+{
+	const u_int count = reader.ReadUInt();
+	for (u_int i = 0; i < count && reader.Good(); ++i) {
+		const u_int type = reader.ReadUInt();
+		const string name(reader.ReadString());
+		const u_int n = reader.ReadUInt();
+		switch (type) {
+			case PARAM_TYPE_INT: {
+				const int *data = reader.ReadArray<int>(n);
+				if (data)
+					params.ReferenceInt(name, data, n, storage);
+				break;
+			}
+			case PARAM_TYPE_FLOAT: {
+				const float *data = reader.ReadArray<float>(n);
+				if (data)
+					params.ReferenceFloat(name, data, n, storage);
+				break;
+			}
+			case PARAM_TYPE_POINT: {
+				const Point *data = reader.ReadArray<Point>(n);
+				if (data)
+					params.ReferencePoint(name, data, n, storage);
+				break;
+			}
+			case PARAM_TYPE_VECTOR: {
+				const Vector *data = reader.ReadArray<Vector>(n);
+				if (data)
+					params.ReferenceVector(name, data, n, storage);
+				break;
+			}
+			case PARAM_TYPE_NORMAL: {
+				const Normal *data = reader.ReadArray<Normal>(n);
+				if (data)
+					params.ReferenceNormal(name, data, n, storage);
+				break;
+			}
+			case PARAM_TYPE_COLOR: {
+				const RGBColor *data = reader.ReadArray<RGBColor>(n);
+				if (data)
+					params.ReferenceRGBColor(name, data, n, storage);
+				break;
+			}
+			case PARAM_TYPE_BOOL: {
+				const char *data = reader.Read(n);
+				if (!data)
+					break;
+				boost::scoped_array<bool> values(new bool[max(n, 1U)]);
+				for (u_int j = 0; j < n; ++j)
+					values[j] = data[j] != 0;
+				params.AddBool(name, values.get(), n);
+				break;
+			}
+			case PARAM_TYPE_STRING:
+			case PARAM_TYPE_TEXTURE: {
+				vector<string> values;
+				for (u_int j = 0; j < n && reader.Good(); ++j)
+					values.push_back(reader.ReadString());
+				if (!reader.Good() || n == 0)
+					break;
+				if (type == PARAM_TYPE_STRING)
+					params.AddString(name, &values[0], n);
+				else
+					params.AddTexture(name, values[0]);
+				break;
+			}
+			default:
+				return false;
+		}
+	}
+	return reader.Good();
+}
+
+void ExecuteCall(Context &ctx, BinarySceneCall call, const vector<string> &s,
+	vector<float> &f, const ParamSet &params)
+{
+	switch (call) {
+		case BINARY_IDENTITY:
+			ctx.Identity();
+			break;
+		case BINARY_TRANSLATE:
+			ctx.Translate(f[0], f[1], f[2]);
+			break;
+		case BINARY_TRANSFORM:
+			ctx.Transform(&f[0]);
+			break;
+		case BINARY_CONCATTRANSFORM:
+			ctx.ConcatTransform(&f[0]);
+			break;
+		case BINARY_ROTATE:
+			ctx.Rotate(f[0], f[1], f[2], f[3]);
+			break;
+		case BINARY_SCALE:
+			ctx.Scale(f[0], f[1], f[2]);
+			break;
+		case BINARY_LOOKAT:
+			ctx.LookAt(f[0], f[1], f[2], f[3], f[4], f[5],
+				f[6], f[7], f[8]);
+			break;
+		case BINARY_COORDINATESYSTEM:
+			ctx.CoordinateSystem(s[0]);
+			break;
+		case BINARY_COORDSYSTRANSFORM:
+			ctx.CoordSysTransform(s[0]);
+			break;
+		case BINARY_SETEPSILON:
+			ctx.SetEpsilon(f[0], f[1]);
+			break;
+		case BINARY_PIXELFILTER:
+			ctx.PixelFilter(s[0], params);
+			break;
+		case BINARY_FILM:
+			ctx.Film(s[0], params);
+			break;
+		case BINARY_SAMPLER:
+			ctx.Sampler(s[0], params);
+			break;
+		case BINARY_ACCELERATOR:
+			ctx.Accelerator(s[0], params);
+			break;
+		case BINARY_SURFACEINTEGRATOR:
+			ctx.SurfaceIntegrator(s[0], params);
+			break;
+		case BINARY_VOLUMEINTEGRATOR:
+			ctx.VolumeIntegrator(s[0], params);
+			break;
+		case BINARY_CAMERA:
+			ctx.Camera(s[0], params);
+			break;
+		case BINARY_WORLDBEGIN:
+			ctx.WorldBegin();
+			break;
+		case BINARY_ATTRIBUTEBEGIN:
+			ctx.AttributeBegin();
+			break;
+		case BINARY_ATTRIBUTEEND:
+			ctx.AttributeEnd();
+			break;
+		case BINARY_TRANSFORMBEGIN:
+			ctx.TransformBegin();
+			break;
+		case BINARY_TRANSFORMEND:
+			ctx.TransformEnd();
+			break;
+		case BINARY_MOTIONBEGIN:
+			ctx.MotionBegin(f.size(), f.empty() ? NULL : &f[0]);
+			break;
+		case BINARY_MOTIONEND:
+			ctx.MotionEnd();
+			break;
+		case BINARY_TEXTURE:
+			ctx.Texture(s[0], s[1], s[2], params);
+			break;
+		case BINARY_MATERIAL:
+			ctx.Material(s[0], params);
+			break;
+		case BINARY_MAKENAMEDMATERIAL:
+			ctx.MakeNamedMaterial(s[0], params);
+			break;
+		case BINARY_MAKENAMEDVOLUME:
+			ctx.MakeNamedVolume(s[0], s[1], params);
+			break;
+		case BINARY_NAMEDMATERIAL:
+			ctx.NamedMaterial(s[0]);
+			break;
+		case BINARY_LIGHTGROUP:
+			ctx.LightGroup(s[0], params);
+			break;
+		case BINARY_LIGHTSOURCE:
+			ctx.LightSource(s[0], params);
+			break;
+		case BINARY_AREALIGHTSOURCE:
+			ctx.AreaLightSource(s[0], params);
+			break;
+		case BINARY_PORTALSHAPE:
+			ctx.PortalShape(s[0], params);
+			break;
+		case BINARY_SHAPE:
+			ctx.Shape(s[0], params);
+			break;
+		case BINARY_RENDERER:
+			ctx.Renderer(s[0], params);
+			break;
+		case BINARY_REVERSEORIENTATION:
+			ctx.ReverseOrientation();
+			break;
+		case BINARY_VOLUME:
+			ctx.Volume(s[0], params);
+			break;
+		case BINARY_EXTERIOR:
+			ctx.Exterior(s[0]);
+			break;
+		case BINARY_INTERIOR:
+			ctx.Interior(s[0]);
+			break;
+		case BINARY_OBJECTBEGIN:
+			ctx.ObjectBegin(s[0]);
+			break;
+		case BINARY_OBJECTEND:
+			ctx.ObjectEnd();
+			break;
+		case BINARY_OBJECTINSTANCE:
+			ctx.ObjectInstance(s[0]);
+			break;
+		case BINARY_PORTALINSTANCE:
+			ctx.PortalInstance(s[0]);
+			break;
+		case BINARY_MOTIONINSTANCE:
+			ctx.MotionInstance(s[0], f[0], f[1], s[1]);
+			break;
+		case BINARY_WORLDEND:
+			ctx.WorldEnd();
+			break;
+	}
+}
+
+const BinarySceneCommand *FindCommand(const string &name)
+{
+	static std::map<string, const BinarySceneCommand *> commands;
+	if (commands.empty()) {
+		for (u_int i = 0; i < sizeof(binarySceneCommands) / sizeof(binarySceneCommands[0]); ++i)
+			commands[binarySceneCommands[i].name] = &binarySceneCommands[i];
+	}
+	std::map<string, const BinarySceneCommand *>::const_iterator it =
+		commands.find(name);
+	return it == commands.end() ? NULL : it->second;
+}
+
+}//namespace
+
+bool lux::IsValidSceneCall(const SceneCall &call)
+{
+	const BinarySceneCommand *command = FindCommand(call.command);
+	return command && call.strings.size() == command->nStrings &&
+		call.hasParams == command->hasParams &&
+		(command->nFloats < 0 ||
+		call.floats.size() == static_cast<size_t>(command->nFloats));
+}
+
+bool lux::ExecuteSceneCall(Context &ctx, const SceneCall &call)
+{
+	if (!IsValidSceneCall(call))
+		return false;
+	const BinarySceneCommand *command = FindCommand(call.command);
+	// Some calls take non const arrays
+	vector<float> floats(call.floats);
+	ExecuteCall(ctx, command->call, call.strings, floats, call.params);
+	return true;
+}
+
+bool lux::ParseBinaryScene(const string &filename)
+{
+	// The mapping is shared by the parameters referencing it and
+	// released once the last of them is destroyed
+	boost::shared_ptr<boost::iostreams::mapped_file_source> file(
+		new boost::iostreams::mapped_file_source());
+	try {
+		file->open(filename);
+	} catch (std::exception &e) {
+		LOG(LUX_SEVERE, LUX_NOFILE) << "Unable to map binary scene file '" <<
+			filename << "': " << e.what();
+		return false;
+	}
+	if (!file->is_open()) {
+		LOG(LUX_SEVERE, LUX_NOFILE) << "Unable to map binary scene file '" <<
+			filename << "'";
+		return false;
+	}
+
+	// Check the header
+	const bool isLittleEndian = osIsLittleEndian();
+	BinarySceneReader reader(file->data(), file->size());
+	const char *magic = reader.Read(sizeof(binarySceneMagic));
+	u_int header[4];
+	for (u_int i = 0; i < 4; ++i) {
+		header[i] = reader.ReadUInt();
+		if (!isLittleEndian)
+			header[i] = (header[i] >> 24) | ((header[i] >> 8) & 0xff00) |
+				((header[i] << 8) & 0xff0000) | (header[i] << 24);
+	}
+	if (!magic || memcmp(magic, binarySceneMagic, sizeof(binarySceneMagic)) ||
+		!reader.Good()) {
+		LOG(LUX_SEVERE, LUX_BADFILE) << "'" << filename <<
+			"' is not a binary scene file";
+		return false;
+	}
+	if (header[0] != binarySceneVersion ||
+		header[1] != (isLittleEndian ? 1U : 0U) ||
+		header[2] != sizeof(float) || header[3] != sizeof(int)) {
+		LOG(LUX_SEVERE, LUX_BADFILE) << "Binary scene file '" << filename <<
+			"' was written with an unsupported version or on a different architecture";
+		return false;
+	}
+
+	Context &ctx(*Context::GetActive());
+	SceneCall call;
+	while (!reader.AtEnd()) {
+		call.command = reader.ReadString();
+		call.strings.clear();
+		const u_int nStrings = reader.ReadUInt();
+		for (u_int i = 0; i < nStrings && reader.Good(); ++i)
+			call.strings.push_back(reader.ReadString());
+		const u_int nFloats = reader.ReadUInt();
+		const char *floatData = reader.Read(sizeof(float) * static_cast<size_t>(nFloats));
+		call.params.Clear();
+		call.hasParams = reader.ReadUInt() != 0;
+		if (!reader.Good() || (call.hasParams && !ReadParams(reader, call.params, file))) {
+			LOG(LUX_SEVERE, LUX_BADFILE) << "Binary scene file '" <<
+				filename << "' is truncated or corrupted";
+			return false;
+		}
+		call.floats.resize(nFloats);
+		if (nFloats > 0)
+			memcpy(&call.floats[0], floatData, sizeof(float) * nFloats);
+
+		if (!FindCommand(call.command)) {
+			LOG(LUX_WARNING, LUX_BADTOKEN) << "Unknown command '" <<
+				call.command << "' in binary scene file '" << filename <<
+				"', ignoring it";
+			continue;
+		}
+		if (!ExecuteSceneCall(ctx, call)) {
+			LOG(LUX_SEVERE, LUX_BADFILE) << "Invalid arguments for '" <<
+				call.command << "' in binary scene file '" << filename << "'";
+			return false;
+		}
+	}
+
+	return true;
+}
@@ -0,0 +1,113 @@
+/***************************************************************************
+ *   Copyright (C) 1998-2013 by authors (see AUTHORS.txt)                  *
+ *                                                                         *
+ *   This file is part of LuxRender.                                       *
+ *                                                                         *
+ *   Lux Renderer is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   Lux Renderer is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+ *                                                                         *
+ *   This project is based on PBRT ; see http://www.pbrt.org               *
+ *   Lux Renderer website : http://www.luxrender.net                       *
+ ***************************************************************************/
+
+#ifndef LUX_BINARYSCENE_H
+#define LUX_BINARYSCENE_H
+// binaryscene.h*
+
+#include "lux.h"
+#include "paramset.h"
+
+#include <fstream>
+
+namespace lux
+{
+
+// Binary scene files (.lxb) hold a sequence of API calls. Each call is
+// stored as its command name, its string and float arguments and
+// optionally its parameter set. Numeric parameter arrays are stored raw,
+// with the native layout and aligned on 16 bytes, so that the loader can
+// memory map the file and hand the arrays to the shapes without copying
+// or converting them. Files are only valid on architectures with the
+// same byte order and type sizes as the one that wrote them.
+
+// An API call with its arguments, command is the name used by the
+// network rendering protocol (luxShape, luxAttributeBegin, ...)
+struct SceneCall {
+	SceneCall() : hasParams(false) { }
+
+	string command;
+	vector<string> strings;
+	vector<float> floats;
+	ParamSet params;
+	bool hasParams;
+};
+
+// Returns false if the command is unknown or its arguments don't match it
+bool IsValidSceneCall(const SceneCall &call);
+// Executes the call on the context, returns false if the call isn't valid
+bool ExecuteSceneCall(Context &ctx, const SceneCall &call);
+
+// Returns true if the file name has the .lxb extension
+bool IsBinarySceneFile(const string &filename);
+
+// Maps the file and replays its API calls on the active context
+bool ParseBinaryScene(const string &filename);
+
+// Records the API calls done on a context, the overloads mirror the ones
+// of RenderFarm::send
+class BinarySceneWriter {
+public:
+	BinarySceneWriter(const string &filename);
+	~BinarySceneWriter();
+
+	bool IsOpen() const { return out.is_open() && out.good(); }
+	// Returns false if some data couldn't be written
+	bool Close();
+
+	void Write(const string &command);
+	void Write(const string &command, const string &name,
+		const ParamSet &params);
+	void Write(const string &command, const string &id,
+		const string &name, const ParamSet &params);
+	void Write(const string &command, const string &name);
+	void Write(const string &command, float x, float y);
+	void Write(const string &command, float x, float y, float z);
+	void Write(const string &command, float a, float x, float y, float z);
+	void Write(const string &command, float ex, float ey, float ez,
+		float lx, float ly, float lz, float ux, float uy, float uz);
+	void Write(const string &command, float tr[16]);
+	void Write(const string &command, u_int n, float *d);
+	void Write(const string &command, const string &name,
+		const string &type, const string &texname,
+		const ParamSet &params);
+	void Write(const string &command, const string &name,
+		float a, float b, const string &transform);
+
+private:
+	void WriteCall(const string &command, u_int nStrings,
+		const string *strings, u_int nFloats, const float *floats,
+		const ParamSet *params);
+	void WriteParams(const ParamSet &params);
+	template <class T> void WriteItems(u_int type,
+		const vector<ParamSetItem<T> *> &items);
+	void WriteUInt(u_int value);
+	void WriteString(const string &value);
+	// Pads the file so that the next data is aligned
+	void Align();
+
+	std::ofstream out;
+};
+
+}//namespace lux
+
+#endif // LUX_BINARYSCENE_H
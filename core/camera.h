@@ -81,7 +81,7 @@ public:
 	 * @param y The sampled y position on screen in pixels
 	 * @return he ray weighting
 	 */
-	float GenerateRay(const Scene &scene, const Sample &sample,
+	virtual float GenerateRay(const Scene &scene, const Sample &sample,
 		Ray *ray, float *x, float *y) const;
 	/**
 	 * Samples the origin of a ray.
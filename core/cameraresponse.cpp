@@ -28,6 +28,7 @@
 
 #include "film/data/cameraresponsefunctions.h"
 
+#include <boost/bind.hpp>
 #include <boost/lexical_cast.hpp> // used to convert string to float
 #include <boost/regex.hpp>
 #include <boost/iterator.hpp>
@@ -138,7 +139,7 @@ CameraResponse::CameraResponse(const string &film)
 		RGBColor c(YI[i]);
 
 		// map handles color / monochrome and interpolation
-		Map(c);		
+		MapCrf(c);
 
 		YB[i] = c.Y();
 	}
@@ -154,10 +155,66 @@ CameraResponse::CameraResponse(const string &film)
 	AdjustGamma(GreenI, GreenB, 1.f / source_gamma);
 	AdjustGamma(BlueI, BlueB, 1.f / source_gamma);
 
+	BuildCurve(redCurve, RedI, RedB);
+	if (color) {
+		BuildCurve(greenCurve, GreenI, GreenB);
+		BuildCurve(blueCurve, BlueI, BlueB);
+	}
+
 	validFile = true;
 }
 
+// Minimum number of entries of the tables of the response functions
+#define CRF_TABLE_SIZE 4096
+
+void CameraResponse::BuildCurve(ToneCurve &curve, const vector<float> &from,
+	const vector<float> &to)
+{
+	// When the function is sampled at regular intervals, the entries
+	// of the table are aligned on the samples so that the table
+	// reproduces the piecewise linear function
+	u_int size = CRF_TABLE_SIZE;
+	const size_t n = from.size();
+	if (n > 1) {
+		const float step = (from.back() - from.front()) / (n - 1);
+		bool regular = step > 0.f;
+		for (size_t i = 1; i < n && regular; ++i)
+			regular = fabsf(from[i] - from[i - 1] - step) <= 1e-3f * step;
+		if (regular)
+			size = (CRF_TABLE_SIZE + n - 2) / (n - 1) * (n - 1) + 1;
+	}
+
+	curve.Build(boost::bind(&CameraResponse::ApplyCrf, this, _1,
+		boost::cref(from), boost::cref(to)), from.front(), from.back(),
+		size);
+}
+
 void CameraResponse::Map(RGBColor &rgb) const
+{
+	if (color) {
+		rgb.c[0] = redCurve.Map(rgb.c[0]);
+		rgb.c[1] = greenCurve.Map(rgb.c[1]);
+		rgb.c[2] = blueCurve.Map(rgb.c[2]);
+	} else {
+		const float y = rgb.Y();
+		rgb.c[0] = rgb.c[1] = rgb.c[2] = redCurve.Map(y);
+	}
+}
+
+void CameraResponse::Map(RGBColor *rgb, u_int count) const
+{
+	if (color) {
+		const u_int stride = sizeof(RGBColor) / sizeof(float);
+		redCurve.Map(&rgb[0].c[0], count, stride);
+		greenCurve.Map(&rgb[0].c[1], count, stride);
+		blueCurve.Map(&rgb[0].c[2], count, stride);
+	} else {
+		for (u_int i = 0; i < count; ++i)
+			Map(rgb[i]);
+	}
+}
+
+void CameraResponse::MapCrf(RGBColor &rgb) const
 {
 	if (color) {
 		rgb.c[0] = ApplyCrf(rgb.c[0], RedI, RedB);
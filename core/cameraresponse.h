@@ -25,6 +25,7 @@
 // cameraresponse.h*
 // Original code by Daniel90
 #include "lux.h"
+#include "tonecurve.h"
 
 namespace lux {
 
@@ -32,11 +33,15 @@ class CameraResponse {
 public:
 	CameraResponse(const string &film);
 	void Map(RGBColor &rgb) const;
+	// Maps count colors in place
+	void Map(RGBColor *rgb, u_int count) const;
 
 	string filmName;
 	bool validFile;
 private:
 	float ApplyCrf(float point, const vector<float> &from, const vector<float> &to) const;
+	void MapCrf(RGBColor &rgb) const;
+	void BuildCurve(ToneCurve &curve, const vector<float> &from, const vector<float> &to);
 	bool loadPreset();
 	bool loadFile();
 
@@ -47,6 +52,9 @@ private:
 	vector<float> GreenB; // measured intensity
 	vector<float> BlueI; // image irradiance (on the image plane)
 	vector<float> BlueB; // measured intensity
+	// Tables of the functions above, the green and blue ones are only
+	// used for color responses
+	ToneCurve redCurve, greenCurve, blueCurve;
 };
 
 }
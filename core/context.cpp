@@ -34,10 +34,12 @@
 #include "volume.h"
 #include "material.h"
 #include "renderfarm.h"
+#include "binaryscene.h"
 #include "film/fleximage.h"
 #include "luxrays/core/epsilon.h"
 using luxrays::MachineEpsilon;
 #include "renderers/samplerrenderer.h"
+#include "textures/imagemap.h"
 
 #include <boost/iostreams/filtering_stream.hpp>
 #include <boost/iostreams/filtering_streambuf.hpp>
@@ -79,6 +81,13 @@ if (inMotionBlock) { \
 	LOG(LUX_ERROR,LUX_NESTING)<<"'"<<func<<"' not allowed allowed inside motion block. Ignoring."; \
 	return; \
 }
+// When exporting, calls are only recorded: this must precede the checks
+// since the API state isn't updated
+#define EXPORT_CALL(args) \
+if (sceneExport) { \
+	sceneExport->Write args; \
+	return; \
+}
 
 boost::shared_ptr<lux::Texture<float> > lux::Context::GetFloatTexture(const string &n) const
 {
@@ -220,6 +229,7 @@ void lux::Context::Cleanup() {
 }
 
 void lux::Context::Identity() {
+	EXPORT_CALL(("luxIdentity"));
 	VERIFY_INITIALIZED_TRANSFORMS("Identity");
 	renderFarm->send("luxIdentity");
 	lux::Transform t;
@@ -230,6 +240,7 @@ void lux::Context::Identity() {
 }
 
 void lux::Context::Translate(float dx, float dy, float dz) {
+	EXPORT_CALL(("luxTranslate", dx, dy, dz));
 	VERIFY_INITIALIZED_TRANSFORMS("Translate");
 	renderFarm->send("luxTranslate", dx, dy, dz);
 	lux::Transform t = lux::Translate(Vector(dx, dy, dz));
@@ -240,6 +251,7 @@ void lux::Context::Translate(float dx, float dy, float dz) {
 }
 
 void lux::Context::Transform(float tr[16]) {
+	EXPORT_CALL(("luxTransform", tr));
 	VERIFY_INITIALIZED_TRANSFORMS("Transform");
 	renderFarm->send("luxTransform", tr);
 	::Transform t(Matrix4x4(tr[0], tr[4], tr[8], tr[12],
@@ -252,6 +264,7 @@ void lux::Context::Transform(float tr[16]) {
 		curTransform = t;
 }
 void lux::Context::ConcatTransform(float tr[16]) {
+	EXPORT_CALL(("luxConcatTransform", tr));
 	VERIFY_INITIALIZED_TRANSFORMS("ConcatTransform");
 	renderFarm->send("luxConcatTransform", tr);
 	::Transform t(Matrix4x4(tr[0], tr[4], tr[8], tr[12],
@@ -264,6 +277,7 @@ void lux::Context::ConcatTransform(float tr[16]) {
 		curTransform = curTransform * t;
 }
 void lux::Context::Rotate(float angle, float dx, float dy, float dz) {
+	EXPORT_CALL(("luxRotate", angle, dx, dy, dz));
 	VERIFY_INITIALIZED_TRANSFORMS("Rotate");
 	renderFarm->send("luxRotate", angle, dx, dy, dz);
 	::Transform t(::Rotate(angle, Vector(dx, dy, dz)));
@@ -273,6 +287,7 @@ void lux::Context::Rotate(float angle, float dx, float dy, float dz) {
 		curTransform = curTransform * t;
 }
 void lux::Context::Scale(float sx, float sy, float sz) {
+	EXPORT_CALL(("luxScale", sx, sy, sz));
 	VERIFY_INITIALIZED_TRANSFORMS("Scale");
 	renderFarm->send("luxScale", sx, sy, sz);
 	::Transform t(::Scale(sx, sy, sz));
@@ -283,6 +298,7 @@ void lux::Context::Scale(float sx, float sy, float sz) {
 }
 void lux::Context::LookAt(float ex, float ey, float ez, float lx, float ly, float lz,
 	float ux, float uy, float uz) {
+	EXPORT_CALL(("luxLookAt", ex, ey, ez, lx, ly, lz, ux, uy, uz));
 	VERIFY_INITIALIZED_TRANSFORMS("LookAt");
 	renderFarm->send("luxLookAt", ex, ey, ez, lx, ly, lz, ux, uy, uz);
 	::Transform t(::LookAt(Point(ex, ey, ez), Point(lx, ly, lz),
@@ -293,11 +309,13 @@ void lux::Context::LookAt(float ex, float ey, float ez, float lx, float ly, floa
 		curTransform = curTransform * t;
 }
 void lux::Context::CoordinateSystem(const string &n) {
+	EXPORT_CALL(("luxCoordinateSystem", n));
 	VERIFY_INITIALIZED("CoordinateSystem");
 	renderFarm->send("luxCoordinateSystem", n);
 	namedCoordinateSystems[n] = curTransform;
 }
 void lux::Context::CoordSysTransform(const string &n) {
+	EXPORT_CALL(("luxCoordSysTransform", n));
 	VERIFY_INITIALIZED_TRANSFORMS("CoordSysTransform");
 	renderFarm->send("luxCoordSysTransform", n);
 	if (namedCoordinateSystems.find(n) != namedCoordinateSystems.end()) {
@@ -317,6 +335,7 @@ void lux::Context::CoordSysTransform(const string &n) {
 }
 void lux::Context::SetEpsilon(const float minValue, const float maxValue)
 {
+	EXPORT_CALL(("luxSetEpsilon", minValue, maxValue));
 	VERIFY_INITIALIZED("SetEpsilon");
 	renderFarm->send("luxSetEpsilon", minValue, maxValue);
 	MachineEpsilon::SetMin(minValue);
@@ -340,12 +359,14 @@ void lux::Context::DisableRandomMode() {
 }
 
 void lux::Context::PixelFilter(const string &n, const ParamSet &params) {
+	EXPORT_CALL(("luxPixelFilter", n, params));
 	VERIFY_OPTIONS("PixelFilter");
 	renderFarm->send("luxPixelFilter", n, params);
 	renderOptions->filterName = n;
 	renderOptions->filterParams = params;
 }
 void lux::Context::Film(const string &type, const ParamSet &params) {
+	EXPORT_CALL(("luxFilm", type, params));
 	VERIFY_OPTIONS("Film");
 	// NOTE - luxFilm command doesn't cause "filename" file to be sent
 	renderFarm->send("luxFilm", type, params);
@@ -355,30 +376,35 @@ void lux::Context::Film(const string &type, const ParamSet &params) {
 		renderOptions->filmParams.Add(*filmOverrideParams);
 }
 void lux::Context::Sampler(const string &n, const ParamSet &params) {
+	EXPORT_CALL(("luxSampler", n, params));
 	VERIFY_OPTIONS("Sampler");
 	renderFarm->send("luxSampler", n, params);
 	renderOptions->samplerName = n;
 	renderOptions->samplerParams = params;
 }
 void lux::Context::Accelerator(const string &n, const ParamSet &params) {
+	EXPORT_CALL(("luxAccelerator", n, params));
 	VERIFY_OPTIONS("Accelerator");
 	renderFarm->send("luxAccelerator", n, params);
 	renderOptions->acceleratorName = n;
 	renderOptions->acceleratorParams = params;
 }
 void lux::Context::SurfaceIntegrator(const string &n, const ParamSet &params) {
+	EXPORT_CALL(("luxSurfaceIntegrator", n, params));
 	VERIFY_OPTIONS("SurfaceIntegrator");
 	renderFarm->send("luxSurfaceIntegrator", n, params);
 	renderOptions->surfIntegratorName = n;
 	renderOptions->surfIntegratorParams = params;
 }
 void lux::Context::VolumeIntegrator(const string &n, const ParamSet &params) {
+	EXPORT_CALL(("luxVolumeIntegrator", n, params));
 	VERIFY_OPTIONS("VolumeIntegrator");
 	renderFarm->send("luxVolumeIntegrator", n, params);
 	renderOptions->volIntegratorName = n;
 	renderOptions->volIntegratorParams = params;
 }
 void lux::Context::Camera(const string &n, const ParamSet &params) {
+	EXPORT_CALL(("luxCamera", n, params));
 	VERIFY_OPTIONS("Camera");
 	renderFarm->send("luxCamera", n, params);
 	renderOptions->cameraName = n;
@@ -412,20 +438,24 @@ void lux::Context::Camera(const string &n, const ParamSet &params) {
 	namedCoordinateSystems["camera"] = cameraTransform.GetInverse();
 }
 void lux::Context::WorldBegin() {
+	EXPORT_CALL(("luxWorldBegin"));
 	VERIFY_OPTIONS("WorldBegin");
 	renderFarm->send("luxWorldBegin");
 	currentApiState = STATE_WORLD_BLOCK;
 	curTransform = lux::Transform();
 	namedCoordinateSystems["world"] = curTransform;
 	shapeNo = 0;
+	renderOptions->definitionsHash.restart();
 }
 void lux::Context::AttributeBegin() {
+	EXPORT_CALL(("luxAttributeBegin"));
 	VERIFY_WORLD("AttributeBegin");
 	renderFarm->send("luxAttributeBegin");
 	pushedGraphicsStates.push_back(*graphicsState);
 	pushedTransforms.push_back(curTransform);
 }
 void lux::Context::AttributeEnd() {
+	EXPORT_CALL(("luxAttributeEnd"));
 	VERIFY_WORLD("AttributeEnd");
 	renderFarm->send("luxAttributeEnd");
 	if (!pushedGraphicsStates.size()) {
@@ -438,11 +468,13 @@ void lux::Context::AttributeEnd() {
 	pushedTransforms.pop_back();
 }
 void lux::Context::TransformBegin() {
+	EXPORT_CALL(("luxTransformBegin"));
 	VERIFY_INITIALIZED("TransformBegin");
 	renderFarm->send("luxTransformBegin");
 	pushedTransforms.push_back(curTransform);
 }
 void lux::Context::TransformEnd() {
+	EXPORT_CALL(("luxTransformEnd"));
 	VERIFY_INITIALIZED("TransformEnd");
 	renderFarm->send("luxTransformEnd");
 	if (!(pushedTransforms.size() > pushedGraphicsStates.size())) {
@@ -453,6 +485,7 @@ void lux::Context::TransformEnd() {
 	pushedTransforms.pop_back();
 }
 void lux::Context::MotionBegin(u_int n, float *t) {
+	EXPORT_CALL(("luxMotionBegin", n, t));
 	VERIFY_INITIALIZED("MotionBegin");
 	renderFarm->send("luxMotionBegin", n, t);
 	motionBlockTimes.assign(t, t+n);
@@ -460,6 +493,7 @@ void lux::Context::MotionBegin(u_int n, float *t) {
 	inMotionBlock = true;
 }
 void lux::Context::MotionEnd() {
+	EXPORT_CALL(("luxMotionEnd"));
 	VERIFY_INITIALIZED_TRANSFORMS("MotionEnd");
 	renderFarm->send("luxMotionEnd");
 	if (!inMotionBlock) {
@@ -476,10 +510,25 @@ void lux::Context::MotionEnd() {
 	}
 	curTransform = curTransform * motionTransform;
 }
+// Folds a scene definition into the hash of the scene definitions
+static void HashDefinition(tigerhash &hash, const string &kind,
+	const string &name, const string &type, const lux::Transform &t,
+	const tigerhash::digest_type &paramsDigest)
+{
+	hash.update(kind.c_str(), kind.size() + 1);
+	hash.update(name.c_str(), name.size() + 1);
+	hash.update(type.c_str(), type.size() + 1);
+	hash.update(reinterpret_cast<const char *>(t.m.m), sizeof(float) * 16);
+	hash.update(reinterpret_cast<const char *>(&paramsDigest[0]),
+		paramsDigest.size());
+}
 void lux::Context::Texture(const string &n, const string &type,
 	const string &texname, const ParamSet &params) {
+	EXPORT_CALL(("luxTexture", n, type, texname, params));
 	VERIFY_WORLD("Texture");
 	renderFarm->send("luxTexture", n, type, texname, params);
+	HashDefinition(renderOptions->definitionsHash, type + " texture", n,
+		texname, curTransform.StaticTransform(), params.Digest());
 	if (type == "float") {
 		// Create _float_ texture and store in _floatTextures_
 		if (graphicsState->floatTextures.find(n) !=
@@ -515,6 +564,7 @@ void lux::Context::Texture(const string &n, const string &type,
 	}
 }
 void lux::Context::Material(const string &n, const ParamSet &params) {
+	EXPORT_CALL(("luxMaterial", n, params));
 	VERIFY_WORLD("Material");
 	renderFarm->send("luxMaterial", n, params);
 	graphicsState->material = MakeMaterial(n, curTransform.StaticTransform(), params);
@@ -522,9 +572,12 @@ void lux::Context::Material(const string &n, const ParamSet &params) {
 
 void lux::Context::MakeNamedMaterial(const string &n, const ParamSet &_params)
 {
+	EXPORT_CALL(("luxMakeNamedMaterial", n, _params));
 	VERIFY_WORLD("MakeNamedMaterial");
 	ParamSet params=_params;
 	renderFarm->send("luxMakeNamedMaterial", n, params);
+	HashDefinition(renderOptions->definitionsHash, "named material", n,
+		"", curTransform.StaticTransform(), params.Digest());
 	if (graphicsState->namedMaterials.find(n) !=
 		graphicsState->namedMaterials.end()) {
 		LOG(LUX_WARNING,LUX_SYNTAX) << "Named material '" << n << "' being redefined.";
@@ -538,8 +591,11 @@ void lux::Context::MakeNamedMaterial(const string &n, const ParamSet &_params)
 void lux::Context::MakeNamedVolume(const string &id, const string &name,
 	const ParamSet &params)
 {
+	EXPORT_CALL(("luxMakeNamedVolume", id, name, params));
 	VERIFY_WORLD("MakeNamedVolume");
 	renderFarm->send("luxMakeNamedVolume", id, name, params);
+	HashDefinition(renderOptions->definitionsHash, "named volume", id,
+		name, curTransform.StaticTransform(), params.Digest());
 	if (graphicsState->namedVolumes.find(id) !=
 		graphicsState->namedVolumes.end()) {
 		LOG(LUX_WARNING, LUX_SYNTAX) << "Named volume '" << id <<
@@ -549,6 +605,7 @@ void lux::Context::MakeNamedVolume(const string &id, const string &name,
 }
 
 void lux::Context::NamedMaterial(const string &n) {
+	EXPORT_CALL(("luxNamedMaterial", n));
 	VERIFY_WORLD("NamedMaterial");
 	renderFarm->send("luxNamedMaterial", n);
 	if (graphicsState->namedMaterials.find(n) !=
@@ -564,6 +621,7 @@ void lux::Context::NamedMaterial(const string &n) {
 
 void lux::Context::LightGroup(const string &n, const ParamSet &params)
 {
+	EXPORT_CALL(("luxLightGroup", n, params));
 	VERIFY_WORLD("LightGroup");
 	renderFarm->send("luxLightGroup", n, params);
 	u_int i = 0;
@@ -578,6 +636,7 @@ void lux::Context::LightGroup(const string &n, const ParamSet &params)
 
 
 void lux::Context::LightSource(const string &n, const ParamSet &params) {
+	EXPORT_CALL(("luxLightSource", n, params));
 	VERIFY_WORLD("LightSource");
 	renderFarm->send("luxLightSource", n, params);
 	u_int lg = GetLightGroup();
@@ -689,6 +748,7 @@ void lux::Context::LightSource(const string &n, const ParamSet &params) {
 }
 
 void lux::Context::AreaLightSource(const string &n, const ParamSet &params) {
+	EXPORT_CALL(("luxAreaLightSource", n, params));
 	VERIFY_WORLD("AreaLightSource");
 	renderFarm->send("luxAreaLightSource", n, params);
 	graphicsState->areaLight = n;
@@ -696,6 +756,7 @@ void lux::Context::AreaLightSource(const string &n, const ParamSet &params) {
 }
 
 void lux::Context::PortalShape(const string &n, const ParamSet &params) {
+	EXPORT_CALL(("luxPortalShape", n, params));
 	VERIFY_WORLD("PortalShape");
 	renderFarm->send("luxPortalShape", n, params);
 	boost::shared_ptr<Primitive> sh(MakeShape(n, curTransform.StaticTransform(),
@@ -714,9 +775,13 @@ void lux::Context::PortalShape(const string &n, const ParamSet &params) {
 }
 
 void lux::Context::Shape(const string &n, const ParamSet &params) {
+	EXPORT_CALL(("luxShape", n, params));
 	VERIFY_WORLD("Shape");
 	renderFarm->send("luxShape", n, params);
 	const u_int sIdx = shapeNo++;
+	// The generated name depends on the declaration order,
+	// so the parameters are hashed before it is added
+	const tigerhash::digest_type paramsDigest(params.Digest());
 	u_int nItems;
 	const string *sn = params.FindString("name", &nItems);
 	if (!sn || *sn == "") {
@@ -734,6 +799,7 @@ void lux::Context::Shape(const string &n, const ParamSet &params) {
 	if (!sh)
 		return;
 	params.ReportUnused();
+	sh->paramsDigest = paramsDigest;
 
 	// Lotus - Set the material
 	if (graphicsState->material)
@@ -748,6 +814,14 @@ void lux::Context::Shape(const string &n, const ParamSet &params) {
 
 	// Create primitive and add to scene or current instance
 	if (renderOptions->currentInstanceRefined) {
+		// Instance contents are not part of the scene primitives
+		const lux::Material &material(*(sh->GetMaterial()));
+		HashDefinition(renderOptions->definitionsHash,
+			"instance shape", n, graphicsState->areaLight,
+			curTransform.StaticTransform(), paramsDigest);
+		renderOptions->definitionsHash.update(
+			reinterpret_cast<const char *>(&material.paramsDigest[0]),
+			material.paramsDigest.size());
 		if (graphicsState->areaLight != "") {
 			u_int lg = GetLightGroup();
 			boost::shared_ptr<AreaLight> area(MakeAreaLight(graphicsState->areaLight,
@@ -802,17 +876,20 @@ void lux::Context::Shape(const string &n, const ParamSet &params) {
 		renderOptions->primitives.push_back(sh);
 }
 void lux::Context::Renderer(const string &n, const ParamSet &params) {
+	EXPORT_CALL(("luxRenderer", n, params));
 	VERIFY_OPTIONS("Renderer");
 	renderFarm->send("luxRenderer", n, params);
 	renderOptions->rendererName = n;
 	renderOptions->rendererParams = params;
 }
 void lux::Context::ReverseOrientation() {
+	EXPORT_CALL(("luxReverseOrientation"));
 	VERIFY_WORLD("ReverseOrientation");
 	renderFarm->send("luxReverseOrientation");
 	graphicsState->reverseOrientation = !graphicsState->reverseOrientation;
 }
 void lux::Context::Volume(const string &n, const ParamSet &params) {
+	EXPORT_CALL(("luxVolume", n, params));
 	VERIFY_WORLD("Volume");
 	renderFarm->send("luxVolume", n, params);
 	Region *vr = MakeVolumeRegion(n, curTransform.StaticTransform(), params);
@@ -820,6 +897,7 @@ void lux::Context::Volume(const string &n, const ParamSet &params) {
 		renderOptions->volumeRegions.push_back(vr);
 }
 void lux::Context::Exterior(const string &n) {
+	EXPORT_CALL(("luxExterior", n));
 	VERIFY_WORLD("Exterior");
 	renderFarm->send("luxExterior", n);
 	if (n == "")
@@ -836,6 +914,7 @@ void lux::Context::Exterior(const string &n) {
 	}
 }
 void lux::Context::Interior(const string &n) {
+	EXPORT_CALL(("luxInterior", n));
 	VERIFY_WORLD("Interior");
 	renderFarm->send("luxInterior", n);
 	if (n == "")
@@ -852,6 +931,7 @@ void lux::Context::Interior(const string &n) {
 	}
 }
 void lux::Context::ObjectBegin(const string &n) {
+	EXPORT_CALL(("luxObjectBegin", n));
 	VERIFY_WORLD("ObjectBegin");
 	renderFarm->send("luxObjectBegin", n);
 	AttributeBegin();
@@ -870,6 +950,7 @@ void lux::Context::ObjectBegin(const string &n) {
 	renderOptions->currentAreaLightInstance = &renderOptions->areaLightInstances[n];
 }
 void lux::Context::ObjectEnd() {
+	EXPORT_CALL(("luxObjectEnd"));
 	VERIFY_WORLD("ObjectEnd");
 	renderFarm->send("luxObjectEnd");
 	if (!renderOptions->currentInstanceRefined) {
@@ -884,6 +965,7 @@ void lux::Context::ObjectEnd() {
 	AttributeEnd();
 }
 void lux::Context::ObjectInstance(const string &n) {
+	EXPORT_CALL(("luxObjectInstance", n));
 	VERIFY_WORLD("ObjectInstance");
 	renderFarm->send("luxObjectInstance", n);
 	// Object instance error checking
@@ -995,6 +1077,7 @@ void lux::Context::ObjectInstance(const string &n) {
 	}
 }
 void lux::Context::PortalInstance(const string &n) {
+	EXPORT_CALL(("luxPortalInstance", n));
 	VERIFY_WORLD("PortalInstance");
 	renderFarm->send("luxPortalInstance", n);
 	// Portal instance error checking
@@ -1020,6 +1103,7 @@ void lux::Context::PortalInstance(const string &n) {
 	}
 }
 void lux::Context::MotionInstance(const string &n, float startTime, float endTime, const string &toTransform) {
+	EXPORT_CALL(("luxMotionInstance", n, startTime, endTime, toTransform));
 	VERIFY_WORLD("MotionInstance");
 	renderFarm->send("luxMotionInstance", n, startTime, endTime, toTransform);
 	LOG(LUX_WARNING, LUX_SYNTAX) << "MotionInstance '" << n << "' is deprecated, use a MotionBegin/MotionEnd block with an ObjectInstance inside";
@@ -1073,6 +1157,7 @@ void lux::Context::MotionInstance(const string &n, float startTime, float endTim
 }
 
 void lux::Context::WorldEnd() {
+	EXPORT_CALL(("luxWorldEnd"));
 	VERIFY_WORLD("WorldEnd");
 	// renderfarm will flush when detecting WorldEnd
 	renderFarm->send("luxWorldEnd");
@@ -1088,6 +1173,9 @@ void lux::Context::WorldEnd() {
 		pushedTransforms.pop_back();
 	}
 
+	// Image textures are loaded in the background during parsing
+	ImageTexture::WaitPendingTextures();
+
 	// Clean up
 	currentApiState = STATE_OPTIONS_BLOCK;
 	curTransform = lux::Transform();
@@ -1171,6 +1259,7 @@ Scene *lux::Context::RenderOptions::MakeScene() const {
 
 	Scene *ret = new Scene(camera, surfaceIntegrator, volumeIntegrator,
 		sampler, primitives, accelerator, lights, lightGroups, volumeRegion);
+	ret->definitionsDigest = definitionsHash.end_message();
 	// Erase primitives, lights, volume regions and instances from _RenderOptions_
 	primitives.clear();
 	lights.clear();
@@ -1358,6 +1447,18 @@ float* lux::Context::FloatFramebuffer() {
 	return luxCurrentScene->GetFloatFramebuffer();
 }
 
+boost::shared_ptr<const FramebufferSnapshot> lux::Context::GetFramebufferSnapshot() {
+	if (!luxCurrentScene)
+		return boost::shared_ptr<const FramebufferSnapshot>();
+	return luxCurrentScene->GetFramebufferSnapshot();
+}
+
+u_int lux::Context::FramebufferVersion() {
+	if (!luxCurrentScene)
+		return 0;
+	return luxCurrentScene->GetFramebufferVersion();
+}
+
 float* lux::Context::AlphaBuffer() {
 	return luxCurrentScene->GetAlphaBuffer();
 }
@@ -47,7 +47,8 @@ namespace lux {
 class LUX_EXPORT Context {
 public:
 
-	Context(std::string n = "Lux default context") : name(n) {}
+	Context(std::string n = "Lux default context") : name(n),
+		sceneExport(NULL) {}
 
 	~Context() {
 		Free();
@@ -174,6 +175,8 @@ public:
 	void UpdateFramebuffer();
 	unsigned char* Framebuffer();
 	float* FloatFramebuffer();
+	boost::shared_ptr<const FramebufferSnapshot> GetFramebufferSnapshot();
+	u_int FramebufferVersion();
 	float* AlphaBuffer();
 	float* ZBuffer();
 
@@ -220,6 +223,9 @@ public:
 	void SetEpsilon(const float minValue, const float maxValue);
 	// NOTE: this feature is not currently supported by network rendering
 	void StartRenderingAfterParse(const bool start);
+	// While a writer is set, API calls are recorded to it instead of
+	// being executed
+	void SetSceneExport(BinarySceneWriter *writer) { sceneExport = writer; }
 
 	void UpdateNetworkNoiseAwareMap();
 	void SetNoiseAwareMap(const float *map);
@@ -295,6 +301,9 @@ private:
 		// and can be instanced right away
 		mutable map<string, vector<vector<boost::shared_ptr<AreaLightPrimitive> > > > areaLightInstances;
 		mutable vector<string> lightGroups;
+		// Texture, named material and named volume definitions
+		// and object instance contents, see Scene::definitionsDigest
+		tigerhash definitionsHash;
 		// Refined primitives
 		mutable vector<boost::shared_ptr<Primitive> > *currentInstanceSource;
 		// Unrefined primitives
@@ -350,6 +359,7 @@ private:
 	vector<GraphicsState> pushedGraphicsStates;
 	vector<lux::MotionTransform> pushedTransforms;
 	RenderFarm *renderFarm;
+	BinarySceneWriter *sceneExport;
 
 	ParamSet *filmOverrideParams;
 	
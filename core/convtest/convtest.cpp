@@ -29,7 +29,8 @@ using namespace lux;
 // ConvergenceTest class
 //------------------------------------------------------------------------------
 
-ConvergenceTest::ConvergenceTest(const u_int w, const u_int h) : width(w), height(h) {
+ConvergenceTest::ConvergenceTest(const u_int w, const u_int h) : width(w), height(h),
+	tileSize(0), xTiles(0), yTiles(0), tileThreshold(0.f), unconvergedPixels(w * h) {
 }
 
 ConvergenceTest::~ConvergenceTest() {
@@ -39,14 +40,66 @@ void ConvergenceTest::NeedTVI() {
 	tvi.resize(width * height, 0.f);
 }
 
+void ConvergenceTest::NeedTiles(const u_int size, const float threshold) {
+	tileSize = std::max(size, 1U);
+	tileThreshold = threshold;
+	xTiles = (width + tileSize - 1) / tileSize;
+	yTiles = (height + tileSize - 1) / tileSize;
+	if (tileConverged.size() != xTiles * yTiles)
+		tileConverged.resize(xTiles * yTiles);
+	passed.resize(width * height);
+	ResetTiles();
+}
+
 void ConvergenceTest::Reset() {
 	reference.resize(0);
+	ResetTiles();
 }
 
 void ConvergenceTest::Reset(const u_int w, const u_int h) {
 	width = w;
 	height = h;
 	reference.resize(0);	
+	if (tileSize > 0)
+		NeedTiles(tileSize, tileThreshold);
+	else
+		unconvergedPixels = width * height;
+}
+
+void ConvergenceTest::ResetTiles() {
+	for (u_int i = 0; i < tileConverged.size(); ++i)
+		osAtomicWrite(&tileConverged[i], 0);
+	unconvergedPixels = width * height;
+}
+
+void ConvergenceTest::UpdateTiles() {
+	unconvergedPixels = 0;
+	for (u_int ty = 0; ty < yTiles; ++ty) {
+		const u_int y0 = ty * tileSize;
+		const u_int y1 = std::min(y0 + tileSize, height);
+		for (u_int tx = 0; tx < xTiles; ++tx) {
+			u_int *converged = &tileConverged[tx + ty * xTiles];
+			if (osAtomicRead(converged))
+				continue;
+
+			const u_int x0 = tx * tileSize;
+			const u_int x1 = std::min(x0 + tileSize, width);
+
+			u_int failed = 0;
+			for (u_int y = y0; y < y1; ++y) {
+				for (u_int x = x0; x < x1; ++x) {
+					if (!passed[x + y * width])
+						++failed;
+				}
+			}
+
+			const u_int pixels = (x1 - x0) * (y1 - y0);
+			if (failed <= tileThreshold * pixels)
+				osAtomicWrite(converged, 1);
+			else
+				unconvergedPixels += pixels;
+		}
+	}
 }
 
 u_int ConvergenceTest::Test(const float *image) {
@@ -57,8 +110,14 @@ u_int ConvergenceTest::Test(const float *image) {
 		std::copy(image, image + pixelCount * 3, reference.begin());
 		return pixelCount;
 	} else {
-		const u_int count = Yee_Compare(&reference[0], image, NULL, &tvi[0], width, height);
+		// Identical images are detected before the pixels are tested
+		std::fill(passed.begin(), passed.end(), true);
+		const u_int count = Yee_Compare(&reference[0], image,
+			passed.empty() ? NULL : &passed,
+			tvi.empty() ? NULL : &tvi[0], width, height);
 		std::copy(image, image + pixelCount * 3, reference.begin());
+		if (!tileConverged.empty())
+			UpdateTiles();
 		return count;
 	}
 }
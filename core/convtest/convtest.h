@@ -23,6 +23,7 @@
 
 #include "luxrays/luxrays.h"
 #include "core/convtest/pdiff/metric.h"
+#include "osfunc.h"
 
 namespace lux {
 
@@ -33,16 +34,41 @@ public:
 
 	void NeedTVI();
 	const float *GetTVI() const { return &tvi[0]; }
+
+	// Tracks the convergence of square tiles of tileSize pixels: a tile
+	// has converged once at most threshold of its pixels fail a test,
+	// it stays converged until the next Reset()
+	void NeedTiles(const u_int tileSize, const float threshold);
+	bool IsTileConverged(const u_int x, const u_int y) const {
+		return !tileConverged.empty() &&
+			osAtomicRead(const_cast<u_int *>(&tileConverged[x / tileSize + (y / tileSize) * xTiles])) != 0;
+	}
+	// Number of pixels in the tiles that haven't converged yet
+	u_int GetUnconvergedPixels() const { return unconvergedPixels; }
 	
 	void Reset();
+	// Reallocates the tile flags when the size changes, it must not be
+	// called while rendering threads test them
 	void Reset(const u_int w, const u_int h);
 	u_int Test(const float *image);
 
 private:
+	void ResetTiles();
+	void UpdateTiles();
+
 	u_int width, height;
 	
 	std::vector<float> reference;
 	std::vector<float> tvi;
+
+	u_int tileSize, xTiles, yTiles;
+	float tileThreshold;
+	u_int unconvergedPixels;
+	// The flags are read by the rendering threads, they are allocated by
+	// NeedTiles() before rendering starts and then only atomically
+	// written by Test() and Reset()
+	std::vector<u_int> tileConverged;
+	std::vector<bool> passed;
 };
 
 }
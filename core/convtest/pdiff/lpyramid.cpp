@@ -18,8 +18,40 @@ if not, write to the Free Software Foundation, Inc., 59 Temple Place, Suite 330,
 
 #include "core/convtest/pdiff/lpyramid.h"
 
+#include <algorithm>
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define LUX_LPYRAMID_SSE2
+#include <emmintrin.h>
+#endif
+
 using namespace lux;
 
+// Images with fewer pixels are filtered by the calling thread
+#define LPYRAMID_PARALLEL_SIZE (256 * 256)
+
+// The 5x5 filter kernel is separable, it is the product of this one
+// with itself
+static const float K0 = 0.05f;
+static const float K1 = 0.25f;
+static const float K2 = 0.4f;
+
+// Mirrors the coordinates outside of the image
+static inline int Mirror(int n, int size)
+{
+	if (n < 0) n = -n;
+	if (n >= size) n = 2 * size - n - 1;
+	return n;
+}
+
+static inline float Filter(float a, float b, float c, float d, float e)
+{
+	return K0 * (a + e) + K1 * (b + d) + K2 * c;
+}
+
 //////////////////////////////////////////////////////////////////////
 // Construction/Destruction
 //////////////////////////////////////////////////////////////////////
@@ -28,6 +60,7 @@ LPyramid::LPyramid(float *image, int width, int height) :
 	Width(width),
 	Height(height)
 {
+	float *tmp = new float[Width * Height];
 	// Make the Laplacian pyramid by successively
 	// copying the earlier levels and blurring them
 	for (int i=0; i<MAX_PYR_LEVELS; i++) {
@@ -35,15 +68,16 @@ LPyramid::LPyramid(float *image, int width, int height) :
 			Levels[i] = Copy(image);
 		} else {
 			Levels[i] = new float[Width * Height];
-			Convolve(Levels[i], Levels[i - 1]);
+			Convolve(Levels[i], Levels[i - 1], tmp);
 		}
 	}
+	delete[] tmp;
 }
 
 LPyramid::~LPyramid()
 {
 	for (int i=0; i<MAX_PYR_LEVELS; i++) {
-		if (Levels[i]) delete Levels[i];
+		if (Levels[i]) delete[] Levels[i];
 	}
 }
 
@@ -51,33 +85,103 @@ float *LPyramid::Copy(float *img)
 {
 	int max = Width * Height;
 	float *out = new float[max];
-	for (int i = 0; i < max; i++) out[i] = img[i];
+	std::copy(img, img + max, out);
 	
 	return out;
 }
 
-void LPyramid::Convolve(float *a, float *b)
-// convolves image b with the filter kernel and stores it in a
+void LPyramid::Convolve(float *a, float *b, float *tmp)
+{
+	// The horizontal pass has to be complete before the vertical one
+	// reads the neighbour rows
+	const int threadCount = Width * Height < LPYRAMID_PARALLEL_SIZE ? 1 :
+		std::min(std::max(1, static_cast<int>(boost::thread::hardware_concurrency())), Height);
+	if (threadCount == 1) {
+		ConvolveRows(tmp, b, 0, Height);
+		ConvolveColumns(a, tmp, 0, Height);
+		return;
+	}
+
+	boost::thread_group rows;
+	for (int i = 0; i < threadCount; ++i)
+		rows.create_thread(boost::bind(&LPyramid::ConvolveRows, this,
+			tmp, b, Height * i / threadCount,
+			Height * (i + 1) / threadCount));
+	rows.join_all();
+
+	boost::thread_group columns;
+	for (int i = 0; i < threadCount; ++i)
+		columns.create_thread(boost::bind(&LPyramid::ConvolveColumns,
+			this, a, tmp, Height * i / threadCount,
+			Height * (i + 1) / threadCount));
+	columns.join_all();
+}
+
+void LPyramid::ConvolveRows(float *tmp, const float *b, int yStart, int yEnd)
+{
+	const int interiorEnd = std::max(2, Width - 2);
+	for (int y = yStart; y < yEnd; ++y) {
+		const float *src = b + y * Width;
+		float *dst = tmp + y * Width;
+		int x;
+		for (x = 0; x < std::min(2, Width); ++x)
+			dst[x] = Filter(src[Mirror(x - 2, Width)],
+				src[Mirror(x - 1, Width)], src[x],
+				src[Mirror(x + 1, Width)], src[Mirror(x + 2, Width)]);
+#if defined(LUX_LPYRAMID_SSE2)
+		const __m128 k0 = _mm_set1_ps(K0);
+		const __m128 k1 = _mm_set1_ps(K1);
+		const __m128 k2 = _mm_set1_ps(K2);
+		for (; x + 4 <= interiorEnd; x += 4) {
+			const __m128 s0 = _mm_loadu_ps(src + x - 2);
+			const __m128 s1 = _mm_loadu_ps(src + x - 1);
+			const __m128 s2 = _mm_loadu_ps(src + x);
+			const __m128 s3 = _mm_loadu_ps(src + x + 1);
+			const __m128 s4 = _mm_loadu_ps(src + x + 2);
+			_mm_storeu_ps(dst + x, _mm_add_ps(_mm_add_ps(
+				_mm_mul_ps(k0, _mm_add_ps(s0, s4)),
+				_mm_mul_ps(k1, _mm_add_ps(s1, s3))),
+				_mm_mul_ps(k2, s2)));
+		}
+#endif
+		for (; x < interiorEnd; ++x)
+			dst[x] = Filter(src[x - 2], src[x - 1], src[x],
+				src[x + 1], src[x + 2]);
+		for (x = interiorEnd; x < Width; ++x)
+			dst[x] = Filter(src[Mirror(x - 2, Width)],
+				src[Mirror(x - 1, Width)], src[x],
+				src[Mirror(x + 1, Width)], src[Mirror(x + 2, Width)]);
+	}
+}
+
+void LPyramid::ConvolveColumns(float *a, const float *tmp, int yStart, int yEnd)
 {
-	int y,x,i,j,nx,ny;
-	const float Kernel[] = {0.05f, 0.25f, 0.4f, 0.25f, 0.05f};
-
-	for (y=0; y<Height; y++) {
-		for (x=0; x<Width; x++) {
-			int index = y * Width + x;
-			a[index] = 0.0f;
-			for (i=-2; i<=2; i++) {
-				for (j=-2; j<=2; j++) {
-					nx=x+i;
-					ny=y+j;
-					if (nx<0) nx=-nx;
-					if (ny<0) ny=-ny;
-					if (nx>=Width) nx=2*Width-nx-1;
-					if (ny>=Height) ny=2*Height-ny-1;
-					a[index] += Kernel[i+2] * Kernel[j+2] * b[ny * Width + nx];
-				} 
-			}
+	for (int y = yStart; y < yEnd; ++y) {
+		const float *r0 = tmp + Mirror(y - 2, Height) * Width;
+		const float *r1 = tmp + Mirror(y - 1, Height) * Width;
+		const float *r2 = tmp + y * Width;
+		const float *r3 = tmp + Mirror(y + 1, Height) * Width;
+		const float *r4 = tmp + Mirror(y + 2, Height) * Width;
+		float *dst = a + y * Width;
+		int x = 0;
+#if defined(LUX_LPYRAMID_SSE2)
+		const __m128 k0 = _mm_set1_ps(K0);
+		const __m128 k1 = _mm_set1_ps(K1);
+		const __m128 k2 = _mm_set1_ps(K2);
+		for (; x + 4 <= Width; x += 4) {
+			const __m128 s0 = _mm_loadu_ps(r0 + x);
+			const __m128 s1 = _mm_loadu_ps(r1 + x);
+			const __m128 s2 = _mm_loadu_ps(r2 + x);
+			const __m128 s3 = _mm_loadu_ps(r3 + x);
+			const __m128 s4 = _mm_loadu_ps(r4 + x);
+			_mm_storeu_ps(dst + x, _mm_add_ps(_mm_add_ps(
+				_mm_mul_ps(k0, _mm_add_ps(s0, s4)),
+				_mm_mul_ps(k1, _mm_add_ps(s1, s3))),
+				_mm_mul_ps(k2, s2)));
 		}
+#endif
+		for (; x < Width; ++x)
+			dst[x] = Filter(r0[x], r1[x], r2[x], r3[x], r4[x]);
 	}
 }
 
@@ -31,7 +31,11 @@ public:
 	float Get_Value(int x, int y, int level);
 protected:
 	float *Copy(float *img);
-	void Convolve(float *a, float *b);
+	// Convolves image b with the filter kernel and stores it in a, tmp
+	// holds the horizontally filtered image
+	void Convolve(float *a, float *b, float *tmp);
+	void ConvolveRows(float *tmp, const float *b, int yStart, int yEnd);
+	void ConvolveColumns(float *a, const float *tmp, int yStart, int yEnd);
 	
 	// Succesively blurred versions of the original image
 	float *Levels[MAX_PYR_LEVELS];
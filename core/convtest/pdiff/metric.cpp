@@ -18,16 +18,23 @@ if not, write to the Free Software Foundation, Inc., 59 Temple Place, Suite 330,
 
 #include <cstdio>
 #include <cmath>
+#include <algorithm>
 
 #include "core/convtest/pdiff/metric.h"
 #include "core/convtest/pdiff/lpyramid.h"
 
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
 #ifndef M_PI
 #define M_PI 3.14159265f
 #endif
 
 using namespace lux;
 
+// Images with fewer pixels are compared by the calling thread
+#define YEE_PARALLEL_SIZE (256 * 256)
+
 /*
 * Given the adaptation luminance, this function returns the
 * threshold of visibility in cd per m^2
@@ -98,22 +105,17 @@ static void AdobeRGBToXYZ(float r, float g, float b, float &x, float &y, float &
 	z = r * 0.0270328f + g * 0.0706879f + b * 0.991248f;
 }
 
-static void XYZToLAB(float x, float y, float z, float &L, float &A, float &B)
+// white is the reference white in XYZ
+static void XYZToLAB(float x, float y, float z, const float white[3],
+	float &L, float &A, float &B)
 {
-	static float xw = -1;
-	static float yw;
-	static float zw;
-	// reference white
-	if (xw < 0) {
-		AdobeRGBToXYZ(1, 1, 1, xw, yw, zw);
-	}
 	const float epsilon  = 216.0f / 24389.0f;
 	const float kappa = 24389.0f / 27.0f;
 	float f[3];
 	float r[3];
-	r[0] = x / xw;
-	r[1] = y / yw;
-	r[2] = z / zw;
+	r[0] = x / white[0];
+	r[1] = y / white[1];
+	r[2] = z / white[2];
 	for (int i = 0; i < 3; i++) {
 		if (r[i] > epsilon) {
 			f[i] = powf(r[i], 1.0f / 3.0f);
@@ -126,99 +128,62 @@ static void XYZToLAB(float x, float y, float z, float &L, float &A, float &B)
 	B = 200.0f * (f[1] - f[2]);
 }
 
-unsigned int lux::Yee_Compare(
-		const float *rgbA,
-		const float *rgbB,
-		std::vector<bool> *diff,
-		float *tviBuffer,
-		const unsigned int width,
-		const unsigned int height,
-		const bool LuminanceOnly,
-		const float FieldOfView,
-		const float Gamma,
-		const float Luminance,
-		const float ColorFactor,
-		const unsigned int DownSample)
+namespace {
+
+// The data shared by the threads comparing bands of rows
+struct YeeData {
+	const float *rgbA, *rgbB;
+	float *tviBuffer;
+	unsigned int width;
+	bool LuminanceOnly;
+	float Gamma, Luminance, ColorFactor;
+	float white[3];
+
+	float *aLum, *bLum;
+	float *aA, *bA, *aB, *bB;
+
+	LPyramid *la, *lb;
+	unsigned int adaptation_level;
+	float cpd[MAX_PYR_LEVELS];
+	float F_freq[MAX_PYR_LEVELS - 2];
+
+	// Result of the test of each pixel, if the caller asked for it
+	unsigned char *pass;
+};
+
+}
+
+static void ConvertColors(const YeeData *d, unsigned int yStart,
+	unsigned int yEnd)
 {
-	unsigned int i, dim;
-	dim = width * height;
-	bool identical = true;
-	for (i = 0; i < 3 * dim; i++) {
-		if (rgbA[i] != rgbB[i]) {
-		  identical = false;
-		  break;
-		}
-	}
-	if (identical) {
-		// Images are binary identical
-		return true;
-	}
-	
 	// assuming colorspaces are in Adobe RGB (1998) convert to XYZ
-	float *aX = new float[dim];
-	float *aY = new float[dim];
-	float *aZ = new float[dim];
-	float *bX = new float[dim];
-	float *bY = new float[dim];
-	float *bZ = new float[dim];
-	float *aLum = new float[dim];
-	float *bLum = new float[dim];
-	
-	float *aA = new float[dim];
-	float *bA = new float[dim];
-	float *aB = new float[dim];
-	float *bB = new float[dim];
-	
-	unsigned int x, y;
-	for (y = 0; y < height; y++) {
-		for (x = 0; x < width; x++) {
-			float r, g, b, l;
-			i = x + y * width;
-			r = powf(rgbA[3 * i], Gamma);
-			g = powf(rgbA[3 * i + 1], Gamma);
-			b = powf(rgbA[3 * i + 2], Gamma);						
-			AdobeRGBToXYZ(r,g,b,aX[i],aY[i],aZ[i]);			
-			XYZToLAB(aX[i], aY[i], aZ[i], l, aA[i], aB[i]);
-			r = powf(rgbB[3 * i], Gamma);
-			g = powf(rgbB[3 * i + 1], Gamma);
-			b = powf(rgbB[3 * i + 2], Gamma);						
-			AdobeRGBToXYZ(r,g,b,bX[i],bY[i],bZ[i]);
-			XYZToLAB(bX[i], bY[i], bZ[i], l, bA[i], bB[i]);
-			aLum[i] = aY[i] * Luminance;
-			bLum[i] = bY[i] * Luminance;
-		}
+	for (unsigned int i = yStart * d->width; i < yEnd * d->width; i++) {
+		float r, g, b, l, X, Y, Z;
+		r = powf(d->rgbA[3 * i], d->Gamma);
+		g = powf(d->rgbA[3 * i + 1], d->Gamma);
+		b = powf(d->rgbA[3 * i + 2], d->Gamma);
+		AdobeRGBToXYZ(r, g, b, X, Y, Z);
+		XYZToLAB(X, Y, Z, d->white, l, d->aA[i], d->aB[i]);
+		d->aLum[i] = Y * d->Luminance;
+		r = powf(d->rgbB[3 * i], d->Gamma);
+		g = powf(d->rgbB[3 * i + 1], d->Gamma);
+		b = powf(d->rgbB[3 * i + 2], d->Gamma);
+		AdobeRGBToXYZ(r, g, b, X, Y, Z);
+		XYZToLAB(X, Y, Z, d->white, l, d->bA[i], d->bB[i]);
+		d->bLum[i] = Y * d->Luminance;
 	}
+}
 
-	// Constructing Laplacian Pyramids
-	
-	LPyramid *la = new LPyramid(aLum, width, height);
-	LPyramid *lb = new LPyramid(bLum, width, height);
-	
-	float num_one_degree_pixels = (float) (2 * tan(FieldOfView * 0.5 * M_PI / 180) * 180 / M_PI);
-	float pixels_per_degree = width / num_one_degree_pixels;
-	
-	// Performing test
-	
-	float num_pixels = 1;
-	unsigned int adaptation_level = 0;
-	for (i = 0; i < MAX_PYR_LEVELS; i++) {
-		adaptation_level = i;
-		if (num_pixels > num_one_degree_pixels) break;
-		num_pixels *= 2;
-	}
-	
-	float cpd[MAX_PYR_LEVELS];
-	cpd[0] = 0.5f * pixels_per_degree;
-	for (i = 1; i < MAX_PYR_LEVELS; i++) cpd[i] = 0.5f * cpd[i - 1];
-	float csf_max = csf(3.248f, 100.0f);
-	
-	float F_freq[MAX_PYR_LEVELS - 2];
-	for (i = 0; i < MAX_PYR_LEVELS - 2; i++) F_freq[i] = csf_max / csf( cpd[i], 100.0f);
-	
+static void TestPixels(const YeeData *d, unsigned int yStart,
+	unsigned int yEnd, unsigned int *failed)
+{
+	LPyramid *la = d->la;
+	LPyramid *lb = d->lb;
 	unsigned int pixels_failed = 0;
-	for (y = 0; y < height; y++) {
-	  for (x = 0; x < width; x++) {
-		int index = x + y * width;
+	for (unsigned int y = yStart; y < yEnd; y++) {
+	  for (unsigned int x = 0; x < d->width; x++) {
+		unsigned int i;
+		int index = x + y * d->width;
 		float contrast[MAX_PYR_LEVELS - 2];
 		float sum_contrast = 0;
 		for (i = 0; i < MAX_PYR_LEVELS - 2; i++) {
@@ -234,15 +199,15 @@ unsigned int lux::Yee_Compare(
 		}
 		if (sum_contrast < 1e-5) sum_contrast = 1e-5f;
 		float F_mask[MAX_PYR_LEVELS - 2];
-		float adapt = la->Get_Value(x,y,adaptation_level) + lb->Get_Value(x,y,adaptation_level);
+		float adapt = la->Get_Value(x,y,d->adaptation_level) + lb->Get_Value(x,y,d->adaptation_level);
 		adapt *= 0.5f;
 		if (adapt < 1e-5) adapt = 1e-5f;
 		for (i = 0; i < MAX_PYR_LEVELS - 2; i++) {
-			F_mask[i] = mask(contrast[i] * csf(cpd[i], adapt)); 
+			F_mask[i] = mask(contrast[i] * csf(d->cpd[i], adapt)); 
 		}
 		float factor = 0;
 		for (i = 0; i < MAX_PYR_LEVELS - 2; i++) {
-			factor += contrast[i] * F_freq[i] * F_mask[i] / sum_contrast;
+			factor += contrast[i] * d->F_freq[i] * F_mask[i] / sum_contrast;
 		}
 		if (factor < 1) factor = 1;
 		if (factor > 10) factor = 10;
@@ -250,20 +215,20 @@ unsigned int lux::Yee_Compare(
 		bool pass = true;
 		// pure luminance test
 		const float tviValue = tvi(adapt);
-		if (tviBuffer)
-			tviBuffer[x + y * width] = tviValue;
+		if (d->tviBuffer)
+			d->tviBuffer[index] = tviValue;
 		if (delta > factor * tviValue) {
 			pass = false;
-		} else if (!LuminanceOnly) {
+		} else if (!d->LuminanceOnly) {
 			// CIE delta E test with modifications
-			float color_scale = ColorFactor;
+			float color_scale = d->ColorFactor;
 			// ramp down the color test in scotopic regions
 			if (adapt < 10.0f) {
 				// Don't do color test at all.
 				color_scale = 0.0;
 			}
-			float da = aA[index] - bA[index];
-			float db = aB[index] - bB[index];
+			float da = d->aA[index] - d->bA[index];
+			float db = d->aB[index] - d->bB[index];
 			da = da * da;
 			db = db * db;
 			float delta_e = (da + db) * color_scale;
@@ -271,32 +236,134 @@ unsigned int lux::Yee_Compare(
 				pass = false;
 			}
 		}
-		if (!pass) {
+		if (!pass)
 			pixels_failed++;
+		if (d->pass)
+			d->pass[index] = pass;
+	  }
+	}
+	*failed = pixels_failed;
+}
 
-			if (diff)
-				(*diff)[index] = false;
-		} else {
-			if (diff)
-				(*diff)[index] = true;
+unsigned int lux::Yee_Compare(
+		const float *rgbA,
+		const float *rgbB,
+		std::vector<bool> *diff,
+		float *tviBuffer,
+		const unsigned int width,
+		const unsigned int height,
+		const bool LuminanceOnly,
+		const float FieldOfView,
+		const float Gamma,
+		const float Luminance,
+		const float ColorFactor,
+		const unsigned int DownSample)
+{
+	unsigned int i, dim;
+	dim = width * height;
+	bool identical = true;
+	for (i = 0; i < 3 * dim; i++) {
+		if (rgbA[i] != rgbB[i]) {
+		  identical = false;
+		  break;
 		}
-	  }
+	}
+	if (identical) {
+		// Images are binary identical
+		return true;
+	}
+
+	// The rows are split in bands processed by different threads
+	const unsigned int threadCount = dim < YEE_PARALLEL_SIZE ? 1U :
+		std::min(std::max(1U, boost::thread::hardware_concurrency()), height);
+
+	YeeData d;
+	d.rgbA = rgbA;
+	d.rgbB = rgbB;
+	d.tviBuffer = tviBuffer;
+	d.width = width;
+	d.LuminanceOnly = LuminanceOnly;
+	d.Gamma = Gamma;
+	d.Luminance = Luminance;
+	d.ColorFactor = ColorFactor;
+	// reference white
+	AdobeRGBToXYZ(1, 1, 1, d.white[0], d.white[1], d.white[2]);
+	
+	d.aLum = new float[dim];
+	d.bLum = new float[dim];
+	d.aA = new float[dim];
+	d.bA = new float[dim];
+	d.aB = new float[dim];
+	d.bB = new float[dim];
+
+	if (threadCount == 1)
+		ConvertColors(&d, 0, height);
+	else {
+		boost::thread_group threads;
+		for (i = 0; i < threadCount; i++)
+			threads.create_thread(boost::bind(ConvertColors, &d,
+				height * i / threadCount,
+				height * (i + 1) / threadCount));
+		threads.join_all();
+	}
+
+	// Constructing Laplacian Pyramids
+	
+	d.la = new LPyramid(d.aLum, width, height);
+	d.lb = new LPyramid(d.bLum, width, height);
+	
+	float num_one_degree_pixels = (float) (2 * tan(FieldOfView * 0.5 * M_PI / 180) * 180 / M_PI);
+	float pixels_per_degree = width / num_one_degree_pixels;
+	
+	// Performing test
+	
+	float num_pixels = 1;
+	d.adaptation_level = 0;
+	for (i = 0; i < MAX_PYR_LEVELS; i++) {
+		d.adaptation_level = i;
+		if (num_pixels > num_one_degree_pixels) break;
+		num_pixels *= 2;
+	}
+	
+	d.cpd[0] = 0.5f * pixels_per_degree;
+	for (i = 1; i < MAX_PYR_LEVELS; i++) d.cpd[i] = 0.5f * d.cpd[i - 1];
+	float csf_max = csf(3.248f, 100.0f);
+	
+	for (i = 0; i < MAX_PYR_LEVELS - 2; i++) d.F_freq[i] = csf_max / csf( d.cpd[i], 100.0f);
+
+	// std::vector<bool> packs the flags in shared words, so the threads
+	// write them in a byte buffer
+	std::vector<unsigned char> pass(diff ? dim : 0);
+	d.pass = diff ? &pass[0] : NULL;
+
+	std::vector<unsigned int> failed(threadCount, 0);
+	if (threadCount == 1)
+		TestPixels(&d, 0, height, &failed[0]);
+	else {
+		boost::thread_group threads;
+		for (i = 0; i < threadCount; i++)
+			threads.create_thread(boost::bind(TestPixels, &d,
+				height * i / threadCount,
+				height * (i + 1) / threadCount, &failed[i]));
+		threads.join_all();
+	}
+
+	unsigned int pixels_failed = 0;
+	for (i = 0; i < threadCount; i++)
+		pixels_failed += failed[i];
+	if (diff) {
+		for (i = 0; i < dim; i++)
+			(*diff)[i] = pass[i] != 0;
 	}
 	
-	if (aX) delete[] aX;
-	if (aY) delete[] aY;
-	if (aZ) delete[] aZ;
-	if (bX) delete[] bX;
-	if (bY) delete[] bY;
-	if (bZ) delete[] bZ;
-	if (aLum) delete[] aLum;
-	if (bLum) delete[] bLum;
-	if (la) delete la;
-	if (lb) delete lb;
-	if (aA) delete[] aA;
-	if (bA) delete[] bA;
-	if (aB) delete[] aB;
-	if (bB) delete[] bB;
+	delete[] d.aLum;
+	delete[] d.bLum;
+	delete d.la;
+	delete d.lb;
+	delete[] d.aA;
+	delete[] d.bA;
+	delete[] d.aB;
+	delete[] d.bB;
 	
 	return pixels_failed;
 }
@@ -30,6 +30,7 @@
 #include "material.h"
 #include "texture.h"
 #include "volume.h"
+#include "light.h"
 
 namespace lux {
 
@@ -118,6 +119,8 @@ Light *MakeLight(const string &name,
 		Light *ret = DynamicLoader::registeredLights()[name](light2world,
 			paramSet);
 		paramSet.ReportUnused();
+		if (ret)
+			ret->paramsDigest = paramSet.Digest();
 		return ret;
 	}
 
@@ -135,6 +138,8 @@ AreaLight *MakeAreaLight(const string &name,
 			DynamicLoader::registeredAreaLights()[name](light2world,
 				paramSet, prim);
 		paramSet.ReportUnused();
+		if (ret)
+			ret->paramsDigest = paramSet.Digest();
 		return ret;
 	}
 
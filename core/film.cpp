@@ -44,6 +44,9 @@
 #include <boost/iostreams/filter/gzip.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/thread.hpp>
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/cstdint.hpp>
 #include <boost/filesystem.hpp>
 //#include <boost/math/special_functions/bessel.hpp>
 #include <complex>
@@ -861,10 +864,8 @@ void ApplyImagingPipeline(vector<XYZColor> &xyzpixels, u_int xResolution, u_int
 		rgbpixels[i] = colorSpace.ToRGBConstrained(xyzpixels[i]);
 
 	// DO NOT USE xyzpixels ANYMORE AFTER THIS POINT
-	if (response && response->validFile) {
-		for (u_int i = 0; i < nPix; ++i)
-			response->Map(rgbpixels[i]);
-	}
+	if (response && response->validFile)
+		response->Map(&rgbpixels[0], nPix);
 
 	// Add vignetting & chromatic aberration effect
 	// These are paired in 1 loop as they can share quite a few calculations
@@ -1056,9 +1057,53 @@ FilterLUT::FilterLUT(Filter *filter, const float offsetX, const float offsetY) {
 	}
 }
 
+FilterLUT1D::FilterLUT1D(Filter *filter, const float offset, const bool yAxis) {
+	const float width = yAxis ? filter->yWidth : filter->xWidth;
+	const int x0 = Ceil2Int(offset - width);
+	const int x1 = Floor2Int(offset + width);
+	lutSize = max(1, x1 - x0 + 1);
+	lut.resize(lutSize);
+
+	// if the whole filter support lies within the pixel
+	// x0>x1, this requires special treatment to avoid blackness
+	float totalWeight = 0.f;
+	if (x1 >= x0) {
+		for (int ix = x0; ix <= x1; ++ix) {
+			const float d = fabsf(ix - offset);
+			const float filterVal = yAxis ? filter->Evaluate(0.f, d) :
+				filter->Evaluate(d, 0.f);
+			totalWeight += filterVal;
+			lut[ix - x0] = filterVal;
+		}
+	} else {
+		lut[0] = filter->Evaluate(0.f, 0.f);
+		totalWeight = lut[0];
+	}
+
+	// Normalize LUT, the product of the normalized X and Y LUTs is the
+	// normalized 2D LUT, filters with negative lobes may sum below 0
+	if (totalWeight != 0.f) {
+		for (u_int i = 0; i < lut.size(); ++i)
+			lut[i] /= totalWeight;
+	}
+}
+
 FilterLUTs::FilterLUTs(Filter *filter, const unsigned int size) {		
 	lutsSize = size + 1;
 	step = 1.f / float(size);
+	separable = filter->IsSeparable();
+
+	if (separable) {
+		xLuts.resize(lutsSize);
+		yLuts.resize(lutsSize);
+		for (unsigned int i = 0; i < lutsSize; ++i) {
+			const float v = i * step - 0.5f + step / 2.f;
+
+			xLuts[i] = FilterLUT1D(filter, v, false);
+			yLuts[i] = FilterLUT1D(filter, v, true);
+		}
+		return;
+	}
 
 	luts.resize(lutsSize * lutsSize);
 
@@ -1072,9 +1117,6 @@ FilterLUTs::FilterLUTs(Filter *filter, const unsigned int size) {
 	}
 }
 
-// OutlierData Definitions
-ColorSystem OutlierData::cs(0.63f, 0.34f, 0.31f, 0.595f, 0.155f, 0.07f, 0.314275f, 0.329411f);
-
 void BufferGroup::CreateBuffers(const vector<BufferConfig> &configs, u_int x, u_int y) {
 	for(vector<BufferConfig>::const_iterator config = configs.begin(); config != configs.end(); ++config) {
 		Buffer *buffer;
@@ -1148,13 +1190,13 @@ Film::Film(u_int xres, u_int yres, Filter *filt, u_int filtRes, const float crop
 	contribPool(NULL), filter(filt), filterTable(NULL), filterLUTs(NULL),
 	filename(filename1),
 	colorSpace(0.63f, 0.34f, 0.31f, 0.595f, 0.155f, 0.07f, 0.314275f, 0.329411f), // default is SMPTE
-	convTest(NULL), varianceBuffer(NULL),
+	convTest(NULL), convergenceTileSize(0), varianceBuffer(NULL),
 	noiseAwareMapVersion(0),
 	userSamplingMapFileName(samplingmapfilename), userSamplingMapVersion(0),
 	ZBuffer(NULL), use_Zbuf(useZbuffer),
 	debug_mode(debugmode), premultiplyAlpha(premult),
 	writeResumeFlm(w_resume_FLM), restartResumeFlm(restart_resume_FLM), writeFlmDirect(write_FLM_direct),
-	outlierRejection_k(outlierk), haltSamplesPerPixel(haltspp),
+	outlierRejection_k(min(outlierk, 255)), haltSamplesPerPixel(haltspp),
 	haltTime(halttime), haltThreshold(haltthreshold), haltThresholdComplete(0.f),
 	histogram(NULL), enoughSamplesPerPixel(false)
 {
@@ -1232,6 +1274,8 @@ Film::Film(u_int xres, u_int yres, Filter *filt, u_int filtRes, const float crop
 	tileOffset2 = 2 * filter->yWidth * invTileHeight;
 
 	if (outlierRejection_k > 0) {
+		if (outlierk > outlierRejection_k)
+			LOG(LUX_WARNING, LUX_BADTOKEN) << "Outlier rejection k is limited to " << outlierRejection_k;
 		const u_int outliers_width = xRealWidth / outlierCellWidth;
 		const u_int outliers_height = yRealHeight / outlierCellHeight;
 		outliers.resize(outliers_height);
@@ -1351,6 +1395,8 @@ void Film::CreateBuffers()
 
 		if (noiseAwareMap)
 			convTest->NeedTVI();
+		if ((haltThreshold >= 0.f) && (convergenceTileSize > 0))
+			convTest->NeedTiles(convergenceTileSize, haltThreshold);
 	}
 
 	// DEBUG: for testing the user sampling map functionality
@@ -1417,7 +1463,7 @@ void Film::SetGroupEnable(u_int index, bool status)
 
 	// Reset the convergence test
 	if (convTest) {
-		boost::mutex::scoped_lock(write_mutex);
+		boost::mutex::scoped_lock lock(write_mutex);
 		convTest->Reset();
 	}
 }
@@ -1436,7 +1482,7 @@ void Film::SetGroupScale(u_int index, float value)
 
 	// Reset the convergence test
 	if (convTest) {
-		boost::mutex::scoped_lock(write_mutex);
+		boost::mutex::scoped_lock lock(write_mutex);
 		convTest->Reset();
 	}
 }
@@ -1455,7 +1501,7 @@ void Film::SetGroupRGBScale(u_int index, const RGBColor &value)
 
 	// Reset the convergence test
 	if (convTest) {
-		boost::mutex::scoped_lock(write_mutex);
+		boost::mutex::scoped_lock lock(write_mutex);
 		convTest->Reset();
 	}
 }
@@ -1474,7 +1520,7 @@ void Film::SetGroupTemperature(u_int index, float value)
 
 	// Reset the convergence test
 	if (convTest) {
-		boost::mutex::scoped_lock(write_mutex);
+		boost::mutex::scoped_lock lock(write_mutex);
 		convTest->Reset();
 	}
 }
@@ -1534,7 +1580,7 @@ void Film::AddSampleCount(const double count) {
 }
 
 
-std::vector<Film::OutlierAccel>& Film::GetOutlierAccelRow(u_int oY, u_int tileIndex, u_int tileStart, u_int tileEnd)
+std::vector<OutlierCell>& Film::GetOutlierRow(u_int oY, u_int tileIndex, u_int tileStart, u_int tileEnd)
 {
 	if (oY < tileStart) {
 		// above currrent tile
@@ -1548,6 +1594,65 @@ std::vector<Film::OutlierAccel>& Film::GetOutlierAccelRow(u_int oY, u_int tileIn
 	return outliers[oY];
 }
 
+// Returns the half octave of 1 + y for the outlier density estimate,
+// negative and NaN luminances are treated as 0
+static inline u_int OutlierBin(float y)
+{
+	union {
+		float f;
+		u_int i;
+	} v;
+	v.f = 1.f + (y > 0.f ? y : 0.f);
+	// 0x3504f3 is the mantissa of sqrt(2)
+	const u_int bin = 2 * ((v.i >> 23) - 127) +
+		((v.i & 0x7fffffU) >= 0x3504f3U ? 1U : 0U);
+	return min(bin, OUTLIER_BIN_COUNT - 1U);
+}
+
+namespace {
+// Ring and luminance bin offsets of the outlier cell counts sorted by
+// their squared distance to a sample, in the (x, y, ln(1 + Y)) space of
+// the previous kd-tree lookup: positions are in cells and counts only
+// know their ring, so the spatial part is the mean squared distance
+// between two uniform points of cells at that ring (1/3, 4/3, 7/3)
+struct OutlierSearchStep {
+	u_int ring;
+	int binOffset;
+	float distance;
+
+	bool operator<(const OutlierSearchStep &s) const {
+		return distance < s.distance;
+	}
+};
+
+class OutlierSearchOrder {
+public:
+	OutlierSearchOrder() {
+		static const float ringDistance[OUTLIER_RING_COUNT] = {
+			1.f / 3.f, 4.f / 3.f, 7.f / 3.f };
+		// A bin is half an octave, that is 0.5 * ln(2)
+		const float binDistance = .34657359f;
+		for (u_int r = 0; r < OUTLIER_RING_COUNT; ++r) {
+			for (int b = 1 - static_cast<int>(OUTLIER_BIN_COUNT);
+				b < static_cast<int>(OUTLIER_BIN_COUNT); ++b) {
+				OutlierSearchStep step;
+				step.ring = r;
+				step.binOffset = b;
+				step.distance = ringDistance[r] +
+					b * b * binDistance * binDistance;
+				steps.push_back(step);
+			}
+		}
+		std::stable_sort(steps.begin(), steps.end());
+	}
+
+	vector<OutlierSearchStep> steps;
+};
+
+// Built at load time so that it is ready before any rendering thread
+const OutlierSearchOrder outlierSearchOrder;
+}
+
 void Film::RejectTileOutliers(const Contribution &contrib, u_int tileIndex, int yTilePixelStart, int yTilePixelEnd)
 {
 	// outlier rejection
@@ -1561,31 +1666,33 @@ void Film::RejectTileOutliers(const Contribution &contrib, u_int tileIndex, int
 	const float fnormX = (contrib.imageX - 0.5f + filter->xWidth) * outlierInvCellWidth;
 	const float fnormY = (contrib.imageY - 0.5f + filter->yWidth) * outlierInvCellHeight;
 
-	OutlierData sd(fnormX, fnormY, contrib.color);
-
 	// perform lookup based on original position
 	// constrain to tile only if we need to add the outlier
 	const int oY = max(0, min(Floor2Int(fnormY), static_cast<int>(outliers.size() - 1)));
 
-	std::vector<OutlierAccel> &outlierRow = GetOutlierAccelRow(oY, tileIndex, tileStart, tileEnd);
+	std::vector<OutlierCell> &outlierRow = GetOutlierRow(oY, tileIndex, tileStart, tileEnd);
 	const int oX = max(0, min(Floor2Int(fnormX), static_cast<int>(outlierRow.size() - 1)));
-	OutlierAccel &outlierAccel = outlierRow[oX];
-
-	NearSetPointProcess<OutlierData::Point_t> proc(outlierRejection_k);
-	vector<ClosePoint<OutlierData::Point_t> > closest(outlierRejection_k);
-	proc.points = &closest[0];
-
-	float maxDist = INFINITY;
-
-	outlierAccel.Lookup(sd.p, proc, maxDist);
 
+	// Gather the k previously rejected samples closest to it in position
+	// and log luminance
+	const u_int bin = OutlierBin(contrib.color.Y());
+	const u_int k = static_cast<u_int>(outlierRejection_k);
+	const OutlierCell &cell(outlierRow[oX]);
+	const vector<OutlierSearchStep> &steps(outlierSearchOrder.steps);
+	u_int foundPoints = 0;
 	float kmeandist = 0.f;
-	for (u_int i = 0; i < proc.foundPoints; ++i)
-		kmeandist += proc.points[i].distance;
-	
-	//kmeandist /= proc.foundPoints;
-		
-	if (proc.foundPoints < 1 || kmeandist > proc.foundPoints) { // kmeandist > 1.f
+	for (u_int i = 0; foundPoints < k && i < steps.size(); ++i) {
+		const int b = static_cast<int>(bin) + steps[i].binOffset;
+		if (b < 0 || b >= static_cast<int>(OUTLIER_BIN_COUNT))
+			continue;
+		const u_int n = min(static_cast<u_int>(cell.counts[steps[i].ring][b]),
+			k - foundPoints);
+		foundPoints += n;
+		kmeandist += n * steps[i].distance;
+	}
+
+	// The sample is valid if their mean squared distance is below 1
+	if (foundPoints < 1 || kmeandist > foundPoints) {
 		// add outlier and return
 		// include surrounding cells so we don't have to
 		// traverse multiple cells for each lookup
@@ -1594,21 +1701,16 @@ void Film::RejectTileOutliers(const Contribution &contrib, u_int tileIndex, int
 		const u_int oTop = static_cast<u_int>(max(0, oY - 1));
 		const u_int oBottom = static_cast<u_int>(min(static_cast<int>(outliers.size() - 1), oY + 1));
 
-		if (oTop < tileStart || oBottom >= tileEnd) {
-			// outlier spans tile borders
-			for (u_int i = oTop; i <= oBottom; ++i) {
-				std::vector<OutlierAccel> &row = GetOutlierAccelRow(i, tileIndex, tileStart, tileEnd);
-				for (u_int j = oLeft; j <= oRight; ++j) {
-					row[j].AddNode(sd.p);
-				}
-			}
-		} else {
-			// we're all inside one tile
-			for (u_int i = oTop; i <= oBottom; ++i) {
-				std::vector<OutlierAccel> &row = outliers[i];
-				for (u_int j = oLeft; j <= oRight; ++j) {
-					row[j].AddNode(sd.p);
-				}
+		for (u_int i = oTop; i <= oBottom; ++i) {
+			// outlier may span tile borders
+			std::vector<OutlierCell> &row = (oTop < tileStart || oBottom >= tileEnd) ?
+				GetOutlierRow(i, tileIndex, tileStart, tileEnd) : outliers[i];
+			for (u_int j = oLeft; j <= oRight; ++j) {
+				const u_int ring = (i != static_cast<u_int>(oY) ? 1U : 0U) +
+					(j != static_cast<u_int>(oX) ? 1U : 0U);
+				u_char &count(row[j].counts[ring][bin]);
+				if (count < 255)
+					++count;
 			}
 		}
 		// outlier, reject
@@ -1698,14 +1800,30 @@ void Film::AddTileSamples(const Contribution* const contribs, u_int num_contribs
 		float dImageY = contrib.imageY - 0.5f;
 
 		// Get filter coefficients
-		const FilterLUT &filterLUT = 
-			filterLUTs->GetLUT(dImageX - Floor2Int(contrib.imageX), dImageY - Floor2Int(contrib.imageY));
-		const float *lut = filterLUT.GetLUT();
+		const float offsetX = dImageX - Floor2Int(contrib.imageX);
+		const float offsetY = dImageY - Floor2Int(contrib.imageY);
+		const bool separable = filterLUTs->IsSeparable();
+		const float *lut, *yLut;
+		u_int lutWidth, lutHeight;
+		if (separable) {
+			const FilterLUT1D &xFilterLUT = filterLUTs->GetXLUT(offsetX);
+			const FilterLUT1D &yFilterLUT = filterLUTs->GetYLUT(offsetY);
+			lut = xFilterLUT.GetLUT();
+			yLut = yFilterLUT.GetLUT();
+			lutWidth = xFilterLUT.GetSize();
+			lutHeight = yFilterLUT.GetSize();
+		} else {
+			const FilterLUT &filterLUT = filterLUTs->GetLUT(offsetX, offsetY);
+			lut = filterLUT.GetLUT();
+			yLut = NULL;
+			lutWidth = filterLUT.GetWidth();
+			lutHeight = filterLUT.GetHeight();
+		}
 
 		int x0 = Ceil2Int (dImageX - filter->xWidth);
-		int x1 = x0 + filterLUT.GetWidth();
+		int x1 = x0 + lutWidth;
 		int y0 = Ceil2Int (dImageY - filter->yWidth);
-		int y1 = y0 + filterLUT.GetHeight();
+		int y1 = y0 + lutHeight;
 		if (x1 < x0 || y1 < y0 || x1 < 0 || y1 < 0)
 			continue;
 
@@ -1714,21 +1832,31 @@ void Film::AddTileSamples(const Contribution* const contribs, u_int num_contribs
 		const u_int xEnd = static_cast<u_int>(min(x1, xTilePixelEnd));
 		const u_int yEnd = static_cast<u_int>(min(y1, yTilePixelEnd));
 
+		const bool addZ = use_Zbuf && contrib.zdepth != 0.f;
+#if defined(LUX_FILM_SSE2)
+		const __m128 Lalpha = _mm_set_ps(alpha, xyz.c[2], xyz.c[1], xyz.c[0]);
+#endif
+
 		for (u_int y = yStart; y < yEnd; ++y) {
-			const int yoffset = (y - y0) * filterLUT.GetWidth();
+			// With a separable filter, all the pixels of the row share
+			// the row weight and use the 1D column weights
+			const float *rowLut = separable ? lut : lut + (y - y0) * lutWidth;
+			const float rowWeight = separable ? weight * yLut[y - y0] : weight;
 			const u_int yPixel = y - yPixelStart;
 			for (u_int x = xStart; x < xEnd; ++x) {
 				// Evaluate filter value at $(x,y)$ pixel
-				const int xoffset = x-x0;
-				const float filterWt = lut[yoffset + xoffset];
+				const float w = rowLut[x - x0] * rowWeight;
 
 				// Update pixel values with filtered sample contribution
 				const u_int xPixel = x - xPixelStart;
-				const float w = filterWt * weight;
+#if defined(LUX_FILM_SSE2)
+				buffer->Add(xPixel, yPixel, Lalpha, w);
+#else
 				buffer->Add(xPixel, yPixel, xyz, alpha, w);
+#endif
 
 				// Update ZBuffer values with filtered zdepth contribution
-				if(use_Zbuf && contrib.zdepth != 0.f)
+				if (addZ)
 					ZBuffer->Add(xPixel, yPixel, contrib.zdepth, 1.0f);
 
 				// Update variance information
@@ -3179,20 +3307,27 @@ static void ApplyBoxFilterYR1(const float *src, float *dst,
 	dst[(height - 1) * width] = t * scale;
 }
 
-static void ApplyBoxFilter(float *frameBuffer, float *tmpFrameBuffer,
-	const unsigned int width, const unsigned int height, const unsigned int radius) {
-	if (radius == 1) {
-		for (unsigned int i = 0; i < height; ++i)
-			ApplyBoxFilterXR1(&frameBuffer[i * width], &tmpFrameBuffer[i * width], width, height);
-
-		for (unsigned int i = 0; i < width; ++i)
-			ApplyBoxFilterYR1(&tmpFrameBuffer[i], &frameBuffer[i], width, height);
-	} else {
-		for (unsigned int i = 0; i < height; ++i)
-			ApplyBoxFilterX(&frameBuffer[i * width], &tmpFrameBuffer[i * width], width, height, radius);
+static void ApplyBoxFilterRows(const float *src, float *dst,
+	const unsigned int width, const unsigned int height, const unsigned int radius,
+	const unsigned int band, const unsigned int bandCount) {
+	const unsigned int yEnd = height * (band + 1) / bandCount;
+	for (unsigned int i = height * band / bandCount; i < yEnd; ++i) {
+		if (radius == 1)
+			ApplyBoxFilterXR1(&src[i * width], &dst[i * width], width, height);
+		else
+			ApplyBoxFilterX(&src[i * width], &dst[i * width], width, height, radius);
+	}
+}
 
-		for (unsigned int i = 0; i < width; ++i)
-			ApplyBoxFilterY(&tmpFrameBuffer[i], &frameBuffer[i], width, height, radius);
+static void ApplyBoxFilterColumns(const float *src, float *dst,
+	const unsigned int width, const unsigned int height, const unsigned int radius,
+	const unsigned int band, const unsigned int bandCount) {
+	const unsigned int xEnd = width * (band + 1) / bandCount;
+	for (unsigned int i = width * band / bandCount; i < xEnd; ++i) {
+		if (radius == 1)
+			ApplyBoxFilterYR1(&src[i], &dst[i], width, height);
+		else
+			ApplyBoxFilterY(&src[i], &dst[i], width, height, radius);
 	}
 }
 
@@ -3200,7 +3335,135 @@ static void ApplyBoxFilter(float *frameBuffer, float *tmpFrameBuffer,
 // Update the noise-aware map
 //------------------------------------------------------------------------------
 
+// Maps with fewer pixels are built by the calling thread
+#define NOISE_AWARE_MAP_PARALLEL_SIZE (256 * 256)
+// The histogram used to clamp the map has NOISE_AWARE_MAP_BINS^2 bins
+#define NOISE_AWARE_MAP_BINS 1000
+
+// Runs work(0) to work(threadCount - 1) in parallel
+static void RunNoiseAwareMapThreads(const u_int threadCount,
+	const boost::function<void (u_int)> &work) {
+	if (threadCount == 1) {
+		work(0);
+		return;
+	}
+
+	boost::thread_group threads;
+	for (u_int i = 0; i < threadCount; ++i)
+		threads.create_thread(boost::bind(work, i));
+	threads.join_all();
+}
+
+static void ApplyBoxFilter(float *frameBuffer, float *tmpFrameBuffer,
+	const unsigned int width, const unsigned int height, const unsigned int radius,
+	const unsigned int threadCount) {
+	// The rows are independent, then the columns are
+	RunNoiseAwareMapThreads(min(threadCount, height), boost::bind(ApplyBoxFilterRows,
+		frameBuffer, tmpFrameBuffer, width, height, radius, _1, min(threadCount, height)));
+	RunNoiseAwareMapThreads(min(threadCount, width), boost::bind(ApplyBoxFilterColumns,
+		tmpFrameBuffer, frameBuffer, width, height, radius, _1, min(threadCount, width)));
+}
+
+struct NoiseAwareMapStats {
+	NoiseAwareMapStats() : hasPixelsToSample(false), allZeroVariance(true),
+		allZeroTVI(true), minValue(std::numeric_limits<float>::infinity()),
+		maxValue(0.f) { }
+
+	bool hasPixelsToSample, allZeroVariance, allZeroTVI;
+	float minValue, maxValue;
+};
+
+// Builds the Standard Error / TVI map of a band of rows
+static void NoiseAwareMapValues(const VarianceBuffer *varianceBuffer,
+	const float *convergenceTVI, float *map, const u_int width,
+	const u_int height, const u_int band, const u_int bandCount,
+	NoiseAwareMapStats *stats) {
+	NoiseAwareMapStats &s(stats[band]);
+	const u_int yEnd = height * (band + 1) / bandCount;
+	for (u_int y = height * band / bandCount; y < yEnd; ++y) {
+		u_int index = y * width;
+		for (u_int x = 0; x < width; ++x, ++index) {
+			const float variance = varianceBuffer->GetVariance(x, y);
+			// -1 means a pixel that have yet to be sampled
+			if (variance == -1.f) {
+				s.hasPixelsToSample = true;
+				return;
+			}
+
+			if (variance > 0.f)
+				s.allZeroVariance = false;
+			if (convergenceTVI[index] > 0.f)
+				s.allZeroTVI = false;
+
+			const float standardError = sqrtf(variance);
+			//const float value = (convergenceTVI[index] == 0.f) ? 0.f : logf(1.f + (standardError / convergenceTVI[index]));
+			const float value = (convergenceTVI[index] == 0.f) ? 0.f : (standardError / convergenceTVI[index]);
+
+			s.minValue = min(s.minValue, value);
+			s.maxValue = max(s.maxValue, value);
+			map[index] = value;
+		}
+	}
+}
+
+// First pixel of a part of the map
+static inline u_int NoiseAwareMapPartStart(const u_int nPix, const u_int part,
+	const u_int partCount) {
+	return static_cast<u_int>(static_cast<boost::uint64_t>(nPix) * part / partCount);
+}
+
+static inline u_int NoiseAwareMapBin(const float value, const float minValue,
+	const float valueRange) {
+	const u_int histogramSize = NOISE_AWARE_MAP_BINS * NOISE_AWARE_MAP_BINS;
+	// Map the value between 0.0 and 1.0
+	const float v = (value - minValue) / valueRange;
+
+	return min(Floor2UInt(v * histogramSize), histogramSize - 1);
+}
+
+// Counts the values of a part of the map in the coarse bins, each one
+// covering NOISE_AWARE_MAP_BINS bins of the histogram
+static void NoiseAwareMapCoarseHistogram(const float *map, const u_int nPix,
+	const float minValue, const float valueRange, const u_int part,
+	const u_int partCount, u_int *counts) {
+	u_int *histogram = counts + part * NOISE_AWARE_MAP_BINS;
+	const u_int end = NoiseAwareMapPartStart(nPix, part + 1, partCount);
+	for (u_int i = NoiseAwareMapPartStart(nPix, part, partCount); i < end; ++i)
+		++histogram[NoiseAwareMapBin(map[i], minValue, valueRange) / NOISE_AWARE_MAP_BINS];
+}
+
+// Counts the values of a part of the map falling in the coarse bins c0 and
+// c1 in the bins of the histogram
+static void NoiseAwareMapFineHistogram(const float *map, const u_int nPix,
+	const float minValue, const float valueRange, const u_int c0,
+	const u_int c1, const u_int part, const u_int partCount, u_int *counts) {
+	u_int *histogram = counts + part * 2 * NOISE_AWARE_MAP_BINS;
+	const u_int end = NoiseAwareMapPartStart(nPix, part + 1, partCount);
+	for (u_int i = NoiseAwareMapPartStart(nPix, part, partCount); i < end; ++i) {
+		const u_int bin = NoiseAwareMapBin(map[i], minValue, valueRange);
+		const u_int coarseBin = bin / NOISE_AWARE_MAP_BINS;
+		if (coarseBin == c0)
+			++histogram[bin % NOISE_AWARE_MAP_BINS];
+		else if (coarseBin == c1)
+			++histogram[NOISE_AWARE_MAP_BINS + bin % NOISE_AWARE_MAP_BINS];
+	}
+}
+
+static void NoiseAwareMapClamp(float *map, const u_int nPix,
+	const float minAllowedValue, const float maxAllowedValue,
+	const u_int part, const u_int partCount) {
+	const u_int end = NoiseAwareMapPartStart(nPix, part + 1, partCount);
+	for (u_int i = NoiseAwareMapPartStart(nPix, part, partCount); i < end; ++i) {
+		// Clamp the map in the [minAllowedValue, maxAllowedValue] range
+		// and scale between 0.1 and 1.0
+		map[i] = .8f * (Clamp(map[i], minAllowedValue, maxAllowedValue) - minAllowedValue) /
+				(maxAllowedValue - minAllowedValue) + .2f;
+	}
+}
+
 void Film::UpdateConvergenceInfo(const float *framebuffer) {
+	const double startTime = osWallClockTime();
+
 	// Compare the new buffer with the old one
 	const u_int failedPixels = convTest->Test(framebuffer);
 
@@ -3216,126 +3479,186 @@ void Film::UpdateConvergenceInfo(const float *framebuffer) {
 		haltThresholdComplete = 1.f - haltThreshold;
 	else
 		haltThresholdComplete = (nPix - failedPixels) / (float)nPix;
+
+	if (convergenceTileSize > 0 && haltThreshold >= 0.f)
+		LOG(LUX_DEBUG, LUX_NOERROR) << "Pixels in unconverged tiles: " <<
+			convTest->GetUnconvergedPixels() << "/" << nPix;
+	LOG(LUX_DEBUG, LUX_NOERROR) << "Convergence test time: " <<
+		(osWallClockTime() - startTime) * 1000.0 << "ms";
 }
 
-void Film::GenerateNoiseAwareMap() {
-	fast_mutex::scoped_lock lock(samplingMapMutex);
+bool Film::IsConverged(float imageX, float imageY) const {
+	if (!convTest)
+		return false;
 
-	const u_int nPix = xPixelCount * yPixelCount;
+	// Samples in the filter border belong to the nearest tile
+	const u_int x = static_cast<u_int>(Clamp(Floor2Int(imageX) - static_cast<int>(xPixelStart),
+		0, static_cast<int>(xPixelCount) - 1));
+	const u_int y = static_cast<u_int>(Clamp(Floor2Int(imageY) - static_cast<int>(yPixelStart),
+		0, static_cast<int>(yPixelCount) - 1));
+	return convTest->IsTileConverged(x, y);
+}
 
-	// Free the reference to the old one and allocate a new one
-	noiseAwareMap.reset(new float[nPix]);
+u_int Film::GetUnconvergedPixels() const {
+	if (!convTest)
+		return xPixelCount * yPixelCount;
 
-	const float *convergenceTVI = convTest->GetTVI();
-	bool hasPixelsToSample = false;
-	bool allZeroVariance = true;
-	bool allZeroTVI = true;
-	u_int index = 0;
-	for (u_int y = 0; y < yPixelCount; ++y) {
-		for (u_int x = 0; x < xPixelCount; ++x, ++index) {
-			const float variance = varianceBuffer->GetVariance(x, y);
-			// -1 means a pixel that have yet to be sampled
-			if (variance == -1.f) {
-				hasPixelsToSample = true;
-				break;
-			}
-			
-			if (variance > 0.f)
-				allZeroVariance = false;
-			if (convergenceTVI[index] > 0.f)
-				allZeroTVI = false;
+	return convTest->GetUnconvergedPixels();
+}
 
-			noiseAwareMap[index] = sqrtf(variance);
-		}
-	}
+void Film::GenerateNoiseAwareMap() {
+	const double startTime = osWallClockTime();
+	const u_int nPix = xPixelCount * yPixelCount;
+	const u_int threadCount = nPix < NOISE_AWARE_MAP_PARALLEL_SIZE ? 1U :
+		min(max(1U, boost::thread::hardware_concurrency()), yPixelCount);
+
+	// The new map is built without holding samplingMapMutex so the
+	// samplers keep using the old one in the meantime
+	boost::shared_array<float> map(new float[nPix]);
 
-	if (hasPixelsToSample || allZeroVariance || allZeroTVI) {
+	const float *convergenceTVI = convTest->GetTVI();
+	vector<NoiseAwareMapStats> stats(threadCount);
+	RunNoiseAwareMapThreads(threadCount, boost::bind(NoiseAwareMapValues,
+		varianceBuffer, convergenceTVI, map.get(), xPixelCount,
+		yPixelCount, _1, threadCount, &stats[0]));
+
+	NoiseAwareMapStats total;
+	for (u_int i = 0; i < threadCount; ++i) {
+		total.hasPixelsToSample = total.hasPixelsToSample || stats[i].hasPixelsToSample;
+		total.allZeroVariance = total.allZeroVariance && stats[i].allZeroVariance;
+		total.allZeroTVI = total.allZeroTVI && stats[i].allZeroTVI;
+		total.minValue = min(total.minValue, stats[i].minValue);
+		total.maxValue = max(total.maxValue, stats[i].maxValue);
+	}
+
+	const bool noiseInformation = !(total.hasPixelsToSample ||
+		total.allZeroVariance || total.allZeroTVI);
+	if (!noiseInformation) {
 		LOG(LUX_DEBUG, LUX_NOERROR) << "Noise aware map based on: uniform distribution";
 
 		// Just use a uniform distribution
-		std::fill(noiseAwareMap.get(), noiseAwareMap.get() + nPix, 1.f);
+		std::fill(map.get(), map.get() + nPix, 1.f);
 	} else {
-		++noiseAwareMapVersion;
-		LOG(LUX_DEBUG, LUX_NOERROR) << "Noise aware map based on: noise information (version: " <<
-				noiseAwareMapVersion << ")";
+		const float minValue = total.minValue;
+		const float maxValue = total.maxValue;
 
-		// First step, build Standard Error / TVI map
-		float minValue = std::numeric_limits<double>::infinity();
-		float maxValue = 0.f;
-		for (u_int i = 0; i < nPix; ++i) {
-			const float standardError = noiseAwareMap[i];
-			//const float value = (convergenceTVI[i] == 0.f) ? 0.f : logf(1.f + (standardError / convergenceTVI[i]));
-			const float value = (convergenceTVI[i] == 0.f) ? 0.f : (standardError / convergenceTVI[i]);
+		// Than build an histogram of the map, the bins holding the 5th
+		// and 95th percentiles are found among the coarse bins first,
+		// only the content of those is counted in the histogram bins
+		const float valueRange = maxValue - minValue;
+		const u_int histogramSize = NOISE_AWARE_MAP_BINS * NOISE_AWARE_MAP_BINS;
+		const u_int threshold = 5 * histogramSize / 100;
+		vector<u_int> partialCounts(threadCount * NOISE_AWARE_MAP_BINS, 0);
+		if (valueRange > 0.f)
+			RunNoiseAwareMapThreads(threadCount, boost::bind(NoiseAwareMapCoarseHistogram,
+				map.get(), nPix, minValue, valueRange, _1, threadCount,
+				&partialCounts[0]));
+		vector<u_int> coarse(NOISE_AWARE_MAP_BINS, 0);
+		for (u_int i = 0; i < partialCounts.size(); ++i)
+			coarse[i % NOISE_AWARE_MAP_BINS] += partialCounts[i];
 
-			minValue = min(minValue, value);
-			maxValue = max(maxValue, value);
-			noiseAwareMap[i] = value;
+		// Clamp of the map between 5th percentile value and 95th
+		u_int coarseMin = 0;
+		bool foundMin = false;
+		u_int count = 0;
+		for (u_int i = 0; i < NOISE_AWARE_MAP_BINS; ++i) {
+			count += coarse[i];
+			if (count > threshold) {
+				coarseMin = i;
+				foundMin = true;
+				break;
+			}
+		}
+		// The coarse bin of the 95th percentile, if it is above the one
+		// of the 5th percentile
+		u_int coarseMax = coarseMin;
+		count = 0;
+		for (u_int i = NOISE_AWARE_MAP_BINS - 1; i > coarseMin; --i) {
+			count += coarse[i];
+			if (count > threshold) {
+				coarseMax = i;
+				break;
+			}
 		}
 
-		// Than build an histogram of the map
-		const float valueRange = maxValue - minValue;
-		const u_int histogramSize = 1000000;
-		float *histogram = new float[histogramSize * sizeof(float)];
-		std::fill(histogram, histogram + histogramSize, 0.f);
-		for (u_int i = 0; i < nPix; ++i) {
-			// Map the value between 0.0 and 1.0
-			const float v = (noiseAwareMap[i] - minValue) / valueRange;
-
-			const u_int binIndex = min(Floor2UInt(v * histogramSize), histogramSize - 1);
-			histogram[binIndex] += 1;
+		vector<u_int> fine(2 * NOISE_AWARE_MAP_BINS, 0);
+		if (valueRange > 0.f) {
+			partialCounts.assign(threadCount * 2 * NOISE_AWARE_MAP_BINS, 0);
+			RunNoiseAwareMapThreads(threadCount, boost::bind(NoiseAwareMapFineHistogram,
+				map.get(), nPix, minValue, valueRange, coarseMin, coarseMax,
+				_1, threadCount, &partialCounts[0]));
+			for (u_int i = 0; i < partialCounts.size(); ++i)
+				fine[i % (2 * NOISE_AWARE_MAP_BINS)] += partialCounts[i];
 		}
 
-		// Clamp of the map between 5th percentile value and 95th
 		u_int minIndex = 0;
-		float count = 0;
-		for (u_int i = 0; i < histogramSize; ++i) {
-			count += histogram[i];
-		
-			if (count > 5.f * histogramSize / 100.f) {
-				minIndex = i;
-				break;
+		if (foundMin) {
+			count = 0;
+			for (u_int i = 0; i < coarseMin; ++i)
+				count += coarse[i];
+			for (u_int i = 0; i < NOISE_AWARE_MAP_BINS; ++i) {
+				count += fine[i];
+				if (count > threshold) {
+					minIndex = coarseMin * NOISE_AWARE_MAP_BINS + i;
+					break;
+				}
 			}
 		}
 
 		u_int maxIndex = minIndex;
 		count = 0;
-		for (u_int i = histogramSize - 1; i > minIndex; --i) {
-			count += histogram[i];
-		
-			if (count > 5.f * histogramSize / 100.f) {
-				maxIndex = i;
+		for (u_int i = NOISE_AWARE_MAP_BINS - 1; i > coarseMax; --i)
+			count += coarse[i];
+		const u_int *maxBins = (coarseMax == coarseMin) ?
+			&fine[0] : &fine[NOISE_AWARE_MAP_BINS];
+		for (u_int i = NOISE_AWARE_MAP_BINS; i-- > 0; ) {
+			const u_int index = coarseMax * NOISE_AWARE_MAP_BINS + i;
+			if (index <= minIndex)
+				break;
+			count += maxBins[i];
+			if (count > threshold) {
+				maxIndex = index;
 				break;
 			}
 		}
 
-		delete[] histogram;
-
 		if (maxIndex <= minIndex) {
 			LOG(LUX_DEBUG, LUX_NOERROR) << "Noise aware map based on: uniform distribution (unable to auto-stretch the map)";
 
 			// Just use a uniform distribution
-			std::fill(noiseAwareMap.get(), noiseAwareMap.get() + nPix, 1.f);
+			std::fill(map.get(), map.get() + nPix, 1.f);
 		} else {
 			const float minAllowedValue = valueRange * minIndex / histogramSize + minValue;
 			const float maxAllowedValue = valueRange * maxIndex / histogramSize + minValue;
 
-			for (u_int i = 0; i < nPix; ++i) {
-				// Clamp the map in the [minAllowedValue, maxAllowedValue] range
-				// and scale between 0.1 and 1.0
-				noiseAwareMap[i] = .8f * (Clamp(noiseAwareMap[i], minAllowedValue, maxAllowedValue) - minAllowedValue) /
-						(maxAllowedValue - minAllowedValue) + .2f;
-			}
+			RunNoiseAwareMapThreads(threadCount, boost::bind(NoiseAwareMapClamp,
+				map.get(), nPix, minAllowedValue, maxAllowedValue,
+				_1, threadCount));
 
 			// Apply an heavy filter to smooth the map
 			float *tmpMap = new float[nPix];
-			ApplyBoxFilter(noiseAwareMap.get(), tmpMap, xPixelCount, yPixelCount, 6);
+			ApplyBoxFilter(map.get(), tmpMap, xPixelCount, yPixelCount, 6, threadCount);
 			delete []tmpMap;
 		}
 	}
 
-	noiseAwareDistribution2D.reset(new Distribution2D(noiseAwareMap.get(), xPixelCount, yPixelCount));
+	boost::shared_ptr<Distribution2D> distribution(new Distribution2D(map.get(),
+		xPixelCount, yPixelCount));
+
+	fast_mutex::scoped_lock lock(samplingMapMutex);
+
+	noiseAwareMap = map;
+	noiseAwareDistribution2D = distribution;
+	if (noiseInformation) {
+		++noiseAwareMapVersion;
+		LOG(LUX_DEBUG, LUX_NOERROR) << "Noise aware map based on: noise information (version: " <<
+				noiseAwareMapVersion << ")";
+	}
 
 	UpdateSamplingMap();
+
+	LOG(LUX_DEBUG, LUX_NOERROR) << "Noise aware map update time: " <<
+		(osWallClockTime() - startTime) * 1000.0 << "ms";
 }
 
 const bool Film::GetNoiseAwareMap(u_int &version, boost::shared_array<float> &map,
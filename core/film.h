@@ -27,7 +27,6 @@
 #include "api.h"
 #include "luxrays/core/color/color.h"
 #include "queryable.h"
-#include "bsh.h"
 #include "fastmutex.h"
 
 #include "luxrays/utils/mcdistribution.h"
@@ -37,6 +36,13 @@
 #include <boost/thread/mutex.hpp>
 #include <boost/thread/xtime.hpp>
 #include <boost/shared_array.hpp>
+#include <boost/shared_ptr.hpp>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define LUX_FILM_SSE2
+#include <emmintrin.h>
+#include <boost/static_assert.hpp>
+#endif
 
 namespace lux {
 
@@ -50,6 +56,26 @@ enum ImageType {
     IMAGE_ALL = IMAGE_FLMOUTPUT | IMAGE_FILEOUTPUT | IMAGE_FRAMEBUFFER
 };
 
+// Display image published by the film. Once published, a snapshot is never
+// written again as long as a reference to it is held, so embedding
+// applications can read its buffers without locking or copying them.
+class FramebufferSnapshot {
+public:
+	FramebufferSnapshot(u_int w, u_int h) : version(0), width(w), height(h),
+		pixels(3 * w * h, 0), floatPixels(3 * w * h, 0.f) { }
+
+	// Incremented each time a new image is published
+	u_int version;
+	u_int width, height;
+	// RGB, 8 bits gamma corrected and linear float values
+	vector<unsigned char> pixels;
+	vector<float> floatPixels;
+	// Regions that changed since the previous version, stored as
+	// x, y, width, height tuples. A host that skipped some versions
+	// has to refresh the whole image.
+	vector<u_int> dirtyRects;
+};
+
 // Buffer types
 
 enum BufferType {
@@ -121,6 +147,19 @@ public:
 		pixel.weightSum += wt;
 	}
 
+#if defined(LUX_FILM_SSE2)
+	// Same as above with L and alpha packed in a single vector,
+	// they are contiguous in the pixel
+	void Add(u_int x, u_int y, __m128 Lalpha, float wt) {
+		BOOST_STATIC_ASSERT(sizeof(Pixel) == 5 * sizeof(float));
+		Pixel &pixel = pixels(x, y);
+		float *p = pixel.L.c;
+		_mm_storeu_ps(p, _mm_add_ps(_mm_loadu_ps(p),
+			_mm_mul_ps(Lalpha, _mm_set1_ps(wt))));
+		pixel.weightSum += wt;
+	}
+#endif
+
 	void Set(u_int x, u_int y, XYZColor L, float alpha, float wt = 1.f) {
 		Pixel &pixel = pixels(x, y);
 		pixel.L = L;
@@ -515,89 +554,74 @@ private:
 	std::vector<float> lut;
 };
 
-class FilterLUTs {
+// Filter weights along one axis of a separable filter
+class FilterLUT1D {
 public:
-	FilterLUTs(Filter *filter, const u_int size);
+	FilterLUT1D() : lut() { }
 
-	~FilterLUTs() {	}
+	FilterLUT1D(Filter *filter, const float offset, const bool yAxis);
 
-	const FilterLUT &GetLUT(const float x, const float y) const {
-		const int ix = max<int>(0, min<int>(luxrays::Floor2Int(lutsSize * (x + 0.5f)), lutsSize - 1));
-		const int iy = max<int>(0, min<int>(luxrays::Floor2Int(lutsSize * (y + 0.5f)), lutsSize - 1));
+	~FilterLUT1D() { }
+
+	const u_int GetSize() const { return lutSize; }
 
-		return luts[ix + iy * lutsSize];
+	const float *GetLUT() const {
+		return &lut.front();
 	}
 
 private:
-	unsigned int lutsSize;
-	float step;
-	std::vector<FilterLUT> luts;
+	u_int lutSize;
+	std::vector<float> lut;
 };
 
-class OutlierDataXYRGB {
+class FilterLUTs {
 public:
-	typedef PointN<5> Point_t;
-
-	OutlierDataXYRGB() : p() {
-	}
-
-	OutlierDataXYRGB(float x, float y, const XYZColor &color) {
-		RGBColor rgb = cs.ToRGBConstrained(color);
-		p.x[0] = x;
-		p.x[1] = y;
-		//p.x[2] = rgb.c[0] * (1.f / 255.f);
-		//p.x[3] = rgb.c[1] * (1.f / 255.f);
-		//p.x[4] = rgb.c[2] * (1.f / 255.f);
-		p.x[2] = logf(1.f + rgb.c[0]);
-		p.x[3] = logf(1.f + rgb.c[1]);
-		p.x[4] = logf(1.f + rgb.c[2]);
-	}
+	FilterLUTs(Filter *filter, const u_int size);
 
-	Point_t p;
+	~FilterLUTs() {	}
 
-	static ColorSystem cs;
-};
+	// Separable filters only have the 1D tables, the weight of a pixel is
+	// the product of its column and row weights
+	bool IsSeparable() const { return separable; }
 
-class OutlierDataRGB {
-public:
-	typedef PointN<3> Point_t;
+	const FilterLUT &GetLUT(const float x, const float y) const {
+		return luts[GetIndex(x) + GetIndex(y) * lutsSize];
+	}
 
-	OutlierDataRGB() : p() {
+	const FilterLUT1D &GetXLUT(const float x) const {
+		return xLuts[GetIndex(x)];
 	}
 
-	OutlierDataRGB(float x, float y, const XYZColor &color) {
-		RGBColor rgb = cs.ToRGBConstrained(color);
-		p.x[0] = rgb.c[0] * (1.f / 255.f);
-		p.x[1] = rgb.c[1] * (1.f / 255.f);
-		p.x[2] = rgb.c[2] * (1.f / 255.f);
+	const FilterLUT1D &GetYLUT(const float y) const {
+		return yLuts[GetIndex(y)];
 	}
 
-	Point_t p;
+private:
+	int GetIndex(const float v) const {
+		return max<int>(0, min<int>(luxrays::Floor2Int(lutsSize * (v + 0.5f)), lutsSize - 1));
+	}
 
-	static ColorSystem cs;
+	unsigned int lutsSize;
+	float step;
+	bool separable;
+	std::vector<FilterLUT> luts;
+	std::vector<FilterLUT1D> xLuts, yLuts;
 };
 
-class OutlierDataXYLY {
-public:
-	typedef PointN<3> Point_t;
-
-	OutlierDataXYLY() : p() {
+// Outlier rejection density estimate for a cell of the film: the number of
+// rejected samples falling in the cell (ring 0), in the cells sharing an
+// edge (ring 1) or a corner (ring 2) with it, binned by half octaves of
+// 1 + Y. Each ring fits in a cache line.
+#define OUTLIER_BIN_COUNT 64U
+#define OUTLIER_RING_COUNT 3U
+struct OutlierCell {
+	OutlierCell() {
+		std::fill(counts[0], counts[0] + OUTLIER_RING_COUNT * OUTLIER_BIN_COUNT, 0);
 	}
 
-	OutlierDataXYLY(float x, float y, const XYZColor &color) {
-		p.x[0] = x;
-		p.x[1] = y;
-		p.x[2] = logf(1.f + color.Y());
-	}
-
-	Point_t p;
-
-	static ColorSystem cs;
+	u_char counts[OUTLIER_RING_COUNT][OUTLIER_BIN_COUNT];
 };
 
-//typedef OutlierDataXYRGB OutlierData;
-typedef OutlierDataXYLY OutlierData;
-
 // Film Declarations
 class LUX_EXPORT Film : public Queryable {
 public:
@@ -687,6 +711,8 @@ public:
 
 	virtual unsigned char* getFrameBuffer() = 0;
 	virtual float* getFloatFrameBuffer() = 0;
+	virtual boost::shared_ptr<const FramebufferSnapshot> getFrameBufferSnapshot() = 0;
+	virtual u_int getFrameBufferVersion() = 0;
 	virtual float* getAlphaBuffer() = 0;
 	virtual float* getZBuffer() = 0;
 	virtual void updateFrameBuffer() = 0;
@@ -718,6 +744,12 @@ public:
 	virtual const bool GetSamplingMap(u_int &naMapVersion, u_int &usMapVersion,
 		boost::shared_array<float> &map, boost::shared_ptr<luxrays::Distribution2D> &distrib);
 
+	// Returns true if the image sample lies in a convergence tile that
+	// passed the convergence test, its samples can then be skipped
+	bool IsConverged(float imageX, float imageY) const;
+	// Number of pixels still receiving samples
+	u_int GetUnconvergedPixels() const;
+
 	/*
 	 * Accessor for samplePerPass
 	 * It is only used by SPPM and may disappears once the Buffer API allows for
@@ -794,6 +826,8 @@ protected: // Put it here for better data alignment
 
 	// Enabled by haltthreshold
 	ConvergenceTest *convTest;
+	// Size of the tiles whose convergence is tracked, 0 if disabled
+	u_int convergenceTileSize;
 
 	// May be enabled by the sampler
 	VarianceBuffer *varianceBuffer; // Used to build the noise map
@@ -829,10 +863,9 @@ protected: // Put it here for better data alignment
 	int outlierRejection_k;
 	u_int outlierCellWidth, outlierCellHeight;
 	float outlierInvCellWidth, outlierInvCellHeight;
-	typedef BSH<OutlierData::Point_t, NearSetPointProcess<OutlierData::Point_t>, 9 > OutlierAccel;
-	std::vector<std::vector<OutlierAccel> > outliers;
+	std::vector<std::vector<OutlierCell> > outliers;
 	// contains the outliers that lies on the overlap between tiles
-	std::vector<std::vector<OutlierAccel> > tileborder_outliers; 
+	std::vector<std::vector<OutlierCell> > tileborder_outliers; 
 
 public:
 	// Samplers will check this flag to know if we have enough samples per
@@ -855,7 +888,7 @@ private:
 	float GetCropWindow3() { return cropWindow[3]; }
 
 	// Gets a reference to the appropriate outlier row data for a given position and tile index.
-	std::vector<OutlierAccel>& GetOutlierAccelRow(u_int oY, u_int tileIndex, u_int tileStart, u_int tileEnd);
+	std::vector<OutlierCell>& GetOutlierRow(u_int oY, u_int tileIndex, u_int tileStart, u_int tileEnd);
 	
 	boost::mutex histMutex;
 };
@@ -40,6 +40,9 @@ public:
 	virtual ~Filter() { }
 
 	virtual float Evaluate(float x, float y) const = 0;
+	// True if Evaluate(x, y) is the product of a function of x and a
+	// function of y, the film then splats with 1D weight tables
+	virtual bool IsSeparable() const { return false; }
 
 	// Filter Public Data
 	const float xWidth, yWidth;
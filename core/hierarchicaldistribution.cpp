@@ -0,0 +1,138 @@
+/***************************************************************************
+ *   Copyright (C) 1998-2013 by authors (see AUTHORS.txt)                  *
+ *                                                                         *
+ *   This file is part of LuxRender.                                       *
+ *                                                                         *
+ *   Lux Renderer is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   Lux Renderer is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+ *                                                                         *
+ *   This project is based on PBRT ; see http://www.pbrt.org               *
+ *   Lux Renderer website : http://www.luxrender.net                       *
+ ***************************************************************************/
+
+// hierarchicaldistribution.cpp*
+#include "hierarchicaldistribution.h"
+#include "sampling.h"
+
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+
+using namespace lux;
+
+// Levels with fewer texels are summed by the calling thread
+#define HIERARCHICAL_DISTRIBUTION_PARALLEL_SIZE (256 * 256)
+
+HierarchicalDistribution2D::HierarchicalDistribution2D(const float *func,
+	u_int nu, u_int nv)
+{
+	nu = max(nu, 1U);
+	nv = max(nv, 1U);
+	width.push_back(nu);
+	height.push_back(nv);
+	levels.push_back(vector<float>(func, func + nu * nv));
+
+	// Build the pyramid down to a single texel
+	while (width.back() > 1 || height.back() > 1) {
+		const u_int w = (width.back() + 1) / 2;
+		const u_int h = (height.back() + 1) / 2;
+		width.push_back(w);
+		height.push_back(h);
+		levels.push_back(vector<float>(w * h));
+		const u_int level = levels.size() - 1;
+
+		const u_int threadCount = w * h < HIERARCHICAL_DISTRIBUTION_PARALLEL_SIZE ?
+			1U : min(max(1U, boost::thread::hardware_concurrency()), h);
+		if (threadCount == 1) {
+			BuildLevel(level, 0, 1);
+			continue;
+		}
+		boost::thread_group threads;
+		for (u_int i = 0; i < threadCount; ++i)
+			threads.create_thread(boost::bind(&HierarchicalDistribution2D::BuildLevel,
+				this, level, i, threadCount));
+		threads.join_all();
+	}
+
+	// Degenerate functions are sampled uniformly
+	if (!(levels.back()[0] > 0.f)) {
+		std::fill(levels[0].begin(), levels[0].end(), 1.f);
+		for (u_int l = 1; l < levels.size(); ++l)
+			BuildLevel(l, 0, 1);
+	}
+	invAverage = nu * nv / levels.back()[0];
+}
+
+void HierarchicalDistribution2D::BuildLevel(u_int level, u_int yStart,
+	u_int yStep)
+{
+	const vector<float> &src(levels[level - 1]);
+	vector<float> &dst(levels[level]);
+	const u_int sw = width[level - 1], sh = height[level - 1];
+	const u_int w = width[level], h = height[level];
+	for (u_int y = yStart; y < h; y += yStep) {
+		const u_int y0 = 2 * y, y1 = min(y0 + 1, sh - 1);
+		for (u_int x = 0; x < w; ++x) {
+			const u_int x0 = 2 * x, x1 = min(x0 + 1, sw - 1);
+			// Missing children at the borders are counted once
+			float sum = src[x0 + y0 * sw];
+			if (x1 != x0)
+				sum += src[x1 + y0 * sw];
+			if (y1 != y0) {
+				sum += src[x0 + y1 * sw];
+				if (x1 != x0)
+					sum += src[x1 + y1 * sw];
+			}
+			dst[x + y * w] = sum;
+		}
+	}
+}
+
+u_int HierarchicalDistribution2D::Choose(float w0, float w1, float *u)
+{
+	const float total = w0 + w1;
+	const float split = *u * total;
+	if (split < w0 || !(w1 > 0.f)) {
+		*u = w0 > 0.f ? min(split / w0, OneMinusEpsilon) : *u;
+		return 0;
+	}
+	*u = min((split - w0) / w1, OneMinusEpsilon);
+	return 1;
+}
+
+void HierarchicalDistribution2D::SampleContinuous(float u0, float u1,
+	float uv[2], float *pdf) const
+{
+	u_int x = 0, y = 0;
+	for (u_int l = levels.size() - 1; l > 0; --l) {
+		const vector<float> &child(levels[l - 1]);
+		const u_int cw = width[l - 1], ch = height[l - 1];
+		const u_int x0 = 2 * x, y0 = 2 * y;
+		const bool hasX1 = x0 + 1 < cw, hasY1 = y0 + 1 < ch;
+		const float *row0 = &child[y0 * cw];
+		const float *row1 = hasY1 ? row0 + cw : NULL;
+
+		// Choose the row first, then the column inside the row
+		const float r00 = row0[x0], r01 = hasX1 ? row0[x0 + 1] : 0.f;
+		const float r10 = hasY1 ? row1[x0] : 0.f;
+		const float r11 = hasY1 && hasX1 ? row1[x0 + 1] : 0.f;
+		const u_int dy = Choose(r00 + r01, r10 + r11, &u1);
+		const u_int dx = dy == 0 ? Choose(r00, r01, &u0) :
+			Choose(r10, r11, &u0);
+		x = x0 + dx;
+		y = y0 + dy;
+	}
+
+	uv[0] = (x + u0) / width[0];
+	uv[1] = (y + u1) / height[0];
+	*pdf = levels[0][x + y * width[0]] * invAverage;
+}
@@ -0,0 +1,69 @@
+/***************************************************************************
+ *   Copyright (C) 1998-2013 by authors (see AUTHORS.txt)                  *
+ *                                                                         *
+ *   This file is part of LuxRender.                                       *
+ *                                                                         *
+ *   Lux Renderer is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   Lux Renderer is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+ *                                                                         *
+ *   This project is based on PBRT ; see http://www.pbrt.org               *
+ *   Lux Renderer website : http://www.luxrender.net                       *
+ ***************************************************************************/
+
+#ifndef LUX_HIERARCHICALDISTRIBUTION_H
+#define LUX_HIERARCHICALDISTRIBUTION_H
+// hierarchicaldistribution.h*
+
+#include "lux.h"
+
+namespace lux
+{
+
+// Piecewise constant 2D distribution stored as a sum pyramid.
+// Level 0 holds the function values, each texel of the next levels holds
+// the sum of the (up to) 4 texels below it. Sampling walks down the
+// pyramid choosing one child at each step, so no per row CDF is needed
+// and the structure only takes a third more memory than the function.
+// The resulting density is the same as the one of luxrays::Distribution2D
+// built from the same function.
+class HierarchicalDistribution2D {
+public:
+	// func holds nu x nv non negative values in scanline order,
+	// levels are summed in parallel for large functions
+	HierarchicalDistribution2D(const float *func, u_int nu, u_int nv);
+
+	void SampleContinuous(float u0, float u1, float uv[2],
+		float *pdf) const;
+	float Pdf(float u, float v) const {
+		const u_int x = min(Floor2UInt(u * width[0]), width[0] - 1);
+		const u_int y = min(Floor2UInt(v * height[0]), height[0] - 1);
+		return levels[0][x + y * width[0]] * invAverage;
+	}
+
+	u_int GetWidth() const { return width[0]; }
+	u_int GetHeight() const { return height[0]; }
+	const float *GetFunction() const { return &levels[0][0]; }
+
+private:
+	void BuildLevel(u_int level, u_int yStart, u_int yStep);
+	// Chooses between 2 weights and rescales u for further use
+	static u_int Choose(float w0, float w1, float *u);
+
+	vector<u_int> width, height;
+	vector<vector<float> > levels;
+	float invAverage;
+};
+
+}//namespace lux
+
+#endif // LUX_HIERARCHICALDISTRIBUTION_H
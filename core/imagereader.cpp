@@ -22,6 +22,7 @@
 #include "lux.h"
 #include "imagereader.h"
 #include "texturecolor.h"
+#include "mipmaptiled.h"
 #include "error.h"
 
 #include <boost/filesystem.hpp>
@@ -179,6 +180,89 @@ MIPMap *ImageData::createMIPMap(ImageTextureFilterType filterType,
 	return mipmap;
 }
 
+template <class T> static bool WriteTiled(const string &filename, u_int width,
+	u_int height, void *data, ImageWrap wrapMode, TiledImageHeader &header)
+{
+	return MIPMapTiledImpl<T>::WriteTiledImage(filename, width, height,
+		static_cast<const T *>(data), wrapMode, header);
+}
+
+bool ImageData::writeTiledImage(const string &filename,
+	ImageTextureFilterType filterType, ImageWrap wrapMode, u_int tileSize, boost::uint64_t sourceSize, boost::int64_t sourceTime)
+{
+	TiledImageHeader header;
+	header.pixelType = pixel_type_;
+	header.channels = noChannels_;
+	header.tileSize = tileSize;
+	header.filterType = filterType;
+	header.sourceSize = sourceSize;
+	header.sourceTime = sourceTime;
+
+	switch (pixel_type_) {
+	case UNSIGNED_CHAR_TYPE:
+		if (noChannels_ == 1)
+			return WriteTiled<TextureColor<unsigned char, 1> >(filename, width_, height_, data_, wrapMode, header);
+		else if (noChannels_ == 3)
+			return WriteTiled<TextureColor<unsigned char, 3> >(filename, width_, height_, data_, wrapMode, header);
+		else if (noChannels_ == 4)
+			return WriteTiled<TextureColor<unsigned char, 4> >(filename, width_, height_, data_, wrapMode, header);
+		break;
+	case UNSIGNED_SHORT_TYPE:
+		if (noChannels_ == 1)
+			return WriteTiled<TextureColor<unsigned short, 1> >(filename, width_, height_, data_, wrapMode, header);
+		else if (noChannels_ == 3)
+			return WriteTiled<TextureColor<unsigned short, 3> >(filename, width_, height_, data_, wrapMode, header);
+		else if (noChannels_ == 4)
+			return WriteTiled<TextureColor<unsigned short, 4> >(filename, width_, height_, data_, wrapMode, header);
+		break;
+	case FLOAT_TYPE:
+		if (noChannels_ == 1)
+			return WriteTiled<TextureColor<float, 1> >(filename, width_, height_, data_, wrapMode, header);
+		else if (noChannels_ == 3)
+			return WriteTiled<TextureColor<float, 3> >(filename, width_, height_, data_, wrapMode, header);
+		else if (noChannels_ == 4)
+			return WriteTiled<TextureColor<float, 4> >(filename, width_, height_, data_, wrapMode, header);
+		break;
+	}
+	LOG(LUX_ERROR, LUX_SYSTEM) << "Unsupported channel count in ImageData::writeTiledImage()";
+	return false;
+}
+
+MIPMap *CreateTiledMIPMap(const boost::shared_ptr<TiledImageFile> &file,
+	ImageTextureFilterType filterType, float maxAniso, float gain, float gamma)
+{
+	const TiledImageHeader &header(file->GetHeader());
+	switch (header.pixelType) {
+	case ImageData::UNSIGNED_CHAR_TYPE:
+		if (header.channels == 1)
+			return new MIPMapTiledImpl<TextureColor<unsigned char, 1> >(filterType, file, maxAniso, gain, gamma);
+		else if (header.channels == 3)
+			return new MIPMapTiledImpl<TextureColor<unsigned char, 3> >(filterType, file, maxAniso, gain, gamma);
+		else if (header.channels == 4)
+			return new MIPMapTiledImpl<TextureColor<unsigned char, 4> >(filterType, file, maxAniso, gain, gamma);
+		break;
+	case ImageData::UNSIGNED_SHORT_TYPE:
+		if (header.channels == 1)
+			return new MIPMapTiledImpl<TextureColor<unsigned short, 1> >(filterType, file, maxAniso, gain, gamma);
+		else if (header.channels == 3)
+			return new MIPMapTiledImpl<TextureColor<unsigned short, 3> >(filterType, file, maxAniso, gain, gamma);
+		else if (header.channels == 4)
+			return new MIPMapTiledImpl<TextureColor<unsigned short, 4> >(filterType, file, maxAniso, gain, gamma);
+		break;
+	case ImageData::FLOAT_TYPE:
+		if (header.channels == 1)
+			return new MIPMapTiledImpl<TextureColor<float, 1> >(filterType, file, maxAniso, gain, gamma);
+		else if (header.channels == 3)
+			return new MIPMapTiledImpl<TextureColor<float, 3> >(filterType, file, maxAniso, gain, gamma);
+		else if (header.channels == 4)
+			return new MIPMapTiledImpl<TextureColor<float, 4> >(filterType, file, maxAniso, gain, gamma);
+		break;
+	}
+	LOG(LUX_ERROR, LUX_SYSTEM) << "Unsupported pixel format in tiled image '" <<
+		file->GetFilename() << "'";
+	return NULL;
+}
+
 static bool FileExists(const boost::filesystem::path &path) {
 	try {
 		// boost::filesystem::exists() can throw an exception under Windows
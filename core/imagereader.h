@@ -24,6 +24,7 @@
 #define LUX_IMAGEREADER_H
 #include "lux.h"
 #include "mipmap.h"
+#include "texturecache.h"
 
 namespace lux
 {
@@ -67,6 +68,13 @@ public:
 		float maxAniso = 8.f, ImageWrap wrapMode = TEXTURE_REPEAT,
 		float gain = 1.0f, float gamma = 1.0f);
 
+	// Writes the image and the MIPMap levels needed by filterType
+	// as a tiled image file
+	bool writeTiledImage(const string &filename,
+		ImageTextureFilterType filterType, ImageWrap wrapMode,
+		u_int tileSize, boost::uint64_t sourceSize,
+		boost::int64_t sourceTime);
+
 private:
 	u_int width_;
 	u_int height_;
@@ -76,6 +84,11 @@ private:
 	bool isExrImage_;
 };
 
+// Creates a MIPMap loading its texels on demand from a tiled image file
+MIPMap *CreateTiledMIPMap(const boost::shared_ptr<TiledImageFile> &file,
+	ImageTextureFilterType filterType = BILINEAR, float maxAniso = 8.f,
+	float gain = 1.0f, float gamma = 1.0f);
+
 class ImageReader {
 public:
 
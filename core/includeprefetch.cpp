@@ -0,0 +1,615 @@
+/***************************************************************************
+ *   Copyright (C) 1998-2013 by authors (see AUTHORS.txt)                  *
+ *                                                                         *
+ *   This file is part of LuxRender.                                       *
+ *                                                                         *
+ *   Lux Renderer is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   Lux Renderer is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+ *                                                                         *
+ *   This project is based on PBRT ; see http://www.pbrt.org               *
+ *   Lux Renderer website : http://www.luxrender.net                       *
+ ***************************************************************************/
+
+// includeprefetch.cpp*
+#include "includeprefetch.h"
+#include "binaryscene.h"
+#include "context.h"
+#include "paramset.h"
+#include "numparse.h"
+#include "luxrays/core/color/color.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <boost/thread.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/bind.hpp>
+#include <boost/ptr_container/ptr_vector.hpp>
+#include <boost/scoped_array.hpp>
+
+// Token values of the scene lexer
+class ParamArray;
+#include "luxparse.hpp"
+
+// Reentrant build of the scene lexer, see luxlex.l
+int luxprefetchlex_init_extra(lux::PrefetchLexerState *state, void **scanner);
+void luxprefetchset_in(FILE *in, void *scanner);
+int luxprefetchlex(void *scanner);
+int luxprefetchlex_destroy(void *scanner);
+
+extern u_int lineNum;
+extern string currentFile;
+
+using namespace lux;
+
+// Number of files each worker may parse ahead of the parser,
+// this bounds the memory held by calls waiting to be replayed
+#define INCLUDE_PREFETCH_WINDOW 2
+
+void *lux::PrefetchScanNumArray(PrefetchLexerState *state, const char *text,
+	u_int length)
+{
+	// Same as ScanNumArray but the numbers are kept in the state
+	state->numbers.clear();
+	if (state->skipArrays) {
+		state->lineNum += std::count(text, text + length, '\n');
+		return NULL;
+	}
+	state->numbers.reserve(length / 8 + 16);
+	const char *p = text + 1;
+	for (;;) {
+		while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') {
+			if (*p == '\n')
+				++state->lineNum;
+			++p;
+		}
+		if (*p == ']' || *p == '\0')
+			break;
+		double value;
+		const char *next = ParseNumber(p, &value);
+		if (!next)
+			break;
+		state->numbers.push_back(static_cast<float>(value));
+		p = next;
+	}
+	return NULL;
+}
+
+bool lux::PrefetchAddStringChar(PrefetchLexerState *state, char c)
+{
+	// Too long strings are reported by the regular lexer
+	if (state->strPos >= 1023) {
+		state->failed = true;
+		return false;
+	}
+	state->lval.string[state->strPos++] = c;
+	state->lval.string[state->strPos] = '\0';
+	return true;
+}
+
+namespace {
+
+// Tokenizes a scene file with the reentrant build of the scene lexer
+class SceneTokenizer {
+public:
+	SceneTokenizer(const string &filename, bool skipArrays = false) :
+		file(fopen(filename.c_str(), "r")), scanner(NULL),
+		state(skipArrays), token(0), peeked(false) {
+		if (!file)
+			return;
+		if (luxprefetchlex_init_extra(&state, &scanner) != 0) {
+			scanner = NULL;
+			return;
+		}
+		luxprefetchset_in(file, scanner);
+	}
+	~SceneTokenizer() {
+		if (scanner)
+			luxprefetchlex_destroy(scanner);
+		if (file)
+			fclose(file);
+	}
+
+	bool IsOpen() const { return scanner != NULL; }
+	// Returns 0 at the end of the file and when the regular lexer
+	// would have reported a problem
+	int Next() {
+		if (peeked) {
+			peeked = false;
+			return token;
+		}
+		token = luxprefetchlex(scanner);
+		if (state.failed)
+			token = 0;
+		return token;
+	}
+	int Peek() {
+		if (!peeked) {
+			Next();
+			peeked = true;
+		}
+		return token;
+	}
+	bool Failed() const { return state.failed; }
+	const char *Text() const { return state.lval.string; }
+	float Number() const { return state.lval.num; }
+	const vector<float> &Numbers() const { return state.numbers; }
+	u_int Line() const { return state.lineNum; }
+
+private:
+	FILE *file;
+	void *scanner;
+	PrefetchLexerState state;
+	int token;
+	bool peeked;
+};
+
+// Geometry statements, the arguments are described by a string where
+// 's' is a string, 'n' a number, 'a' a number array and 'p' a parameter list
+struct GeometryStatement {
+	int token;
+	const char *command;
+	const char *arguments;
+	int arrayLength; // -1 for any length
+};
+
+const GeometryStatement geometryStatements[] = {
+	{ AREALIGHTSOURCE, "luxAreaLightSource", "sp", -1 },
+	{ ATTRIBUTEBEGIN, "luxAttributeBegin", "", -1 },
+	{ ATTRIBUTEEND, "luxAttributeEnd", "", -1 },
+	{ CONCATTRANSFORM, "luxConcatTransform", "a", 16 },
+	{ COORDSYSTRANSFORM, "luxCoordSysTransform", "s", -1 },
+	{ COORDINATESYSTEM, "luxCoordinateSystem", "s", -1 },
+	{ EXTERIOR, "luxExterior", "s", -1 },
+	{ IDENTITY, "luxIdentity", "", -1 },
+	{ INTERIOR, "luxInterior", "s", -1 },
+	{ LIGHTGROUP, "luxLightGroup", "sp", -1 },
+	{ MOTIONBEGIN, "luxMotionBegin", "a", -1 },
+	{ MOTIONEND, "luxMotionEnd", "", -1 },
+	{ MOTIONINSTANCE, "luxMotionInstance", "snns", -1 },
+	{ NAMEDMATERIAL, "luxNamedMaterial", "s", -1 },
+	{ OBJECTBEGIN, "luxObjectBegin", "s", -1 },
+	{ OBJECTEND, "luxObjectEnd", "", -1 },
+	{ OBJECTINSTANCE, "luxObjectInstance", "s", -1 },
+	{ PORTALINSTANCE, "luxPortalInstance", "s", -1 },
+	{ PORTALSHAPE, "luxPortalShape", "sp", -1 },
+	{ REVERSEORIENTATION, "luxReverseOrientation", "", -1 },
+	{ ROTATE, "luxRotate", "nnnn", -1 },
+	{ SCALE, "luxScale", "nnn", -1 },
+	{ SHAPE, "luxShape", "sp", -1 },
+	{ TRANSFORM, "luxTransform", "a", 16 },
+	{ TRANSFORMBEGIN, "luxTransformBegin", "", -1 },
+	{ TRANSFORMEND, "luxTransformEnd", "", -1 },
+	{ TRANSLATE, "luxTranslate", "nnn", -1 }
+};
+
+const GeometryStatement *FindGeometryStatement(int token)
+{
+	for (u_int i = 0; i < sizeof(geometryStatements) / sizeof(geometryStatements[0]); ++i) {
+		if (geometryStatements[i].token == token)
+			return &geometryStatements[i];
+	}
+	return NULL;
+}
+
+// Reads the numbers between brackets when the lexer couldn't match
+// the array as a whole (comments or line continuations inside)
+bool ReadNumberList(SceneTokenizer &tokenizer, vector<float> &values)
+{
+	int token;
+	while ((token = tokenizer.Next()) == NUM)
+		values.push_back(tokenizer.Number());
+	return token == RBRACK && !values.empty();
+}
+
+// Reads a bracketed number array, or a single number when allowed
+bool ReadNumberArray(SceneTokenizer &tokenizer, bool allowSingle,
+	vector<float> &values)
+{
+	values.clear();
+	const int token = tokenizer.Next();
+	if (token == NUM && allowSingle) {
+		values.push_back(tokenizer.Number());
+		return true;
+	}
+	if (token == NUM_ARRAY) {
+		values = tokenizer.Numbers();
+		return true;
+	}
+	return token == LBRACK && ReadNumberList(tokenizer, values);
+}
+
+// Adds a parameter the way the parser does, but gives up instead of
+// reporting problems
+bool AddParam(ParamSet &params, const string &token, const vector<float> &numbers,
+	const vector<string> &strings, bool singleString)
+{
+	// LookupType reports unknown types
+	static const char *types[] = { "float", "integer", "bool", "point",
+		"vector", "normal", "string", "texture", "color" };
+	const char *t = token.c_str();
+	while (*t && isspace(*t))
+		++t;
+	bool known = false;
+	for (u_int i = 0; i < sizeof(types) / sizeof(types[0]) && !known; ++i)
+		known = strncmp(t, types[i], strlen(types[i])) == 0;
+	if (!known)
+		return false;
+	ParamType type;
+	string name;
+	LookupType(token.c_str(), &type, name);
+
+	const bool isString = type == PARAM_TYPE_STRING ||
+		type == PARAM_TYPE_TEXTURE || type == PARAM_TYPE_BOOL;
+	if ((isString && strings.empty()) || (!isString && numbers.empty()) ||
+		(singleString && type != PARAM_TYPE_TEXTURE && type != PARAM_TYPE_STRING))
+		return false;
+	const u_int n = isString ? strings.size() : numbers.size();
+	switch (type) {
+		case PARAM_TYPE_INT: {
+			vector<int> values(n);
+			for (u_int i = 0; i < n; ++i)
+				values[i] = static_cast<int>(numbers[i]);
+			params.AddInt(name, &values[0], n);
+			break;
+		}
+		case PARAM_TYPE_BOOL: {
+			boost::scoped_array<bool> values(new bool[n]);
+			for (u_int i = 0; i < n; ++i) {
+				if (strings[i] == "true")
+					values[i] = true;
+				else if (strings[i] == "false")
+					values[i] = false;
+				else
+					return false;
+			}
+			params.AddBool(name, values.get(), n);
+			break;
+		}
+		case PARAM_TYPE_FLOAT:
+			params.AddFloat(name, &numbers[0], n);
+			break;
+		case PARAM_TYPE_POINT:
+			params.AddPoint(name, reinterpret_cast<const Point *>(&numbers[0]), n / 3);
+			break;
+		case PARAM_TYPE_VECTOR:
+			params.AddVector(name, reinterpret_cast<const Vector *>(&numbers[0]), n / 3);
+			break;
+		case PARAM_TYPE_NORMAL:
+			params.AddNormal(name, reinterpret_cast<const Normal *>(&numbers[0]), n / 3);
+			break;
+		case PARAM_TYPE_COLOR:
+			params.AddRGBColor(name, reinterpret_cast<const RGBColor *>(&numbers[0]), n / COLOR_SAMPLES);
+			break;
+		case PARAM_TYPE_STRING:
+			params.AddString(name, &strings[0], n);
+			break;
+		case PARAM_TYPE_TEXTURE:
+			if (n != 1)
+				return false;
+			params.AddTexture(name, strings[0]);
+			break;
+	}
+	return true;
+}
+
+
+bool ReadParams(SceneTokenizer &tokenizer, ParamSet &params)
+{
+	vector<float> numbers;
+	vector<string> strings;
+	while (tokenizer.Peek() == STRING) {
+		tokenizer.Next();
+		const string token(tokenizer.Text());
+		numbers.clear();
+		strings.clear();
+		bool singleString = false;
+		int value = tokenizer.Next();
+		if (value == NUM)
+			numbers.push_back(tokenizer.Number());
+		else if (value == NUM_ARRAY)
+			numbers = tokenizer.Numbers();
+		else if (value == STRING) {
+			strings.push_back(tokenizer.Text());
+			singleString = true;
+		} else if (value == LBRACK) {
+			if (tokenizer.Peek() == NUM) {
+				if (!ReadNumberList(tokenizer, numbers))
+					return false;
+			} else {
+				while ((value = tokenizer.Next()) == STRING)
+					strings.push_back(tokenizer.Text());
+				if (value != RBRACK)
+					return false;
+			}
+		} else
+			return false;
+		if (!AddParam(params, token, numbers, strings, singleString))
+			return false;
+	}
+	return true;
+}
+
+// Parses a file made only of geometry statements, the line of each
+// statement is recorded for the messages of the replayed calls
+bool ParseGeometryFile(const string &filename,
+	boost::ptr_vector<SceneCall> &calls, vector<u_int> &lines)
+{
+	SceneTokenizer tokenizer(filename);
+	if (!tokenizer.IsOpen())
+		return false;
+
+	for (;;) {
+		const int token = tokenizer.Next();
+		if (token == 0)
+			return !tokenizer.Failed();
+		const GeometryStatement *statement = FindGeometryStatement(token);
+		if (!statement)
+			return false;
+
+		calls.push_back(new SceneCall);
+		lines.push_back(tokenizer.Line());
+		SceneCall &call(calls.back());
+		call.command = statement->command;
+		for (const char *arg = statement->arguments; *arg; ++arg) {
+			switch (*arg) {
+				case 's':
+					if (tokenizer.Next() != STRING)
+						return false;
+					call.strings.push_back(tokenizer.Text());
+					break;
+				case 'n':
+					if (tokenizer.Next() != NUM)
+						return false;
+					call.floats.push_back(tokenizer.Number());
+					break;
+				case 'a':
+					// Transform requires brackets
+					if (!ReadNumberArray(tokenizer,
+						statement->token != TRANSFORM, call.floats))
+						return false;
+					if (statement->arrayLength >= 0 &&
+						call.floats.size() != static_cast<size_t>(statement->arrayLength))
+						return false;
+					break;
+				case 'p':
+					call.hasParams = true;
+					if (!ReadParams(tokenizer, call.params))
+						return false;
+					break;
+			}
+		}
+	}
+}
+
+class IncludePrefetcher {
+public:
+	IncludePrefetcher(const string &filename);
+	~IncludePrefetcher();
+
+	bool Wait(const string &filename);
+	bool Replay();
+
+private:
+	struct Entry {
+		Entry(const string &name) : filename(name), done(false),
+			parsed(false) { }
+		string filename;
+		bool done, parsed;
+		boost::ptr_vector<SceneCall> calls;
+		vector<u_int> lines;
+	};
+
+	void Scan(const string &filename);
+	void Work();
+
+	// Entries are added by the scan while the parser runs, the
+	// elements of a ptr_vector don't move when it grows
+	boost::ptr_vector<Entry> entries;
+	u_int nextToParse, nextToReplay, window;
+	bool scanDone, stop;
+	boost::mutex mutex;
+	boost::condition_variable condition;
+	boost::thread_group workers;
+};
+
+IncludePrefetcher::IncludePrefetcher(const string &filename) :
+	nextToParse(0), nextToReplay(0), scanDone(false), stop(false)
+{
+	const u_int threadCount = max(1U, boost::thread::hardware_concurrency());
+	window = threadCount * INCLUDE_PREFETCH_WINDOW;
+	workers.create_thread(boost::bind(&IncludePrefetcher::Scan, this,
+		filename));
+	for (u_int i = 0; i < threadCount; ++i)
+		workers.create_thread(boost::bind(&IncludePrefetcher::Work, this));
+}
+
+IncludePrefetcher::~IncludePrefetcher()
+{
+	{
+		boost::mutex::scoped_lock lock(mutex);
+		stop = true;
+	}
+	condition.notify_all();
+	workers.join_all();
+}
+
+void IncludePrefetcher::Scan(const string &filename)
+{
+	// Collects the names of the files included by the scene, these are
+	// the files the lexer asks IsIncludePrefetched about. The scan runs
+	// along the parser and only converts what it needs.
+	try {
+		SceneTokenizer tokenizer(filename, true);
+		int token = tokenizer.IsOpen() ? tokenizer.Next() : 0;
+		for (; token != 0; token = tokenizer.Next()) {
+			if (token != PREFETCHEDINCLUDE)
+				continue;
+			{
+				boost::mutex::scoped_lock lock(mutex);
+				if (stop)
+					break;
+				entries.push_back(new Entry(tokenizer.Text()));
+			}
+			condition.notify_all();
+		}
+	} catch (std::exception &) {
+	}
+
+	{
+		boost::mutex::scoped_lock lock(mutex);
+		scanDone = true;
+	}
+	condition.notify_all();
+}
+
+void IncludePrefetcher::Work()
+{
+	for (;;) {
+		u_int index;
+		{
+			boost::mutex::scoped_lock lock(mutex);
+			while (!stop && (nextToParse < entries.size() ?
+				nextToParse >= nextToReplay + window : !scanDone))
+				condition.wait(lock);
+			if (stop || nextToParse >= entries.size())
+				return;
+			index = nextToParse++;
+		}
+
+		Entry &entry(entries[index]);
+		bool parsed;
+		try {
+			parsed = ParseGeometryFile(entry.filename, entry.calls,
+				entry.lines);
+			for (u_int i = 0; i < entry.calls.size() && parsed; ++i)
+				parsed = IsValidSceneCall(entry.calls[i]);
+		} catch (std::exception &) {
+			parsed = false;
+		}
+		if (!parsed) {
+			entry.calls.clear();
+			entry.lines.clear();
+		}
+
+		{
+			boost::mutex::scoped_lock lock(mutex);
+			entry.done = true;
+			entry.parsed = parsed;
+		}
+		condition.notify_all();
+	}
+}
+
+bool IncludePrefetcher::Wait(const string &filename)
+{
+	boost::mutex::scoped_lock lock(mutex);
+	// The parser may not reach some of the scanned Include statements,
+	// when it stopped on an error for instance, skip them. The scan may
+	// also not have reached this one yet.
+	u_int index = nextToReplay;
+	for (;;) {
+		while (index < entries.size() && entries[index].filename != filename)
+			++index;
+		if (index < entries.size() || scanDone)
+			break;
+		condition.wait(lock);
+	}
+	if (index >= entries.size())
+		return false;
+	for (; nextToReplay < index; ++nextToReplay) {
+		// Entries still being parsed are freed with the prefetcher
+		if (entries[nextToReplay].done) {
+			entries[nextToReplay].calls.clear();
+			entries[nextToReplay].lines.clear();
+		}
+	}
+	condition.notify_all();
+	while (!entries[nextToReplay].done)
+		condition.wait(lock);
+	if (entries[nextToReplay].parsed)
+		return true;
+	// Left to the regular parser
+	++nextToReplay;
+	condition.notify_all();
+	return false;
+}
+
+bool IncludePrefetcher::Replay()
+{
+	Entry *entry;
+	{
+		boost::mutex::scoped_lock lock(mutex);
+		entry = &entries[nextToReplay];
+	}
+	// Nothing is executed unless every call can be, so that the
+	// regular parser can include the file instead
+	bool valid = true;
+	for (u_int i = 0; i < entry->calls.size() && valid; ++i)
+		valid = IsValidSceneCall(entry->calls[i]);
+	if (valid) {
+		// The calls are attributed to the included file like with
+		// the regular parser, the parser position is restored
+		// afterwards
+		const string parentFile(currentFile);
+		const u_int parentLine = lineNum;
+		currentFile = entry->filename;
+		Context &ctx(*Context::GetActive());
+		for (u_int i = 0; i < entry->calls.size(); ++i) {
+			lineNum = entry->lines[i];
+			ExecuteSceneCall(ctx, entry->calls[i]);
+		}
+		currentFile = parentFile;
+		lineNum = parentLine;
+	} else
+		LOG(LUX_WARNING, LUX_BUG) << "Unable to replay the prefetched file '" <<
+			entry->filename << "', it is parsed again";
+	entry->calls.clear();
+	entry->lines.clear();
+
+	{
+		boost::mutex::scoped_lock lock(mutex);
+		++nextToReplay;
+	}
+	condition.notify_all();
+	return valid;
+}
+
+IncludePrefetcher *includePrefetcher = NULL;
+
+}//namespace
+
+void lux::StartIncludePrefetch(const string &filename)
+{
+	StopIncludePrefetch();
+	if (filename == "-")
+		return;
+	includePrefetcher = new IncludePrefetcher(filename);
+}
+
+void lux::StopIncludePrefetch()
+{
+	delete includePrefetcher;
+	includePrefetcher = NULL;
+}
+
+bool lux::IsIncludePrefetched(const string &filename)
+{
+	return includePrefetcher && includePrefetcher->Wait(filename);
+}
+
+bool lux::ReplayPrefetchedInclude()
+{
+	return !includePrefetcher || includePrefetcher->Replay();
+}
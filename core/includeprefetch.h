@@ -0,0 +1,90 @@
+/***************************************************************************
+ *   Copyright (C) 1998-2013 by authors (see AUTHORS.txt)                  *
+ *                                                                         *
+ *   This file is part of LuxRender.                                       *
+ *                                                                         *
+ *   Lux Renderer is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   Lux Renderer is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+ *                                                                         *
+ *   This project is based on PBRT ; see http://www.pbrt.org               *
+ *   Lux Renderer website : http://www.luxrender.net                       *
+ ***************************************************************************/
+
+#ifndef LUX_INCLUDEPREFETCH_H
+#define LUX_INCLUDEPREFETCH_H
+// includeprefetch.h*
+
+#include "lux.h"
+
+namespace lux
+{
+
+// Scenes are usually split in many geometry files (.lxo) included by the
+// main scene file. Parsing such a file doesn't depend on the state of the
+// context, so the files included by the main scene file are parsed ahead
+// by worker threads into lists of calls, which the parser replays in order
+// when it reaches the corresponding Include statements.
+// The files are tokenized by a reentrant build of the scene lexer.
+// Only files made of geometry statements (shapes, object blocks,
+// attributes and transforms) are handled this way, any other statement or
+// anything unusual leaves the file to the regular parser, which then
+// reports the errors as usual.
+
+// Starts scanning the scene file for Include statements and parsing the
+// included files in the background
+void StartIncludePrefetch(const string &filename);
+// Stops the workers and frees the calls that weren't replayed
+void StopIncludePrefetch();
+// Waits for the next included file to be parsed, returns true if its
+// calls are available to ReplayPrefetchedInclude
+bool IsIncludePrefetched(const string &filename);
+// Executes the calls of the file accepted by IsIncludePrefetched,
+// returns false without executing any of them if one isn't valid, the
+// file then has to be included by the regular parser
+bool ReplayPrefetchedInclude();
+
+// State of the reentrant build of the scene lexer (luxlex.l compiled with
+// LUX_PREFETCH_LEXER) used by the prefetch workers
+struct PrefetchLexerState {
+	PrefetchLexerState(bool skip) : lineNum(1), strPos(0),
+		skipArrays(skip), failed(false) {
+		lval.string[0] = '\0';
+		lval.num = 0.f;
+		lval.ribarray = NULL;
+	}
+
+	// Token value, with the member names of the parser YYSTYPE
+	struct {
+		char string[1024];
+		float num;
+		void *ribarray;
+	} lval;
+	// Content of the last NUM_ARRAY token
+	vector<float> numbers;
+	u_int lineNum;
+	int strPos;
+	// NUM_ARRAY tokens aren't converted when only the Include
+	// statements are looked for
+	bool skipArrays;
+	// Set when the regular lexer would have reported a problem
+	bool failed;
+};
+
+// Lexer helpers replacing the ones working on the parser globals
+void *PrefetchScanNumArray(PrefetchLexerState *state, const char *text,
+	u_int length);
+bool PrefetchAddStringChar(PrefetchLexerState *state, char c);
+
+}//namespace lux
+
+#endif // LUX_INCLUDEPREFETCH_H
@@ -25,156 +25,243 @@
 // kdtree.h*
 #include "lux.h"
 #include "luxrays/core/geometry/bbox.h"
+#include "luxrays/utils/memory.h"
+#include <boost/shared_ptr.hpp>
 using luxrays::BBox;
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define LUX_KDTREE_SSE2
+#include <emmintrin.h>
+#endif
+
+// Maximum number of points in a leaf, the points of a leaf are tested
+// 4 at a time
+#define KDTREE_LEAF_SIZE 8U
+// Enough for 2^32 points
+#define KDTREE_MAX_DEPTH 32U
 // KdTree Declarations
 
 namespace lux
 {
 
 struct KdNode {
-	void init(float p, u_int a) {
-		splitPos = p;
-		splitAxis = a;
-		// Dade - in order to avoid a gcc warning
-		rightChild = 0;
-		rightChild = ~rightChild;
-		hasLeftChild = 0;
-	}
-	void initLeaf() {
-		init(0.0f, 3);
-	}
-	// KdNode Data
 	float splitPos;
-	u_int splitAxis:2;
-	u_int hasLeftChild:1;
-	u_int rightChild:29;
+	u_int splitAxis;
 };
+
+// The tree is balanced and all its leaves are at the same depth, so that
+// it is stored implicitly: the children of node i are nodes 2i+1 and 2i+2,
+// and the range of data of each node is found by halving the range of its
+// parent. Data is sorted in leaf order and the point positions are also
+// stored as separate coordinate arrays for the distance tests.
+// Since the layout doesn't depend on pointers, a tree can also use arrays
+// that are kept in some external storage, like a memory mapped file.
 template <class NodeData, class LookupProc> class KdTree {
 public:
 	// KdTree Public Methods
 	KdTree(const vector<NodeData> &data);
+	// Uses the arrays of a previously built tree in place, storage is
+	// kept alive as long as the tree. The coordinate arrays have 3 more
+	// elements than data.
+	KdTree(u_int nd, u_int nn, const KdNode *n, const NodeData *d,
+		const float *x, const float *y, const float *z,
+		const boost::shared_ptr<void> &s) : nodes(n), nodeData(d),
+		px(x), py(y), pz(z), nData(nd), nNodes(nn), storage(s) { }
 	~KdTree() {
-		luxrays::FreeAligned(nodes);
+		if (storage)
+			return;
+		luxrays::FreeAligned(const_cast<KdNode *>(nodes));
+		luxrays::FreeAligned(const_cast<float *>(px));
+		luxrays::FreeAligned(const_cast<float *>(py));
+		luxrays::FreeAligned(const_cast<float *>(pz));
 		delete[] nodeData;
 	}
-	void recursiveBuild(u_int nodeNum, u_int start, u_int end,
-		vector<const NodeData *> &buildNodes);
 	void Lookup(const Point &p, const LookupProc &process,
 			float &maxDistSquared) const;
-	NodeData *getNodeData() { return nodeData; }
+	// Number of interior nodes of a tree over nData points
+	static u_int NodeCount(u_int nData) {
+		// Split until the leaves are small enough
+		u_int nLeaves = 1;
+		while (nData > nLeaves * KDTREE_LEAF_SIZE)
+			nLeaves *= 2;
+		return nLeaves - 1;
+	}
+	u_int getDataCount() const { return nData; }
+	u_int getNodeCount() const { return nNodes; }
+	const KdNode *getNodes() const { return nodes; }
+	const NodeData *getNodeData() const { return nodeData; }
+	const float *getCoordinates(u_int axis) const {
+		return axis == 0 ? px : (axis == 1 ? py : pz);
+	}
 
 private:
 	// KdTree Private Methods
-	void privateLookup(u_int nodeNum, const Point &p,
+	void recursiveBuild(KdNode *buildTree, u_int nodeNum, u_int start,
+		u_int end, vector<u_int> &buildNodes,
+		const vector<NodeData> &data);
+	void leafLookup(u_int start, u_int end, const Point &p,
 		const LookupProc &process, float &maxDistSquared) const;
 	// KdTree Private Data
-	KdNode *nodes;
-	NodeData *nodeData;
-	u_int nNodes, nextFreeNode;
+	const KdNode *nodes;
+	const NodeData *nodeData;
+	const float *px, *py, *pz;
+	u_int nData, nNodes;
+	boost::shared_ptr<void> storage;
 };
 template<class NodeData> struct CompareNode {
-	CompareNode(int a) { axis = a; }
+	CompareNode(const vector<NodeData> &d, int a) : data(d), axis(a) { }
+	const vector<NodeData> &data;
 	int axis;
-	bool operator()(const NodeData *d1,
-			const NodeData *d2) const {
-		return d1->p[axis] == d2->p[axis] ? (d1 < d2) :
-			d1->p[axis] < d2->p[axis];
+	bool operator()(u_int d1, u_int d2) const {
+		return data[d1].p[axis] == data[d2].p[axis] ? (d1 < d2) :
+			data[d1].p[axis] < data[d2].p[axis];
 	}
 };
 // KdTree Method Definitions
 template <class NodeData, class LookupProc>
 KdTree<NodeData,
        LookupProc>::KdTree(const vector<NodeData> &d) {
-	nNodes = d.size();
-	nextFreeNode = 1;
-	nodes = luxrays::AllocAligned<KdNode>(nNodes);
-	nodeData = new NodeData[nNodes];
-	vector<const NodeData *> buildNodes;
-	for (u_int i = 0; i < nNodes; ++i)
-		buildNodes.push_back(&d[i]);
+	nData = d.size();
+	nNodes = NodeCount(nData);
+	KdNode *buildTree = luxrays::AllocAligned<KdNode>(max(nNodes, 1U));
+	NodeData *buildData = new NodeData[max(nData, 1U)];
+	// The coordinate arrays are padded so that the last leaf can be
+	// read 4 values at a time
+	float *x = luxrays::AllocAligned<float>(nData + 3);
+	float *y = luxrays::AllocAligned<float>(nData + 3);
+	float *z = luxrays::AllocAligned<float>(nData + 3);
+	vector<u_int> buildNodes(nData);
+	for (u_int i = 0; i < nData; ++i)
+		buildNodes[i] = i;
 	// Begin the KdTree building process
-	recursiveBuild(0, 0, nNodes, buildNodes);
+	if (nNodes > 0)
+		recursiveBuild(buildTree, 0, 0, nData, buildNodes, d);
+	for (u_int i = 0; i < nData; ++i) {
+		const NodeData &data(d[buildNodes[i]]);
+		buildData[i] = data;
+		x[i] = data.p.x;
+		y[i] = data.p.y;
+		z[i] = data.p.z;
+	}
+	for (u_int i = nData; i < nData + 3; ++i)
+		x[i] = y[i] = z[i] = 0.f;
+	nodes = buildTree;
+	nodeData = buildData;
+	px = x;
+	py = y;
+	pz = z;
 }
 template <class NodeData, class LookupProc> void
-KdTree<NodeData, LookupProc>::recursiveBuild(u_int nodeNum,
-		u_int start, u_int end,
-		vector<const NodeData *> &buildNodes) {
-	// Create leaf node of kd-tree if we've reached the bottom
-	if (start + 1 == end) {
-		nodes[nodeNum].initLeaf();
-		nodeData[nodeNum] = *buildNodes[start];
-		return;
-	}
+KdTree<NodeData, LookupProc>::recursiveBuild(KdNode *buildTree,
+		u_int nodeNum, u_int start, u_int end,
+		vector<u_int> &buildNodes, const vector<NodeData> &data) {
 	// Choose split direction and partition data
 	// Compute bounds of data from _start_ to _end_
 	BBox bound;
 	for (u_int i = start; i < end; ++i)
-		bound = Union(bound, buildNodes[i]->p);
+		bound = Union(bound, data[buildNodes[i]].p);
 	u_int splitAxis = bound.MaximumExtent();
 	u_int splitPos = (start + end) / 2;
-	// buildNodes[buildNodes.size()] may not exist
 	std::nth_element(buildNodes.begin()+start, buildNodes.begin()+splitPos,
-		buildNodes.begin()+end, CompareNode<NodeData>(splitAxis));
+		buildNodes.begin()+end, CompareNode<NodeData>(data, splitAxis));
 
-	// Allocate kd-tree node and continue recursively
-	nodes[nodeNum].init(buildNodes[splitPos]->p[splitAxis],
-		splitAxis);
-	nodeData[nodeNum] = *buildNodes[splitPos];
-	if (start < splitPos) {
-		nodes[nodeNum].hasLeftChild = 1;
-		u_int childNum = nextFreeNode++;
-		recursiveBuild(childNum, start, splitPos, buildNodes);
-	}
-	if (splitPos+1 < end) {
-		nodes[nodeNum].rightChild = nextFreeNode++;
-		recursiveBuild(nodes[nodeNum].rightChild, splitPos+1,
-		               end, buildNodes);
+	// Fill kd-tree node and continue recursively
+	buildTree[nodeNum].splitPos = data[buildNodes[splitPos]].p[splitAxis];
+	buildTree[nodeNum].splitAxis = splitAxis;
+	if (2 * nodeNum + 1 < nNodes) {
+		recursiveBuild(buildTree, 2 * nodeNum + 1, start, splitPos,
+			buildNodes, data);
+		recursiveBuild(buildTree, 2 * nodeNum + 2, splitPos, end,
+			buildNodes, data);
 	}
 }
 template <class NodeData, class LookupProc> void
 KdTree<NodeData, LookupProc>::Lookup(const Point &p,
 		const LookupProc &proc,
 		float &maxDistSquared) const {
-	privateLookup(0, p, proc, maxDistSquared);
+	if (nData == 0)
+		return;
+	// Nodes still to visit, with their range of data and the squared
+	// distance to the splitting plane of their parent
+	struct StackEntry {
+		u_int nodeNum, start, end;
+		float dist2;
+	} stack[KDTREE_MAX_DEPTH + 1];
+	u_int stackSize = 1;
+	stack[0].nodeNum = 0;
+	stack[0].start = 0;
+	stack[0].end = nData;
+	stack[0].dist2 = 0.f;
+	while (stackSize > 0) {
+		StackEntry entry(stack[--stackSize]);
+		if (!(entry.dist2 < maxDistSquared))
+			continue;
+		// Go down to the leaf containing the point, remembering the
+		// far children
+		while (entry.nodeNum < nNodes) {
+			const KdNode &node(nodes[entry.nodeNum]);
+			const u_int mid = (entry.start + entry.end) / 2;
+			const float dist = p[node.splitAxis] - node.splitPos;
+			StackEntry &farEntry(stack[stackSize++]);
+			farEntry.dist2 = dist * dist;
+			if (dist <= 0.f) {
+				farEntry.nodeNum = 2 * entry.nodeNum + 2;
+				farEntry.start = mid;
+				farEntry.end = entry.end;
+				entry.nodeNum = 2 * entry.nodeNum + 1;
+				entry.end = mid;
+			} else {
+				farEntry.nodeNum = 2 * entry.nodeNum + 1;
+				farEntry.start = entry.start;
+				farEntry.end = mid;
+				entry.nodeNum = 2 * entry.nodeNum + 2;
+				entry.start = mid;
+			}
+		}
+		leafLookup(entry.start, entry.end, p, proc, maxDistSquared);
+	}
 }
 template <class NodeData, class LookupProc> void
-KdTree<NodeData, LookupProc>::privateLookup(u_int nodeNum,
+KdTree<NodeData, LookupProc>::leafLookup(u_int start, u_int end,
 		const Point &p,	const LookupProc &process,
 		float &maxDistSquared) const {
-	KdNode *node = &nodes[nodeNum];
-	// Process kd-tree node's children
-	int axis = node->splitAxis;
-	if (axis != 3) {
-		float dist = p[axis] - node->splitPos;
-		float dist2 = dist * dist;
-		if (p[axis] <= node->splitPos) {
-			if (node->hasLeftChild)
-				privateLookup(nodeNum+1, p,
-				              process, maxDistSquared);
-			if (dist2 < maxDistSquared &&
-			    node->rightChild < nNodes)
-				privateLookup(node->rightChild,
-				              p,
-							  process,
-							  maxDistSquared);
-		}
-		else {
-			if (node->rightChild < nNodes)
-				privateLookup(node->rightChild,
-				              p,
-							  process,
-							  maxDistSquared);
-			if (dist2 < maxDistSquared && node->hasLeftChild)
-				privateLookup(nodeNum+1,
-				              p,
-							  process,
-							  maxDistSquared);
+#if defined(LUX_KDTREE_SSE2)
+	const __m128 x = _mm_set1_ps(p.x);
+	const __m128 y = _mm_set1_ps(p.y);
+	const __m128 z = _mm_set1_ps(p.z);
+	const __m128 lanes = _mm_set_ps(3.f, 2.f, 1.f, 0.f);
+	for (u_int i = start; i < end; i += 4) {
+		const __m128 dx = _mm_sub_ps(_mm_loadu_ps(px + i), x);
+		const __m128 dy = _mm_sub_ps(_mm_loadu_ps(py + i), y);
+		const __m128 dz = _mm_sub_ps(_mm_loadu_ps(pz + i), z);
+		const __m128 d2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx),
+			_mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+		// Keep the points of the leaf closer than the current radius
+		const __m128 valid = _mm_and_ps(
+			_mm_cmplt_ps(lanes, _mm_set1_ps(static_cast<float>(end - i))),
+			_mm_cmplt_ps(d2, _mm_set1_ps(maxDistSquared)));
+		int mask = _mm_movemask_ps(valid);
+		if (!mask)
+			continue;
+		float dist2[4];
+		_mm_storeu_ps(dist2, d2);
+		for (u_int j = 0; mask; ++j, mask >>= 1) {
+			// The radius may shrink while processing
+			if ((mask & 1) && dist2[j] < maxDistSquared)
+				process(nodeData[i + j], dist2[j],
+					maxDistSquared);
 		}
 	}
-	// Hand kd-tree node to processing function
-	float dist2 = DistanceSquared(nodeData[nodeNum].p, p);
-	if (dist2 < maxDistSquared)
-		process(nodeData[nodeNum], dist2, maxDistSquared);
+#else
+	for (u_int i = start; i < end; ++i) {
+		const float dx = px[i] - p.x;
+		const float dy = py[i] - p.y;
+		const float dz = pz[i] - p.z;
+		const float dist2 = dx * dx + dy * dy + dz * dz;
+		if (dist2 < maxDistSquared)
+			process(nodeData[i], dist2, maxDistSquared);
+	}
+#endif
 }
 
 }//namespace lux
@@ -28,6 +28,7 @@
 #include "error.h"
 #include "renderinghints.h"
 #include "queryable.h"
+#include "tigerhash.h"
 
 #include "luxrays/core/geometry/motionsystem.h"
 #include "luxrays/core/color/swcspectrum.h"
@@ -42,8 +43,8 @@ public:
 	// Light Interface
 	Light(const string &name, const Transform &l2w, u_int ns = 1U)
 		: Queryable(name), nSamples(max(1U, ns)), nrPortalShapes(0),
-		PortalArea(0.f), group(0), LightToWorld(l2w),
-		havePortalShape(false) {
+		PortalArea(0.f), group(0), index(~0U), paramsDigest(),
+		LightToWorld(l2w), havePortalShape(false) {
 		if (LightToWorld.HasScale())
 			LOG(LUX_DEBUG,LUX_UNIMPLEMENT)<< "Scaling detected in light-to-world transformation! Some lights might not support it yet.";
 
@@ -71,6 +72,11 @@ public:
 		const Point &p, float u1, float u2, float u3,
 		BSDF **bsdf, float *pdf, float *pdfDirect,
 		SWCSpectrum *L) const = 0;
+	/**
+	 * The world space bounds of the emitting geometry,
+	 * an empty box for lights without finite bounds
+	 */
+	virtual BBox WorldBound() const { return BBox(); }
 	const LightRenderingHints *GetRenderingHints() const { return &hints; }
 
 	void AddPortalShape(boost::shared_ptr<Primitive> &shape);
@@ -83,6 +89,10 @@ public:
 	vector<boost::shared_ptr<Primitive> > PortalShapes;
 	float PortalArea;
 	u_int group;
+	// Position in Scene::lights, set by the Scene
+	u_int index;
+	// Hash of the creation parameters, used to detect scene changes
+	tigerhash::digest_type paramsDigest;
 protected:
 	// Light Protected Data
 	const Transform LightToWorld;
@@ -124,6 +134,7 @@ public:
 		const DifferentialGeometry &dg, BSDF **bsdf, float *pdf,
 		float *pdfDirect, SWCSpectrum *Le) const;
 	virtual float Power(const Scene &scene) const;
+	virtual BBox WorldBound() const;
 	virtual float Pdf(const Point &p, const PartialDifferentialGeometry &dg) const;
 	virtual bool SampleL(const Scene &scene, const Sample &sample,
 		float u1, float u2, float u3, BSDF **bsdf, float *pdf,
@@ -153,7 +164,10 @@ public:
 	// Light Interface
 	InstanceLight(const Transform &l2w, boost::shared_ptr<Light> &l)
 		: Light("InstanceLight-" + boost::lexical_cast<string>(this),
-		l2w, l->nSamples), light(l) { group = light->group; }
+		l2w, l->nSamples), light(l) {
+		group = light->group;
+		paramsDigest = light->paramsDigest;
+	}
 	virtual ~InstanceLight() { }
 	virtual float Power(const Scene &scene) const {
 		return light->Power(scene);
@@ -162,6 +176,11 @@ public:
 	virtual bool IsEnvironmental() const {
 		return light->IsEnvironmental();
 	}
+	virtual BBox WorldBound() const {
+		const BBox bounds(light->WorldBound());
+		return bounds.pMin.x <= bounds.pMax.x ?
+			LightToWorld * bounds : bounds;
+	}
 	virtual bool Le(const Scene &scene, const Sample &sample, const Ray &r,
 		BSDF **bsdf, float *pdf, float *pdfDirect,
 		SWCSpectrum *L) const;
@@ -188,7 +207,10 @@ public:
 	// Light Interface
 	MotionLight(const MotionSystem &mp, boost::shared_ptr<Light> &l)
 		: Light("MotionLight-" + boost::lexical_cast<string>(this),
-		Transform(), l->nSamples), light(l), motionPath(mp) { group = light->group; }
+		Transform(), l->nSamples), light(l), motionPath(mp) {
+		group = light->group;
+		paramsDigest = light->paramsDigest;
+	}
 	virtual ~MotionLight() { }
 	virtual float Power(const Scene &scene) const {
 		return light->Power(scene);
@@ -197,6 +219,12 @@ public:
 	virtual bool IsEnvironmental() const {
 		return light->IsEnvironmental();
 	}
+	virtual BBox WorldBound() const {
+		// Swept over the whole motion
+		const BBox bounds(light->WorldBound());
+		return bounds.pMin.x <= bounds.pMax.x ?
+			motionPath.Bound(bounds, false) : bounds;
+	}
 	virtual bool Le(const Scene &scene, const Sample &sample, const Ray &r,
 		BSDF **bsdf, float *pdf, float *pdfDirect,
 		SWCSpectrum *L) const;
@@ -225,7 +253,10 @@ public:
 	// Light Interface
 	InstanceAreaLight(const Transform &l2w, boost::shared_ptr<AreaLight> &l) :
 		AreaLight("InstanceAreaLight-" + boost::lexical_cast<string>(this),
-		l2w, l->nSamples), light(l) { group = light->group; }
+		l2w, l->nSamples), light(l) {
+		group = light->group;
+		paramsDigest = light->paramsDigest;
+	}
 	virtual ~InstanceAreaLight() { }
 	virtual float Power(const Scene &scene) const {
 		return light->Power(scene);
@@ -234,6 +265,11 @@ public:
 	virtual bool IsEnvironmental() const {
 		return light->IsEnvironmental();
 	}
+	virtual BBox WorldBound() const {
+		const BBox bounds(light->WorldBound());
+		return bounds.pMin.x <= bounds.pMax.x ?
+			LightToWorld * bounds : bounds;
+	}
 	virtual bool Le(const Scene &scene, const Sample &sample, const Ray &r,
 		BSDF **bsdf, float *pdf, float *pdfDirect,
 		SWCSpectrum *L) const;
@@ -270,7 +306,10 @@ public:
 	// Light Interface
 	MotionAreaLight(const MotionSystem &mp, boost::shared_ptr<AreaLight> &l) :
 		AreaLight("MotionAreaLight-" + boost::lexical_cast<string>(this),
-		Transform(), l->nSamples), light(l), motionPath(mp) { group = light->group; }
+		Transform(), l->nSamples), light(l), motionPath(mp) {
+		group = light->group;
+		paramsDigest = light->paramsDigest;
+	}
 	virtual ~MotionAreaLight() { }
 	virtual float Power(const Scene &scene) const {
 		return light->Power(scene);
@@ -279,6 +318,12 @@ public:
 	virtual bool IsEnvironmental() const {
 		return light->IsEnvironmental();
 	}
+	virtual BBox WorldBound() const {
+		// Swept over the whole motion
+		const BBox bounds(light->WorldBound());
+		return bounds.pMin.x <= bounds.pMax.x ?
+			motionPath.Bound(bounds, false) : bounds;
+	}
 	virtual bool Le(const Scene &scene, const Sample &sample, const Ray &r,
 		BSDF **bsdf, float *pdf, float *pdfDirect,
 		SWCSpectrum *L) const;
@@ -189,6 +189,7 @@ namespace lux
   class Sample;
   class Filter;
   class Film;
+  class FramebufferSnapshot;
   class ToneMap;
   class BxDF;
   class BRDF;
@@ -231,6 +232,7 @@ namespace lux
   class VolumeIntegrator;
   class RandomGenerator;
   class RenderFarm;
+  class BinarySceneWriter;
   class Contribution;
   class ContributionBuffer;
   class ContributionPool;
@@ -27,6 +27,9 @@
 #include "error.h"
 #include "paramset.h"
 #include "context.h"
+#include "numparse.h"
+#include "binaryscene.h"
+#include "includeprefetch.h"
 #include "luxrays/core/color/color.h"
 #include <stdarg.h>
 #include <sstream>
@@ -34,6 +37,7 @@
 using namespace lux;
 
 extern int yylex(void);
+extern void include_prefetched_fallback(char *filename);
 u_int lineNum = 0;
 string currentFile;
 
@@ -100,6 +104,42 @@ void AddArrayElement(void *elem)
 	curArray->nelems++;
 }
 
+// Builds a number array from the text of a whole "[ ... ]" array matched
+// by the lexer, this avoids a lexer and a parser round trip per number.
+// The text only holds numbers and white spaces.
+ParamArray *ScanNumArray(const char *text, u_int length)
+{
+	ParamArray *ret = new ParamArray;
+	ret->elementSize = sizeof(float);
+	// Exported meshes are written with at least 6 decimals,
+	// this avoids most reallocations
+	ret->allocated = length / 8 + 16;
+	ret->array = malloc(ret->allocated * sizeof(float));
+
+	const char *p = text + 1;
+	for (;;) {
+		while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') {
+			if (*p == '\n')
+				++lineNum;
+			++p;
+		}
+		if (*p == ']' || *p == '\0')
+			break;
+		double value;
+		const char *next = ParseNumber(p, &value);
+		if (!next)
+			break;
+		if (ret->nelems >= ret->allocated) {
+			ret->allocated *= 2;
+			ret->array = realloc(ret->array,
+				ret->allocated * sizeof(float));
+		}
+		NA(ret)[ret->nelems++] = static_cast<float>(value);
+		p = next;
+	}
+	return ret;
+}
+
 ParamArray *ArrayDup(ParamArray *ra)
 {
 	ParamArray *ret = new ParamArray;
@@ -158,6 +198,9 @@ ParamArray *ribarray;
 }
 %token <string> STRING ID
 %token <num> NUM
+%token <ribarray> NUM_ARRAY
+%token <string> BINARYINCLUDE
+%token <string> PREFETCHEDINCLUDE
 %token LBRACK RBRACK
 
 %token ACCELERATOR AREALIGHTSOURCE ATTRIBUTEBEGIN ATTRIBUTEEND
@@ -250,6 +293,10 @@ num_array: real_num_array
 real_num_array: array_init LBRACK num_list RBRACK
 {
 	$$ = ArrayDup(curArray);
+}
+| array_init NUM_ARRAY
+{
+	$$ = $2;
 };
 
 single_element_num_array: array_init num_list_entry
@@ -331,6 +378,15 @@ ri_stmt: ACCELERATOR STRING paramlist
 {
 	luxAttributeEnd();
 }
+| BINARYINCLUDE
+{
+	ParseBinaryScene($1);
+}
+| PREFETCHEDINCLUDE
+{
+	if (!ReplayPrefetchedInclude())
+		include_prefetched_fallback($1);
+}
 | CAMERA STRING paramlist
 {
 	ParamSet params;
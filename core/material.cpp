@@ -29,7 +29,8 @@
 using namespace lux;
 
 // Material Method Definitions
-Material::Material(const string &name, const ParamSet &mp, bool hasBumpMap) : Queryable(name) {
+Material::Material(const string &name, const ParamSet &mp, bool hasBumpMap) : Queryable(name),
+	paramsDigest(mp.Digest()) {
 	// so we can accurately report unused params if material doesn't support bump mapping
 	if (hasBumpMap) {
 		bumpmapSampleDistance = mp.FindOneFloat("bumpmapsampledistance", .001f);
@@ -25,6 +25,7 @@
 // material.h*
 #include "lux.h"
 #include "queryable.h"
+#include "tigerhash.h"
 
 namespace lux
 {
@@ -63,6 +64,10 @@ public:
 	boost::shared_ptr<Texture<float> > bumpMap;
 	float bumpmapSampleDistance;
 	CompositingParams compParams;
+	// Hash of the creation parameters, used to detect scene changes.
+	// Textures and named materials are only known by their names,
+	// their definitions are covered by Scene::definitionsDigest.
+	tigerhash::digest_type paramsDigest;
 };
 
 }//namespace lux
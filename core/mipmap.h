@@ -31,6 +31,13 @@
 #include "queryable.h"
 #include "luxrays/utils/memory.h"
 
+#include <boost/thread/mutex.hpp>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define LUX_EWA_SSE2
+#include <emmintrin.h>
+#endif
+
 namespace lux
 {
 
@@ -75,6 +82,80 @@ public:
 	virtual void DiscardMipmaps(u_int n) { }
 };
 
+#define WEIGHT_LUT_SIZE 128
+// Maximum number of texels of a footprint row whose EWA weights are
+// computed at once
+#define EWA_ROW_CHUNK 64
+
+// Computes the EWA filter weights of count consecutive texels of a
+// footprint row. ss0 is the offset along s of the first texel from the
+// ellipse center and tt the offset of the row along t. Texels outside of
+// the ellipse get a 0 weight. Returns the sum of the weights.
+inline float EWARowWeightsScalar(const float *lut, float A, float B, float C,
+	float ss0, float tt, u_int count, float *weights)
+{
+	const float Btt = B * tt, Ctt2 = C * tt * tt;
+	float sum = 0.f;
+	for (u_int i = 0; i < count; ++i) {
+		const float ss = ss0 + i;
+		const float r2 = (A * ss + Btt) * ss + Ctt2;
+		if (r2 < 1.f) {
+			weights[i] = lut[min(luxrays::Float2Int(r2 *
+				WEIGHT_LUT_SIZE), WEIGHT_LUT_SIZE - 1)];
+			sum += weights[i];
+		} else
+			weights[i] = 0.f;
+	}
+	return sum;
+}
+
+#if defined(LUX_EWA_SSE2)
+inline float EWARowWeights(const float *lut, float A, float B, float C,
+	float ss0, float tt, u_int count, float *weights)
+{
+	const __m128 vA = _mm_set1_ps(A);
+	const __m128 vBtt = _mm_set1_ps(B * tt);
+	const __m128 vCtt2 = _mm_set1_ps(C * tt * tt);
+	const __m128 one = _mm_set1_ps(1.f);
+	const __m128 lutScale = _mm_set1_ps(static_cast<float>(WEIGHT_LUT_SIZE));
+	const __m128 lutMax = _mm_set1_ps(static_cast<float>(WEIGHT_LUT_SIZE - 1));
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 four = _mm_set1_ps(4.f);
+	__m128 ss = _mm_add_ps(_mm_set1_ps(ss0), _mm_set_ps(3.f, 2.f, 1.f, 0.f));
+	__m128 vSum = zero;
+	u_int i = 0;
+	for (; i + 4 <= count; i += 4) {
+		const __m128 r2 = _mm_add_ps(_mm_mul_ps(_mm_add_ps(
+			_mm_mul_ps(vA, ss), vBtt), ss), vCtt2);
+		const __m128 inside = _mm_cmplt_ps(r2, one);
+		// Texels outside of the ellipse are clamped to a valid index
+		// and masked afterwards
+		const __m128i index = _mm_cvttps_epi32(_mm_max_ps(zero,
+			_mm_min_ps(_mm_mul_ps(r2, lutScale), lutMax)));
+		int idx[4];
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(idx), index);
+		const __m128 w = _mm_and_ps(inside, _mm_set_ps(lut[idx[3]],
+			lut[idx[2]], lut[idx[1]], lut[idx[0]]));
+		_mm_storeu_ps(weights + i, w);
+		vSum = _mm_add_ps(vSum, w);
+		ss = _mm_add_ps(ss, four);
+	}
+	float partial[4];
+	_mm_storeu_ps(partial, vSum);
+	float sum = (partial[0] + partial[1]) + (partial[2] + partial[3]);
+	if (i < count)
+		sum += EWARowWeightsScalar(lut, A, B, C, ss0 + i, tt,
+			count - i, weights + i);
+	return sum;
+}
+#else
+inline float EWARowWeights(const float *lut, float A, float B, float C,
+	float ss0, float tt, u_int count, float *weights)
+{
+	return EWARowWeightsScalar(lut, A, B, C, ss0, tt, count, weights);
+}
+#endif
+
 template <class T> class MIPMapFastImpl : public MIPMap {
 public:
 	// MIPMapFastImpl Public Methods
@@ -292,6 +373,12 @@ public:
 		return singleMap;
 	}
 
+	// Number of pyramid levels, 0 for NEAREST and BILINEAR maps
+	u_int GetLevelCount() const { return nLevels; }
+	const luxrays::BlockedArray<T> *GetLevel(u_int level) const {
+		return (nLevels == 0) ? singleMap : pyramid[level];
+	}
+
 protected:
 	// Dade - used by MIPMAP_EWA, MIPMAP_TRILINEAR
 	float Texel(Channel channel, u_int level, int s, int t) const;
@@ -368,11 +455,13 @@ private:
 		luxrays::BlockedArray<T> *singleMap;
 	};
 
-#define WEIGHT_LUT_SIZE 128
 	static float *weightLut;
+	// Maps may be built concurrently by the texture loading threads
+	static boost::mutex weightLutMutex;
 };
 
 template <class T> float *MIPMapFastImpl<T>::weightLut = NULL;
+template <class T> boost::mutex MIPMapFastImpl<T>::weightLutMutex;
 
 // MIPMapFastImpl Method Definitions
 template <class T>
@@ -738,18 +827,29 @@ float MIPMapFastImpl<T>::EWA(Channel channel, float s, float t,
 	// Scan over ellipse bound and compute quadratic equation
 	float num = 0.f;
 	float den = 0.f;
+	// Texels of footprints that don't cross the map border are
+	// read directly without handling the wrap mode
+	const luxrays::BlockedArray<T> &l = *pyramid[level];
+	const bool interior = s0 >= 0 && t0 >= 0 &&
+		s1 < static_cast<int>(l.uSize()) &&
+		t1 < static_cast<int>(l.vSize());
+	float weights[EWA_ROW_CHUNK];
 	for (int it = t0; it <= t1; ++it) {
 		const float tt = it - t;
-		for (int is = s0; is <= s1; ++is) {
-			const float ss = is - s;
-			// Compute squared radius and filter texel if inside ellipse
-			const float r2 = A * ss * ss + B * ss * tt + C * tt * tt;
-			if (r2 < 1.f) {
-				const float weight =
-					weightLut[min(luxrays::Float2Int(r2 *
-					WEIGHT_LUT_SIZE), WEIGHT_LUT_SIZE - 1)];
-				num += Texel(channel, level, is, it) * weight;
-				den += weight;
+		for (int is = s0; is <= s1; is += EWA_ROW_CHUNK) {
+			const int count = min(s1 - is + 1, EWA_ROW_CHUNK);
+			den += EWARowWeights(weightLut, A, B, C, is - s, tt,
+				count, weights);
+			if (interior) {
+				for (int i = 0; i < count; ++i) {
+					if (weights[i] > 0.f)
+						num += l(is + i, it).GetFloat(channel) * weights[i];
+				}
+			} else {
+				for (int i = 0; i < count; ++i) {
+					if (weights[i] > 0.f)
+						num += Texel(channel, level, is + i, it) * weights[i];
+				}
 			}
 		}
 	}
@@ -789,18 +889,29 @@ SWCSpectrum MIPMapFastImpl<T>::EWA(const SpectrumWavelengths &sw,
 	// Scan over ellipse bound and compute quadratic equation
 	SWCSpectrum num(0.f);
 	float den = 0.f;
+	// Texels of footprints that don't cross the map border are
+	// read directly without handling the wrap mode
+	const luxrays::BlockedArray<T> &l = *pyramid[level];
+	const bool interior = s0 >= 0 && t0 >= 0 &&
+		s1 < static_cast<int>(l.uSize()) &&
+		t1 < static_cast<int>(l.vSize());
+	float weights[EWA_ROW_CHUNK];
 	for (int it = t0; it <= t1; ++it) {
 		const float tt = it - t;
-		for (int is = s0; is <= s1; ++is) {
-			const float ss = is - s;
-			// Compute squared radius and filter texel if inside ellipse
-			const float r2 = A * ss * ss + B * ss * tt + C * tt * tt;
-			if (r2 < 1.f) {
-				const float weight =
-					weightLut[min(luxrays::Float2Int(r2 *
-					WEIGHT_LUT_SIZE), WEIGHT_LUT_SIZE - 1)];
-				num += Texel(sw, level, is, it) * weight;
-				den += weight;
+		for (int is = s0; is <= s1; is += EWA_ROW_CHUNK) {
+			const int count = min(s1 - is + 1, EWA_ROW_CHUNK);
+			den += EWARowWeights(weightLut, A, B, C, is - s, tt,
+				count, weights);
+			if (interior) {
+				for (int i = 0; i < count; ++i) {
+					if (weights[i] > 0.f)
+						num += l(is + i, it).GetSpectrum(sw) * weights[i];
+				}
+			} else {
+				for (int i = 0; i < count; ++i) {
+					if (weights[i] > 0.f)
+						num += Texel(sw, level, is + i, it) * weights[i];
+				}
 			}
 		}
 	}
@@ -839,18 +950,29 @@ RGBAColor MIPMapFastImpl<T>::EWA(float s, float t,
 	// Scan over ellipse bound and compute quadratic equation
 	float num = 0.f;
 	float den = 0.f;
+	// Texels of footprints that don't cross the map border are
+	// read directly without handling the wrap mode
+	const luxrays::BlockedArray<T> &l = *pyramid[level];
+	const bool interior = s0 >= 0 && t0 >= 0 &&
+		s1 < static_cast<int>(l.uSize()) &&
+		t1 < static_cast<int>(l.vSize());
+	float weights[EWA_ROW_CHUNK];
 	for (int it = t0; it <= t1; ++it) {
 		const float tt = it - t;
-		for (int is = s0; is <= s1; ++is) {
-			const float ss = is - s;
-			// Compute squared radius and filter texel if inside ellipse
-			const float r2 = A * ss * ss + B * ss * tt + C * tt * tt;
-			if (r2 < 1.f) {
-				const float weight =
-					weightLut[min(luxrays::Float2Int(r2 *
-					WEIGHT_LUT_SIZE), WEIGHT_LUT_SIZE - 1)];
-				num += Texel(level, is, it) * weight;
-				den += weight;
+		for (int is = s0; is <= s1; is += EWA_ROW_CHUNK) {
+			const int count = min(s1 - is + 1, EWA_ROW_CHUNK);
+			den += EWARowWeights(weightLut, A, B, C, is - s, tt,
+				count, weights);
+			if (interior) {
+				for (int i = 0; i < count; ++i) {
+					if (weights[i] > 0.f)
+						num += l(is + i, it).GetRGBAColor() * weights[i];
+				}
+			} else {
+				for (int i = 0; i < count; ++i) {
+					if (weights[i] > 0.f)
+						num += Texel(level, is + i, it) * weights[i];
+				}
 			}
 		}
 	}
@@ -1007,13 +1129,15 @@ MIPMapFastImpl<T>::MIPMapFastImpl(ImageTextureFilterType type, u_int sres, u_int
 			delete[] resampledImage;
 
 		// Initialize EWA filter weights if needed
+		boost::mutex::scoped_lock lock(weightLutMutex);
 		if (!weightLut) {
-			weightLut = luxrays::AllocAligned<float>(WEIGHT_LUT_SIZE);
+			float *lut = luxrays::AllocAligned<float>(WEIGHT_LUT_SIZE);
 			for (u_int i = 0; i < WEIGHT_LUT_SIZE; ++i) {
 				const float alpha = 2.f;
 				const float r2 = static_cast<float>(i) / static_cast<float>(WEIGHT_LUT_SIZE - 1);
-				weightLut[i] = expf(-alpha * r2) - expf(-alpha);
+				lut[i] = expf(-alpha * r2) - expf(-alpha);
 			}
+			weightLut = lut;
 		}
 		break;
 	}
@@ -0,0 +1,496 @@
+/***************************************************************************
+ *   Copyright (C) 1998-2013 by authors (see AUTHORS.txt)                  *
+ *                                                                         *
+ *   This file is part of LuxRender.                                       *
+ *                                                                         *
+ *   Lux Renderer is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   Lux Renderer is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+ *                                                                         *
+ *   This project is based on PBRT ; see http://www.pbrt.org               *
+ *   Lux Renderer website : http://www.luxrender.net                       *
+ ***************************************************************************/
+
+#ifndef LUX_MIPMAPTILED_H
+#define LUX_MIPMAPTILED_H
+// mipmaptiled.h*
+
+#include "lux.h"
+#include "mipmap.h"
+#include "texturecache.h"
+
+#include <fstream>
+#include <boost/filesystem.hpp>
+
+namespace lux
+{
+
+// MIPMap reading its texels on demand from a tiled image file through
+// the TextureTileCache. Only a bounded number of tiles is kept in memory
+// whatever the number and the resolution of the images.
+template <class T> class MIPMapTiledImpl : public MIPMap {
+public:
+	MIPMapTiledImpl(ImageTextureFilterType type,
+		const boost::shared_ptr<TiledImageFile> &f, float maxAniso = 8.f,
+		float g = 1.f, float gam = 1.f);
+	virtual ~MIPMapTiledImpl() { }
+
+	virtual float LookupFloat(Channel channel, float s, float t,
+		float width = 0.f) const {
+		return GainGamma(Lookup(FloatLookup(channel), s, t, width));
+	}
+	virtual float LookupFloat(Channel channel, float s, float t,
+		float ds0, float dt0, float ds1, float dt1) const {
+		return GainGamma(Lookup(FloatLookup(channel), s, t,
+			ds0, dt0, ds1, dt1));
+	}
+	virtual RGBAColor LookupRGBAColor(float s, float t,
+		float width = 0.f) const {
+		const RGBAColor col(Lookup(RGBALookup(), s, t, width));
+		if (gain == 1.f && gamma == 1.f)
+			return col;
+		RGBAColor ret((gain * col).Pow(gamma));
+		ret.alpha = col.alpha;
+		return ret;
+	}
+	virtual SWCSpectrum LookupSpectrum(const SpectrumWavelengths &sw,
+		float s, float t, float width = 0.f) const {
+		return GainGamma(Lookup(SpectrumLookup(sw), s, t, width));
+	}
+	virtual SWCSpectrum LookupSpectrum(const SpectrumWavelengths &sw,
+		float s, float t, float ds0, float dt0, float ds1, float dt1) const {
+		return GainGamma(Lookup(SpectrumLookup(sw), s, t,
+			ds0, dt0, ds1, dt1));
+	}
+	virtual void GetDifferentials(Channel channel, float s, float t,
+		float *ds, float *dt) const {
+		Differentials(FloatLookup(channel), s, t, ds, dt);
+		ApplyGainGamma(channel, s, t, ds, dt);
+	}
+	virtual void GetDifferentials(const SpectrumWavelengths &sw,
+		float s, float t, float *ds, float *dt) const {
+		Differentials(FilterLookup(sw), s, t, ds, dt);
+		ApplyGainGamma(CHANNEL_MEAN, s, t, ds, dt);
+	}
+	virtual void GetMinMaxFloat(Channel channel, float *minValue,
+		float *maxValue) const {
+		// Computed from the full resolution level when the file is built
+		*minValue = powf(gain * header.minValue[channel], gamma);
+		*maxValue = powf(gain * header.maxValue[channel], gamma);
+	}
+
+	virtual u_int GetMemoryUsed() const {
+		return static_cast<u_int>(file->GetResidentMemory());
+	}
+	virtual void DiscardMipmaps(u_int n) {
+		if (filterType != MIPMAP_TRILINEAR && filterType != MIPMAP_EWA)
+			return;
+		baseLevel = min(baseLevel + n, header.GetLevelCount() - 1);
+		nLevels = header.GetLevelCount() - baseLevel;
+	}
+
+	// Creates the tiled image file from a fully loaded image
+	static bool WriteTiledImage(const string &filename, u_int sres,
+		u_int tres, const T *img, ImageWrap wrapMode,
+		TiledImageHeader header);
+
+private:
+	// Converters from a texel to the type returned by a lookup
+	class FloatLookup {
+	public:
+		typedef float result_type;
+		FloatLookup(Channel c) : channel(c) { }
+		float operator()(const T &texel) const {
+			return texel.GetFloat(channel);
+		}
+		float Constant(float v) const { return v; }
+		Channel channel;
+	};
+	class SpectrumLookup {
+	public:
+		typedef SWCSpectrum result_type;
+		SpectrumLookup(const SpectrumWavelengths &w) : sw(w) { }
+		SWCSpectrum operator()(const T &texel) const {
+			return texel.GetSpectrum(sw);
+		}
+		SWCSpectrum Constant(float v) const { return SWCSpectrum(v); }
+		const SpectrumWavelengths &sw;
+	};
+	class FilterLookup {
+	public:
+		typedef float result_type;
+		FilterLookup(const SpectrumWavelengths &w) : sw(w) { }
+		float operator()(const T &texel) const {
+			return texel.GetSpectrum(sw).Filter(sw);
+		}
+		float Constant(float v) const { return v; }
+		const SpectrumWavelengths &sw;
+	};
+	class RGBALookup {
+	public:
+		typedef RGBAColor result_type;
+		RGBAColor operator()(const T &texel) const {
+			return texel.GetRGBAColor();
+		}
+		RGBAColor Constant(float v) const { return RGBAColor(v); }
+	};
+
+	float GainGamma(float v) const {
+		if (gain == 1.f && gamma == 1.f)
+			return v;
+		return powf(gain * v, gamma);
+	}
+	SWCSpectrum GainGamma(const SWCSpectrum &v) const {
+		if (gain == 1.f && gamma == 1.f)
+			return v;
+		return Pow(gain * v, gamma);
+	}
+	void ApplyGainGamma(Channel channel, float s, float t,
+		float *ds, float *dt) const {
+		*ds *= gain;
+		*dt *= gain;
+		if (gamma != 1.f) {
+			const float factor = gamma *
+				powf(Lookup(FloatLookup(channel), s, t, 0.f),
+				gamma - 1.f);
+			*ds *= factor;
+			*dt *= factor;
+		}
+	}
+
+	u_int uSize(u_int level) const { return header.uRes[baseLevel + level]; }
+	u_int vSize(u_int level) const { return header.vRes[baseLevel + level]; }
+
+	template <class L> typename L::result_type Texel(TileAccessor &tiles,
+		const L &lookup, u_int level, int s, int t) const {
+		const int uRes = static_cast<int>(uSize(level));
+		const int vRes = static_cast<int>(vSize(level));
+		// Compute texel $(s,t)$ accounting for boundary conditions
+		switch (wrapMode) {
+			case TEXTURE_REPEAT:
+				s = luxrays::Mod(s, uRes);
+				t = luxrays::Mod(t, vRes);
+				break;
+			case TEXTURE_CLAMP:
+				s = luxrays::Clamp(s, 0, uRes - 1);
+				t = luxrays::Clamp(t, 0, vRes - 1);
+				break;
+			case TEXTURE_BLACK:
+				if (s < 0 || s >= uRes || t < 0 || t >= vRes)
+					return lookup.Constant(0.f);
+				break;
+			case TEXTURE_WHITE:
+				if (s < 0 || s >= uRes || t < 0 || t >= vRes)
+					return lookup.Constant(1.f);
+				break;
+		}
+
+		return lookup(*reinterpret_cast<const T *>(tiles.Texel(
+			baseLevel + level, s, t)));
+	}
+	template <class L> typename L::result_type Triangle(TileAccessor &tiles,
+		const L &lookup, u_int level, float s, float t) const {
+		level = min(level, nLevels - 1);
+		s = s * uSize(level) - .5f;
+		t = t * vSize(level) - .5f;
+		const int s0 = luxrays::Floor2Int(s), t0 = luxrays::Floor2Int(t);
+		const float ds = s - s0, dt = t - t0;
+		return luxrays::Lerp(ds,
+			luxrays::Lerp(dt, Texel(tiles, lookup, level, s0, t0),
+			Texel(tiles, lookup, level, s0, t0 + 1)),
+			luxrays::Lerp(dt, Texel(tiles, lookup, level, s0 + 1, t0),
+			Texel(tiles, lookup, level, s0 + 1, t0 + 1)));
+	}
+	template <class L> typename L::result_type EWA(TileAccessor &tiles,
+		const L &lookup, float s, float t,
+		float ds0, float dt0, float ds1, float dt1, u_int level) const;
+	template <class L> typename L::result_type Lookup(const L &lookup,
+		float s, float t, float width) const;
+	template <class L> typename L::result_type Lookup(const L &lookup,
+		float s, float t,
+		float ds0, float dt0, float ds1, float dt1) const;
+	template <class L> void Differentials(const L &lookup,
+		float s, float t, float *ds, float *dt) const;
+
+	boost::shared_ptr<TiledImageFile> file;
+	const TiledImageHeader &header;
+	ImageTextureFilterType filterType;
+	ImageWrap wrapMode;
+	float maxAnisotropy;
+	float gain, gamma;
+	u_int baseLevel, nLevels;
+
+	static float weightLut[WEIGHT_LUT_SIZE];
+	static bool weightLutInitialized;
+	static boost::mutex weightLutMutex;
+};
+
+template <class T> float MIPMapTiledImpl<T>::weightLut[WEIGHT_LUT_SIZE];
+template <class T> bool MIPMapTiledImpl<T>::weightLutInitialized = false;
+template <class T> boost::mutex MIPMapTiledImpl<T>::weightLutMutex;
+
+template <class T>
+MIPMapTiledImpl<T>::MIPMapTiledImpl(ImageTextureFilterType type,
+	const boost::shared_ptr<TiledImageFile> &f, float maxAniso,
+	float g, float gam) :
+	MIPMap("MIPMapTiledImpl-" + boost::lexical_cast<string>(this)),
+	file(f), header(f->GetHeader()), filterType(type),
+	wrapMode(static_cast<ImageWrap>(f->GetHeader().wrapMode)),
+	maxAnisotropy(maxAniso), gain(g), gamma(gam), baseLevel(0)
+{
+	// NEAREST and BILINEAR only use the full resolution level
+	if (filterType == MIPMAP_TRILINEAR || filterType == MIPMAP_EWA)
+		nLevels = header.GetLevelCount();
+	else
+		nLevels = 1;
+
+	boost::mutex::scoped_lock lock(weightLutMutex);
+	if (!weightLutInitialized) {
+		for (u_int i = 0; i < WEIGHT_LUT_SIZE; ++i) {
+			const float alpha = 2.f;
+			const float r2 = static_cast<float>(i) / static_cast<float>(WEIGHT_LUT_SIZE - 1);
+			weightLut[i] = expf(-alpha * r2) - expf(-alpha);
+		}
+		weightLutInitialized = true;
+	}
+}
+
+template <class T> template <class L>
+typename L::result_type MIPMapTiledImpl<T>::Lookup(const L &lookup,
+	float s, float t, float width) const
+{
+	TileAccessor tiles(*file);
+	switch (filterType) {
+		case MIPMAP_TRILINEAR:
+		case MIPMAP_EWA: {
+			// Compute MIPMap level for trilinear filtering
+			const float level = nLevels - 1 +
+				luxrays::Log2(max(width, 1e-8f));
+			// Perform trilinear interpolation at appropriate level
+			if (level < 0)
+				return Triangle(tiles, lookup, 0, s, t);
+			else if (level >= nLevels - 1)
+				return Texel(tiles, lookup, nLevels - 1,
+					luxrays::Floor2Int(s * uSize(nLevels - 1)),
+					luxrays::Floor2Int(t * vSize(nLevels - 1)));
+			else {
+				const u_int iLevel = luxrays::Floor2UInt(level);
+				const float delta = level - iLevel;
+				return luxrays::Lerp(delta,
+					Triangle(tiles, lookup, iLevel, s, t),
+					Triangle(tiles, lookup, iLevel + 1, s, t));
+			}
+		}
+		case BILINEAR:
+			return Triangle(tiles, lookup, 0, s, t);
+		case NEAREST:
+			return Texel(tiles, lookup, 0,
+				luxrays::Floor2Int(s * uSize(0) - .5f),
+				luxrays::Floor2Int(t * vSize(0) - .5f));
+	}
+	LOG(LUX_ERROR, LUX_SYSTEM) << "Internal error in MIPMapTiledImpl::Lookup()";
+	return lookup.Constant(1.f);
+}
+
+template <class T> template <class L>
+typename L::result_type MIPMapTiledImpl<T>::Lookup(const L &lookup,
+	float s, float t, float ds0, float dt0, float ds1, float dt1) const
+{
+	if (filterType != MIPMAP_EWA)
+		return Lookup(lookup, s, t, 2.f * max(max(fabsf(ds0), fabsf(dt0)),
+			max(fabsf(ds1), fabsf(dt1))));
+
+	// Compute ellipse minor and major axes
+	if (ds0 * ds0 + dt0 * dt0 < ds1 * ds1 + dt1 * dt1) {
+		swap(ds0, ds1);
+		swap(dt0, dt1);
+	}
+	const float majorLength = sqrtf(ds0 * ds0 + dt0 * dt0);
+	float minorLength = sqrtf(ds1 * ds1 + dt1 * dt1);
+
+	// Clamp ellipse eccentricity if too large
+	if (minorLength * maxAnisotropy < majorLength) {
+		const float scale = majorLength / (minorLength * maxAnisotropy);
+		ds1 *= scale;
+		dt1 *= scale;
+		minorLength *= scale;
+	}
+
+	// Choose level of detail for EWA lookup and perform EWA filtering
+	TileAccessor tiles(*file);
+	const float lod = nLevels - 1 + luxrays::Log2(minorLength);
+	if (lod <= 0.f)
+		return Triangle(tiles, lookup, 0, s, t);
+	else if (lod >= nLevels - 1)
+		return Texel(tiles, lookup, nLevels - 1,
+			luxrays::Floor2Int(s * uSize(nLevels - 1)),
+			luxrays::Floor2Int(t * vSize(nLevels - 1)));
+	const u_int ilod = luxrays::Floor2UInt(lod);
+	const float d = lod - ilod;
+	return luxrays::Lerp(d,
+		EWA(tiles, lookup, s, t, ds0, dt0, ds1, dt1, ilod),
+		EWA(tiles, lookup, s, t, ds0, dt0, ds1, dt1, ilod + 1));
+}
+
+template <class T> template <class L>
+typename L::result_type MIPMapTiledImpl<T>::EWA(TileAccessor &tiles,
+	const L &lookup, float s, float t,
+	float ds0, float dt0, float ds1, float dt1, u_int level) const
+{
+	if (level >= nLevels)
+		level = nLevels - 1;
+	s = s * uSize(level);
+	t = t * vSize(level);
+	// Convert EWA coordinates to appropriate scale for level
+	ds0 *= uSize(level);
+	dt0 *= vSize(level);
+	ds1 *= uSize(level);
+	dt1 *= vSize(level);
+	// Compute ellipse coefficients to bound EWA filter region
+	float A = dt0 * dt0 + dt1 * dt1 + 1.f;
+	float B = -2.f * (ds0 * dt0 + ds1 * dt1);
+	float C = ds0 * ds0 + ds1 * ds1 + 1.f;
+	const float F = A * C - B * B * 0.25f;
+	// Compute the ellipse's $(s,t)$ bounding box in texture space
+	const float du = sqrtf(C), dv = sqrtf(A);
+	const int s0 = luxrays::Ceil2Int(s - du);
+	const int s1 = luxrays::Floor2Int(s + du);
+	const int t0 = luxrays::Ceil2Int(t - dv);
+	const int t1 = luxrays::Floor2Int(t + dv);
+
+	const float invF = 1.f / F;
+	A *= invF;
+	B *= invF;
+	C *= invF;
+	// Scan over ellipse bound and compute quadratic equation
+	typename L::result_type num(0.f);
+	float den = 0.f;
+	for (int it = t0; it <= t1; ++it) {
+		const float tt = it - t;
+		for (int is = s0; is <= s1; ++is) {
+			const float ss = is - s;
+			// Compute squared radius and filter texel if inside ellipse
+			const float r2 = A * ss * ss + B * ss * tt + C * tt * tt;
+			if (r2 < 1.f) {
+				const float weight =
+					weightLut[min(luxrays::Float2Int(r2 *
+					WEIGHT_LUT_SIZE), WEIGHT_LUT_SIZE - 1)];
+				num += Texel(tiles, lookup, level, is, it) * weight;
+				den += weight;
+			}
+		}
+	}
+
+	return num / den;
+}
+
+template <class T> template <class L>
+void MIPMapTiledImpl<T>::Differentials(const L &lookup, float s, float t,
+	float *ds, float *dt) const
+{
+	TileAccessor tiles(*file);
+	s *= uSize(0);
+	const int is = luxrays::Floor2Int(s);
+	const float as = s - is;
+	t *= vSize(0);
+	const int it = luxrays::Floor2Int(t);
+	const float at = t - it;
+	const int s0 = as < .5f ? is - 1 : is, s1 = s0 + 1;
+	const int t0 = at < .5f ? it - 1 : it, t1 = t0 + 1;
+	*ds = luxrays::Lerp(at, Texel(tiles, lookup, 0, s1, it) -
+		Texel(tiles, lookup, 0, s0, it),
+		Texel(tiles, lookup, 0, s1, it + 1) -
+		Texel(tiles, lookup, 0, s0, it + 1)) * uSize(0);
+	*dt = luxrays::Lerp(as, Texel(tiles, lookup, 0, is, t1) -
+		Texel(tiles, lookup, 0, is, t0),
+		Texel(tiles, lookup, 0, is + 1, t1) -
+		Texel(tiles, lookup, 0, is + 1, t0)) * vSize(0);
+}
+
+template <class T>
+bool MIPMapTiledImpl<T>::WriteTiledImage(const string &filename, u_int sres,
+	u_int tres, const T *img, ImageWrap wrapMode, TiledImageHeader header)
+{
+	// Build the levels exactly as the in memory MIPMap would do for the
+	// requested filter: NEAREST and BILINEAR keep the original resolution
+	// while TRILINEAR and EWA need a power of 2 pyramid.
+	// The MIPMap is only kept alive while the file is being written
+	MIPMapFastImpl<T> mipmap(static_cast<ImageTextureFilterType>(header.filterType),
+		sres, tres, img, 8.f, wrapMode);
+
+	header.texelSize = sizeof(T);
+	header.wrapMode = wrapMode;
+	header.uRes.clear();
+	header.vRes.clear();
+	const u_int nLevels = max(mipmap.GetLevelCount(), 1U);
+	for (u_int i = 0; i < nLevels; ++i) {
+		header.uRes.push_back(mipmap.GetLevel(i)->uSize());
+		header.vRes.push_back(mipmap.GetLevel(i)->vSize());
+	}
+	header.ComputeLayout();
+	for (u_int i = 0; i < TILED_IMAGE_CHANNEL_COUNT; ++i)
+		mipmap.GetMinMaxFloat(static_cast<Channel>(i),
+			&header.minValue[i], &header.maxValue[i]);
+
+	// Write to a temporary file first so that a partially written
+	// file is never picked up by another process, the name is unique
+	// as several loaders may build the same file at once
+	string tmpFilename;
+	try {
+		tmpFilename = filename + "." +
+			boost::filesystem::unique_path().string() + ".tmp";
+		std::ofstream os(tmpFilename.c_str(),
+			std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+		if (!os.good())
+			return false;
+		header.Write(os);
+
+		const u_int tileSize = header.tileSize;
+		vector<T> tile(tileSize * tileSize);
+		for (u_int l = 0; l < header.GetLevelCount(); ++l) {
+			const luxrays::BlockedArray<T> &level = *(mipmap.GetLevel(l));
+			for (u_int ty = 0; ty < header.vTiles[l]; ++ty) {
+				for (u_int tx = 0; tx < header.uTiles[l]; ++tx) {
+					for (u_int t = 0; t < tileSize; ++t) {
+						// Border tiles are padded by replicating the edge texels
+						const u_int lt = min(ty * tileSize + t, header.vRes[l] - 1);
+						for (u_int s = 0; s < tileSize; ++s) {
+							const u_int ls = min(tx * tileSize + s, header.uRes[l] - 1);
+							tile[t * tileSize + s] = level(ls, lt);
+						}
+					}
+					os.write(reinterpret_cast<const char *>(&tile[0]),
+						tile.size() * sizeof(T));
+				}
+			}
+		}
+		os.close();
+		if (os.fail()) {
+			boost::filesystem::remove(tmpFilename);
+			return false;
+		}
+		boost::filesystem::rename(tmpFilename, filename);
+	} catch (const std::exception &e) {
+		LOG(LUX_WARNING, LUX_SYSTEM) << "Unable to write tiled image '" <<
+			filename << "': " << e.what();
+		boost::system::error_code ec;
+		if (!tmpFilename.empty())
+			boost::filesystem::remove(tmpFilename, ec);
+		return false;
+	}
+
+	return true;
+}
+
+}//namespace lux
+
+#endif // LUX_MIPMAPTILED_H
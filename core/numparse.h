@@ -0,0 +1,124 @@
+/***************************************************************************
+ *   Copyright (C) 1998-2013 by authors (see AUTHORS.txt)                  *
+ *                                                                         *
+ *   This file is part of LuxRender.                                       *
+ *                                                                         *
+ *   Lux Renderer is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   Lux Renderer is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+ *                                                                         *
+ *   This project is based on PBRT ; see http://www.pbrt.org               *
+ *   Lux Renderer website : http://www.luxrender.net                       *
+ ***************************************************************************/
+
+#ifndef LUX_NUMPARSE_H
+#define LUX_NUMPARSE_H
+// numparse.h*
+
+#include <cstdlib>
+#include <boost/cstdint.hpp>
+
+namespace lux
+{
+
+inline bool IsNumDigit(char c)
+{
+	return c >= '0' && c <= '9';
+}
+
+// Parses a number with the syntax of the NUMBER rule of the scene lexer:
+// [-+]?([0-9]+|(([0-9]+\.[0-9]*)|(\.[0-9]+)))([eE][-+]?[0-9]+)?
+// Returns the position following the number, or NULL if str doesn't
+// start with a number.
+// The result is the same as the one of strtod: numbers with up to
+// 15 significant digits and a small exponent, which is what exporters
+// write, are converted exactly with a single multiplication or division
+// of exact double values, other numbers fall back to strtod.
+inline const char *ParseNumber(const char *str, double *value)
+{
+	static const double powers[] = {
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+		1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20,
+		1e21, 1e22
+	};
+
+	const char *p = str;
+	const bool negative = (*p == '-');
+	if (*p == '-' || *p == '+')
+		++p;
+
+	// Only the first 19 significant digits fit the mantissa,
+	// further digits make the fast path fail below
+	boost::uint64_t mantissa = 0;
+	int digits = 0;
+	int exponent = 0;
+	bool hasDigits = false;
+	for (; IsNumDigit(*p); ++p) {
+		hasDigits = true;
+		if (digits < 19) {
+			mantissa = mantissa * 10 + (*p - '0');
+			if (mantissa > 0)
+				++digits;
+		} else {
+			++exponent;
+			++digits;
+		}
+	}
+	if (*p == '.') {
+		const char *q = p + 1;
+		for (; IsNumDigit(*q); ++q) {
+			hasDigits = true;
+			if (digits < 19) {
+				mantissa = mantissa * 10 + (*q - '0');
+				if (mantissa > 0)
+					++digits;
+				--exponent;
+			} else
+				++digits;
+		}
+		p = q;
+	}
+	if (!hasDigits)
+		return NULL;
+	if (*p == 'e' || *p == 'E') {
+		const char *q = p + 1;
+		const bool negativeExponent = (*q == '-');
+		if (*q == '-' || *q == '+')
+			++q;
+		if (IsNumDigit(*q)) {
+			int e = 0;
+			for (; IsNumDigit(*q); ++q) {
+				if (e < 100000)
+					e = e * 10 + (*q - '0');
+			}
+			exponent += negativeExponent ? -e : e;
+			p = q;
+		}
+	}
+
+	if (digits <= 19 && mantissa <= (1ULL << 53) &&
+		exponent >= -22 && exponent <= 22) {
+		double v = static_cast<double>(mantissa);
+		if (exponent < 0)
+			v /= powers[-exponent];
+		else
+			v *= powers[exponent];
+		*value = negative ? -v : v;
+	} else
+		*value = strtod(str, NULL);
+
+	return p;
+}
+
+}//namespace lux
+
+#endif // LUX_NUMPARSE_H
@@ -94,6 +94,13 @@ template <class T> inline void AddParamType(vector<ParamSetItem<T> *> &vec,
 	EraseParamType(vec, name);
 	vec.push_back(new ParamSetItem<T>(name, data, nItems));
 }
+template <class T> inline void ReferenceParamType(vector<ParamSetItem<T> *> &vec,
+	const string &name, const T *data, u_int nItems,
+	const boost::shared_ptr<const void> &storage)
+{
+	EraseParamType(vec, name);
+	vec.push_back(new ParamSetItem<T>(name, data, nItems, storage));
+}
 template <class T> inline const T *LookupPtr(const vector<ParamSetItem<T> *> &vec,
 	const string &name, u_int *nItems)
 {
@@ -140,42 +147,50 @@ template <class T> inline void MarkAllUsed(const vector<ParamSetItem<T> *> &vec)
 // ParamSet Methods
 template <> ParamSetItem<int>::~ParamSetItem()
 {
-	delete[] data;
+	if (!storage)
+		delete[] data;
 }
 
 template <> ParamSetItem<bool>::~ParamSetItem()
 {
-	delete[] data;
+	if (!storage)
+		delete[] data;
 }
 
 template <> ParamSetItem<float>::~ParamSetItem()
 {
-	delete[] data;
+	if (!storage)
+		delete[] data;
 }
 
 template <> ParamSetItem<Point>::~ParamSetItem()
 {
-	delete[] data;
+	if (!storage)
+		delete[] data;
 }
 
 template <> ParamSetItem<Vector>::~ParamSetItem()
 {
-	delete[] data;
+	if (!storage)
+		delete[] data;
 }
 
 template <> ParamSetItem<Normal>::~ParamSetItem()
 {
-	delete[] data;
+	if (!storage)
+		delete[] data;
 }
 
 template <> ParamSetItem<RGBColor>::~ParamSetItem()
 {
-	delete[] data;
+	if (!storage)
+		delete[] data;
 }
 
 template <> ParamSetItem<string>::~ParamSetItem()
 {
-	delete[] data;
+	if (!storage)
+		delete[] data;
 }
 
 ParamSet::ParamSet(const ParamSet &p2) {
@@ -1156,6 +1171,36 @@ void ParamSet::AddTexture(const string &name, const string &value)
 {
 	AddParamType(textures, name, &value, 1);
 }
+void ParamSet::ReferenceFloat(const string &name, const float *data, u_int nItems,
+	const boost::shared_ptr<const void> &storage)
+{
+	ReferenceParamType(floats, name, data, nItems, storage);
+}
+void ParamSet::ReferenceInt(const string &name, const int *data, u_int nItems,
+	const boost::shared_ptr<const void> &storage)
+{
+	ReferenceParamType(ints, name, data, nItems, storage);
+}
+void ParamSet::ReferencePoint(const string &name, const Point *data, u_int nItems,
+	const boost::shared_ptr<const void> &storage)
+{
+	ReferenceParamType(points, name, data, nItems, storage);
+}
+void ParamSet::ReferenceVector(const string &name, const Vector *data, u_int nItems,
+	const boost::shared_ptr<const void> &storage)
+{
+	ReferenceParamType(vectors, name, data, nItems, storage);
+}
+void ParamSet::ReferenceNormal(const string &name, const Normal *data, u_int nItems,
+	const boost::shared_ptr<const void> &storage)
+{
+	ReferenceParamType(normals, name, data, nItems, storage);
+}
+void ParamSet::ReferenceRGBColor(const string &name, const RGBColor *data, u_int nItems,
+	const boost::shared_ptr<const void> &storage)
+{
+	ReferenceParamType(spectra, name, data, nItems, storage);
+}
 bool ParamSet::EraseInt(const string &n) {
 	return EraseParamType(ints, n);
 }
@@ -1298,6 +1343,46 @@ void ParamSet::Clear() {
 	DelParams(strings);
 	DelParams(textures);
 }
+template <class T> static void DigestItems(tigerhash &hash,
+	const char *type, const vector<ParamSetItem<T> *> &items)
+{
+	for (u_int i = 0; i < items.size(); ++i) {
+		const ParamSetItem<T> *item = items[i];
+		hash.update(type, strlen(type) + 1);
+		hash.update(item->name.c_str(), item->name.size() + 1);
+		hash.update(reinterpret_cast<const char *>(&item->nItems),
+			sizeof(item->nItems));
+		hash.update(reinterpret_cast<const char *>(item->data),
+			sizeof(T) * item->nItems);
+	}
+}
+static void DigestItems(tigerhash &hash, const char *type,
+	const vector<ParamSetItem<string> *> &items)
+{
+	for (u_int i = 0; i < items.size(); ++i) {
+		const ParamSetItem<string> *item = items[i];
+		hash.update(type, strlen(type) + 1);
+		hash.update(item->name.c_str(), item->name.size() + 1);
+		hash.update(reinterpret_cast<const char *>(&item->nItems),
+			sizeof(item->nItems));
+		for (u_int j = 0; j < item->nItems; ++j)
+			hash.update(item->data[j].c_str(),
+				item->data[j].size() + 1);
+	}
+}
+tigerhash::digest_type ParamSet::Digest() const {
+	tigerhash hash;
+	DigestItems(hash, "integer", ints);
+	DigestItems(hash, "bool", bools);
+	DigestItems(hash, "float", floats);
+	DigestItems(hash, "point", points);
+	DigestItems(hash, "vector", vectors);
+	DigestItems(hash, "normal", normals);
+	DigestItems(hash, "string", strings);
+	DigestItems(hash, "texture", textures);
+	DigestItems(hash, "color", spectra);
+	return hash.end_message();
+}
 string ParamSet::ToString() const {
 	std::stringstream ret("");
 	for (u_int i = 0; i < ints.size(); ++i) {
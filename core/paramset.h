@@ -25,8 +25,10 @@
 // paramset.h*
 #include "lux.h"
 #include "api.h"
+#include "tigerhash.h"
 
 #include <boost/serialization/split_member.hpp>
+#include <boost/shared_ptr.hpp>
 
 #include <map>
 using std::map;
@@ -49,9 +51,11 @@ template <class T> struct ParamSetItem {
 	// ParamSetItem Public Methods
 	
 	ParamSetItem<T> *Clone() const {
+		if (storage)
+			return new ParamSetItem<T>(name, data, nItems, storage);
 		return new ParamSetItem<T>(name, data, nItems);
 	}
-	ParamSetItem() { data=0; }
+	ParamSetItem() : data(0) { }
 	// The const_cast forces a copy of the string data
 	ParamSetItem(const string &n, const T *v, u_int ni = 1) :
 		name(const_cast<string &>(n)), nItems(ni), lookedUp(false) {
@@ -59,6 +63,12 @@ template <class T> struct ParamSetItem {
 		for (u_int i = 0; i < nItems; ++i)
 			data[i] = v[i];
 	}
+	// References v without copy, s holds the memory v points to
+	// and is shared by the clones of the item
+	ParamSetItem(const string &n, const T *v, u_int ni,
+		const boost::shared_ptr<const void> &s) :
+		name(const_cast<string &>(n)), nItems(ni),
+		data(const_cast<T *>(v)), lookedUp(false), storage(s) { }
 	~ParamSetItem();
 	
 	template<class Archive>
@@ -76,8 +86,9 @@ template <class T> struct ParamSetItem {
 	void load(Archive & ar, const unsigned int version) {
 		ar & name;
 		ar & nItems;
-		if(data!=0)
+		if(data!=0 && !storage)
 			delete[] data;
+		storage.reset();
 		data=new T[nItems];
 		for (u_int i = 0; i < nItems; ++i)
 			ar & data[i];
@@ -91,9 +102,12 @@ template <class T> struct ParamSetItem {
 	u_int nItems;
 	T *data;
 	mutable bool lookedUp;
+	// Owner of the data when it is referenced instead of copied
+	boost::shared_ptr<const void> storage;
 };
 class LUX_EXPORT ParamSet {
 	friend class boost::serialization::access;
+	friend class BinarySceneWriter;
 	
 public:
 	// ParamSet Public Methods
@@ -113,6 +127,21 @@ public:
 	void AddRGBColor(const string &, const RGBColor *, u_int nItems = 1);
 	void AddString(const string &, const string *, u_int nItems = 1);
 	void AddTexture(const string &, const string &);
+	// The Reference variants don't copy the data, storage must own
+	// the memory data points to, it is kept alive by the ParamSet
+	// and its copies
+	void ReferenceFloat(const string &, const float *, u_int nItems,
+		const boost::shared_ptr<const void> &storage);
+	void ReferenceInt(const string &, const int *, u_int nItems,
+		const boost::shared_ptr<const void> &storage);
+	void ReferencePoint(const string &, const Point *, u_int nItems,
+		const boost::shared_ptr<const void> &storage);
+	void ReferenceVector(const string &, const Vector *, u_int nItems,
+		const boost::shared_ptr<const void> &storage);
+	void ReferenceNormal(const string &, const Normal *, u_int nItems,
+		const boost::shared_ptr<const void> &storage);
+	void ReferenceRGBColor(const string &, const RGBColor *, u_int nItems,
+		const boost::shared_ptr<const void> &storage);
 	bool EraseInt(const string &);
 	bool EraseBool(const string &);
 	bool EraseFloat(const string &);
@@ -158,6 +187,9 @@ public:
 	}
 	void Clear();
 	string ToString() const;
+	// Hash of the names and raw values of all the parameters,
+	// cheaper than hashing ToString() for large meshes
+	tigerhash::digest_type Digest() const;
 
 private:
 	// ParamSet Data
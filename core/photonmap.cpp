@@ -24,17 +24,26 @@
 #include "light.h"
 #include "luxrays/core/color/spectrumwavelengths.h"
 #include "primitive.h"
+#include "shape.h"
+#include "material.h"
 #include "scene.h"
 #include "sampling.h"
 #include "camera.h"
 #include "error.h"
 #include "randomgen.h"
 #include "osfunc.h"
+#include "tigerhash.h"
 
 #include "luxrays/utils/mc.h"
 #include "luxrays/utils/mcdistribution.h"
 
+#include <cstring>
 #include <fstream>
+#include <boost/bind.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/iostreams/device/mapped_file.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
 #include <boost/thread/xtime.hpp>
 
 using namespace luxrays;
@@ -61,76 +70,6 @@ SWCSpectrum BasicColorPhoton::GetSWCSpectrum(const SpectrumWavelengths &sw) cons
 	return result;
 }
 
-void BasicColorPhoton::save(bool isLittleEndian, std::basic_ostream<char> &stream) const
-{
-	// Point p
-	for (u_int i = 0; i < 3; ++i)
-		osWriteLittleEndianFloat(isLittleEndian, stream, p[i]);
-
-	// SWCSpectrum alpha
-	for (u_int i = 0; i < WAVELENGTH_SAMPLES; ++i)
-		osWriteLittleEndianFloat(isLittleEndian, stream, alpha.c[i]);
-
-	// wavelengths
-	for (u_int i = 0; i < WAVELENGTH_SAMPLES; ++i)
-		osWriteLittleEndianFloat(isLittleEndian, stream, w[i]);
-}
-
-void BasicColorPhoton::load(bool isLittleEndian, std::basic_istream<char> &stream)
-{
-	// Point p
-	for (u_int i = 0; i < 3; ++i)
-		p[i] = osReadLittleEndianFloat(isLittleEndian, stream);
-
-	// SWCSpectrum alpha
-	for (u_int i = 0; i < WAVELENGTH_SAMPLES; ++i)
-		alpha.c[i] = osReadLittleEndianFloat(isLittleEndian, stream);
-
-	// wavelengths
-	for (u_int i = 0; i < WAVELENGTH_SAMPLES; ++i)
-		w[i] = osReadLittleEndianFloat(isLittleEndian, stream);
-}
-
-void LightPhoton::save(bool isLittleEndian, std::basic_ostream<char> &stream) const
-{
-	// BasicColorPhoton
-	BasicColorPhoton::save(isLittleEndian, stream);
-
-	// Vector wi
-	for (u_int i = 0; i < 3; ++i)
-		osWriteLittleEndianFloat(isLittleEndian, stream, wi[i]);
-}
-
-void LightPhoton::load(bool isLittleEndian, std::basic_istream<char> &stream)
-{
-	// BasicColorPhoton
-	BasicColorPhoton::load(isLittleEndian, stream);
-
-	// Vector wi
-	for (u_int i = 0; i < 3; ++i)
-		wi[i] = osReadLittleEndianFloat(isLittleEndian, stream);
-}
-
-void RadiancePhoton::save(bool isLittleEndian, std::basic_ostream<char> &stream) const
-{
-	// BasicColorPhoton
-	BasicColorPhoton::save(isLittleEndian, stream);
-
-	// Normal n
-	for (u_int i = 0; i < 3; ++i)
-		osWriteLittleEndianFloat(isLittleEndian, stream, n[i]);
-}
-
-void RadiancePhoton::load(bool isLittleEndian, std::basic_istream<char> &stream)
-{
-	// BasicColorPhoton
-	BasicColorPhoton::load(isLittleEndian, stream);
-
-	// Normal n
-	for (u_int i = 0; i < 3; ++i)
-		n[i] = osReadLittleEndianFloat(isLittleEndian, stream);
-}
-
 SWCSpectrum RadiancePhotonMap::LPhoton(const SpectrumWavelengths &sw,
 	const Intersection& isect, const Vector& wo,
 	const BxDFType bxdfType) const 
@@ -328,364 +267,923 @@ static bool unsuccessful(u_int needed, u_int found, u_int shot)
 	return (found < needed && (found == 0 || found < shot / 1024));
 }
 
-void PhotonMapPreprocess(const RandomGenerator &rng, const Scene &scene, 
-	const string *mapFileName, const BxDFType photonBxdfType,
-	const BxDFType radianceBxdfType, u_int nDirectPhotons,
-	u_int nRadiancePhotons, RadiancePhotonMap *radianceMap,
-	u_int nIndirectPhotons, LightPhotonMap *indirectMap,
-	u_int nCausticPhotons, LightPhotonMap *causticMap,
-	u_int maxDepth)
+// Photons are shot by batches of consecutive paths and each batch is added
+// to the maps as a whole, so that the number of paths of each map is exact
+// whatever the order in which the threads complete their batches
+#define PHOTON_BATCH_SIZE 256U
+
+// Photons stored by a batch of paths or by the whole shooting
+struct ShotPhotons {
+	void Clear() {
+		directPhotons.clear();
+		causticPhotons.clear();
+		indirectPhotons.clear();
+		radiancePhotons.clear();
+		rpReflectances.clear();
+		rpTransmittances.clear();
+	}
+
+	vector<LightPhoton> directPhotons;
+	vector<LightPhoton> causticPhotons;
+	vector<LightPhoton> indirectPhotons;
+	vector<RadiancePhoton> radiancePhotons;
+	// Reflectance and transmittance at each radiance photon
+	vector<SWCSpectrum> rpReflectances;
+	vector<SWCSpectrum> rpTransmittances;
+};
+
+class PhotonShooter {
+public:
+	PhotonShooter(const Scene &s, BxDFType pType, BxDFType rType,
+		u_int nDirect, u_int nRadiance, u_int nIndirect,
+		u_int nCaustic, u_int depth) : scene(s), photonBxdfType(pType),
+		radianceBxdfType(rType), nDirectPhotons(nDirect),
+		nRadiancePhotons(nRadiance), nIndirectPhotons(nIndirect),
+		nCausticPhotons(nCaustic), maxDepth(depth),
+		targetPhotons(nCaustic + nIndirect), nextPath(0), nShot(0),
+		nDirectPaths(0), nCausticPaths(0), nIndirectPaths(0),
+		directDone(nDirect == 0 || nRadiance == 0),
+		causticDone(nCaustic == 0), indirectDone(nIndirect == 0),
+		radianceDone(nRadiance == 0), failed(false) {
+		photons.directPhotons.reserve(nDirectPhotons);
+		photons.causticPhotons.reserve(nCausticPhotons);
+		photons.indirectPhotons.reserve(nIndirectPhotons);
+		photons.radiancePhotons.reserve(nRadiancePhotons);
+		photons.rpReflectances.reserve(nRadiancePhotons);
+		photons.rpTransmittances.reserve(nRadiancePhotons);
+
+		// Compute light power CDF for photon shooting
+		const u_int nLights = scene.lights.size();
+		float *lightPower = new float[nLights];
+		for (u_int i = 0; i < nLights; ++i)
+			lightPower[i] = scene.lights[i]->Power(scene);
+		lightCDF = new Distribution1D(lightPower, nLights);
+		delete[] lightPower;
+	}
+	~PhotonShooter() { delete lightCDF; }
+
+	// Shoots photons until all maps are filled, returns false if the
+	// shooting failed or was interrupted
+	bool Shoot(const RandomGenerator &rng, u_int threadCount);
+	// Computes the exitance at the radiance photons
+	void ComputeRadiance(const LightPhotonMap *directMap,
+		const LightPhotonMap *indirectMap,
+		const LightPhotonMap *causticMap, u_int threadCount);
+
+	const Scene &scene;
+	const BxDFType photonBxdfType, radianceBxdfType;
+	const u_int nDirectPhotons, nRadiancePhotons, nIndirectPhotons;
+	// Set to 0 when the caustic map is disabled
+	u_int nCausticPhotons;
+	const u_int maxDepth, targetPhotons;
+
+	ShotPhotons photons;
+	// Number of paths which contributed to each map
+	u_int nDirectPaths, nCausticPaths, nIndirectPaths;
+
+private:
+	void Work(unsigned long seed);
+	// Traces path number nPath and stores its photons in batch
+	void TracePath(u_int nPath, Sample &sample,
+		bool storeDirect, bool storeCaustic, bool storeIndirect,
+		bool storeRadiance, ShotPhotons &batch) const;
+	// Adds the photons of a batch to the maps which aren't full yet
+	void Commit(const ShotPhotons &batch, u_int nPaths);
+	void ComputeRadianceRange(const LightPhotonMap *directMap,
+		const LightPhotonMap *indirectMap,
+		const LightPhotonMap *causticMap, u_int start, u_int step);
+
+	Distribution1D *lightCDF;
+
+	// The following members are protected by mutex
+	boost::mutex mutex;
+	u_int nextPath, nShot;
+	bool directDone, causticDone, indirectDone, radianceDone, failed;
+	boost::xtime lastUpdateTime;
+};
+
+bool PhotonShooter::Shoot(const RandomGenerator &rng, u_int threadCount)
 {
-	if (scene.lights.size() == 0)
-		return;
+	boost::xtime_get(&lastUpdateTime, boost::TIME_UTC_);
 
-	std::stringstream ss;
+	boost::thread_group threads;
+	for (u_int i = 0; i < threadCount; ++i)
+		threads.create_thread(boost::bind(&PhotonShooter::Work, this,
+			rng.uintValue()));
+	threads.join_all();
 
-	// Dade - try to read the photon maps from file
-	if (mapFileName) {
-		// Dade - check if the maps file exists
-		std::ifstream ifs(mapFileName->c_str(), std::ios_base::in | std::ios_base::binary);
-
-		if (ifs.good()) {
-			LOG( LUX_INFO,LUX_NOERROR) << "Found photon maps file: " << *mapFileName;
-
-			bool isLittleEndian = osIsLittleEndian();
-
-			bool ok = true; // flag indicating whether all is ok or not
-
-			// Dade - read the settings
-			int storedPhotonBxdfType;
-			int storedRadianceBxdfType;
-			u_int storedNDirectPhotons;
-			u_int storedNRadiancePhotons;
-			u_int storedNIndirectPhotons;
-			u_int storedNCausticPhotons;
-			storedPhotonBxdfType = osReadLittleEndianInt(isLittleEndian, ifs);
-			storedRadianceBxdfType = osReadLittleEndianInt(isLittleEndian, ifs);
-			storedNDirectPhotons = osReadLittleEndianUInt(isLittleEndian, ifs);
-			storedNRadiancePhotons = osReadLittleEndianUInt(isLittleEndian, ifs);
-			storedNIndirectPhotons = osReadLittleEndianUInt(isLittleEndian, ifs);
-			storedNCausticPhotons = osReadLittleEndianUInt(isLittleEndian, ifs);
-			if (storedPhotonBxdfType != photonBxdfType ||
-				storedRadianceBxdfType != radianceBxdfType ||
-				storedNDirectPhotons != nDirectPhotons ||
-				storedNRadiancePhotons != nRadiancePhotons ||
-				storedNIndirectPhotons != nIndirectPhotons ||
-				storedNCausticPhotons != nCausticPhotons) {
-				LOG( LUX_INFO,LUX_NOERROR)<< "Some photon map settings changed, rebuilding photon maps...";
-				ok = false;
-			}
-			if (ok) {
-				//TODO should compare a scene hash or something
-				u_int storedNLights;
-				storedNLights = osReadLittleEndianUInt(isLittleEndian, ifs);
-				if (storedNLights != scene.lights.size() ) {
-					LOG( LUX_INFO,LUX_NOERROR)<< "Scene changed, rebuilding photon maps...";
-					ok = false;
-				}
-			}
+	return !failed && !scene.terminated;
+}
 
-			// Dade - read the data
-			if (ok && nRadiancePhotons) {
-				LOG( LUX_INFO,LUX_NOERROR)<< "Reading radiance photon map...";
-				RadiancePhotonMap::load(ifs, radianceMap);
-				LOG(LUX_INFO,LUX_NOERROR) << "Read " << radianceMap->getPhotonCount() << " radiance photons";
+void PhotonShooter::Work(unsigned long seed)
+{
+	RandomGenerator rng(seed);
+	Sample sample;
+	sample.rng = &rng;
+	sample.camera = scene.camera()->Clone();
+	sample.realTime = sample.camera->GetTime(.5f); //FIXME sample it
+	sample.camera->SampleMotion(sample.realTime);
 
-				if (!ifs.good()) {
-					LOG( LUX_INFO,LUX_NOERROR)<< "Failed to read all photon maps";
-					ok = false;
-				}
-			}
-			if (ok && nIndirectPhotons) {
-				LOG( LUX_INFO,LUX_NOERROR)<< "Reading indirect photon map...";
-				LightPhotonMap::load(ifs, indirectMap);
-				LOG(LUX_INFO,LUX_NOERROR) << "Read " << indirectMap->getPhotonCount() << " light photons";
-
-				if (!ifs.good()) {
-					LOG( LUX_INFO,LUX_NOERROR)<< "Failed to read all photon maps";
-					ok = false;
+	ShotPhotons batch;
+	while (true) {
+		u_int start;
+		bool storeDirect, storeCaustic, storeIndirect, storeRadiance;
+		{
+			boost::mutex::scoped_lock lock(mutex);
+			if ((radianceDone && directDone && causticDone &&
+				indirectDone) || failed || scene.terminated)
+				return;
+			start = nextPath;
+			nextPath += PHOTON_BATCH_SIZE;
+			storeDirect = !directDone;
+			storeCaustic = !causticDone;
+			storeIndirect = !indirectDone;
+			storeRadiance = !radianceDone;
+		}
+
+		for (u_int i = 1; i <= PHOTON_BATCH_SIZE; ++i) {
+			TracePath(start + i, sample, storeDirect, storeCaustic,
+				storeIndirect, storeRadiance, batch);
+			sample.arena.FreeAll();
+		}
+		if (scene.terminated)
+			return;
+
+		Commit(batch, PHOTON_BATCH_SIZE);
+		batch.Clear();
+	}
+}
+
+void PhotonShooter::TracePath(u_int nPath, Sample &sample,
+	bool storeDirect, bool storeCaustic, bool storeIndirect,
+	bool storeRadiance, ShotPhotons &batch) const
+{
+	const RandomGenerator &rng(*sample.rng);
+	SpectrumWavelengths &sw(sample.swl);
+
+	// Sample the wavelengths
+	sw.Sample(RadicalInverse(nPath, 2));
+
+	// Trace a photon path and store contribution
+	// Choose 6D sample values for photon
+	float u[6];
+	u[0] = RadicalInverse(nPath, 3);
+	u[1] = RadicalInverse(nPath, 5);
+	u[2] = RadicalInverse(nPath, 7);
+	u[3] = RadicalInverse(nPath, 11);
+	u[4] = RadicalInverse(nPath, 13);
+	u[5] = RadicalInverse(nPath, 17);
+
+	// Choose light to shoot photon from
+	float lightPdf;
+	float uln = RadicalInverse(nPath, 19);
+	u_int lightNum = lightCDF->SampleDiscrete(uln, &lightPdf);
+	const Light *light = scene.lights[lightNum].get();
+
+	// Generate _photonRay_ from light source and initialize _alpha_
+	BSDF *bsdf;
+	float pdf;
+	SWCSpectrum alpha;
+	if (!light->SampleL(scene, sample, u[0], u[1], u[2],
+		&bsdf, &pdf, &alpha))
+		return;
+	Ray photonRay;
+	photonRay.o = bsdf->dgShading.p;
+	float pdf2;
+	SWCSpectrum alpha2;
+	if (!bsdf->SampleF(sw, Vector(bsdf->dgShading.nn), &photonRay.d,
+		u[3], u[4], u[5], &alpha2, &pdf2))
+		return;
+	alpha *= alpha2;
+	alpha /= lightPdf;
+
+	if (alpha.Black())
+		return;
+
+	// Follow photon path through scene and record intersections
+	bool specularPath = false, directPhoton = true;
+	Intersection photonIsect;
+	const Volume *volume = NULL; //FIXME: try to get volume from light
+	BSDF *photonBSDF;
+	u_int nIntersections = 0;
+	while (scene.Intersect(sample, volume, false,
+		photonRay, 1.f, &photonIsect, &photonBSDF,
+		NULL, NULL, &alpha)) {
+		++nIntersections;
+
+		// Handle photon/surface intersection
+		Vector wo = -photonRay.d;
+
+		if (photonBSDF->NumComponents(photonBxdfType) > 0) {
+			// Deposit photon at surface
+			LightPhoton photon(sw, photonIsect.dg.p, alpha, wo);
+
+			if (directPhoton) {
+				// Deposit direct photon
+				if (storeDirect)
+					batch.directPhotons.push_back(photon);
+			} else {
+				// Deposit either caustic or indirect photon
+				if (specularPath) {
+					// Process caustic photon intersection
+					if (storeCaustic)
+						batch.causticPhotons.push_back(photon);
+				} else {
+					// Process indirect lighting photon intersection
+					if (storeIndirect)
+						batch.indirectPhotons.push_back(photon);
 				}
 			}
-			if (ok && nCausticPhotons) {
-				LOG( LUX_INFO,LUX_NOERROR)<< "Reading caustic photon map...";
-				LightPhotonMap::load(ifs, causticMap);
-				LOG(LUX_INFO,LUX_NOERROR) << "Read " << causticMap->getPhotonCount() << " light photons";
-
-				if (!ifs.good()) {
-					LOG( LUX_INFO,LUX_NOERROR)<< "Failed to read all photon maps";
-					ok = false;
+
+			if (storeRadiance &&
+				(photonBSDF->NumComponents(radianceBxdfType) > 0) &&
+				(rng.floatValue() < 0.125f)) {
+				SWCSpectrum rho_t =
+					photonBSDF->rho(sw, BxDFType(radianceBxdfType & BSDF_ALL_TRANSMISSION));
+				SWCSpectrum rho_r =
+					photonBSDF->rho(sw, BxDFType(radianceBxdfType & BSDF_ALL_REFLECTION));
+
+				if(!rho_t.Black() || !rho_r.Black()) {
+					// Store data for radiance photon
+					Normal n = photonIsect.dg.nn;
+					if (Dot(n, photonRay.d) > 0.f)
+						n = -n;
+					batch.radiancePhotons.push_back(RadiancePhoton(sw, photonIsect.dg.p, n));
+
+					batch.rpReflectances.push_back(rho_r);
+					batch.rpTransmittances.push_back(rho_t);
 				}
 			}
-			
-			// Close file
-			ifs.close();
+		}
 
-			// Return if all is ok
-			if (ok)
-				return;
+		// Sample new photon ray direction
+		Vector wi;
+		float pdfo;
+		BxDFType flags;
+		// Get random numbers for sampling outgoing photon direction
+		float u1, u2, u3;
+		if (nIntersections == 1) {
+			u1 = RadicalInverse(nPath, 23);
+			u2 = RadicalInverse(nPath, 29);
+			u3 = RadicalInverse(nPath, 31);
 		} else {
-			LOG( LUX_INFO,LUX_NOERROR)<< "Photon maps file doesn't exist yet";
-			ifs.close();
+			u1 = rng.floatValue();
+			u2 = rng.floatValue();
+			u3 = rng.floatValue();
 		}
+
+		// Compute new photon weight and possibly terminate with RR
+		SWCSpectrum fr;
+		if (!photonBSDF->SampleF(sw, wo, &wi, u1, u2, u3, &fr, &pdfo, BSDF_ALL, &flags))
+			break;
+		SWCSpectrum anew = fr;
+		float continueProb = min(1.f, anew.Filter(sw));
+		if (nIntersections > maxDepth || rng.floatValue() > continueProb)
+			break;
+		alpha *= anew / continueProb;
+		const bool passThrough = flags == (BSDF_TRANSMISSION | BSDF_SPECULAR) &&
+			photonBSDF->Pdf(sw, wo, wi, BxDFType(BSDF_TRANSMISSION | BSDF_SPECULAR)) > 0.f;
+		if (!passThrough) {
+			specularPath = (directPhoton || specularPath) &&
+				((flags & BSDF_SPECULAR) != 0 || pdfo > 100.f);
+			directPhoton = false;
+		}
+		photonRay = Ray(photonIsect.dg.p, wi);
+		volume = photonBSDF->GetVolume(photonRay.d);
 	}
+}
 
-	// Dade - check if have to build the radiancemap
-	bool computeRadianceMap = (nRadiancePhotons > 0);
+void PhotonShooter::Commit(const ShotPhotons &batch, u_int nPaths)
+{
+	boost::mutex::scoped_lock lock(mutex);
+	if (failed)
+		return;
 
-	// Dade - shoot photons
-	const u_int targetPhotons = nCausticPhotons + nIndirectPhotons;
-	LOG(LUX_INFO,LUX_NOERROR) << "Shooting photons (target: " << targetPhotons << ")...";
+	nShot += nPaths;
+	// The maps may end up with a few more photons than requested since
+	// batches are never split
+	if (!directDone) {
+		photons.directPhotons.insert(photons.directPhotons.end(),
+			batch.directPhotons.begin(), batch.directPhotons.end());
+		nDirectPaths += nPaths;
+		directDone = photons.directPhotons.size() >= nDirectPhotons;
+	}
+	if (!causticDone) {
+		photons.causticPhotons.insert(photons.causticPhotons.end(),
+			batch.causticPhotons.begin(), batch.causticPhotons.end());
+		nCausticPaths += nPaths;
+		causticDone = photons.causticPhotons.size() >= nCausticPhotons;
+	}
+	if (!indirectDone) {
+		photons.indirectPhotons.insert(photons.indirectPhotons.end(),
+			batch.indirectPhotons.begin(), batch.indirectPhotons.end());
+		nIndirectPaths += nPaths;
+		indirectDone = photons.indirectPhotons.size() >= nIndirectPhotons;
+	}
+	if (!radianceDone) {
+		// Radiance photons don't depend on the number of paths
+		// so they are kept to the exact count
+		const u_int n = min<u_int>(batch.radiancePhotons.size(),
+			nRadiancePhotons - photons.radiancePhotons.size());
+		photons.radiancePhotons.insert(photons.radiancePhotons.end(),
+			batch.radiancePhotons.begin(), batch.radiancePhotons.begin() + n);
+		photons.rpReflectances.insert(photons.rpReflectances.end(),
+			batch.rpReflectances.begin(), batch.rpReflectances.begin() + n);
+		photons.rpTransmittances.insert(photons.rpTransmittances.end(),
+			batch.rpTransmittances.begin(), batch.rpTransmittances.begin() + n);
+		radianceDone = photons.radiancePhotons.size() == nRadiancePhotons;
+	}
 
-	vector<LightPhoton> directPhotons;
-	directPhotons.reserve(nDirectPhotons);
-	bool directDone = (nDirectPhotons == 0);
+	// Give up if we're not storing enough photons
+	if (nShot > max(500000U, targetPhotons * 10)) {
+		if (indirectDone && !causticDone &&
+			unsuccessful(nCausticPhotons, photons.causticPhotons.size(), nShot)) {
+			// Dade - disable castic photon map: we are unable to store
+			// enough photons
+			LOG( LUX_WARNING,LUX_CONSISTENCY)<< "Unable to store enough photons in the caustic photonmap. Giving up and disabling the map.";
+
+			photons.causticPhotons.clear();
+			causticDone = true;
+			nCausticPhotons = 0;
+		}
 
-	vector<LightPhoton> causticPhotons;
-	causticPhotons.reserve(nCausticPhotons);
-	bool causticDone = (nCausticPhotons == 0);
+		if (!indirectDone &&
+			unsuccessful(nIndirectPhotons, photons.indirectPhotons.size(), nShot)) {
+			LOG( LUX_ERROR,LUX_CONSISTENCY)<< "Unable to store enough photons in the indirect photonmap. Unable to render the image.";
+			failed = true;
+			return;
+		}
+	}
 
-	vector<LightPhoton> indirectPhotons;
-	indirectPhotons.reserve(nIndirectPhotons);
-	bool indirectDone = (nIndirectPhotons == 0);
+	// Dade - print some progress information
+	boost::xtime currentTime;
+	boost::xtime_get(&currentTime, boost::TIME_UTC_);
+	if (currentTime.sec - lastUpdateTime.sec > 5) {
+		std::stringstream ss;
+		ss << "Photon shooting progress: Direct[" << photons.directPhotons.size();
+		if (nDirectPhotons > 0)
+			ss << " (" << (100 * photons.directPhotons.size() / nDirectPhotons) << "% limit)";
+		else
+			ss << " (100% limit)";
+		ss << "] Caustic[" << photons.causticPhotons.size();
+		if (nCausticPhotons > 0)
+			ss << " (" << (100 * photons.causticPhotons.size() / nCausticPhotons) << "%)";
+		else
+			ss << " (100%)";
+		ss << "] Indirect[" << photons.indirectPhotons.size();
+		if (nIndirectPhotons > 0)
+			ss << " (" << (100 * photons.indirectPhotons.size() / nIndirectPhotons) << "%)";
+		else
+			ss << " (100%)";
+		ss << "] Radiance[" << photons.radiancePhotons.size();
+		if (nRadiancePhotons > 0)
+			ss << " (" << (100 * photons.radiancePhotons.size() / nRadiancePhotons) << "% limit)";
+		else
+			ss << " (100% limit)";
+		ss << "]";
+		LOG(LUX_INFO,LUX_NOERROR)<< ss.str().c_str();
 
-	vector<RadiancePhoton> radiancePhotons;
-	radiancePhotons.reserve(nRadiancePhotons);
-	bool radianceDone = (nRadiancePhotons == 0);
+		lastUpdateTime = currentTime;
+	}
+}
 
-	// Dade - initialize SpectrumWavelengths
-	Sample sample;
-	sample.rng = &rng;
-	SpectrumWavelengths &sw(sample.swl);
-	sample.camera = scene.camera()->Clone();
-	sample.realTime = sample.camera->GetTime(.5f); //FIXME sample it
-	sample.camera->SampleMotion(sample.realTime);
+void PhotonShooter::ComputeRadiance(const LightPhotonMap *directMap,
+	const LightPhotonMap *indirectMap, const LightPhotonMap *causticMap,
+	u_int threadCount)
+{
+	boost::xtime_get(&lastUpdateTime, boost::TIME_UTC_);
 
-	// Compute light power CDF for photon shooting
-	u_int nLights = scene.lights.size();
-	float *lightPower = new float[nLights];
-	for (u_int i = 0; i < nLights; ++i)
-		lightPower[i] = scene.lights[i]->Power(scene);
-	Distribution1D lightCDF(lightPower, nLights);
-	delete[] lightPower;
+	threadCount = min<u_int>(threadCount, photons.radiancePhotons.size());
+	if (threadCount <= 1) {
+		ComputeRadianceRange(directMap, indirectMap, causticMap, 0, 1);
+		return;
+	}
+	boost::thread_group threads;
+	for (u_int i = 0; i < threadCount; ++i)
+		threads.create_thread(boost::bind(&PhotonShooter::ComputeRadianceRange,
+			this, directMap, indirectMap, causticMap, i, threadCount));
+	threads.join_all();
+}
 
-	// Declare radiance photon reflectance arrays
-	vector<SWCSpectrum> rpReflectances;
-	rpReflectances.reserve(nRadiancePhotons);
-	vector<SWCSpectrum> rpTransmittances;
-	rpTransmittances.reserve(nRadiancePhotons);
+void PhotonShooter::ComputeRadianceRange(const LightPhotonMap *directMap,
+	const LightPhotonMap *indirectMap, const LightPhotonMap *causticMap,
+	u_int start, u_int step)
+{
+	SpectrumWavelengths sw;
+	const u_int nPhotons = photons.radiancePhotons.size();
+	for (u_int i = start; i < nPhotons; i += step) {
+		// Dade - print some progress info, the first thread is
+		// representative of the others
+		if (start == 0) {
+			boost::xtime currentTime;
+			boost::xtime_get(&currentTime, boost::TIME_UTC_);
+			if (currentTime.sec - lastUpdateTime.sec > 5) {
+				LOG(LUX_INFO,LUX_NOERROR) << "Radiance photon map computation progress: " << i << " (" << (100 * i / nPhotons) << "%)";
 
-	boost::xtime photonShootingStartTime;
-	boost::xtime lastUpdateTime;
-	boost::xtime_get(&photonShootingStartTime, boost::TIME_UTC_);
-	boost::xtime_get(&lastUpdateTime, boost::TIME_UTC_);
-	u_int nshot = 0;
-	while ((!radianceDone || !directDone || !causticDone || !indirectDone) && !scene.terminated) {
-		// Dade - print some progress information
-		boost::xtime currentTime;
-		boost::xtime_get(&currentTime, boost::TIME_UTC_);
-		if (currentTime.sec - lastUpdateTime.sec > 5) {
-			ss.str("");
-			ss << "Photon shooting progress: Direct[" << directPhotons.size();
-			if (nDirectPhotons > 0)
-				ss << " (" << (100 * directPhotons.size() / nDirectPhotons) << "% limit)";
-			else
-				ss << " (100% limit)";
-			ss << "] Caustic[" << causticPhotons.size();
-			if (nCausticPhotons > 0)
-				ss << " (" << (100 * causticPhotons.size() / nCausticPhotons) << "%)";
-			else
-				ss << " (100%)";
-			ss << "] Indirect[" << indirectPhotons.size();
-			if (nIndirectPhotons > 0)
-				ss << " (" << (100 * indirectPhotons.size() / nIndirectPhotons) << "%)";
-			else
-				ss << " (100%)";
-			ss << "] Radiance[" << radiancePhotons.size();
-			if (nRadiancePhotons > 0)
-				ss << " (" << (100 * radiancePhotons.size() / nRadiancePhotons) << "% limit)";
-			else
-				ss << " (100% limit)";
-			ss << "]";
-			LOG(LUX_INFO,LUX_NOERROR)<< ss.str().c_str();
-
-			lastUpdateTime = currentTime;
-		}
-		
-		++nshot;
-
-		// Give up if we're not storing enough photons
-		if (nshot > max(500000U, targetPhotons * 10)) {
-			if (indirectDone && unsuccessful(nCausticPhotons, causticPhotons.size(), nshot)) {
-				// Dade - disable castic photon map: we are unable to store
-				// enough photons
-				LOG( LUX_WARNING,LUX_CONSISTENCY)<< "Unable to store enough photons in the caustic photonmap. Giving up and disabling the map.";
-
-				causticPhotons.clear();
-				causticDone = true;
-				nCausticPhotons = 0;
+				lastUpdateTime = currentTime;
 			}
+		}
 
-			if (unsuccessful(nIndirectPhotons, indirectPhotons.size(), nshot)) {
-				LOG( LUX_ERROR,LUX_CONSISTENCY)<< "Unable to store enough photons in the indirect photonmap. Unable to render the image.";
-				return;
+		// Compute radiance for radiance photon _i_
+		RadiancePhoton &rp = photons.radiancePhotons[i];
+		const SWCSpectrum &rho_r = photons.rpReflectances[i];
+		const SWCSpectrum &rho_t = photons.rpTransmittances[i];
+		const Point& p = rp.p;
+		const Normal& n = rp.n;
+		SWCSpectrum alpha(0.f);
+		for (u_int j = 0; j < WAVELENGTH_SAMPLES; ++j)
+			sw.w[j] = rp.w[j];
+
+		if (!rho_r.Black()) {
+			SWCSpectrum E = directMap->EPhoton(sw, p, n);
+			E += indirectMap->EPhoton(sw, p, n);
+			E += causticMap->EPhoton(sw, p, n);
+
+			alpha += E * INV_PI * rho_r;
+		}
+
+		if (!rho_t.Black()) {
+			SWCSpectrum E = directMap->EPhoton(sw, p, -n);
+			E += indirectMap->EPhoton(sw, p, -n);
+			E += causticMap->EPhoton(sw, p, -n);
+
+			alpha += E * INV_PI * rho_t;
+		}
+
+		rp.alpha = alpha;
+	}
+}
+
+//------------------------------------------------------------------------------
+// Photon maps file
+// The maps are stored with the kd-tree arrays as raw memory, with the native
+// layout and aligned on 16 bytes, so that they can be used in place when
+// the file is memory mapped. The file starts with a key computed from the
+// lights, the primitives and the photon settings, each map is stored with
+// the photon counts it was built with so that the maps which are still
+// valid can be reused when some settings change.
+//------------------------------------------------------------------------------
+
+static const char photonMapsMagic[8] = { 'L', 'U', 'X', 'P', 'H', 'M', 'P', '\0' };
+static const u_int photonMapsVersion = 4;
+// Alignment of the arrays, relative to the start of the file
+#define PHOTON_MAPS_ALIGNMENT 16
+
+enum PhotonMapsSection {
+	PHOTON_MAPS_RADIANCE, PHOTON_MAPS_INDIRECT, PHOTON_MAPS_CAUSTIC,
+	PHOTON_MAPS_SECTION_COUNT
+};
+
+// Photon counts of the maps, the radiance map also depends on the counts
+// of the other maps
+struct PhotonMapsSettings {
+	u_int nDirectPhotons, nRadiancePhotons, nIndirectPhotons;
+	u_int nCausticPhotons;
+
+	u_int Count(u_int section) const {
+		switch (section) {
+			case PHOTON_MAPS_RADIANCE:
+				return 4;
+			default:
+				return 1;
+		}
+	}
+	u_int Get(u_int section, u_int i) const {
+		switch (section) {
+			case PHOTON_MAPS_RADIANCE: {
+				const u_int counts[] = { nRadiancePhotons,
+					nDirectPhotons, nIndirectPhotons,
+					nCausticPhotons };
+				return counts[i];
 			}
+			case PHOTON_MAPS_INDIRECT:
+				return nIndirectPhotons;
+			default:
+				return nCausticPhotons;
 		}
-		// Sample the wavelengths
-		sw.Sample(RadicalInverse(nshot, 2));
-
-		// Trace a photon path and store contribution
-		// Choose 6D sample values for photon
-		float u[6];
-		u[0] = RadicalInverse(nshot, 3);
-		u[1] = RadicalInverse(nshot, 5);
-		u[2] = RadicalInverse(nshot, 7);
-		u[3] = RadicalInverse(nshot, 11);
-		u[4] = RadicalInverse(nshot, 13);
-		u[5] = RadicalInverse(nshot, 17);
-
-		// Choose light to shoot photon from
-		float lightPdf;
-		float uln = RadicalInverse(nshot, 19);
-		u_int lightNum = lightCDF.SampleDiscrete(uln, &lightPdf);
-		const Light *light = scene.lights[lightNum].get();
-
-		// Generate _photonRay_ from light source and initialize _alpha_
-		BSDF *bsdf;
-		float pdf;
-		SWCSpectrum alpha;
-		if (!light->SampleL(scene, sample, u[0], u[1], u[2],
-			&bsdf, &pdf, &alpha))
-			continue;
-		Ray photonRay;
-		photonRay.o = bsdf->dgShading.p;
-		float pdf2;
-		SWCSpectrum alpha2;
-		if (!bsdf->SampleF(sw, Vector(bsdf->dgShading.nn), &photonRay.d,
-			u[3], u[4], u[5], &alpha2, &pdf2))
-			continue;
-		alpha *= alpha2;
-		alpha /= lightPdf;
-
-		if (!alpha.Black()) {
-			// Follow photon path through scene and record intersections
-			bool specularPath = false, directPhoton = true;
-			Intersection photonIsect;
-			const Volume *volume = NULL; //FIXME: try to get volume from light
-			BSDF *photonBSDF;
-			u_int nIntersections = 0;
-			while (scene.Intersect(sample, volume, false,
-				photonRay, 1.f, &photonIsect, &photonBSDF,
-				NULL, NULL, &alpha)) {
-				++nIntersections;
-
-				// Handle photon/surface intersection
-				Vector wo = -photonRay.d;
-
-				if (photonBSDF->NumComponents(photonBxdfType) > 0) {
-					// Deposit photon at surface
-					LightPhoton photon(sw, photonIsect.dg.p, alpha, wo);
-
-					if (directPhoton) {
-						if (computeRadianceMap && (!directDone)) {
-							// Deposit direct photon
-							directPhotons.push_back(photon);
-
-							// Dade - check if we have enough direct photons
-							if (directPhotons.size() == nDirectPhotons)
-								directDone = true;
-						}
-					} else {
-						// Deposit either caustic or indirect photon
-						if (specularPath) {
-							// Process caustic photon intersection
-							if (!causticDone) {
-								causticPhotons.push_back(photon);
-
-								if (causticPhotons.size() == nCausticPhotons) {
-									causticDone = true;
-									causticMap->init(nshot, causticPhotons);
-								}
-							}
-						} else {
-							// Process indirect lighting photon intersection
-							if (!indirectDone) {
-								indirectPhotons.push_back(photon);
-
-								if (indirectPhotons.size() == nIndirectPhotons) {
-									indirectDone = true;
-									indirectMap->init(nshot, indirectPhotons);
-								}
-							}
-						}
-					}
+	}
+};
 
-					if (computeRadianceMap && 
-						(!radianceDone) && 
-						(photonBSDF->NumComponents(radianceBxdfType) > 0) && 
-						(rng.floatValue() < 0.125f)) {
-						SWCSpectrum rho_t =
-							photonBSDF->rho(sw, BxDFType(radianceBxdfType & BSDF_ALL_TRANSMISSION));
-						SWCSpectrum rho_r = 
-							photonBSDF->rho(sw, BxDFType(radianceBxdfType & BSDF_ALL_REFLECTION));
-
-						if(!rho_t.Black() || !rho_r.Black()) {
-							// Store data for radiance photon
-							Normal n = photonIsect.dg.nn;
-							if (Dot(n, photonRay.d) > 0.f)
-								n = -n;
-							radiancePhotons.push_back(RadiancePhoton(sw, photonIsect.dg.p, n));
-
-							rpReflectances.push_back(rho_r);
-							rpTransmittances.push_back(rho_t);
-							
-							if (radiancePhotons.size() == nRadiancePhotons)
-								radianceDone = true;
-						}
-					}
-				}
+// Material of a scene primitive, NULL when it is only defined by the
+// instanced primitives
+static const Material *PrimitiveMaterial(const Primitive *prim)
+{
+	const AreaLightPrimitive *areaLight =
+		dynamic_cast<const AreaLightPrimitive *>(prim);
+	if (areaLight)
+		prim = areaLight->GetPrimitive().get();
+	const Shape *shape = dynamic_cast<const Shape *>(prim);
+	if (shape)
+		return shape->GetMaterial();
+	const InstancePrimitive *instance =
+		dynamic_cast<const InstancePrimitive *>(prim);
+	if (instance)
+		return instance->GetMaterial();
+	const MotionPrimitive *motion =
+		dynamic_cast<const MotionPrimitive *>(prim);
+	if (motion)
+		return motion->GetMaterial();
+	return NULL;
+}
 
-				// Sample new photon ray direction
-				Vector wi;
-				float pdfo;
-				BxDFType flags;
-				// Get random numbers for sampling outgoing photon direction
-				float u1, u2, u3;
-				if (nIntersections == 1) {
-					u1 = RadicalInverse(nshot, 23);
-					u2 = RadicalInverse(nshot, 29);
-					u3 = RadicalInverse(nshot, 31);
-				} else {
-					u1 = rng.floatValue();
-					u2 = rng.floatValue();
-					u3 = rng.floatValue();
-				}
+// Shape of a scene primitive, NULL for instances and motion primitives
+static const Shape *PrimitiveShape(const Primitive *prim)
+{
+	const AreaLightPrimitive *areaLight =
+		dynamic_cast<const AreaLightPrimitive *>(prim);
+	if (areaLight)
+		prim = areaLight->GetPrimitive().get();
+	return dynamic_cast<const Shape *>(prim);
+}
 
-				// Compute new photon weight and possibly terminate with RR
-				SWCSpectrum fr;
-				if (!photonBSDF->SampleF(sw, wo, &wi, u1, u2, u3, &fr, &pdfo, BSDF_ALL, &flags))
-					break;
-				SWCSpectrum anew = fr;
-				float continueProb = min(1.f, anew.Filter(sw));
-				if (nIntersections > maxDepth || rng.floatValue() > continueProb)
-					break;
-				alpha *= anew / continueProb;
-				const bool passThrough = flags == (BSDF_TRANSMISSION | BSDF_SPECULAR) &&
-					photonBSDF->Pdf(sw, wo, wi, BxDFType(BSDF_TRANSMISSION | BSDF_SPECULAR)) > 0.f;
-				if (!passThrough) {
-					specularPath = (directPhoton || specularPath) &&
-						((flags & BSDF_SPECULAR) != 0 || pdfo > 100.f);
-					directPhoton = false;
-				}
-				photonRay = Ray(photonIsect.dg.p, wi);
-				volume = photonBSDF->GetVolume(photonRay.d);
+static void HashDigest(tigerhash &hash, const tigerhash::digest_type &digest)
+{
+	hash.update(reinterpret_cast<const char *>(&digest[0]), digest.size());
+}
+
+// The key covers the parameters and transform of each light and shape,
+// the bounds and material parameters of each primitive and the texture,
+// named material, named volume and instance definitions, so that moved
+// or edited objects invalidate the maps. It doesn't cover the contents
+// of files referenced by name (image maps, PLY meshes...), the transform
+// of instanced or motion primitives when it keeps their bounds, nor the
+// volume regions. The camera is not part of it, so that the maps of a walkthrough
+// animation are built once
+static tigerhash::digest_type PhotonMapsKey(const Scene &scene,
+	BxDFType photonBxdfType, BxDFType radianceBxdfType, u_int maxDepth)
+{
+	tigerhash hash;
+	const u_int settings[] = { photonBxdfType, radianceBxdfType, maxDepth,
+		static_cast<u_int>(scene.lights.size()),
+		static_cast<u_int>(scene.primitives.size()) };
+	hash.update(reinterpret_cast<const char *>(settings), sizeof(settings));
+	HashDigest(hash, scene.definitionsDigest);
+	for (u_int i = 0; i < scene.lights.size(); ++i) {
+		const Light &light(*(scene.lights[i]));
+		const float power = light.Power(scene);
+		hash.update(reinterpret_cast<const char *>(&power), sizeof(power));
+		hash.update(reinterpret_cast<const char *>(&light.group),
+			sizeof(light.group));
+		hash.update(reinterpret_cast<const char *>(light.GetTransform().m.m),
+			sizeof(float) * 16);
+		HashDigest(hash, light.paramsDigest);
+	}
+	for (u_int i = 0; i < scene.primitives.size(); ++i) {
+		const Primitive *prim = scene.primitives[i].get();
+		const BBox bound(prim->WorldBound());
+		const float bounds[] = { bound.pMin.x, bound.pMin.y, bound.pMin.z,
+			bound.pMax.x, bound.pMax.y, bound.pMax.z };
+		hash.update(reinterpret_cast<const char *>(bounds), sizeof(bounds));
+		const Shape *shape = PrimitiveShape(prim);
+		if (shape) {
+			HashDigest(hash, shape->paramsDigest);
+			hash.update(reinterpret_cast<const char *>(shape->ObjectToWorld.m.m),
+				sizeof(float) * 16);
+			hash.update(reinterpret_cast<const char *>(&shape->reverseOrientation),
+				sizeof(shape->reverseOrientation));
+		}
+		const Material *material = PrimitiveMaterial(prim);
+		if (material)
+			HashDigest(hash, material->paramsDigest);
+	}
+	return hash.end_message();
+}
+
+class PhotonMapsWriter {
+public:
+	PhotonMapsWriter(const string &filename) : out(filename.c_str(),
+		std::ios::out | std::ios::binary | std::ios::trunc) { }
+
+	bool Good() { return out.is_open() && out.good(); }
+	void Close() { out.close(); }
+
+	void Write(const void *data, size_t size) {
+		out.write(static_cast<const char *>(data), size);
+	}
+	void WriteUInt(u_int value) { Write(&value, sizeof(value)); }
+	void Align() {
+		const size_t offset = static_cast<size_t>(out.tellp()) %
+			PHOTON_MAPS_ALIGNMENT;
+		if (offset > 0) {
+			const char padding[PHOTON_MAPS_ALIGNMENT] = { 0 };
+			Write(padding, PHOTON_MAPS_ALIGNMENT - offset);
+		}
+	}
+	template <class NodeData, class LookupProc> void WriteTree(
+		const KdTree<NodeData, LookupProc> *tree) {
+		const u_int nData = tree ? tree->getDataCount() : 0;
+		WriteUInt(nData);
+		WriteUInt(tree ? tree->getNodeCount() : 0);
+		if (nData == 0)
+			return;
+		Align();
+		Write(tree->getNodes(), sizeof(KdNode) * tree->getNodeCount());
+		Align();
+		Write(tree->getNodeData(), sizeof(NodeData) * nData);
+		for (u_int axis = 0; axis < 3; ++axis) {
+			Align();
+			Write(tree->getCoordinates(axis), sizeof(float) * (nData + 3));
+		}
+	}
+
+private:
+	std::ofstream out;
+};
+
+// Bounds checked cursor over the mapped file
+class PhotonMapsReader {
+public:
+	PhotonMapsReader(const char *data, size_t size) : start(data),
+		pos(data), end(data + size), ok(true) { }
+
+	bool Good() const { return ok; }
+
+	const char *Read(size_t size) {
+		if (!ok || size > static_cast<size_t>(end - pos)) {
+			ok = false;
+			return NULL;
+		}
+		const char *data = pos;
+		pos += size;
+		return data;
+	}
+	void Align() {
+		const size_t offset = (pos - start) % PHOTON_MAPS_ALIGNMENT;
+		if (offset > 0)
+			Read(PHOTON_MAPS_ALIGNMENT - offset);
+	}
+	u_int ReadUInt() {
+		u_int value = 0;
+		const char *data = Read(sizeof(value));
+		if (data)
+			memcpy(&value, data, sizeof(value));
+		return value;
+	}
+	// Returns the aligned array in place, NULL on error
+	template <class T> const T *ReadArray(u_int n) {
+		Align();
+		if (!ok || n > static_cast<size_t>(end - pos) / sizeof(T)) {
+			ok = false;
+			return NULL;
+		}
+		return reinterpret_cast<const T *>(Read(sizeof(T) * n));
+	}
+	// Returns a tree using the arrays in place, NULL if the tree is
+	// empty or on error
+	template <class NodeData, class LookupProc>
+	KdTree<NodeData, LookupProc> *ReadTree(
+		const boost::shared_ptr<void> &storage) {
+		const u_int nData = ReadUInt();
+		const u_int nNodes = ReadUInt();
+		if (!ok || nData == 0)
+			return NULL;
+		if (nNodes != KdTree<NodeData, LookupProc>::NodeCount(nData)) {
+			ok = false;
+			return NULL;
+		}
+		const KdNode *nodes = ReadArray<KdNode>(nNodes);
+		const NodeData *data = ReadArray<NodeData>(nData);
+		const float *x = ReadArray<float>(nData + 3);
+		const float *y = ReadArray<float>(nData + 3);
+		const float *z = ReadArray<float>(nData + 3);
+		if (!ok)
+			return NULL;
+		return new KdTree<NodeData, LookupProc>(nData, nNodes, nodes,
+			data, x, y, z, storage);
+	}
+
+private:
+	const char *start, *pos, *end;
+	bool ok;
+};
+
+// Header values which must match the ones of the reading architecture
+static void PhotonMapsHeader(u_int header[7])
+{
+	header[0] = photonMapsVersion;
+	header[1] = osIsLittleEndian() ? 1U : 0U;
+	header[2] = sizeof(float);
+	header[3] = WAVELENGTH_SAMPLES;
+	header[4] = sizeof(KdNode);
+	header[5] = sizeof(LightPhoton);
+	header[6] = sizeof(RadiancePhoton);
+}
+
+// Maps the photon maps file and initializes the maps which match the
+// settings, ready[section] is set for each of them
+static void ReadPhotonMaps(const string &filename,
+	const tigerhash::digest_type &key, const PhotonMapsSettings &settings,
+	RadiancePhotonMap *radianceMap, LightPhotonMap *indirectMap,
+	LightPhotonMap *causticMap, bool ready[PHOTON_MAPS_SECTION_COUNT])
+{
+	if (!boost::filesystem::exists(filename)) {
+		LOG( LUX_INFO,LUX_NOERROR)<< "Photon maps file doesn't exist yet";
+		return;
+	}
+
+	boost::shared_ptr<boost::iostreams::mapped_file_source> file(
+		new boost::iostreams::mapped_file_source());
+	try {
+		file->open(filename);
+	} catch (std::exception &e) {
+		LOG(LUX_WARNING, LUX_NOFILE) << "Unable to map photon maps file '" <<
+			filename << "': " << e.what();
+		return;
+	}
+	if (!file->is_open() || file->size() == 0) {
+		LOG(LUX_WARNING, LUX_NOFILE) << "Unable to map photon maps file '" <<
+			filename << "'";
+		return;
+	}
+	LOG( LUX_INFO,LUX_NOERROR) << "Found photon maps file: " << filename;
+
+	PhotonMapsReader reader(file->data(), file->size());
+	const char *magic = reader.Read(sizeof(photonMapsMagic));
+	u_int header[7], expectedHeader[7];
+	PhotonMapsHeader(expectedHeader);
+	bool headerOk = magic && !memcmp(magic, photonMapsMagic,
+		sizeof(photonMapsMagic));
+	for (u_int i = 0; i < 7; ++i) {
+		header[i] = reader.ReadUInt();
+		headerOk = headerOk && header[i] == expectedHeader[i];
+	}
+	if (!headerOk || !reader.Good()) {
+		LOG( LUX_INFO,LUX_NOERROR)<< "Photon maps file has an older format or was written on a different architecture, rebuilding photon maps...";
+		return;
+	}
+	const char *storedKey = reader.Read(key.size());
+	if (!storedKey || memcmp(storedKey, &key[0], key.size())) {
+		LOG( LUX_INFO,LUX_NOERROR)<< "Scene changed, rebuilding photon maps...";
+		return;
+	}
+
+	const u_int nSections = reader.ReadUInt();
+	for (u_int i = 0; i < nSections && reader.Good(); ++i) {
+		const u_int section = reader.ReadUInt();
+		if (section >= PHOTON_MAPS_SECTION_COUNT)
+			break;
+		bool match = true;
+		for (u_int j = 0; j < settings.Count(section); ++j)
+			match = (reader.ReadUInt() == settings.Get(section, j)) && match;
+		const u_int nPaths = reader.ReadUInt();
+		if (section == PHOTON_MAPS_RADIANCE) {
+			RadiancePhotonMap::Tree *tree =
+				reader.ReadTree<RadiancePhoton, NearPhotonProcess<RadiancePhoton> >(file);
+			if (!match || !radianceMap || ready[section] || !reader.Good()) {
+				delete tree;
+				continue;
+			}
+			if (tree) {
+				radianceMap->init(tree);
+				LOG(LUX_INFO,LUX_NOERROR) << "Read " << radianceMap->getPhotonCount() << " radiance photons";
 			}
+		} else {
+			LightPhotonMap *map = section == PHOTON_MAPS_INDIRECT ?
+				indirectMap : causticMap;
+			LightPhotonMap::Tree *tree =
+				reader.ReadTree<LightPhoton, NearSetPhotonProcess<LightPhoton> >(file);
+			if (!match || !map || ready[section] || !reader.Good()) {
+				delete tree;
+				continue;
+			}
+			// A map which couldn't be filled is stored empty and
+			// stays disabled
+			if (tree) {
+				map->init(nPaths, tree);
+				LOG(LUX_INFO,LUX_NOERROR) << "Read " << map->getPhotonCount() << (section == PHOTON_MAPS_INDIRECT ? " indirect" : " caustic") << " photons";
+			}
+		}
+		ready[section] = true;
+	}
+	if (!reader.Good())
+		LOG( LUX_WARNING,LUX_BADFILE)<< "Failed to read all photon maps";
+}
+
+static void WritePhotonMaps(const string &filename,
+	const tigerhash::digest_type &key, const PhotonMapsSettings &settings,
+	const RadiancePhotonMap *radianceMap, const LightPhotonMap *indirectMap,
+	const LightPhotonMap *causticMap)
+{
+	LOG(LUX_INFO,LUX_NOERROR)<< "Writing photon maps to '" << filename << "'...";
+
+	// The file is written aside and then replaces the previous one, which
+	// may still be mapped by the maps that have been reused
+	const string tmpFilename(filename + ".tmp");
+	PhotonMapsWriter writer(tmpFilename);
+	if (!writer.Good()) {
+		LOG(LUX_SEVERE,LUX_SYSTEM)<< "Cannot open file '" << tmpFilename << "' for writing photon maps";
+		return;
+	}
+
+	u_int header[7];
+	PhotonMapsHeader(header);
+	writer.Write(photonMapsMagic, sizeof(photonMapsMagic));
+	for (u_int i = 0; i < 7; ++i)
+		writer.WriteUInt(header[i]);
+	writer.Write(&key[0], key.size());
+
+	writer.WriteUInt(PHOTON_MAPS_SECTION_COUNT);
+	for (u_int section = 0; section < PHOTON_MAPS_SECTION_COUNT; ++section) {
+		writer.WriteUInt(section);
+		for (u_int j = 0; j < settings.Count(section); ++j)
+			writer.WriteUInt(settings.Get(section, j));
+		if (section == PHOTON_MAPS_RADIANCE) {
+			writer.WriteUInt(0);
+			writer.WriteTree(radianceMap ? radianceMap->getTree() : NULL);
+		} else {
+			const LightPhotonMap *map = section == PHOTON_MAPS_INDIRECT ?
+				indirectMap : causticMap;
+			writer.WriteUInt(map ? map->getPathCount() : 0);
+			writer.WriteTree(map ? map->getTree() : NULL);
 		}
+	}
+
+	const bool ok = writer.Good();
+	writer.Close();
+	boost::system::error_code ec;
+	if (ok)
+		boost::filesystem::rename(tmpFilename, filename, ec);
+	if (!ok || ec) {
+		LOG( LUX_SEVERE,LUX_SYSTEM) << "Error while writing photon maps to file '" << filename << "'";
+		boost::filesystem::remove(tmpFilename, ec);
+		return;
+	}
+
+	if (radianceMap && radianceMap->getTree())
+		LOG(LUX_INFO,LUX_NOERROR) << "Written " << radianceMap->getTree()->getDataCount() << " radiance photons";
+	if (indirectMap && indirectMap->getTree())
+		LOG(LUX_INFO,LUX_NOERROR) << "Written " << indirectMap->getTree()->getDataCount() << " indirect photons";
+	if (causticMap && causticMap->getTree())
+		LOG(LUX_INFO,LUX_NOERROR) << "Written " << causticMap->getTree()->getDataCount() << " caustic photons";
+}
 
-		sample.arena.FreeAll();
+void PhotonMapPreprocess(const RandomGenerator &rng, const Scene &scene, 
+	const string *mapFileName, const BxDFType photonBxdfType,
+	const BxDFType radianceBxdfType, u_int nDirectPhotons,
+	u_int nRadiancePhotons, RadiancePhotonMap *radianceMap,
+	u_int nIndirectPhotons, LightPhotonMap *indirectMap,
+	u_int nCausticPhotons, LightPhotonMap *causticMap,
+	u_int maxDepth)
+{
+	if (scene.lights.size() == 0)
+		return;
+
+	PhotonMapsSettings settings;
+	settings.nDirectPhotons = nDirectPhotons;
+	settings.nRadiancePhotons = nRadiancePhotons;
+	settings.nIndirectPhotons = nIndirectPhotons;
+	settings.nCausticPhotons = nCausticPhotons;
+	bool ready[PHOTON_MAPS_SECTION_COUNT];
+	ready[PHOTON_MAPS_RADIANCE] = (nRadiancePhotons == 0);
+	ready[PHOTON_MAPS_INDIRECT] = (nIndirectPhotons == 0);
+	ready[PHOTON_MAPS_CAUSTIC] = (nCausticPhotons == 0);
+
+	// Dade - try to read the photon maps from file
+	tigerhash::digest_type key;
+	if (mapFileName) {
+		key = PhotonMapsKey(scene, photonBxdfType, radianceBxdfType,
+			maxDepth);
+		ReadPhotonMaps(*mapFileName, key, settings, radianceMap,
+			indirectMap, causticMap, ready);
 	}
+	if (ready[PHOTON_MAPS_RADIANCE] && ready[PHOTON_MAPS_INDIRECT] &&
+		ready[PHOTON_MAPS_CAUSTIC])
+		return;
 
-	if (scene.terminated)
+	// Only shoot the photons of the maps which couldn't be reused, the
+	// direct photons are only needed to build the radiance map
+	if (ready[PHOTON_MAPS_RADIANCE]) {
+		nDirectPhotons = 0;
+		nRadiancePhotons = 0;
+	}
+	if (ready[PHOTON_MAPS_INDIRECT])
+		nIndirectPhotons = 0;
+	if (ready[PHOTON_MAPS_CAUSTIC])
+		nCausticPhotons = 0;
+
+	// Dade - check if have to build the radiancemap
+	bool computeRadianceMap = (nRadiancePhotons > 0);
+
+	const u_int threadCount = max(1U, boost::thread::hardware_concurrency());
+
+	// Dade - shoot photons
+	PhotonShooter shooter(scene, photonBxdfType, radianceBxdfType,
+		nDirectPhotons, nRadiancePhotons, nIndirectPhotons,
+		nCausticPhotons, maxDepth);
+	LOG(LUX_INFO,LUX_NOERROR) << "Shooting photons (target: " << shooter.targetPhotons << ", " << threadCount << " threads)...";
+
+	boost::xtime photonShootingStartTime;
+	boost::xtime_get(&photonShootingStartTime, boost::TIME_UTC_);
+	if (!shooter.Shoot(rng, threadCount))
 		return;
+	// The caustic map may have been disabled
+	nCausticPhotons = shooter.nCausticPhotons;
+
+	ShotPhotons &photons(shooter.photons);
+	if (nCausticPhotons > 0)
+		causticMap->init(shooter.nCausticPaths, photons.causticPhotons);
+	if (nIndirectPhotons > 0)
+		indirectMap->init(shooter.nIndirectPaths, photons.indirectPhotons);
 
 	boost::xtime photonShootingEndTime;
 	boost::xtime_get(&photonShootingEndTime, boost::TIME_UTC_);
@@ -697,48 +1195,12 @@ void PhotonMapPreprocess(const RandomGenerator &rng, const Scene &scene,
 		// Precompute radiance at a subset of the photons
 		LightPhotonMap directMap(radianceMap->nLookup, radianceMap->maxDistSquared);
 		if (nDirectPhotons > 0)
-			directMap.init(nDirectPhotons, directPhotons);
-
-		for (u_int i = 0; i < radiancePhotons.size(); ++i) {
-			// Dade - print some progress info
-			boost::xtime currentTime;
-			boost::xtime_get(&currentTime, boost::TIME_UTC_);
-			if (currentTime.sec - lastUpdateTime.sec > 5) {
-				LOG(LUX_INFO,LUX_NOERROR) << "Radiance photon map computation progress: " << i << " (" << (100 * i / radiancePhotons.size()) << "%)";
-
-				lastUpdateTime = currentTime;
-			}
-
-			// Compute radiance for radiance photon _i_
-			RadiancePhoton &rp = radiancePhotons[i];
-			const SWCSpectrum &rho_r = rpReflectances[i];
-			const SWCSpectrum &rho_t = rpTransmittances[i];
-			const Point& p = rp.p;
-			const Normal& n = rp.n;
-			SWCSpectrum alpha(0.f);
-			for (u_int j = 0; j < WAVELENGTH_SAMPLES; ++j)
-				sw.w[j] = rp.w[j];
-
-			if (!rho_r.Black()) {
-				SWCSpectrum E = directMap.EPhoton(sw, p, n);
-				E += indirectMap->EPhoton(sw, p, n);
-				E += causticMap->EPhoton(sw, p, n);
-
-				alpha += E * INV_PI * rho_r;
-			}
-
-			if (!rho_t.Black()) {
-				SWCSpectrum E = directMap.EPhoton(sw, p, -n);
-				E += indirectMap->EPhoton(sw, p, -n);
-				E += causticMap->EPhoton(sw, p, -n);
-
-				alpha += E * INV_PI * rho_t;
-			}
+			directMap.init(shooter.nDirectPaths, photons.directPhotons);
 
-			rp.alpha = alpha;
-		}
+		shooter.ComputeRadiance(&directMap, indirectMap, causticMap,
+			threadCount);
 
-		radianceMap->init(radiancePhotons);
+		radianceMap->init(photons.radiancePhotons);
 
 
 		boost::xtime radianceComputeEndTime;
@@ -747,58 +1209,9 @@ void PhotonMapPreprocess(const RandomGenerator &rng, const Scene &scene,
 	}
 
 	// Dade - check if we have to save maps to a file
-	if (mapFileName) {
-		LOG( LUX_INFO,LUX_NOERROR)<< "Saving photon maps to file";
-
-		std::ofstream ofs(mapFileName->c_str(), std::ios_base::out | std::ios_base::binary);
-		if(ofs.good()) {
-			LOG(LUX_INFO,LUX_NOERROR)<< "Writing photon maps to '" << (*mapFileName) << "'...";
-
-			bool isLittleEndian = osIsLittleEndian();
-
-			// Write settings
-			osWriteLittleEndianUInt(isLittleEndian, ofs, photonBxdfType);
-			osWriteLittleEndianUInt(isLittleEndian, ofs, radianceBxdfType);
-			osWriteLittleEndianUInt(isLittleEndian, ofs, nDirectPhotons);
-			osWriteLittleEndianUInt(isLittleEndian, ofs, nRadiancePhotons);
-			osWriteLittleEndianUInt(isLittleEndian, ofs, nIndirectPhotons);
-			osWriteLittleEndianUInt(isLittleEndian, ofs, nCausticPhotons);
-			osWriteLittleEndianUInt(isLittleEndian, ofs, scene.lights.size());
-
-			// Dade - write the data
-			// Dade - save radiance photon map
-			if (radianceMap) {
-				radianceMap->save(ofs);
-
-				LOG(LUX_INFO,LUX_NOERROR) << "Written " << radianceMap->getPhotonCount() << " radiance photons";
-			} else
-				osWriteLittleEndianInt(isLittleEndian, ofs, 0);
-
-			// Dade - save indirect photon map
-			if (indirectMap) {
-				indirectMap->save(ofs);
-
-				LOG(LUX_INFO,LUX_NOERROR) << "Written " << indirectMap->getPhotonCount() << " indirect photons";
-			} else
-				osWriteLittleEndianInt(isLittleEndian, ofs, 0);
-
-			// Dade - save indirect photon map
-			if (causticMap) {
-				causticMap->save(ofs);
-
-				LOG(LUX_INFO,LUX_NOERROR) << "Written " << causticMap->getPhotonCount() << " caustic photons";
-			} else
-				osWriteLittleEndianInt(isLittleEndian, ofs, 0);
-
-			if(!ofs.good()) {
-				LOG( LUX_SEVERE,LUX_SYSTEM) << "Error while writing photon maps to file";
-			}
-
-			ofs.close();
-		} else {
-			LOG(LUX_SEVERE,LUX_SYSTEM)<< "Cannot open file '" << (*mapFileName) << "' for writing photon maps";
-		}
-	}
+	if (mapFileName)
+		WritePhotonMaps(*mapFileName, key, settings, radianceMap,
+			indirectMap, causticMap);
 }
 
 SWCSpectrum PhotonMapFinalGatherWithImportaceSampling(const Scene &scene,
@@ -1066,71 +1479,4 @@ SWCSpectrum PhotonMapFinalGather(const Scene &scene, const Sample &sample,
 	return L;
 }
 
-void LightPhotonMap::load(std::basic_istream<char> &stream, LightPhotonMap *map)
-{
-	if (!map)
-		return;
-
-	bool isLittleEndian = osIsLittleEndian();
-
-	// Dade - read the size of the map
-	u_int count = osReadLittleEndianUInt(isLittleEndian, stream);
-
-	u_int npaths = osReadLittleEndianUInt(isLittleEndian, stream);
-
-	vector<LightPhoton> photons(count);
-	for (u_int i = 0; i < count; ++i)
-		photons[i].load(isLittleEndian, stream);
-
-	if (count > 0)
-		map->init(npaths, photons);
-}
-
-void LightPhotonMap::save(std::basic_ostream<char> &stream) const
-{
-	bool isLittleEndian = osIsLittleEndian();
-
-	// Dade - write the size of the map
-	osWriteLittleEndianUInt(isLittleEndian, stream, photonCount);
-	osWriteLittleEndianUInt(isLittleEndian, stream, nPaths);
-
-	if (photonmap != NULL) {
-		LightPhoton *photons = photonmap->getNodeData();
-		for (u_int i = 0; i < photonCount; i++)
-			photons[i].save(isLittleEndian, stream);
-	}
-}
-
-void RadiancePhotonMap::load(std::basic_istream<char> &stream, RadiancePhotonMap *map)
-{
-	if(!map)
-		return;
-
-	bool isLittleEndian = osIsLittleEndian();
-
-	// Dade - read the size of the map
-	u_int count = osReadLittleEndianUInt(isLittleEndian, stream);
-
-	vector<RadiancePhoton> photons(count);
-	for (u_int i = 0; i < count; ++i)
-		photons[i].load(isLittleEndian, stream);
-
-	if (count > 0)
-		map->init(photons);
-}
-
-void RadiancePhotonMap::save(std::basic_ostream<char> &stream) const
-{
-	bool isLittleEndian = osIsLittleEndian();
-
-	// Dade - write the size of the map
-	osWriteLittleEndianUInt(isLittleEndian, stream, photonCount);
-
-	if (photonmap != NULL) {
-		RadiancePhoton *photons = photonmap->getNodeData();
-		for (u_int i = 0; i < photonCount; ++i)
-			photons[i].save(isLittleEndian, stream);
-	}
-}
-
 }//namespace lux
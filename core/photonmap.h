@@ -37,6 +37,8 @@ namespace lux
 //------------------------------------------------------------------------------
 // Dade - different kind of photon types. All of them must extend the base
 // class BasicPhoton.
+// Photons have no virtual methods so that they can be written as raw
+// memory to the photon maps file and used in place when it is mapped.
 //------------------------------------------------------------------------------
 
 class BasicPhoton {
@@ -48,11 +50,6 @@ public:
 	BasicPhoton() {
 	}
 
-	virtual ~BasicPhoton() {}
-
-	virtual void save(bool isLittleEndian, std::basic_ostream<char> &stream) const = 0;
-	virtual void load(bool isLittleEndian, std::basic_istream<char> &stream) = 0;
-
 	Point p;
 };
 
@@ -71,13 +68,9 @@ public:
 	}
 
 	BasicColorPhoton() : BasicPhoton() { }
-	virtual ~BasicColorPhoton() { }
 
 	SWCSpectrum GetSWCSpectrum(const SpectrumWavelengths &sw) const;
 
-	virtual void save(bool isLittleEndian, std::basic_ostream<char> &stream) const;
-	virtual void load(bool isLittleEndian, std::basic_istream<char> &stream);
-
 	SWCSpectrum alpha;
 	float w[WAVELENGTH_SAMPLES];
 };
@@ -89,10 +82,6 @@ public:
 		: BasicColorPhoton(sw, pp, wt), wi(wi_) { }
 
 	LightPhoton() : BasicColorPhoton() { }
-	virtual ~LightPhoton() { }
-
-	virtual void save(bool isLittleEndian, std::basic_ostream<char> &stream) const;
-	virtual void load(bool isLittleEndian, std::basic_istream<char> &stream);
 
 	Vector wi;
 };
@@ -106,10 +95,6 @@ public:
 		: BasicColorPhoton(sw, pp, SWCSpectrum(0.0f)), n(nn) { }
 
 	RadiancePhoton() : BasicColorPhoton() { }
-	virtual ~RadiancePhoton() { }
-
-	virtual void save(bool isLittleEndian, std::basic_ostream<char> &stream) const;
-	virtual void load(bool isLittleEndian, std::basic_istream<char> &stream);
 
 	Normal n;
 };
@@ -144,10 +129,6 @@ public:
 	}
 
 	PdfPhoton() : BasicPhoton(), dirs(0) { }
-	virtual ~PdfPhoton() { }
-
-	virtual void save(bool isLittleEndian, std::basic_ostream<char> &stream) const {
-	}
 
 	float Sample(Vector *wi, float u1, float u2, float u3) const {
 		size_t dn = luxrays::Clamp<size_t>(static_cast<size_t>(
@@ -224,10 +205,20 @@ public:
 				maxDistSquared = photons[0].distanceSquared;
 			}
 		} else {
-			// Remove most distant photon from heap and add new photon
-			std::pop_heap(&photons[0], &photons[nLookup]);
-			photons[nLookup - 1] = ClosePhoton<PhotonType>(&photon, distSquared);
-			std::push_heap(&photons[0], &photons[nLookup]);
+			// Replace most distant photon at the top of the heap
+			// and sift the new photon down
+			const ClosePhoton<PhotonType> closePhoton(&photon, distSquared);
+			u_int i = 0;
+			for (u_int child = 1; child < nLookup; child = 2 * i + 1) {
+				if (child + 1 < nLookup &&
+					photons[child] < photons[child + 1])
+					++child;
+				if (!(closePhoton < photons[child]))
+					break;
+				photons[i] = photons[child];
+				i = child;
+			}
+			photons[i] = closePhoton;
 			maxDistSquared = photons[0].distanceSquared;
 		}
 	}
@@ -268,6 +259,8 @@ public:
 
 template <class PhotonType, class PhotonProcess> class PhotonMap {
 public:
+	typedef KdTree<PhotonType, PhotonProcess> Tree;
+
 	PhotonMap() : photonCount(0), photonmap(NULL) { }
 
 	virtual ~PhotonMap() {
@@ -293,10 +286,11 @@ public:
 	}
 
 	u_int getPhotonCount() { return photonCount; }
+	const Tree *getTree() const { return photonmap; }
 
 protected:
 	u_int photonCount;
-	KdTree<PhotonType, PhotonProcess> *photonmap;
+	Tree *photonmap;
 };
 
 class RadiancePhotonMap : public PhotonMap<RadiancePhoton, NearPhotonProcess<RadiancePhoton> > {
@@ -311,6 +305,12 @@ public:
 		photonmap = new KdTree<RadiancePhoton, NearPhotonProcess<RadiancePhoton> >(photons);
 		empty = false;
 	}
+	// Takes ownership of an already built tree
+	void init(Tree *tree) {
+		photonCount = tree->getDataCount();
+		photonmap = tree;
+		empty = false;
+	}
 
 	bool IsEmpty() const {
 		return empty;
@@ -331,10 +331,6 @@ public:
 		const Vector& wo, 
 		const BxDFType bxdfType) const;
 
-	void save(std::basic_ostream<char> &stream) const;
-
-	static void load(std::basic_istream<char> &stream, RadiancePhotonMap *map);
-
 	// Dade - used only to build the map (lookup in the direct map) but not for lookup
 	const u_int nLookup;
 	const float maxDistSquared;
@@ -353,6 +349,13 @@ public:
 		nPaths = npaths;
 		photonmap = new KdTree<LightPhoton, NearSetPhotonProcess<LightPhoton> >(photons);
 	}
+	// Takes ownership of an already built tree
+	void init(u_int npaths, Tree *tree) {
+		photonCount = tree->getDataCount();
+		nPaths = npaths;
+		photonmap = tree;
+	}
+	u_int getPathCount() const { return nPaths; }
 
 	bool IsEmpty() const {
 		return (nPaths == 0);
@@ -426,10 +429,6 @@ public:
 		const Intersection &isect,
 		const Vector &wo) const;
 
-	void save(std::basic_ostream<char> &stream) const;
-
-	static void load(std::basic_istream<char> &stream, LightPhotonMap *map);
-
 	const u_int nLookup;
 	const float maxDistSquared;
 private:
@@ -451,6 +450,13 @@ enum PhotonMapRRStrategy { RR_EFFICIENCY, RR_PROBABILITY, RR_NONE };
  * @param rng              The random generator to use
  * @param scene            The scene to build the photon maps for.
  * @param mapFileName      The file to load photonmaps from and store them to.
+ *                         The maps found in the file are reused if they
+ *                         were built for the same lights, scene bounds and
+ *                         settings, the others are built and the file is
+ *                         updated. The file is memory mapped and the maps
+ *                         are used in place, it is only valid on
+ *                         architectures with the same layout as the one
+ *                         that wrote it.
  * @param photonBxdfType   The bxdf types where photons should be stored.
  * @param radianceBxdfType The bxdf types that the radiance photons should take
  *                         into account.
@@ -37,11 +37,22 @@
 
 #include "luxrays/utils/memory.h"
 #include <boost/noncopyable.hpp>
+#include <boost/cstdint.hpp>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define LUX_RANDOM_SSE2
+#include <emmintrin.h>
+#endif
 
 #define MASK 0xffffffffUL
 #define FLOATMASK 0x00ffffffUL
 
 #define RAN_BUFFER_AMOUNT 2048
+// Number of interleaved taus113 streams, the buffer is filled with
+// RAN_STREAMS consecutive values at a time, one from each stream.
+// The scalar code generates the same streams so that the sequence
+// doesn't depend on the instruction set.
+#define RAN_STREAMS 4
 
 namespace lux
 {
@@ -52,11 +63,11 @@ class RandomGenerator : boost::noncopyable
 {
 public:
 	RandomGenerator() {
-		buf = AllocAligned<unsigned long>(RAN_BUFFER_AMOUNT);
+		buf = AllocAligned<boost::uint32_t>(RAN_BUFFER_AMOUNT);
 		bufid = RAN_BUFFER_AMOUNT;
 	}
 	RandomGenerator(unsigned long tn) {
-		buf = AllocAligned<unsigned long>(RAN_BUFFER_AMOUNT);
+		buf = AllocAligned<boost::uint32_t>(RAN_BUFFER_AMOUNT);
 		bufid = RAN_BUFFER_AMOUNT;
 		taus113_set(tn);
 	}
@@ -71,8 +82,7 @@ public:
 		// Repopulate buffer if necessary
 		const unsigned int offset = bufid; // for thread safety
 		if (offset >= RAN_BUFFER_AMOUNT) {
-			for(int i = 0; i < RAN_BUFFER_AMOUNT; ++i)
-				buf[i] = nobuf_generateUInt();
+			fillBuffer();
 			bufid = 1;
 			return buf[0];
 		}
@@ -86,48 +96,89 @@ public:
 
 private:
 	inline unsigned long LCG(const unsigned long n) {
-		return 69069UL * n; // The result is clamped to 32 bits (long)
+		return (69069UL * n) & MASK;
 	}
 	void taus113_set(unsigned long s) {
 		if (!s)
 			s = 1UL; // default seed is 1
 
-		z1 = LCG(s);
-		if (z1 < 2UL)
-			z1 += 2UL;
-		z2 = LCG (z1);
-		if (z2 < 8UL)
-			z2 += 8UL;
-		z3 = LCG (z2);
-		if (z3 < 16UL)
-			z3 += 16UL;
-		z4 = LCG (z3);
-		if (z4 < 128UL)
-			z4 += 128UL;
+		// Each stream is seeded from a different point of the
+		// LCG sequence started at the seed
+		unsigned long z = s & MASK;
+		for (int i = 0; i < RAN_STREAMS; ++i) {
+			z = LCG(z);
+			z1[i] = z < 2UL ? z + 2UL : z;
+			z = LCG(z);
+			z2[i] = z < 8UL ? z + 8UL : z;
+			z = LCG(z);
+			z3[i] = z < 16UL ? z + 16UL : z;
+			z = LCG(z);
+			z4[i] = z < 128UL ? z + 128UL : z;
+		}
 
 		// Calling RNG ten times to satify recurrence condition
 		for(int i = 0; i < 10; ++i)
-			nobuf_generateUInt();
+			step(buf);
+		bufid = RAN_BUFFER_AMOUNT;
 	}
 
-	inline unsigned long nobuf_generateUInt() const {
-		const unsigned long b1 = ((((z1 << 6UL) & MASK) ^ z1) >> 13UL);
-		z1 = ((((z1 & 4294967294UL) << 18UL) & MASK) ^ b1);
-
-		const unsigned long b2 = ((((z2 << 2UL) & MASK) ^ z2) >> 27UL);
-		z2 = ((((z2 & 4294967288UL) << 2UL) & MASK) ^ b2);
-
-		const unsigned long b3 = ((((z3 << 13UL) & MASK) ^ z3) >> 21UL);
-		z3 = ((((z3 & 4294967280UL) << 7UL) & MASK) ^ b3);
-
-		const unsigned long b4 = ((((z4 << 3UL) & MASK) ^ z4) >> 12UL);
-		z4 = ((((z4 & 4294967168UL) << 13UL) & MASK) ^ b4);
+	// Generates one value for each stream
+	inline void step(boost::uint32_t *out) const {
+#if defined(LUX_RANDOM_SSE2)
+		__m128i z = _mm_loadu_si128(reinterpret_cast<const __m128i *>(z1));
+		__m128i b = _mm_srli_epi32(_mm_xor_si128(_mm_slli_epi32(z, 6), z), 13);
+		const __m128i r1 = _mm_xor_si128(_mm_slli_epi32(_mm_and_si128(z,
+			_mm_set1_epi32(static_cast<int>(4294967294U))), 18), b);
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(z1), r1);
+
+		z = _mm_loadu_si128(reinterpret_cast<const __m128i *>(z2));
+		b = _mm_srli_epi32(_mm_xor_si128(_mm_slli_epi32(z, 2), z), 27);
+		const __m128i r2 = _mm_xor_si128(_mm_slli_epi32(_mm_and_si128(z,
+			_mm_set1_epi32(static_cast<int>(4294967288U))), 2), b);
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(z2), r2);
+
+		z = _mm_loadu_si128(reinterpret_cast<const __m128i *>(z3));
+		b = _mm_srli_epi32(_mm_xor_si128(_mm_slli_epi32(z, 13), z), 21);
+		const __m128i r3 = _mm_xor_si128(_mm_slli_epi32(_mm_and_si128(z,
+			_mm_set1_epi32(static_cast<int>(4294967280U))), 7), b);
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(z3), r3);
+
+		z = _mm_loadu_si128(reinterpret_cast<const __m128i *>(z4));
+		b = _mm_srli_epi32(_mm_xor_si128(_mm_slli_epi32(z, 3), z), 12);
+		const __m128i r4 = _mm_xor_si128(_mm_slli_epi32(_mm_and_si128(z,
+			_mm_set1_epi32(static_cast<int>(4294967168U))), 13), b);
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(z4), r4);
+
+		_mm_store_si128(reinterpret_cast<__m128i *>(out),
+			_mm_xor_si128(_mm_xor_si128(r1, r2), _mm_xor_si128(r3, r4)));
+#else
+		for (int i = 0; i < RAN_STREAMS; ++i) {
+			const boost::uint32_t b1 = ((z1[i] << 6) ^ z1[i]) >> 13;
+			z1[i] = ((z1[i] & 4294967294U) << 18) ^ b1;
+
+			const boost::uint32_t b2 = ((z2[i] << 2) ^ z2[i]) >> 27;
+			z2[i] = ((z2[i] & 4294967288U) << 2) ^ b2;
+
+			const boost::uint32_t b3 = ((z3[i] << 13) ^ z3[i]) >> 21;
+			z3[i] = ((z3[i] & 4294967280U) << 7) ^ b3;
+
+			const boost::uint32_t b4 = ((z4[i] << 3) ^ z4[i]) >> 12;
+			z4[i] = ((z4[i] & 4294967168U) << 13) ^ b4;
+
+			out[i] = z1[i] ^ z2[i] ^ z3[i] ^ z4[i];
+		}
+#endif
+	}
 
-		return (z1 ^ z2 ^ z3 ^ z4);
+	void fillBuffer() const {
+		for (int i = 0; i < RAN_BUFFER_AMOUNT; i += RAN_STREAMS)
+			step(buf + i);
 	}
 
-	mutable unsigned long z1, z2, z3, z4;
-	unsigned long *buf;
+	// Stream states, 32 bits wide so that they map to SIMD lanes
+	mutable boost::uint32_t z1[RAN_STREAMS], z2[RAN_STREAMS];
+	mutable boost::uint32_t z3[RAN_STREAMS], z4[RAN_STREAMS];
+	boost::uint32_t *buf;
 	mutable int bufid;
 };
 
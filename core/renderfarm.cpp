@@ -1216,6 +1216,7 @@ void RenderFarm::send(const string &command, const string &name,
 		fileParams.push_back("iesname");
 		fileParams.push_back("configfile");
 		fileParams.push_back("usersamplingmap_filename");
+		fileParams.push_back("photonmapsfile");
 		if (command != "luxFilm")
 			fileParams.push_back("filename");
 
@@ -1224,9 +1225,13 @@ void RenderFarm::send(const string &command, const string &name,
 			//send the files
 			string file;
 			file = params.FindOneString(paramName, "");
-			// usersamplingmap_filename can be ignored if the file doesn't exist
+			// usersamplingmap_filename can be ignored if the file doesn't exist.
+			// The scene is sent before the photon maps of this render are
+			// built, so photonmapsfile is only sent when a previous render
+			// left one; slaves check its key and rebuild stale maps
 			if (file == "" || FileData::present(params, paramName) ||
-					((paramName == "usersamplingmap_filename") && !boost::filesystem::exists(file)))
+					((paramName == "usersamplingmap_filename" ||
+					paramName == "photonmapsfile") && !boost::filesystem::exists(file)))
 				continue;
 
 			// silent replacement, since relevant plugin will report replacement
@@ -31,6 +31,7 @@
 
 #include "luxrays/utils/mcdistribution.h"
 
+#include <algorithm>
 #include <boost/assert.hpp>
 
 using namespace luxrays;
@@ -73,6 +74,8 @@ LightsSamplingStrategy *LightsSamplingStrategy::Create(const string &name,
 		lightStrategyType = LightsSamplingStrategy::SAMPLE_AUTOMATIC_POWER_IMPORTANCE;
 	else if (st == "logpowerimp")
 		lightStrategyType = LightsSamplingStrategy::SAMPLE_ONE_LOG_POWER_IMPORTANCE;
+	else if (st == "lighttree")
+		lightStrategyType = LightsSamplingStrategy::SAMPLE_ONE_LIGHT_TREE;
 	else {
 		LOG( LUX_WARNING,LUX_BADTOKEN) << "Strategy  '" << st << "' unknown. Using \"auto\".";
 		lightStrategyType = LightsSamplingStrategy::SAMPLE_AUTOMATIC;
@@ -104,6 +107,9 @@ LightsSamplingStrategy *LightsSamplingStrategy::Create(const string &name,
 		case LightsSamplingStrategy::SAMPLE_ONE_LOG_POWER_IMPORTANCE:
 			lsStrategy = new LSSOneLogPowerImportance();
 			break;
+		case LightsSamplingStrategy::SAMPLE_ONE_LIGHT_TREE:
+			lsStrategy = new LSSOneLightTree();
+			break;
 		default:
 			BOOST_ASSERT(false);
 	}
@@ -212,11 +218,7 @@ const Light *LSSOneImportance::SampleLight(const Scene &scene, u_int index,
 
 float LSSOneImportance::Pdf(const Scene &scene, const Light *light) const
 {
-	for (u_int i = 0; i < scene.lights.size(); ++i) {
-		if (scene.lights[i].get() == light)
-			return lightDistribution->Pdf(i);
-	}
-	return 0.f;
+	return Pdf(scene, light->index);
 }
 
 float LSSOneImportance::Pdf(const Scene &scene, u_int light) const
@@ -261,11 +263,7 @@ const Light *LSSAllPowerImportance::SampleLight(const Scene &scene, u_int index,
 
 float LSSAllPowerImportance::Pdf(const Scene &scene, const Light *light) const
 {
-	for (u_int i = 0; i < scene.lights.size(); ++i) {
-		if (scene.lights[i].get() == light)
-			return lightDistribution->Pdf(i) * scene.lights.size();
-	}
-	return 0.f;
+	return Pdf(scene, light->index);
 }
 
 float LSSAllPowerImportance::Pdf(const Scene &scene, u_int light) const
@@ -312,6 +310,188 @@ void LSSOneLogPowerImportance::Init(const Scene &scene) {
 	delete[] lightPower;
 }
 
+//******************************************************************************
+// Light Sampling Strategies: LightStrategyOneLightTree
+//******************************************************************************
+
+LSSOneLightTree::~LSSOneLightTree()
+{
+	delete topDistribution;
+}
+
+void LSSOneLightTree::Init(const Scene &scene)
+{
+	// Point independent sampling
+	LSSOnePowerImportance::Init(scene);
+
+	const u_int nLights = scene.lights.size();
+	vector<float> lightPower(nLights);
+	vector<u_int> treeLights;
+	lightLeaf.assign(nLights, ~0U);
+	lightEntry.assign(nLights, ~0U);
+	entryLight.clear();
+	nodes.clear();
+	for (u_int i = 0; i < nLights; ++i) {
+		const Light *l = scene.lights[i].get();
+		lightPower[i] = l->GetRenderingHints()->GetImportance() *
+			l->Power(scene);
+		const BBox bounds(l->WorldBound());
+		// Lights without power would never be picked by the tree,
+		// keep them in the top level distribution like lights
+		// without finite bounds
+		if (!l->IsEnvironmental() && lightPower[i] > 0.f &&
+			bounds.pMin.x <= bounds.pMax.x)
+			treeLights.push_back(i);
+	}
+
+	vector<float> entryPower;
+	if (!treeLights.empty()) {
+		nodes.reserve(2 * treeLights.size() - 1);
+		BuildTree(scene, treeLights, lightPower, 0, treeLights.size(), 0);
+		entryLight.push_back(~0U);
+		entryPower.push_back(nodes[0].power);
+	}
+	for (u_int i = 0; i < nLights; ++i) {
+		if (lightLeaf[i] != ~0U)
+			continue;
+		lightEntry[i] = entryLight.size();
+		entryLight.push_back(i);
+		entryPower.push_back(lightPower[i]);
+	}
+
+	delete topDistribution;
+	topDistribution = entryPower.empty() ? NULL :
+		new Distribution1D(&entryPower[0], entryPower.size());
+
+	LOG(LUX_DEBUG, LUX_NOERROR) << "Light tree: " << treeLights.size() <<
+		" lights in " << nodes.size() << " nodes, " <<
+		(entryLight.size() - (treeLights.empty() ? 0 : 1)) <<
+		" lights outside of the tree";
+}
+
+u_int LSSOneLightTree::BuildTree(const Scene &scene, vector<u_int> &lights,
+	const vector<float> &power, u_int begin, u_int end, u_int parent)
+{
+	const u_int node = nodes.size();
+	nodes.push_back(LightTreeNode());
+	nodes[node].parent = parent;
+
+	if (end - begin == 1) {
+		const u_int light = lights[begin];
+		nodes[node].bounds = scene.lights[light]->WorldBound();
+		nodes[node].power = power[light];
+		nodes[node].index = light;
+		nodes[node].leaf = true;
+		lightLeaf[light] = node;
+		return node;
+	}
+
+	// Split the lights at the median of their centers along the largest
+	// extent of the centers bounds
+	BBox centerBounds;
+	for (u_int i = begin; i < end; ++i) {
+		const BBox b(scene.lights[lights[i]]->WorldBound());
+		centerBounds = Union(centerBounds, b.pMin + (b.pMax - b.pMin) * .5f);
+	}
+	const int axis = centerBounds.MaximumExtent();
+	vector<std::pair<float, u_int> > keys(end - begin);
+	for (u_int i = begin; i < end; ++i) {
+		const BBox b(scene.lights[lights[i]]->WorldBound());
+		keys[i - begin] = std::make_pair(b.pMin[axis] + b.pMax[axis],
+			lights[i]);
+	}
+	const u_int mid = (begin + end) / 2;
+	std::nth_element(keys.begin(), keys.begin() + (mid - begin), keys.end());
+	for (u_int i = begin; i < end; ++i)
+		lights[i] = keys[i - begin].second;
+
+	const u_int first = BuildTree(scene, lights, power, begin, mid, node);
+	const u_int second = BuildTree(scene, lights, power, mid, end, node);
+	LightTreeNode &n(nodes[node]);
+	n.bounds = Union(nodes[first].bounds, nodes[second].bounds);
+	n.power = nodes[first].power + nodes[second].power;
+	n.index = second;
+	n.leaf = false;
+	return node;
+}
+
+float LSSOneLightTree::Importance(const LightTreeNode &node,
+	const Point &p) const
+{
+	// Power over squared distance to the bounds center, the distance
+	// is clamped to the bounds radius for points close to the lights
+	const Point center(node.bounds.pMin +
+		(node.bounds.pMax - node.bounds.pMin) * .5f);
+	const float r2 = .25f * DistanceSquared(node.bounds.pMin,
+		node.bounds.pMax);
+	const float d2 = max(DistanceSquared(p, center), r2);
+	return d2 > 0.f ? node.power / d2 : INFINITY;
+}
+
+float LSSOneLightTree::FirstChildProbability(u_int node, const Point &p) const
+{
+	const LightTreeNode &first(nodes[node + 1]);
+	const LightTreeNode &second(nodes[nodes[node].index]);
+	const float w1 = Importance(first, p);
+	const float w2 = Importance(second, p);
+	const float w = w1 + w2;
+	// Fall back to the power when the distance gives no information
+	if (!(w > 0.f) || w == INFINITY)
+		return first.power / (first.power + second.power);
+	return w1 / w;
+}
+
+const Light *LSSOneLightTree::SampleLight(const Scene &scene, u_int index,
+	const Point &p, float *u, float *pdf) const
+{
+	if (index > 0 || !topDistribution)
+		return NULL;
+	const u_int entry = topDistribution->SampleDiscrete(*u, pdf, u);
+	if (entryLight[entry] != ~0U)
+		return scene.lights[entryLight[entry]].get();
+
+	// Traverse the tree choosing a child according to its importance
+	u_int node = 0;
+	while (!nodes[node].leaf) {
+		const float pFirst = FirstChildProbability(node, p);
+		if (*u < pFirst) {
+			*u = min(*u / pFirst, OneMinusEpsilon);
+			*pdf *= pFirst;
+			++node;
+		} else {
+			*u = min((*u - pFirst) / (1.f - pFirst), OneMinusEpsilon);
+			*pdf *= 1.f - pFirst;
+			node = nodes[node].index;
+		}
+	}
+	return scene.lights[nodes[node].index].get();
+}
+
+float LSSOneLightTree::Pdf(const Scene &scene, const Point &p,
+	const Light *light) const
+{
+	return Pdf(scene, p, light->index);
+}
+
+float LSSOneLightTree::Pdf(const Scene &scene, const Point &p,
+	u_int light) const
+{
+	if (light >= lightLeaf.size() || !topDistribution)
+		return 0.f;
+	if (lightLeaf[light] == ~0U)
+		return topDistribution->Pdf(lightEntry[light]);
+
+	// Walk up from the leaf to the root
+	float pdf = topDistribution->Pdf(0);
+	for (u_int node = lightLeaf[light]; node != 0; ) {
+		const u_int parent = nodes[node].parent;
+		const float pFirst = FirstChildProbability(parent, p);
+		pdf *= (node == parent + 1) ? pFirst : 1.f - pFirst;
+		node = parent;
+	}
+	return pdf;
+}
+
 //------------------------------------------------------------------------------
 // SurfaceIntegrator Rendering Hints
 //------------------------------------------------------------------------------
@@ -398,7 +578,7 @@ u_int SurfaceIntegratorRenderingHints::SampleLights(const Scene &scene,
 							continue;
 						const float d2 = DistanceSquared(p,
 							lightBsdf->dgShading.p);
-						const float lsPdf = lsStrategy->Pdf(scene, light);
+						const float lsPdf = lsStrategy->Pdf(scene, p, light);
 						const float lightPdf2 = lightPdf *
 							lsPdf * shadowRayCount * d2 /
 							AbsDot(wi, lightBsdf->ng);
@@ -417,7 +597,7 @@ u_int SurfaceIntegratorRenderingHints::SampleLights(const Scene &scene,
 						&Li)) {
 						const float d2 = DistanceSquared(p,
 							lightBsdf->dgShading.p);
-						const float lsPdf = lsStrategy->Pdf(scene, lightIsect.arealight) * shadowRayCount;
+						const float lsPdf = lsStrategy->Pdf(scene, p, lightIsect.arealight) * shadowRayCount;
 						const float lightPdf2 = lightPdf *
 							lsPdf * d2 /
 							AbsDot(wi, lightBsdf->ng);
@@ -446,7 +626,7 @@ u_int SurfaceIntegratorRenderingHints::SampleLights(const Scene &scene,
 		const u_int offset = i * (1 + shadowRayCount * 3) + 3;
 		float lc = data[offset];
 		float lsPdf;
-		const Light *light = lsStrategy->SampleLight(scene, i, &lc,
+		const Light *light = lsStrategy->SampleLight(scene, i, p, &lc,
 			&lsPdf);
 		if (!light)
 			break;
@@ -25,6 +25,7 @@
 
 #include "lux.h"
 
+#include "luxrays/core/geometry/bbox.h"
 #include "luxrays/utils/mcdistribution.h"
 
 namespace lux {
@@ -51,7 +52,7 @@ public:
 		SAMPLE_ALL_UNIFORM, SAMPLE_ONE_UNIFORM,
 		SAMPLE_AUTOMATIC, SAMPLE_ONE_IMPORTANCE,
 		SAMPLE_ONE_POWER_IMPORTANCE, SAMPLE_ALL_POWER_IMPORTANCE, SAMPLE_AUTOMATIC_POWER_IMPORTANCE,
-		SAMPLE_ONE_LOG_POWER_IMPORTANCE
+		SAMPLE_ONE_LOG_POWER_IMPORTANCE, SAMPLE_ONE_LIGHT_TREE
 	};
 
 	LightsSamplingStrategy() : Strategy() { }
@@ -87,6 +88,49 @@ public:
 	 * @return The requested probability
 	 */
 	virtual float Pdf(const Scene &scene, u_int light) const = 0;
+	/**
+	 * Samples a light for the illumination of a given point.
+	 * Strategies ignoring the illuminated point use the point
+	 * independent sampling.
+	 * @param scene The current scene
+	 * @param index The current sampling iteration
+	 * @param p The illuminated point
+	 * @param u A pointer to a random variable in the [0,1) range,
+	 * the value might be adjusted if needed so that it can be used
+	 * to sample the light component
+	 * @param pdf The probability of having sampled that light taking
+	 * the looping process into account
+	 * @return A pointer to the sampled Light or NULL if the looping is over
+	 * in which case u and pdf are left untouched
+	 */
+	virtual const Light *SampleLight(const Scene &scene, u_int index,
+		const Point &p, float *u, float *pdf) const {
+		return SampleLight(scene, index, u, pdf);
+	}
+	/**
+	 * The probability of sampling a given light for the illumination
+	 * of a given point
+	 * @param scene The current scene
+	 * @param p The illuminated point
+	 * @param light A pointer to the light being queried
+	 * @return The requested probability
+	 */
+	virtual float Pdf(const Scene &scene, const Point &p,
+		const Light *light) const {
+		return Pdf(scene, light);
+	}
+	/**
+	 * The probability of sampling a given light for the illumination
+	 * of a given point
+	 * @param scene The current scene
+	 * @param p The illuminated point
+	 * @param light The index of the light being queried in scene.lights
+	 * @return The requested probability
+	 */
+	virtual float Pdf(const Scene &scene, const Point &p,
+		u_int light) const {
+		return Pdf(scene, light);
+	}
 	/**
 	 * The maximum number of light samples in one go
 	 * The looping over SampleLight will never exceed he returned value
@@ -220,6 +264,59 @@ public:
 	virtual void Init(const Scene &scene);
 };
 
+/**
+ * Samples one light according to its estimated contribution to the
+ * illuminated point. Lights with finite bounds are stored in a bounding
+ * volume hierarchy which is traversed choosing each child according to
+ * its power and its distance to the point. Lights without bounds
+ * (environment, sun, distant lights...) and the whole hierarchy are
+ * chosen according to their power.
+ * The point independent methods behave like LSSOnePowerImportance.
+ */
+class LSSOneLightTree : public LSSOnePowerImportance {
+public:
+	LSSOneLightTree() : LSSOnePowerImportance(), topDistribution(NULL) { }
+	virtual ~LSSOneLightTree();
+	virtual void Init(const Scene &scene);
+
+	using LSSOneImportance::SampleLight;
+	using LSSOneImportance::Pdf;
+	virtual const Light *SampleLight(const Scene &scene, u_int index,
+		const Point &p, float *u, float *pdf) const;
+	virtual float Pdf(const Scene &scene, const Point &p,
+		const Light *light) const;
+	virtual float Pdf(const Scene &scene, const Point &p,
+		u_int light) const;
+
+private:
+	struct LightTreeNode {
+		BBox bounds;
+		float power;
+		// Index of the second child for inner nodes (the first one
+		// immediately follows its parent), index of the light for leaves
+		u_int index;
+		u_int parent;
+		bool leaf;
+	};
+
+	u_int BuildTree(const Scene &scene, vector<u_int> &lights,
+		const vector<float> &power, u_int begin, u_int end,
+		u_int parent);
+	float Importance(const LightTreeNode &node, const Point &p) const;
+	// Probability to choose the first child of an inner node
+	float FirstChildProbability(u_int node, const Point &p) const;
+
+	vector<LightTreeNode> nodes;
+	// Leaf of each light in the tree, or ~0U for lights sampled
+	// by the top level distribution
+	vector<u_int> lightLeaf;
+	// Light of each top level entry, ~0U for the tree
+	vector<u_int> entryLight;
+	// Top level entry of each light outside of the tree
+	vector<u_int> lightEntry;
+	luxrays::Distribution1D *topDistribution;
+};
+
 //******************************************************************************
 // Rendering Hints
 //******************************************************************************
@@ -299,6 +396,25 @@ public:
 	u_int GetSamplingLimit(const Scene &scene) const {
 		return lsStrategy->GetSamplingLimit(scene);
 	}
+	/**
+	 * Samples a light for the illumination of a given point.
+	 * The method should be called in a loop until it returns NULL.
+	 * @see LightsSamplingStrategy::SampleLight
+	 */
+	const Light *SampleLight(const Scene &scene, u_int index,
+		const Point &p, float *u, float *pdf) const {
+		return lsStrategy->SampleLight(scene, index, p, u, pdf);
+	}
+	/**
+	 * The probability of sampling a given light for the illumination
+	 * of a given point
+	 */
+	float Pdf(const Scene &scene, const Point &p, const Light *light) const {
+		return lsStrategy->Pdf(scene, p, light);
+	}
+	float Pdf(const Scene &scene, const Point &p, u_int light) const {
+		return lsStrategy->Pdf(scene, p, light);
+	}
 	
 	const LightsSamplingStrategy *GetLightsSamplingStrategy() const { return lsStrategy; };
 
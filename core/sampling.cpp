@@ -51,7 +51,7 @@ void Sampler::AddSample(const Sample &sample)
 }
 
 // Sample Method Definitions
-Sample::Sample() : arena(2048), samplerData(NULL), camera(NULL)
+Sample::Sample(u_int arenaSize) : arena(arenaSize), samplerData(NULL), camera(NULL)
 {
 }
 
@@ -36,7 +36,7 @@ namespace lux
 class Sample {
 public:
 	// Sample Public Methods
-	Sample();
+	explicit Sample(u_int arenaSize = 2048);
 	~Sample();
 
 	void AddContribution(float x, float y, const XYZColor &c, float a,
@@ -83,6 +83,9 @@ public:
 	virtual void SetFilm(Film* f) { film = f; }
 	virtual void GetBufferType(BufferType *t) { }
 	virtual void AddSample(const Sample &sample);
+	// Returns false if every sample has to be evaluated and given back to
+	// AddSample, like the mutations of a Markov chain
+	virtual bool CanSkipSamples() const { return true; }
 	
 	u_int Add1D(u_int num) {
 		n1D.push_back(num);
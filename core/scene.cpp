@@ -66,6 +66,14 @@ float* Scene::GetFloatFramebuffer() {
     return camera()->film->getFloatFrameBuffer();
 }
 
+boost::shared_ptr<const FramebufferSnapshot> Scene::GetFramebufferSnapshot() {
+    return camera()->film->getFrameBufferSnapshot();
+}
+
+u_int Scene::GetFramebufferVersion() {
+    return camera()->film->getFrameBufferVersion();
+}
+
 float* Scene::GetAlphaBuffer() {
     return camera()->film->getAlphaBuffer();
 }
@@ -143,10 +151,12 @@ Scene::Scene(Camera *cam, SurfaceIntegrator *si, VolumeIntegrator *vi,
 	vector<boost::shared_ptr<Light> > &lts, const vector<string> &lg, Region *vr) :
 	ready(false), aggregate(accel), lights(lts),
 	lightGroups(lg), camera(cam), volumeRegion(vr), surfaceIntegrator(si),
-	volumeIntegrator(vi), sampler(s), terminated(false), primitives(prims),
-	filmOnly(false)
+	volumeIntegrator(vi), sampler(s), terminated(false), definitionsDigest(),
+	primitives(prims), filmOnly(false)
 {
 	// Scene Constructor Implementation
+	for (u_int i = 0; i < lights.size(); ++i)
+		lights[i]->index = i;
 	bound = Union(aggregate->WorldBound(), camera()->Bounds());
 	if (volumeRegion)
 		bound = Union(bound, volumeRegion->WorldBound());
@@ -161,7 +171,7 @@ Scene::Scene(Camera *cam, SurfaceIntegrator *si, VolumeIntegrator *vi,
 
 Scene::Scene(Camera *cam) :
 	camera(cam), volumeRegion(NULL), surfaceIntegrator(NULL),
-	volumeIntegrator(NULL), sampler(NULL),
+	volumeIntegrator(NULL), sampler(NULL), definitionsDigest(),
 	filmOnly(true)
 {
 	for(u_int i = 0; i < cam->film->GetNumBufferGroups(); i++)
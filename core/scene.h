@@ -28,6 +28,7 @@
 #include "primitive.h"
 #include "transport.h"
 #include "camera.h"
+#include "tigerhash.h"
 
 #include <boost/thread/thread.hpp>
 #include <boost/noncopyable.hpp>
@@ -108,6 +109,8 @@ public:
 	void UpdateFramebuffer();
 	unsigned char* GetFramebuffer();
 	float* GetFloatFramebuffer();
+	boost::shared_ptr<const FramebufferSnapshot> GetFramebufferSnapshot();
+	u_int GetFramebufferVersion();
 	float* GetAlphaBuffer();
 	float* GetZBuffer();
 	bool SaveEXR(const string& filename, bool useHalfFloat, bool includeZBuffer, int compressionType, bool tonemapped);
@@ -154,6 +157,9 @@ public:
 	BBox bound;
 	u_long seedBase;
 	bool terminated; // rendering is terminated
+	// Hash of the texture, named material and named volume definitions
+	// and of the object instance contents, used to detect scene changes
+	tigerhash::digest_type definitionsDigest;
 
 	// The following data are used when tracing rays with LuxRays
 	// The list of original primitives. It is required by LuxRays to build the DataSet.
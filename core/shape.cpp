@@ -30,15 +30,15 @@ using namespace lux;
 
 // Shape Method Definitions
 Shape::Shape(const Transform &o2w, bool ro, const string &n)
-	: ObjectToWorld(o2w), name(n), reverseOrientation(ro),
+	: ObjectToWorld(o2w), paramsDigest(), name(n), reverseOrientation(ro),
 	transformSwapsHandedness(o2w.SwapsHandedness())
 {
 }
 
 Shape::Shape(const Transform &o2w, bool ro, boost::shared_ptr<Material> &mat,
 	boost::shared_ptr<Volume> &ex, boost::shared_ptr<Volume> &in, const string &n)
-	: ObjectToWorld(o2w), material(mat), exterior(ex), interior(in),
-	name(n), reverseOrientation(ro),
+	: ObjectToWorld(o2w), paramsDigest(), material(mat), exterior(ex),
+	interior(in), name(n), reverseOrientation(ro),
 	transformSwapsHandedness(o2w.SwapsHandedness())
 {
 }
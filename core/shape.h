@@ -26,6 +26,7 @@
 #include "lux.h"
 #include "primitive.h"
 #include "error.h"
+#include "tigerhash.h"
 
 namespace lux
 {
@@ -148,6 +149,8 @@ public:
 	}
 	// Shape data
 	const Transform ObjectToWorld;
+	// Hash of the creation parameters, used to detect scene changes
+	tigerhash::digest_type paramsDigest;
 protected:
 	boost::shared_ptr<Material> material;
 	boost::shared_ptr<Volume> exterior, interior;
@@ -0,0 +1,336 @@
+/***************************************************************************
+ *   Copyright (C) 1998-2013 by authors (see AUTHORS.txt)                  *
+ *                                                                         *
+ *   This file is part of LuxRender.                                       *
+ *                                                                         *
+ *   Lux Renderer is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   Lux Renderer is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+ *                                                                         *
+ *   This project is based on PBRT ; see http://www.pbrt.org               *
+ *   Lux Renderer website : http://www.luxrender.net                       *
+ ***************************************************************************/
+
+// texturecache.cpp*
+#include "texturecache.h"
+#include "osfunc.h"
+#include "error.h"
+
+#include <cstring>
+#include <boost/filesystem.hpp>
+#include <boost/lexical_cast.hpp>
+
+using namespace lux;
+
+static const char tiledImageMagic[8] = { 'L', 'U', 'X', 'T', 'I', 'L', 'E', '\0' };
+static const u_int tiledImageVersion = 2;
+
+//------------------------------------------------------------------------------
+// TiledImageHeader
+//------------------------------------------------------------------------------
+
+void TiledImageHeader::ComputeLayout()
+{
+	tileShift = 0;
+	while ((1U << tileShift) < tileSize)
+		++tileShift;
+	tileMask = tileSize - 1;
+
+	const u_int nLevels = uRes.size();
+	uTiles.resize(nLevels);
+	vTiles.resize(nLevels);
+	firstTile.resize(nLevels);
+	u_int count = 0;
+	for (u_int i = 0; i < nLevels; ++i) {
+		uTiles[i] = (uRes[i] + tileSize - 1) >> tileShift;
+		vTiles[i] = (vRes[i] + tileSize - 1) >> tileShift;
+		firstTile[i] = count;
+		count += uTiles[i] * vTiles[i];
+	}
+}
+
+void TiledImageHeader::Write(std::ostream &os) const
+{
+	// Tiles are stored with the native byte order, the flag allows
+	// to detect files generated on a different architecture
+	const bool isLittleEndian = osIsLittleEndian();
+	os.write(tiledImageMagic, sizeof(tiledImageMagic));
+	osWriteLittleEndianUInt(isLittleEndian, os, tiledImageVersion);
+	osWriteLittleEndianUInt(isLittleEndian, os, isLittleEndian ? 1 : 0);
+	osWriteLittleEndianUInt(isLittleEndian, os, pixelType);
+	osWriteLittleEndianUInt(isLittleEndian, os, channels);
+	osWriteLittleEndianUInt(isLittleEndian, os, texelSize);
+	osWriteLittleEndianUInt(isLittleEndian, os, tileSize);
+	osWriteLittleEndianUInt(isLittleEndian, os, wrapMode);
+	osWriteLittleEndianUInt(isLittleEndian, os, filterType);
+	osWriteLittleEndianUInt(isLittleEndian, os,
+		static_cast<uint32_t>(sourceSize & 0xffffffffULL));
+	osWriteLittleEndianUInt(isLittleEndian, os,
+		static_cast<uint32_t>(sourceSize >> 32));
+	osWriteLittleEndianUInt(isLittleEndian, os,
+		static_cast<uint32_t>(static_cast<boost::uint64_t>(sourceTime) & 0xffffffffULL));
+	osWriteLittleEndianUInt(isLittleEndian, os,
+		static_cast<uint32_t>(static_cast<boost::uint64_t>(sourceTime) >> 32));
+	for (u_int i = 0; i < TILED_IMAGE_CHANNEL_COUNT; ++i) {
+		osWriteLittleEndianFloat(isLittleEndian, os, minValue[i]);
+		osWriteLittleEndianFloat(isLittleEndian, os, maxValue[i]);
+	}
+	osWriteLittleEndianUInt(isLittleEndian, os, uRes.size());
+	for (u_int i = 0; i < uRes.size(); ++i) {
+		osWriteLittleEndianUInt(isLittleEndian, os, uRes[i]);
+		osWriteLittleEndianUInt(isLittleEndian, os, vRes[i]);
+	}
+}
+
+bool TiledImageHeader::Read(std::istream &is)
+{
+	const bool isLittleEndian = osIsLittleEndian();
+	char magic[sizeof(tiledImageMagic)];
+	is.read(magic, sizeof(magic));
+	if (!is.good() || memcmp(magic, tiledImageMagic, sizeof(magic)))
+		return false;
+	if (osReadLittleEndianUInt(isLittleEndian, is) != tiledImageVersion)
+		return false;
+	if (osReadLittleEndianUInt(isLittleEndian, is) != (isLittleEndian ? 1U : 0U))
+		return false;
+	pixelType = osReadLittleEndianUInt(isLittleEndian, is);
+	channels = osReadLittleEndianUInt(isLittleEndian, is);
+	texelSize = osReadLittleEndianUInt(isLittleEndian, is);
+	tileSize = osReadLittleEndianUInt(isLittleEndian, is);
+	wrapMode = osReadLittleEndianUInt(isLittleEndian, is);
+	filterType = osReadLittleEndianUInt(isLittleEndian, is);
+	sourceSize = osReadLittleEndianUInt(isLittleEndian, is);
+	sourceSize |= static_cast<boost::uint64_t>(osReadLittleEndianUInt(isLittleEndian, is)) << 32;
+	boost::uint64_t time = osReadLittleEndianUInt(isLittleEndian, is);
+	time |= static_cast<boost::uint64_t>(osReadLittleEndianUInt(isLittleEndian, is)) << 32;
+	sourceTime = static_cast<boost::int64_t>(time);
+	for (u_int i = 0; i < TILED_IMAGE_CHANNEL_COUNT; ++i) {
+		minValue[i] = osReadLittleEndianFloat(isLittleEndian, is);
+		maxValue[i] = osReadLittleEndianFloat(isLittleEndian, is);
+	}
+	const u_int nLevels = osReadLittleEndianUInt(isLittleEndian, is);
+	if (!is.good() || nLevels == 0 || nLevels > 32 || texelSize == 0 ||
+		tileSize == 0 || (tileSize & (tileSize - 1)) != 0)
+		return false;
+	uRes.resize(nLevels);
+	vRes.resize(nLevels);
+	for (u_int i = 0; i < nLevels; ++i) {
+		uRes[i] = osReadLittleEndianUInt(isLittleEndian, is);
+		vRes[i] = osReadLittleEndianUInt(isLittleEndian, is);
+	}
+	if (!is.good())
+		return false;
+	dataOffset = is.tellg();
+	ComputeLayout();
+
+	return true;
+}
+
+//------------------------------------------------------------------------------
+// TiledImageFile
+//------------------------------------------------------------------------------
+
+TiledImageFile::TiledImageFile(const string &name) : filename(name),
+	valid(false), file(name.c_str(), std::ios_base::in | std::ios_base::binary)
+{
+	for (u_int i = 0; i < TEXTURE_TILE_CACHE_STRIPES; ++i)
+		residentTiles[i] = 0;
+	if (!file.is_open())
+		return;
+	if (!header.Read(file)) {
+		LOG(LUX_WARNING, LUX_BADFILE) << "Invalid tiled image file '" <<
+			filename << "'";
+		return;
+	}
+	tiles.resize(header.GetTileCount());
+	lruPos.resize(header.GetTileCount());
+	valid = true;
+}
+
+TiledImageFile::~TiledImageFile()
+{
+	TextureTileCache::Release(*this);
+}
+
+bool TiledImageFile::IsUpToDate(const string &sourceFilename) const
+{
+	boost::uint64_t size;
+	boost::int64_t time;
+	if (!SourceStamp(sourceFilename, &size, &time))
+		return false;
+	return size == header.sourceSize && time == header.sourceTime;
+}
+
+size_t TiledImageFile::GetResidentMemory() const
+{
+	// Statistics only, the counters are read without their stripe lock
+	size_t count = 0;
+	for (u_int i = 0; i < TEXTURE_TILE_CACHE_STRIPES; ++i)
+		count += residentTiles[i];
+	return count * header.GetTileBytes();
+}
+
+bool TiledImageFile::ReadTile(u_int index, char *data)
+{
+	const size_t bytes = header.GetTileBytes();
+	fast_mutex::scoped_lock lock(fileMutex);
+	file.clear();
+	file.seekg(header.dataOffset + static_cast<std::streamoff>(index) * bytes);
+	file.read(data, bytes);
+	return file.good();
+}
+
+string TiledImageFile::CachePath(const string &sourceFilename, u_int wrapMode,
+	u_int filterType, const string &cacheDir)
+{
+	boost::filesystem::path sourcePath(AdjustFilename(sourceFilename, true));
+	// The stored levels depend on the filter type, and on the wrap mode
+	// when the image needs to be resampled to a power of 2 resolution
+	const string name = sourcePath.filename().string() + "." +
+		boost::lexical_cast<string>(wrapMode) + "." +
+		boost::lexical_cast<string>(filterType) + ".luxtile";
+
+	if (!cacheDir.empty())
+		return (boost::filesystem::path(cacheDir) / name).string();
+	return (sourcePath.parent_path() / name).string();
+}
+
+bool TiledImageFile::SourceStamp(const string &sourceFilename,
+	boost::uint64_t *size, boost::int64_t *time)
+{
+	try {
+		boost::filesystem::path sourcePath(AdjustFilename(sourceFilename, true));
+		if (!boost::filesystem::exists(sourcePath))
+			return false;
+		*size = boost::filesystem::file_size(sourcePath);
+		*time = boost::filesystem::last_write_time(sourcePath);
+		return true;
+	} catch (const boost::filesystem::filesystem_error &) {
+		return false;
+	}
+}
+
+//------------------------------------------------------------------------------
+// TextureTileCache
+//------------------------------------------------------------------------------
+
+TextureTileCache::Stripe TextureTileCache::stripes[TEXTURE_TILE_CACHE_STRIPES];
+
+u_int TextureTileCache::StripeIndex(const TiledImageFile &file, u_int index)
+{
+	// Neighbour tiles of a file end up in different stripes
+	const size_t h = (reinterpret_cast<size_t>(&file) >> 4) ^
+		(index * 2654435761U);
+	return static_cast<u_int>((h ^ (h >> 16)) % TEXTURE_TILE_CACHE_STRIPES);
+}
+
+TextureTilePtr TextureTileCache::GetTile(TiledImageFile &file, u_int index)
+{
+	const u_int s = StripeIndex(file, index);
+	Stripe &stripe(stripes[s]);
+	{
+		boost::mutex::scoped_lock lock(stripe.mutex);
+		if (file.tiles[index]) {
+			// Move the tile in front of the LRU list
+			stripe.lru.splice(stripe.lru.begin(), stripe.lru,
+				file.lruPos[index]);
+			return file.tiles[index];
+		}
+	}
+
+	// Read the tile without holding the stripe lock so that other
+	// threads can keep on using resident tiles
+	TextureTilePtr tile(new TextureTile(file.header.GetTileBytes()));
+	if (!file.ReadTile(index, tile->data)) {
+		LOG(LUX_ERROR, LUX_BADFILE) << "Unable to read tile " << index <<
+			" from '" << file.filename << "'";
+		memset(tile->data, 0, file.header.GetTileBytes());
+	}
+
+	boost::mutex::scoped_lock lock(stripe.mutex);
+	// Another thread may have loaded the same tile in the meantime
+	if (file.tiles[index]) {
+		stripe.lru.splice(stripe.lru.begin(), stripe.lru,
+			file.lruPos[index]);
+		return file.tiles[index];
+	}
+	file.tiles[index] = tile;
+	stripe.lru.push_front(Entry(&file, index));
+	file.lruPos[index] = stripe.lru.begin();
+	++file.residentTiles[s];
+	stripe.memoryUsed += file.header.GetTileBytes();
+	Evict(stripe);
+
+	return tile;
+}
+
+void TextureTileCache::Evict(Stripe &stripe)
+{
+	// Tiles still referenced by a TileAccessor stay valid until released,
+	// always keep at least the most recent tile
+	while (stripe.memoryUsed > stripe.maxMemory && stripe.lru.size() > 1) {
+		const Entry &entry = stripe.lru.back();
+		TiledImageFile &file = *(entry.first);
+		file.tiles[entry.second].reset();
+		--file.residentTiles[StripeIndex(file, entry.second)];
+		stripe.memoryUsed -= file.header.GetTileBytes();
+		stripe.lru.pop_back();
+	}
+}
+
+void TextureTileCache::Release(TiledImageFile &file)
+{
+	for (u_int s = 0; s < TEXTURE_TILE_CACHE_STRIPES; ++s) {
+		Stripe &stripe(stripes[s]);
+		boost::mutex::scoped_lock lock(stripe.mutex);
+		if (file.residentTiles[s] == 0)
+			continue;
+		for (u_int i = 0; i < file.tiles.size(); ++i) {
+			if (!file.tiles[i] || StripeIndex(file, i) != s)
+				continue;
+			stripe.lru.erase(file.lruPos[i]);
+			file.tiles[i].reset();
+			stripe.memoryUsed -= file.header.GetTileBytes();
+		}
+		file.residentTiles[s] = 0;
+	}
+}
+
+void TextureTileCache::SetMaxMemory(size_t bytes)
+{
+	for (u_int s = 0; s < TEXTURE_TILE_CACHE_STRIPES; ++s) {
+		Stripe &stripe(stripes[s]);
+		boost::mutex::scoped_lock lock(stripe.mutex);
+		stripe.maxMemory = bytes / TEXTURE_TILE_CACHE_STRIPES;
+		Evict(stripe);
+	}
+}
+
+size_t TextureTileCache::GetMaxMemory()
+{
+	size_t bytes = 0;
+	for (u_int s = 0; s < TEXTURE_TILE_CACHE_STRIPES; ++s) {
+		boost::mutex::scoped_lock lock(stripes[s].mutex);
+		bytes += stripes[s].maxMemory;
+	}
+	return bytes;
+}
+
+size_t TextureTileCache::GetMemoryUsed()
+{
+	size_t bytes = 0;
+	for (u_int s = 0; s < TEXTURE_TILE_CACHE_STRIPES; ++s) {
+		boost::mutex::scoped_lock lock(stripes[s].mutex);
+		bytes += stripes[s].memoryUsed;
+	}
+	return bytes;
+}
@@ -0,0 +1,218 @@
+/***************************************************************************
+ *   Copyright (C) 1998-2013 by authors (see AUTHORS.txt)                  *
+ *                                                                         *
+ *   This file is part of LuxRender.                                       *
+ *                                                                         *
+ *   Lux Renderer is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   Lux Renderer is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+ *                                                                         *
+ *   This project is based on PBRT ; see http://www.pbrt.org               *
+ *   Lux Renderer website : http://www.luxrender.net                       *
+ ***************************************************************************/
+
+#ifndef LUX_TEXTURECACHE_H
+#define LUX_TEXTURECACHE_H
+// texturecache.h*
+
+#include "lux.h"
+#include "fastmutex.h"
+
+#include <list>
+#include <fstream>
+#include <boost/cstdint.hpp>
+#include <boost/thread/mutex.hpp>
+
+namespace lux
+{
+
+// Number of Channel values, see texturecolor.h
+#define TILED_IMAGE_CHANNEL_COUNT 6
+// Default tile edge in texels, must be a power of 2
+#define TILED_IMAGE_TILE_SIZE 64
+// Number of independently locked partitions of the tile cache
+#define TEXTURE_TILE_CACHE_STRIPES 16
+
+// Header of a pre-tiled, pre-mipmapped image file.
+// The file holds the MIPMap levels needed by the filter type it has been
+// built for (only the full resolution level for NEAREST and BILINEAR),
+// each one split in square tiles of
+// tileSize x tileSize texels. Tiles are stored level after level in
+// scanline order; border tiles are padded so that all tiles have the
+// same size and can be located with a single multiply-add.
+class TiledImageHeader {
+public:
+	TiledImageHeader() : pixelType(0), channels(0), texelSize(0),
+		tileSize(0), wrapMode(0), filterType(0), sourceSize(0), sourceTime(0),
+		dataOffset(0) {
+		for (u_int i = 0; i < TILED_IMAGE_CHANNEL_COUNT; ++i) {
+			minValue[i] = 0.f;
+			maxValue[i] = 0.f;
+		}
+	}
+
+	bool Read(std::istream &is);
+	void Write(std::ostream &os) const;
+
+	// Computes the tile layout once the level resolutions are known
+	void ComputeLayout();
+
+	u_int GetLevelCount() const { return uRes.size(); }
+	u_int GetTileCount() const {
+		return uRes.empty() ? 0 : firstTile.back() +
+			uTiles.back() * vTiles.back();
+	}
+	size_t GetTileBytes() const {
+		return static_cast<size_t>(tileSize) * tileSize * texelSize;
+	}
+	u_int TileIndex(u_int level, u_int s, u_int t) const {
+		return firstTile[level] + (t >> tileShift) * uTiles[level] +
+			(s >> tileShift);
+	}
+	u_int TexelIndex(u_int s, u_int t) const {
+		return ((t & tileMask) << tileShift) + (s & tileMask);
+	}
+
+	// Stored fields
+	u_int pixelType; // ImageData::PixelDataType
+	u_int channels;
+	u_int texelSize;
+	u_int tileSize;
+	u_int wrapMode; // ImageWrap used to build the pyramid
+	u_int filterType; // ImageTextureFilterType used to build the pyramid
+	boost::uint64_t sourceSize;
+	boost::int64_t sourceTime;
+	float minValue[TILED_IMAGE_CHANNEL_COUNT];
+	float maxValue[TILED_IMAGE_CHANNEL_COUNT];
+	vector<u_int> uRes, vRes;
+
+	// Derived fields
+	u_int tileShift, tileMask;
+	vector<u_int> uTiles, vTiles, firstTile;
+	std::streamoff dataOffset;
+};
+
+class TextureTile {
+public:
+	TextureTile(size_t bytes) : data(new char[bytes]) { }
+	~TextureTile() { delete[] data; }
+
+	char *data;
+private:
+	TextureTile(const TextureTile &);
+	TextureTile &operator=(const TextureTile &);
+};
+typedef boost::shared_ptr<TextureTile> TextureTilePtr;
+
+class TextureTileCache;
+
+// A tiled image file opened for on-demand tile reads
+class TiledImageFile {
+public:
+	TiledImageFile(const string &filename);
+	~TiledImageFile();
+
+	bool IsValid() const { return valid; }
+	const string &GetFilename() const { return filename; }
+	const TiledImageHeader &GetHeader() const { return header; }
+	// Checks that the file has been generated from the current version
+	// of the source image
+	bool IsUpToDate(const string &sourceFilename) const;
+	size_t GetResidentMemory() const;
+
+	// Returns the path of the tiled file for the given source image
+	static string CachePath(const string &sourceFilename,
+		u_int wrapMode, u_int filterType, const string &cacheDir);
+	// Retrieves the size and the modification time of a file
+	static bool SourceStamp(const string &sourceFilename,
+		boost::uint64_t *size, boost::int64_t *time);
+
+private:
+	friend class TextureTileCache;
+	bool ReadTile(u_int index, char *data);
+
+	string filename;
+	TiledImageHeader header;
+	bool valid;
+	std::ifstream file;
+	fast_mutex fileMutex;
+
+	// Resident tiles and their position in the LRU list, each entry
+	// is guarded by the mutex of the TextureTileCache stripe it maps to
+	vector<TextureTilePtr> tiles;
+	vector<std::list<std::pair<TiledImageFile *, u_int> >::iterator> lruPos;
+	u_int residentTiles[TEXTURE_TILE_CACHE_STRIPES];
+};
+
+// Process wide cache of texture tiles with a fixed memory budget.
+// Tiles are loaded the first time they are accessed and evicted
+// in least recently used order once the budget is exceeded.
+// The cache is split in stripes, each one with its own lock, LRU list
+// and share of the budget, so that render threads switching tiles
+// seldom contend for the same lock.
+class TextureTileCache {
+public:
+	static TextureTilePtr GetTile(TiledImageFile &file, u_int index);
+	// Drops all resident tiles of a file, used when the file is closed
+	static void Release(TiledImageFile &file);
+
+	static void SetMaxMemory(size_t bytes);
+	static size_t GetMaxMemory();
+	static size_t GetMemoryUsed();
+
+private:
+	typedef std::pair<TiledImageFile *, u_int> Entry;
+
+	class Stripe {
+	public:
+		// Default budget of 512MB shared by all the stripes
+		Stripe() : memoryUsed(0),
+			maxMemory(512 * 1024 * 1024 / TEXTURE_TILE_CACHE_STRIPES) { }
+
+		boost::mutex mutex;
+		std::list<Entry> lru;
+		size_t memoryUsed;
+		size_t maxMemory;
+	};
+
+	static u_int StripeIndex(const TiledImageFile &file, u_int index);
+	static void Evict(Stripe &stripe);
+
+	static Stripe stripes[TEXTURE_TILE_CACHE_STRIPES];
+};
+
+// Caches the last tile used so that consecutive texel fetches from
+// the same tile don't go through the cache lock
+class TileAccessor {
+public:
+	TileAccessor(TiledImageFile &f) : file(f), header(f.GetHeader()),
+		current(~0U) { }
+
+	const char *Texel(u_int level, u_int s, u_int t) {
+		const u_int index = header.TileIndex(level, s, t);
+		if (index != current) {
+			tile = TextureTileCache::GetTile(file, index);
+			current = index;
+		}
+		return tile->data + header.TexelIndex(s, t) * header.texelSize;
+	}
+
+private:
+	TiledImageFile &file;
+	const TiledImageHeader &header;
+	u_int current;
+	TextureTilePtr tile;
+};
+
+}//namespace lux
+
+#endif // LUX_TEXTURECACHE_H
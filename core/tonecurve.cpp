@@ -0,0 +1,68 @@
+/***************************************************************************
+ *   Copyright (C) 1998-2013 by authors (see AUTHORS.txt)                  *
+ *                                                                         *
+ *   This file is part of LuxRender.                                       *
+ *                                                                         *
+ *   Lux Renderer is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   Lux Renderer is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+ *                                                                         *
+ *   This project is based on PBRT ; see http://www.pbrt.org               *
+ *   Lux Renderer website : http://www.luxrender.net                       *
+ ***************************************************************************/
+
+// tonecurve.cpp*
+#include "tonecurve.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define LUX_TONECURVE_SSE2
+#include <emmintrin.h>
+#endif
+
+using namespace lux;
+
+void ToneCurve::Map(float *x, u_int count, u_int stride) const
+{
+	u_int i = 0;
+#if defined(LUX_TONECURVE_SSE2)
+	// The positions in the table and the interpolation are computed
+	// 4 values at a time, only the table reads are scalar
+	const __m128 offset = _mm_set1_ps(xMin);
+	const __m128 s = _mm_set1_ps(scale);
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 last = _mm_set1_ps(static_cast<float>(values.size() - 2));
+	const float *v = &values[0];
+	for (; i + 4 <= count; i += 4) {
+		float *p0 = x + i * stride;
+		float *p1 = p0 + stride;
+		float *p2 = p1 + stride;
+		float *p3 = p2 + stride;
+		const __m128 t = _mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_sub_ps(
+			_mm_set_ps(*p3, *p2, *p1, *p0), offset), s), zero), last);
+		const __m128i ti = _mm_cvttps_epi32(t);
+		const __m128 f = _mm_sub_ps(t, _mm_cvtepi32_ps(ti));
+		int idx[4];
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(idx), ti);
+		const __m128 a = _mm_set_ps(v[idx[3]], v[idx[2]], v[idx[1]], v[idx[0]]);
+		const __m128 b = _mm_set_ps(v[idx[3] + 1], v[idx[2] + 1],
+			v[idx[1] + 1], v[idx[0] + 1]);
+		float r[4];
+		_mm_storeu_ps(r, _mm_add_ps(a, _mm_mul_ps(f, _mm_sub_ps(b, a))));
+		*p0 = r[0];
+		*p1 = r[1];
+		*p2 = r[2];
+		*p3 = r[3];
+	}
+#endif
+	for (; i < count; ++i)
+		x[i * stride] = Map(x[i * stride]);
+}
@@ -0,0 +1,77 @@
+/***************************************************************************
+ *   Copyright (C) 1998-2013 by authors (see AUTHORS.txt)                  *
+ *                                                                         *
+ *   This file is part of LuxRender.                                       *
+ *                                                                         *
+ *   Lux Renderer is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   Lux Renderer is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+ *                                                                         *
+ *   This project is based on PBRT ; see http://www.pbrt.org               *
+ *   Lux Renderer website : http://www.luxrender.net                       *
+ ***************************************************************************/
+
+#ifndef LUX_TONECURVE_H
+#define LUX_TONECURVE_H
+// tonecurve.h*
+
+#include "lux.h"
+
+namespace lux {
+
+// Dense table of a curve sampled at regular intervals over [xMin, xMax]
+// and evaluated by linear interpolation, values outside of the range are
+// clamped to its ends.
+// Used to bake the camera response functions and the display gamma of
+// the imaging pipeline, the tables are only rebuilt when the curve changes.
+class ToneCurve {
+public:
+	ToneCurve() : xMin(0.f), xMax(0.f), scale(0.f) { }
+
+	// Samples f at size regularly spaced points
+	template <class F> void Build(F f, float minX, float maxX, u_int size) {
+		xMin = minX;
+		xMax = maxX;
+		size = max(size, 2U);
+		scale = maxX > minX ? (size - 1) / (maxX - minX) : 0.f;
+		// The last value is repeated so that the interpolation
+		// never reads past the end
+		values.resize(size + 1);
+		for (u_int i = 0; i < size; ++i)
+			values[i] = f(Lerp(static_cast<float>(i) / (size - 1),
+				minX, maxX));
+		values[size] = values[size - 1];
+	}
+	void Clear() { values.clear(); }
+	bool IsEmpty() const { return values.empty(); }
+
+	float Map(float x) const {
+		float t = (x - xMin) * scale;
+		// Also catches NaN values
+		if (!(t > 0.f))
+			t = 0.f;
+		else if (t > values.size() - 2)
+			t = values.size() - 2;
+		const u_int i = static_cast<u_int>(t);
+		return Lerp(t - i, values[i], values[i + 1]);
+	}
+	// Maps count values stored every stride floats in place
+	void Map(float *x, u_int count, u_int stride) const;
+
+private:
+	float xMin, xMax, scale;
+	vector<float> values;
+};
+
+}
+
+#endif // LUX_TONECURVE_H
@@ -29,6 +29,10 @@
 
 #include "luxrays/luxrays.h"
 
+#include <new>
+#include <algorithm>
+#include <boost/type_traits/alignment_of.hpp>
+
 namespace lux
 {
 
@@ -51,6 +55,86 @@ public:
 	virtual void Free(const Scene &scene) = 0;
 };
 
+// Lays out the arrays of a set of SurfaceIntegratorState in a single
+// allocation. There can be tens of thousands of states with hybrid
+// rendering, this saves the overhead of one heap block per array.
+// Every state registers its arrays in the same order after BeginState(),
+// the arrays registered at the same position by all the states are
+// stored next to each other, each one only aligned for its type.
+// The owner of the allocation releases it with FreeAligned() so only
+// types without destructor can be stored.
+class SurfaceIntegratorStateSlab {
+public:
+	SurfaceIntegratorStateSlab() : stateSection(0) { }
+
+	// Starts the registration of the arrays of a new state
+	void BeginState() { stateSection = 0; }
+
+	// Reserves an array of count elements, its address is stored in
+	// *array by Allocate()
+	template <class T> void Add(T **array, u_int count) {
+		Section section;
+		section.array = array;
+		section.index = stateSection++;
+		section.size = sizeof(T) * count;
+		section.alignment = boost::alignment_of<T>::value;
+		section.count = count;
+		section.place = &Place<T>;
+		sections.push_back(section);
+	}
+
+	// Allocates the memory, constructs the elements and sets the array
+	// pointers, the result must be freed with FreeAligned().
+	// The registered arrays are then forgotten so that the slab can
+	// be reused for another set of states.
+	char *Allocate(size_t *allocatedSize = NULL) {
+		std::stable_sort(sections.begin(), sections.end(),
+			SectionOrder());
+		size_t size = 0;
+		for (size_t i = 0; i < sections.size(); ++i) {
+			Section &section(sections[i]);
+			size = (size + section.alignment - 1) &
+				~(section.alignment - 1);
+			section.offset = size;
+			size += section.size;
+		}
+		char *memory = AllocAligned<char>(max<size_t>(size, 1));
+		for (size_t i = 0; i < sections.size(); ++i) {
+			const Section &section(sections[i]);
+			section.place(section.array, memory + section.offset,
+				section.count);
+		}
+		sections.clear();
+		if (allocatedSize)
+			*allocatedSize = size;
+		return memory;
+	}
+
+private:
+	struct Section {
+		void *array;
+		size_t offset, size, alignment;
+		u_int index, count;
+		void (*place)(void *array, char *memory, u_int count);
+	};
+	struct SectionOrder {
+		bool operator()(const Section &a, const Section &b) const {
+			return a.index < b.index;
+		}
+	};
+
+	template <class T> static void Place(void *array, char *memory,
+		u_int count) {
+		T *elements = reinterpret_cast<T *>(memory);
+		for (u_int i = 0; i < count; ++i)
+			new (elements + i) T();
+		*static_cast<T **>(array) = elements;
+	}
+
+	vector<Section> sections;
+	u_int stateSection;
+};
+
 class SurfaceIntegrator : public Integrator, public Queryable {
 public:
 	SurfaceIntegrator() : Queryable("surfaceintegrator") { }
@@ -62,7 +146,8 @@ public:
 	//FIXME: just to check SurfaceIntegratorRenderingHints light strategy, to remove
 	virtual bool CheckLightStrategy(const Scene &scene) const { return false; }
 	virtual SurfaceIntegratorState *NewState(const Scene &scene,
-		ContributionBuffer *contribBuffer, RandomGenerator *rng) {
+		ContributionBuffer *contribBuffer, RandomGenerator *rng,
+		SurfaceIntegratorStateSlab &slab) {
 		throw std::runtime_error("Internal error: called SurfaceIntegrator::NewSurfaceIntegratorState()");
 	}
 	virtual bool GenerateRays(const Scene &scene,
@@ -33,6 +33,7 @@
 
 // Lux headers
 #include "api.h"
+#include "film.h"
 #include "luxrays/core/color/color.h"
 
 // CPP API headers
@@ -515,6 +516,40 @@ const float* lux_wrapped_context::zBuffer()
 	checkContext();
 	return ctx->ZBuffer();
 }
+unsigned int lux_wrapped_context::framebufferVersion()
+{
+	boost::mutex::scoped_lock lock(ctxMutex);
+	checkContext();
+	return ctx->FramebufferVersion();
+}
+bool lux_wrapped_context::mapFramebuffer(lux_framebuffer_mapping *mapping)
+{
+	boost::shared_ptr<const lux::FramebufferSnapshot> snapshot;
+	{
+		boost::mutex::scoped_lock lock(ctxMutex);
+		checkContext();
+		snapshot = ctx->GetFramebufferSnapshot();
+	}
+	if (!snapshot) {
+		mapping->handle = NULL;
+		return false;
+	}
+
+	mapping->version = snapshot->version;
+	mapping->width = snapshot->width;
+	mapping->height = snapshot->height;
+	mapping->pixels = &(snapshot->pixels[0]);
+	mapping->floatPixels = &(snapshot->floatPixels[0]);
+	mapping->dirtyRectCount = snapshot->dirtyRects.size() / 4;
+	mapping->dirtyRects = snapshot->dirtyRects.empty() ? NULL : &(snapshot->dirtyRects[0]);
+	mapping->handle = new boost::shared_ptr<const lux::FramebufferSnapshot>(snapshot);
+	return true;
+}
+void lux_wrapped_context::unmapFramebuffer(lux_framebuffer_mapping *mapping)
+{
+	delete static_cast<boost::shared_ptr<const lux::FramebufferSnapshot> *>(mapping->handle);
+	mapping->handle = NULL;
+}
 const unsigned char* lux_wrapped_context::getHistogramImage(unsigned int width, unsigned int height, int options)
 {
 	boost::mutex::scoped_lock lock(ctxMutex);
@@ -118,6 +118,9 @@ public:
 	const float* floatFramebuffer();
 	const float* alphaBuffer();
 	const float* zBuffer();
+	unsigned int framebufferVersion();
+	bool mapFramebuffer(lux_framebuffer_mapping *mapping);
+	void unmapFramebuffer(lux_framebuffer_mapping *mapping);
 	const unsigned char* getHistogramImage(unsigned int width, unsigned int height, int options);
 
 	// Old-style parameter update interface
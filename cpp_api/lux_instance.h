@@ -28,6 +28,21 @@
 #include "luxrays/utils/exportdefs.h"
 #include "lux_paramset.h"
 
+// Read-only view of a published display image, filled by
+// lux_instance::mapFramebuffer. The buffers remain valid and unchanged
+// until the view is passed to lux_instance::unmapFramebuffer.
+struct lux_framebuffer_mapping {
+	unsigned int version;
+	unsigned int width, height;
+	const unsigned char *pixels; // RGB, 8 bits gamma corrected
+	const float *floatPixels; // RGB, linear
+	// Regions that changed since the previous version,
+	// as x, y, width, height tuples
+	unsigned int dirtyRectCount;
+	const unsigned int *dirtyRects;
+	void *handle;
+};
+
 // This is the CPP API Interface for LuxRender
 CPP_EXPORT class CPP_API lux_instance {
 public:
@@ -110,6 +125,9 @@ public:
 	virtual const float* floatFramebuffer() = 0;
 	virtual const float* alphaBuffer() = 0;
 	virtual const float* zBuffer() = 0;
+	virtual unsigned int framebufferVersion() = 0;
+	virtual bool mapFramebuffer(lux_framebuffer_mapping *mapping) = 0;
+	virtual void unmapFramebuffer(lux_framebuffer_mapping *mapping) = 0;
 	virtual const unsigned char* getHistogramImage(unsigned int width, unsigned int height, int options) = 0;
 
 	// Old-style parameter update interface
@@ -45,6 +45,7 @@
 
 #include <boost/thread/xtime.hpp>
 #include <boost/filesystem.hpp>
+#include <cstring>
 
 using namespace lux;
 
@@ -60,15 +61,18 @@ FlexImageFilm::FlexImageFilm(u_int xres, u_int yres, Filter *filt, u_int filtRes
 	float p_ReinhardBurn, float p_LinearSensitivity, float p_LinearExposure, float p_LinearFStop, float p_LinearGamma,
 	float p_ContrastYwa, int p_FalseMethod, int p_FalseColorScale, float p_FalseMaxSat, float p_FalseMinSat, const string &p_response, float p_Gamma,
 	const float cs_red[2], const float cs_green[2], const float cs_blue[2], const float whitepoint[2],
-	bool debugmode, int outlierk, int tilec, const double convstep, const string &samplingmapfilename, const bool disableNoiseMapUpd, 
+	bool debugmode, int outlierk, int tilec, const double convstep, u_int convtilesize, const string &samplingmapfilename, const bool disableNoiseMapUpd, 
 	bool bloomEnabled, float bloomRadius, float bloomWeight, bool vignettingEnabled, float vignettingScale, bool abberationEnabled, float abberationAmount, 
 	bool glareEnabled, float glareAmount, float glareRadius, int glareBlades, float glareThreshold, const string &pupilmap, const string &lashesmap) :
 	Film(xres, yres, filt, filtRes, crop, filename1, premult, cw_EXR_ZBuf || cw_PNG_ZBuf || cw_TGA_ZBuf, w_resume_FLM, 
 		restart_resume_FLM, write_FLM_direct, haltspp, halttime, haltthreshold, debugmode, outlierk, tilec, samplingmapfilename), 
-	framebuffer(NULL), float_framebuffer(NULL), alpha_buffer(NULL), z_buffer(NULL),
+	framebuffer(NULL), float_framebuffer(NULL),
+	legacy_framebuffer(NULL), legacy_float_framebuffer(NULL),
+	alpha_buffer(NULL), z_buffer(NULL),
 	writeInterval(wI), flmWriteInterval(fwI), displayInterval(dI), convUpdateThread(NULL), convUpdateStep(convstep), disableNoiseMapUpdate(disableNoiseMapUpd)
 {
 	colorSpace = ColorSystem(cs_red[0], cs_red[1], cs_green[0], cs_green[1], cs_blue[0], cs_blue[1], whitepoint[0], whitepoint[1], 1.f);
+	convergenceTileSize = convtilesize;
 
 	// Set Image Output parameters
 	clampMethod = d_clampMethod = cM;
@@ -499,7 +503,7 @@ void FlexImageFilm::SetParameterValue(luxComponentParameters param, double value
 
 	// Reset the convergence test
 	if (convTest) {
-		boost::mutex::scoped_lock(write_mutex);
+		boost::mutex::scoped_lock lock(write_mutex);
 		convTest->Reset();
 	}
 }
@@ -958,7 +962,7 @@ void FlexImageFilm::SetStringParameterValue(luxComponentParameters param, const
 
 	// Reset the convergence test
 	if (convTest) {
-		boost::mutex::scoped_lock(write_mutex);
+		boost::mutex::scoped_lock lock(write_mutex);
 		convTest->Reset();
 	}
 }
@@ -1115,6 +1119,18 @@ vector<RGBColor>& FlexImageFilm::ApplyPipeline(const ColorSystem &colorSpace, ve
 	return reinterpret_cast<vector<RGBColor> &>(xyzcolor);
 }
 
+// Number of entries of the display gamma curve, values are clamped
+// to [0, 1] before the correction
+#define GAMMA_CURVE_SIZE 16384
+
+namespace {
+struct GammaFunction {
+	GammaFunction(float g) : invGamma(g) { }
+	float operator()(float x) const { return powf(x, invGamma); }
+	float invGamma;
+};
+}
+
 bool FlexImageFilm::WriteImage2(ImageType type, vector<XYZColor> &xyzcolor, vector<float> &alpha, string postfix)
 {
 	bool result = true;
@@ -1211,8 +1227,20 @@ bool FlexImageFilm::WriteImage2(ImageType type, vector<XYZColor> &xyzcolor, vect
 
 			// Apply gamma correction
 			const float invGamma = 1.f / m_Gamma;
-			for (u_int i = 0; i < nPix; ++i) {
-				rgbcolor[i] = rgbcolor[i].Pow(invGamma);
+			if ((type & IMAGE_FILEOUTPUT) && (write_TGA || write_PNG)) {
+				for (u_int i = 0; i < nPix; ++i) {
+					rgbcolor[i] = rgbcolor[i].Pow(invGamma);
+				}
+			} else {
+				// Only the 8 bits framebuffer needs the corrected
+				// values, the baked curve is precise enough for it
+				if (gammaCurve.IsEmpty() || gammaCurveGamma != m_Gamma) {
+					gammaCurve.Build(GammaFunction(invGamma), 0.f, 1.f,
+						GAMMA_CURVE_SIZE);
+					gammaCurveGamma = m_Gamma;
+				}
+				gammaCurve.Map(&rgbcolor[0].c[0],
+					nPix * (sizeof(RGBColor) / sizeof(float)), 1);
 			}
 
 			// write out tonemapped TGA
@@ -1367,7 +1395,7 @@ bool FlexImageFilm::WriteImage(ImageType type)
 {
 	// ensure we dont try to perform multiple writes at once
 	// needed since we can't put the pool lock up here
-	boost::mutex::scoped_lock(write_mutex);
+	boost::mutex::scoped_lock lock(write_mutex);
 	
 	// check if film is initialized
 	if (!contribPool)
@@ -1489,6 +1517,11 @@ bool FlexImageFilm::WriteImage(ImageType type)
 	m_FalseAvgLum = Y;
 
 	result &= WriteImage2(type, pixels, alpha, "");
+
+	// Make the new display image available
+	if (type & IMAGE_FRAMEBUFFER)
+		PublishFrameBuffer();
+
 	return result;
 }
 
@@ -1621,8 +1654,12 @@ void FlexImageFilm::createFrameBuffer()
 	boost::mutex::scoped_lock lock(framebufferMutex);
 
 	// allocate pixels and zero out
-	allocate_framebuffer(&framebuffer, xResolution, yResolution, 3);
-	allocate_framebuffer(&float_framebuffer, xResolution, yResolution, 3);
+	if (!framebuffer) {
+		frontFramebuffer.reset(new FramebufferSnapshot(xResolution, yResolution));
+		backFramebuffer.reset(new FramebufferSnapshot(xResolution, yResolution));
+		framebuffer = &(backFramebuffer->pixels[0]);
+		float_framebuffer = &(backFramebuffer->floatPixels[0]);
+	}
 	allocate_framebuffer(&alpha_buffer, xResolution, yResolution, 1);
 	allocate_framebuffer(&z_buffer, xResolution, yResolution, 1);
 }
@@ -1640,7 +1677,12 @@ unsigned char* FlexImageFilm::getFrameBuffer()
 	if(!framebuffer)
 		createFrameBuffer();
 
-	return framebuffer;
+	boost::mutex::scoped_lock lock(framebufferMutex);
+	if (!legacy_framebuffer)
+		allocate_framebuffer(&legacy_framebuffer, xResolution, yResolution, 3);
+	std::copy(frontFramebuffer->pixels.begin(),
+		frontFramebuffer->pixels.end(), legacy_framebuffer);
+	return legacy_framebuffer;
 }
 
 float* FlexImageFilm::getFloatFrameBuffer()
@@ -1648,7 +1690,97 @@ float* FlexImageFilm::getFloatFrameBuffer()
 	if (!float_framebuffer)
 		createFrameBuffer();
 
-	return float_framebuffer;
+	boost::mutex::scoped_lock lock(framebufferMutex);
+	if (!legacy_float_framebuffer)
+		allocate_framebuffer(&legacy_float_framebuffer, xResolution, yResolution, 3);
+	std::copy(frontFramebuffer->floatPixels.begin(),
+		frontFramebuffer->floatPixels.end(), legacy_float_framebuffer);
+	return legacy_float_framebuffer;
+}
+
+boost::shared_ptr<const FramebufferSnapshot> FlexImageFilm::getFrameBufferSnapshot()
+{
+	if (!framebuffer)
+		createFrameBuffer();
+
+	boost::mutex::scoped_lock lock(framebufferMutex);
+	return frontFramebuffer;
+}
+
+u_int FlexImageFilm::getFrameBufferVersion()
+{
+	boost::mutex::scoped_lock lock(framebufferMutex);
+	return frontFramebuffer ? frontFramebuffer->version : 0;
+}
+
+// Size of the tiles compared to find the regions of the display image
+// that changed between two versions
+#define FRAMEBUFFER_DIRTY_TILE_SIZE 32
+
+static void AddDirtyRect(vector<u_int> &rects, u_int x, u_int y,
+	u_int width, u_int height)
+{
+	rects.push_back(x);
+	rects.push_back(y);
+	rects.push_back(width);
+	rects.push_back(height);
+}
+
+void FlexImageFilm::PublishFrameBuffer()
+{
+	boost::mutex::scoped_lock lock(framebufferMutex);
+
+	const FramebufferSnapshot &front(*frontFramebuffer);
+	FramebufferSnapshot &back(*backFramebuffer);
+
+	back.version = front.version + 1;
+	back.dirtyRects.clear();
+	if (front.version == 0) {
+		// Nothing was published yet, the whole image is new
+		AddDirtyRect(back.dirtyRects, 0, 0, xResolution, yResolution);
+	} else {
+		// Compare the tiles of both images, the dirty tiles of
+		// a row are merged into horizontal runs
+		const u_int tileSize = FRAMEBUFFER_DIRTY_TILE_SIZE;
+		for (u_int ty = 0; ty < yResolution; ty += tileSize) {
+			const u_int th = min(tileSize, yResolution - ty);
+			u_int runStart = 0;
+			bool inRun = false;
+			for (u_int tx = 0; tx < xResolution; tx += tileSize) {
+				const u_int tw = min(tileSize, xResolution - tx);
+				bool dirty = false;
+				for (u_int y = ty; y < ty + th && !dirty; ++y) {
+					const u_int offset = 3 * (y * xResolution + tx);
+					dirty = memcmp(&back.floatPixels[offset],
+						&front.floatPixels[offset],
+						3 * tw * sizeof(float)) != 0 ||
+						memcmp(&back.pixels[offset],
+						&front.pixels[offset], 3 * tw) != 0;
+				}
+
+				if (dirty && !inRun) {
+					runStart = tx;
+					inRun = true;
+				} else if (!dirty && inRun) {
+					AddDirtyRect(back.dirtyRects, runStart, ty,
+						tx - runStart, th);
+					inRun = false;
+				}
+			}
+			if (inRun)
+				AddDirtyRect(back.dirtyRects, runStart, ty,
+					xResolution - runStart, th);
+		}
+	}
+
+	frontFramebuffer.swap(backFramebuffer);
+
+	// The previous image is recycled as the next back buffer, unless
+	// it is still held by an application
+	if (!backFramebuffer.unique())
+		backFramebuffer.reset(new FramebufferSnapshot(xResolution, yResolution));
+	framebuffer = &(backFramebuffer->pixels[0]);
+	float_framebuffer = &(backFramebuffer->floatPixels[0]);
 }
 
 float* FlexImageFilm::getAlphaBuffer()
@@ -1765,9 +1897,11 @@ void FlexImageFilm::ConvUpdateThreadImpl(FlexImageFilm *film, Context *ctx) {
 	while (!boost::this_thread::interruption_requested()) {
 		boost::this_thread::sleep(boost::posix_time::seconds(1));
 
-		// Check the amount of samples per pixel rendered
+		// Check the amount of samples per pixel rendered, converged tiles
+		// don't receive samples anymore
 		const double totalSamplesCount = film->numberOfLocalSamples + film->numberOfSamplesFromNetwork;
-		const double sppDelta = (totalSamplesCount - lastCheckSamplesCount) / nPix;
+		const double sppDelta = (totalSamplesCount - lastCheckSamplesCount) /
+			max(1U, film->GetUnconvergedPixels());
 
 		if (sppDelta > film->convUpdateStep) {
 			lastCheckSamplesCount = totalSamplesCount;
@@ -1775,15 +1909,19 @@ void FlexImageFilm::ConvUpdateThreadImpl(FlexImageFilm *film, Context *ctx) {
 			// First of all I have to update the frame buffer
 			film->updateFrameBuffer();
 
+			// Hold the display image so that it isn't recycled while
+			// the convergence test reads it
+			boost::shared_ptr<const FramebufferSnapshot> displayImage(film->getFrameBufferSnapshot());
+
 			bool noiseAwareMapUpdated = false;
 			{
 				// Lock the frame buffer
-				boost::mutex::scoped_lock(film->write_mutex);
+				boost::mutex::scoped_lock lock(film->write_mutex);
 
 				bool convergenceInfoUpdated = false;
 				if (film->haltThreshold >= 0.f) {
 					// Than run the convergence test
-					film->UpdateConvergenceInfo(film->float_framebuffer);
+					film->UpdateConvergenceInfo(&(displayImage->floatPixels[0]));
 					LOG(LUX_DEBUG, LUX_NOERROR) << "Convergence test result: " << film->haltThresholdComplete;
 					convergenceInfoUpdated = true;
 				}
@@ -1794,7 +1932,7 @@ void FlexImageFilm::ConvUpdateThreadImpl(FlexImageFilm *film, Context *ctx) {
 					if (sppNoiseAwareDelta > noiseAwareStep) {
 						if (!convergenceInfoUpdated) {
 							// I have to run the convergence test for TVI information
-							film->UpdateConvergenceInfo(film->float_framebuffer);
+							film->UpdateConvergenceInfo(&(displayImage->floatPixels[0]));
 							LOG(LUX_DEBUG, LUX_NOERROR) << "Convergence test result: " << film->haltThresholdComplete;
 						}
 
@@ -1990,6 +2128,9 @@ Film* FlexImageFilm::CreateFilm(const ParamSet &params, Filter *filter)
 	const int halttime = params.FindOneInt("halttime", -1);
 	const float haltthreshold = params.FindOneFloat("haltthreshold", -1.f);
 	const double convUpdateStep = max(4.0, (double)params.FindOneFloat("convergencestep", 32.f));
+	// Size of the tiles that stop receiving samples once they pass the
+	// convergence test, 0 disables it
+	const u_int convTileSize = max(0, params.FindOneInt("convergencetilesize", 0));
 	// This flag is used by network slaves and it is not intended to be used directly in .lxs files
 	const bool disableNoiseMapUpdate = params.FindOneBool("disable_noisemap_update", false);
 
@@ -2104,7 +2245,7 @@ Film* FlexImageFilm::CreateFilm(const ParamSet &params, Filter *filter)
 		w_resume_FLM, restart_resume_FLM, w_FLM_direct, haltspp, halttime, haltthreshold,
 		s_TonemapKernel, s_ReinhardPreScale, s_ReinhardPostScale, s_ReinhardBurn, s_LinearSensitivity,
 		s_LinearExposure, s_LinearFStop, s_LinearGamma, s_ContrastYwa, s_FalseMethod, s_FalseScalecolor, s_FalseMaxSat, s_FalseMinSat, response, s_Gamma,
-		red, green, blue, white, debug_mode, outlierrejection_k, tilecount, convUpdateStep, samplingmapfilename, disableNoiseMapUpdate,
+		red, green, blue, white, debug_mode, outlierrejection_k, tilecount, convUpdateStep, convTileSize, samplingmapfilename, disableNoiseMapUpdate,
 		bloomEnabled, bloomRadius, bloomWeight, vignettingEnabled, vignettingScale, abberationEnabled, abberationAmount, 
 		glareEnabled, glareAmount, glareRadius, glareBlades, glareThreshold, s_GlarePupilFilename, s_GlareLashesFilename);
 }
@@ -30,6 +30,7 @@
 #include "luxrays/core/color/color.h"
 #include "paramset.h"
 #include "tonemap.h"
+#include "tonecurve.h"
 #include "sampling.h"
 #include <boost/thread/mutex.hpp>
 
@@ -55,7 +56,7 @@ public:
 		float p_ReinhardBurn, float p_LinearSensitivity, float p_LinearExposure, float p_LinearFStop, float p_LinearGamma,
 		float p_ContrastDisplayAdaptionY, int p_FalseMethod, int p_FalseColorScale, float p_FalseMaxSat, float p_FalseMinSat, const string &response, float p_Gamma,
 		const float cs_red[2], const float cs_green[2], const float cs_blue[2], const float whitepoint[2],
-		bool debugmode, int outlierk, int tilecount, const double convstep, const string &samplingmapfilename, const bool disableNoiseMapUpd,
+		bool debugmode, int outlierk, int tilecount, const double convstep, u_int convtilesize, const string &samplingmapfilename, const bool disableNoiseMapUpd,
 		bool bloomEnabled, float bloomRadius, float bloomWeight, bool vignettingEnabled, float vignettingScale, bool abberationEnabled, float abberationAmount, 
 		bool glareEnabled, float glareAmount, float glareRadius, int glareBlades, float glareThreshold, const string &pupilmap, const string &lashesmap);
 
@@ -65,8 +66,9 @@ public:
 			convUpdateThread->join();
 		}
 
-		delete[] framebuffer;
-		delete[] float_framebuffer;
+		// framebuffer and float_framebuffer belong to the snapshots
+		delete[] legacy_framebuffer;
+		delete[] legacy_float_framebuffer;
 		delete[] alpha_buffer;
 		delete[] z_buffer;
 		delete convUpdateThread;
@@ -81,6 +83,8 @@ public:
 	virtual void updateFrameBuffer();
 	virtual unsigned char* getFrameBuffer();
 	virtual float* getFloatFrameBuffer();
+	virtual boost::shared_ptr<const FramebufferSnapshot> getFrameBufferSnapshot();
+	virtual u_int getFrameBufferVersion();
 	virtual float* getAlphaBuffer();
 	virtual float* getZBuffer();
 	virtual void createFrameBuffer();
@@ -110,13 +114,23 @@ private:
 	bool WriteTGAImage(vector<RGBColor> &rgb, vector<float> &alpha, const string &filename);
 	bool WritePNGImage(vector<RGBColor> &rgb, vector<float> &alpha, const string &filename);
 	bool WriteEXRImage(vector<RGBColor> &rgb, vector<float> &alpha, const string &filename, vector<float> &zbuf);
+	void PublishFrameBuffer();
 
 	// FlexImageFilm Private Data
 	// mutex is used for protecting the framebuffer pointer
 	// not reading/writing to the framebuffer
 	boost::mutex framebufferMutex;
+	// The display image is double buffered: the imaging pipeline writes
+	// into the back snapshot, framebuffer and float_framebuffer point to
+	// its buffers, which then replaces the published front snapshot
+	boost::shared_ptr<FramebufferSnapshot> frontFramebuffer, backFramebuffer;
 	unsigned char *framebuffer;
 	float *float_framebuffer;
+	// Copies of the front snapshot returned by getFrameBuffer() and
+	// getFloatFrameBuffer(), the snapshots themselves are only handed
+	// out by getFrameBufferSnapshot() so that they can be recycled
+	unsigned char *legacy_framebuffer;
+	float *legacy_float_framebuffer;
 	float *alpha_buffer;
 	float *z_buffer;
 
@@ -129,6 +143,9 @@ private:
 	float m_RGB_X_Blue, d_RGB_X_Blue;
 	float m_RGB_Y_Blue, d_RGB_Y_Blue;
 	float m_Gamma, d_Gamma;
+	// Display gamma correction baked for m_Gamma
+	ToneCurve gammaCurve;
+	float gammaCurveGamma;
 	int clampMethod, d_clampMethod;
 
 	int m_TonemapKernel, d_TonemapKernel;
@@ -40,6 +40,7 @@ namespace lux
 		}
 		virtual ~BlackmanHarrisFilter() { }
 		virtual float Evaluate(float x, float y) const;
+		virtual bool IsSeparable() const { return true; }
 		
 		static Filter *CreateFilter(const ParamSet &ps);
 	private:
@@ -39,6 +39,7 @@ public:
 	}
 	virtual ~BoxFilter() { }
 	virtual float Evaluate(float x, float y) const;
+	virtual bool IsSeparable() const { return true; }
 	
 	static Filter *CreateFilter(const ParamSet &ps);
 };
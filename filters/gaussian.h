@@ -44,6 +44,7 @@ public:
 	}
 	virtual ~GaussianFilter() { }
 	virtual float Evaluate(float x, float y) const;
+	virtual bool IsSeparable() const { return true; }
 
 	float GetAlpha() const { return alpha; }
 	
@@ -28,14 +28,12 @@ using namespace lux;
 
 // Mitchell Filter Method Definitions
 float MitchellFilter::Evaluate(float x, float y) const {
+	if (separable)
+		return MitchellSS(fabsf(x * invXWidth)) *
+			MitchellSS(fabsf(y * invYWidth));
 	const float distance = sqrtf(x * x * invXWidth * invXWidth +
 		y * y * invYWidth * invYWidth);
-	if (!super)
-		return Mitchell1D(distance);
-	const float dist = distance / .6f;
-	return a1 * Mitchell1D(dist - 2.f / 3.f) +
-		a0 * Mitchell1D(dist) +
-		a1 * Mitchell1D(dist + 2.f / 3.f);
+	return MitchellSS(distance);
 }
 Filter* MitchellFilter::CreateFilter(const ParamSet &ps) {
 	// Find common filter parameters
@@ -44,7 +42,8 @@ Filter* MitchellFilter::CreateFilter(const ParamSet &ps) {
 	float B = ps.FindOneFloat("B", 1.f/3.f);
 	float C = ps.FindOneFloat("C", 1.f/3.f);
 	bool sup = ps.FindOneBool("supersample", false);
-	return new MitchellFilter(sup, B, C, xw, yw);
+	bool sep = ps.FindOneBool("separable", false);
+	return new MitchellFilter(sup, sep, B, C, xw, yw);
 }
 
 static DynamicLoader::RegisterFilter<MitchellFilter> r("mitchell");
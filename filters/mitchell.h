@@ -34,9 +34,9 @@ namespace lux
 class MitchellFilter : public Filter {
 public:
 	// MitchellFilter Public Methods
-	MitchellFilter(bool sup, float b, float c, float xw, float yw)
+	MitchellFilter(bool sup, bool sep, float b, float c, float xw, float yw)
 		: Filter(sup ? xw * 5.f / 3.f : xw, sup ? yw * 5.f / 3.f : yw),
-		super(sup), B(b), C(c),
+		super(sup), separable(sep), B(b), C(c),
 		a0((76.f - 16.f * B + 8.f * C) / 81.f), a1((1.f - a0)/ 2.f) {
 		if (super)
 			AddStringConstant(*this, "type", "Filter type", "mitchell_ss");
@@ -45,6 +45,9 @@ public:
 	}
 	virtual ~MitchellFilter() { }
 	virtual float Evaluate(float x, float y) const;
+	// The separable variant is the product of the 1D filters along x and y
+	// instead of the 1D filter of the radial distance
+	virtual bool IsSeparable() const { return separable; }
 	
 	float GetB() const { return B; }
 	float GetC() const { return C; }
@@ -63,7 +66,15 @@ private:
 				(-3.f + 2.f*B + C)) * x*x +
 				(1.f - B/3.f);
 	}
-	const bool super;
+	float MitchellSS(float distance) const {
+		if (!super)
+			return Mitchell1D(distance);
+		const float dist = distance / .6f;
+		return a1 * Mitchell1D(dist - 2.f / 3.f) +
+			a0 * Mitchell1D(dist) +
+			a1 * Mitchell1D(dist + 2.f / 3.f);
+	}
+	const bool super, separable;
 	const float B, C, a0, a1;
 };
 
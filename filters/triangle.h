@@ -38,6 +38,7 @@ public:
 	}
 	virtual ~TriangleFilter() { }
 	virtual float Evaluate(float x, float y) const;
+	virtual bool IsSeparable() const { return true; }
 	
 	static Filter *CreateFilter(const ParamSet &ps);
 };
@@ -441,7 +441,7 @@ u_int BidirIntegrator::Li(const Scene &scene, const Sample &sample) const
 		float dWeight, dPdf;
 		float portal = directData0[offset];
 		const Light *light = lightDirectStrategy->SampleLight(scene, l,
-			&portal, &dPdf);
+			eye0.p, &portal, &dPdf);
 		if (!light)
 			break;
 		dPdf *= shadowRayCount;
@@ -540,7 +540,7 @@ u_int BidirIntegrator::Li(const Scene &scene, const Sample &sample) const
 					v.dAWeight *= lightPathStrategy->Pdf(scene,
 						lightNumber) * lightRayCount;
 					ePdfDirect *= lightDirectStrategy->Pdf(scene,
-						lightNumber) * shadowRayCount;
+						vp.p, lightNumber) * shadowRayCount;
 					vp.dAWeight = v.pdf * v.tPdf *
 						spdf / vp.d2;
 					if (!vp.bsdf->dgShading.scattered)
@@ -596,7 +596,7 @@ u_int BidirIntegrator::Li(const Scene &scene, const Sample &sample) const
 				v.dAWeight *= lightPathStrategy->Pdf(scene,
 					isect.arealight) * lightRayCount;
 				ePdfDirect *= lightDirectStrategy->Pdf(scene,
-					isect.arealight) * shadowRayCount;
+					vp.p, isect.arealight) * shadowRayCount;
 				vp.dAWeight = v.pdf * v.tPdf / vp.d2;
 				if (!vp.bsdf->dgShading.scattered)
 					vp.dAWeight *= vp.cosi;
@@ -618,7 +618,7 @@ u_int BidirIntegrator::Li(const Scene &scene, const Sample &sample) const
 				float portal = directData[offset];
 				const Light *directLight =
 					lightDirectStrategy->SampleLight(scene,
-					l, &portal, &dPdf);
+					l, v.p, &portal, &dPdf);
 				if (!directLight)
 					break;
 				dPdf *= shadowRayCount;
@@ -697,7 +697,9 @@ u_int BidirIntegrator::Li(const Scene &scene, const Sample &sample) const
 			break;
 		lPdf *= lightRayCount;
 		const u_int lightGroup = light->group;
-		const float directWeight = lightDirectStrategy->Pdf(scene, light) * shadowRayCount;
+		// The direct lighting probability of the light depends on the
+		// illuminated point with some strategies
+		const u_int lightIndex = light->index;
 		for (u_int r = 0; r < lightRayCount; ++r) {
 			component = sample.sampler->GetOneD(sample,
 				lightPortalOffset, l * lightRayCount + r);
@@ -744,7 +746,8 @@ u_int BidirIntegrator::Li(const Scene &scene, const Sample &sample) const
 						// Compute direct lighting pdf for first light vertex
 						const float directPdf = light->Pdf(vE.p,
 							light0.bsdf->dgShading) *
-							directWeight;
+							lightDirectStrategy->Pdf(scene,
+							vE.p, lightIndex) * shadowRayCount;
 						if (vE.bsdf->NumComponents(BxDFType(~BSDF_SPECULAR)) == 0)
 							continue;
 						SWCSpectrum Ll(Le);
@@ -842,7 +845,8 @@ u_int BidirIntegrator::Li(const Scene &scene, const Sample &sample) const
 						if (nLight == 2)
 							lightDirectPdf = light->Pdf(v.p,
 								vp.bsdf->dgShading) *
-								directWeight;
+								lightDirectStrategy->Pdf(scene,
+								v.p, lightIndex) * shadowRayCount;
 
 						// Connect eye subpath to light subpath
 						// Go through all eye vertices
@@ -962,7 +966,8 @@ u_int BidirIntegrator::Li(const Scene &scene, const Sample &sample) const
 // be traced on the GPUs.
 //------------------------------------------------------------------------------
 
-BidirPathState::BidirPathState(const Scene &scene, ContributionBuffer *contribBuffer, RandomGenerator *rng) {
+BidirPathState::BidirPathState(const Scene &scene, ContributionBuffer *contribBuffer,
+	RandomGenerator *rng, SurfaceIntegratorStateSlab &slab) {
 	BidirIntegrator *bidir = (BidirIntegrator *)scene.surfaceIntegrator;
 
 	// Some sampler may have to use the RandomNumber generator in InitSample()
@@ -972,24 +977,21 @@ BidirPathState::BidirPathState(const Scene &scene, ContributionBuffer *contribBu
 	sample.camera = scene.camera()->Clone();
 	sample.realTime = 0.f;
 
-	eyePath = new BidirStateVertex[bidir->maxEyeDepth];
 	eyePathLength = 0;
-
-	lightPath = new BidirStateVertex[bidir->maxLightDepth];
 	lightPathLength = 0;
 
-	Ld = new SWCSpectrum[bidir->maxEyeDepth];
-	LdGroup = new u_int[bidir->maxEyeDepth];
-
-	Lc = new SWCSpectrum[bidir->maxEyeDepth * bidir->maxLightDepth];
-
-	LlightPath = new SWCSpectrum[bidir->maxLightDepth];
-	distanceLightPath = new float[bidir->maxLightDepth];
-	imageXYLightPath = new float[2 * bidir->maxLightDepth];
-
+	// The arrays are allocated by the SurfaceIntegratorStateBuffer
 	const u_int lightGroupCount = scene.lightGroups.size();
-	L = new SWCSpectrum[lightGroupCount];
-	V = new float[lightGroupCount];
+	slab.Add(&eyePath, bidir->maxEyeDepth);
+	slab.Add(&lightPath, bidir->maxLightDepth);
+	slab.Add(&Ld, bidir->maxEyeDepth);
+	slab.Add(&LdGroup, bidir->maxEyeDepth);
+	slab.Add(&Lc, bidir->maxEyeDepth * bidir->maxLightDepth);
+	slab.Add(&LlightPath, bidir->maxLightDepth);
+	slab.Add(&distanceLightPath, bidir->maxLightDepth);
+	slab.Add(&imageXYLightPath, 2 * bidir->maxLightDepth);
+	slab.Add(&L, lightGroupCount);
+	slab.Add(&V, lightGroupCount);
 
 	state = TO_INIT;
 }
@@ -1391,13 +1393,6 @@ bool BidirPathState::Init(const Scene &scene) {
 }
 
 void BidirPathState::Free(const Scene &scene) {
-	delete[] eyePath;
-	delete[] lightPath;
-	delete[] LlightPath;
-	delete[] distanceLightPath;
-	delete[] imageXYLightPath;
-	delete[] L;
-	delete[] V;
 	scene.sampler->FreeSample(&sample);
 }
 
@@ -1847,8 +1842,9 @@ void BidirPathState::Terminate(const Scene &scene,
 //------------------------------------------------------------------------------
 
 SurfaceIntegratorState *BidirIntegrator::NewState(const Scene &scene,
-		ContributionBuffer *contribBuffer, RandomGenerator *rng) {
-	return new BidirPathState(scene, contribBuffer, rng);
+		ContributionBuffer *contribBuffer, RandomGenerator *rng,
+		SurfaceIntegratorStateSlab &slab) {
+	return new BidirPathState(scene, contribBuffer, rng, slab);
 }
 
 bool BidirIntegrator::GenerateRays(const Scene &scene,
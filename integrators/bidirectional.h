@@ -37,7 +37,8 @@ public:
 		TO_INIT, TRACE_SHADOWRAYS, TERMINATE
 	};
 
-	BidirPathState(const Scene &scene, ContributionBuffer *contribBuffer, RandomGenerator *rng);
+	BidirPathState(const Scene &scene, ContributionBuffer *contribBuffer,
+		RandomGenerator *rng, SurfaceIntegratorStateSlab &slab);
 	~BidirPathState() {	}
 
 	bool Init(const Scene &scene);
@@ -173,7 +174,8 @@ public:
 		return true;
 	}
 	virtual SurfaceIntegratorState *NewState(const Scene &scene,
-		ContributionBuffer *contribBuffer, RandomGenerator *rng);
+		ContributionBuffer *contribBuffer, RandomGenerator *rng,
+		SurfaceIntegratorStateSlab &slab);
 	virtual bool GenerateRays(const Scene &scene,
 		SurfaceIntegratorState *state, luxrays::RayBuffer *rayBuffer);
 	virtual bool NextState(const Scene &scene, SurfaceIntegratorState *state,
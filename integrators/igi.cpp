@@ -34,6 +34,8 @@
 
 #include "luxrays/utils/mc.h"
 
+#include <algorithm>
+
 using namespace luxrays;
 using namespace lux;
 
@@ -55,14 +57,97 @@ SWCSpectrum VirtualLight::GetSWCSpectrum(const SpectrumWavelengths &sw) const
 	return result;
 }
 
+// Lightcuts helpers
+namespace {
+
+struct CompareLightPosition {
+	CompareLightPosition(const vector<VirtualLight> &l, u_int a) :
+		lights(l), axis(a) { }
+	bool operator()(u_int l1, u_int l2) const {
+		return lights[l1].p[axis] < lights[l2].p[axis];
+	}
+	const vector<VirtualLight> &lights;
+	u_int axis;
+};
+
+// A cluster of the current cut
+struct CutCluster {
+	u_int node;
+	// Upper bound of the error of the cluster estimate
+	float error;
+	// Estimated contribution of the cluster and unscaled contribution of
+	// its representative, which is reused by the child sharing it
+	SWCSpectrum L, representativeL;
+};
+
+struct CompareCutError {
+	bool operator()(const CutCluster &c1, const CutCluster &c2) const {
+		return c1.error < c2.error;
+	}
+};
+
+}
+
+// Upper bound of the geometric term times the receiver cosine between p
+// and any point of the box, the cosine at the virtual lights is bounded
+// by 1
+static float ClusterBound(const Point &p, const Normal &n, float gLimit,
+	const BBox &bound)
+{
+	float d2 = 0.f;
+	for (u_int i = 0; i < 3; ++i) {
+		const float d = max(0.f, max(bound.pMin[i] - p[i],
+			p[i] - bound.pMax[i]));
+		d2 += d * d;
+	}
+	const float G = d2 > 0.f ? min(1.f / d2, gLimit) : gLimit;
+
+	// Bound the cosine in the local frame of the normal
+	Vector t1, t2;
+	CoordinateSystem(Vector(n), &t1, &t2);
+	float xMin = INFINITY, xMax = -INFINITY, yMin = INFINITY;
+	float yMax = -INFINITY, zAbs = 0.f;
+	for (u_int i = 0; i < 8; ++i) {
+		const Vector d(Point((i & 1) ? bound.pMax.x : bound.pMin.x,
+			(i & 2) ? bound.pMax.y : bound.pMin.y,
+			(i & 4) ? bound.pMax.z : bound.pMin.z) - p);
+		const float x = Dot(d, t1), y = Dot(d, t2);
+		xMin = min(xMin, x);
+		xMax = max(xMax, x);
+		yMin = min(yMin, y);
+		yMax = max(yMax, y);
+		zAbs = max(zAbs, fabsf(Dot(d, n)));
+	}
+	if (!(zAbs > 0.f))
+		return 0.f;
+	const float x2 = (xMin <= 0.f && xMax >= 0.f) ? 0.f :
+		min(xMin * xMin, xMax * xMax);
+	const float y2 = (yMin <= 0.f && yMax >= 0.f) ? 0.f :
+		min(yMin * yMin, yMax * yMax);
+	return G * zAbs / sqrtf(x2 + y2 + zAbs * zAbs);
+}
+
+// The lightcut is kept on the stack of the render thread
+static const u_int maxCutSizeLimit = 1024;
+
 // IGIIntegrator Implementation
-IGIIntegrator::IGIIntegrator(u_int nl, u_int ns, u_int d, float gl) : SurfaceIntegrator()
+IGIIntegrator::IGIIntegrator(u_int nl, u_int ns, u_int d, float gl, bool lc,
+	float ce, u_int mc) : SurfaceIntegrator()
 {
 	nLightPaths = RoundUpPow2(nl);
 	nLightSets = RoundUpPow2(ns);
 	gLimit = gl;
 	maxSpecularDepth = d;
+	lightcuts = lc;
+	cutError = ce;
+	maxCutSize = max(mc, 1U);
+	if (maxCutSize > maxCutSizeLimit) {
+		LOG(LUX_WARNING, LUX_BADTOKEN) << "IGI maxcutsize " <<
+			maxCutSize << " reduced to " << maxCutSizeLimit;
+		maxCutSize = maxCutSizeLimit;
+	}
 	virtualLights.resize(nLightSets);
+	lightTrees.resize(nLightSets);
 	AddStringConstant(*this, "name", "Name of current surface integrator", "igi");
 }
 void IGIIntegrator::RequestSamples(Sampler *sampler, const Scene &scene)
@@ -187,6 +272,152 @@ void IGIIntegrator::Preprocess(const RandomGenerator &rng, const Scene &scene)
 	delete[] lightSamp0b; // NOBOOK
 	delete[] lightSamp1; // NOBOOK
 	delete[] lightSamp1b; // NOBOOK
+
+	if (!lightcuts)
+		return;
+	// Build the light trees, lights without intensity can't be
+	// representatives and are left out
+	u_int nLeaves = 0;
+	for (u_int s = 0; s < nLightSets; ++s) {
+		vector<u_int> lights;
+		for (u_int i = 0; i < virtualLights[s].size(); ++i) {
+			if (virtualLights[s][i].intensity > 0.f)
+				lights.push_back(i);
+		}
+		if (lights.empty())
+			continue;
+		lightTrees[s].reserve(2 * lights.size() - 1);
+		BuildClusters(rng, s, lights, 0, lights.size());
+		nLeaves = max(nLeaves, static_cast<u_int>(lights.size()));
+	}
+	// A cut never holds more clusters than the tree has leaves
+	maxCutSize = min(maxCutSize, max(nLeaves, 1U));
+}
+
+u_int IGIIntegrator::BuildClusters(const RandomGenerator &rng, u_int lSet,
+	vector<u_int> &lights, u_int start, u_int end)
+{
+	const vector<VirtualLight> &vls(virtualLights[lSet]);
+	vector<VirtualLightCluster> &clusters(lightTrees[lSet]);
+	const u_int nodeNum = clusters.size();
+	clusters.push_back(VirtualLightCluster());
+	if (start + 1 == end) {
+		const VirtualLight &vl(vls[lights[start]]);
+		clusters[nodeNum].bound = BBox(vl.p);
+		clusters[nodeNum].intensity = vl.intensity;
+		clusters[nodeNum].representative = lights[start];
+		clusters[nodeNum].secondChild = 0;
+		return nodeNum;
+	}
+
+	// Split the lights at the median of the largest extent
+	BBox bound;
+	for (u_int i = start; i < end; ++i)
+		bound = Union(bound, vls[lights[i]].p);
+	const u_int mid = (start + end) / 2;
+	std::nth_element(lights.begin() + start, lights.begin() + mid,
+		lights.begin() + end,
+		CompareLightPosition(vls, bound.MaximumExtent()));
+	const u_int first = BuildClusters(rng, lSet, lights, start, mid);
+	const u_int second = BuildClusters(rng, lSet, lights, mid, end);
+
+	// Choose the representative with a probability proportional to
+	// the intensity of the children
+	VirtualLightCluster &node(clusters[nodeNum]);
+	const VirtualLightCluster &c1(clusters[first]), &c2(clusters[second]);
+	node.bound = bound;
+	node.intensity = c1.intensity + c2.intensity;
+	node.representative = rng.floatValue() * node.intensity < c1.intensity ?
+		c1.representative : c2.representative;
+	node.secondChild = second;
+	return nodeNum;
+}
+
+SWCSpectrum IGIIntegrator::VirtualLightL(const Scene &scene,
+	const Sample &sample, const BSDF *bsdf, const Vector &wo,
+	bool scattered, const VirtualLight &vl) const
+{
+	const SpectrumWavelengths &sw(sample.swl);
+	const Point &p = bsdf->dgShading.p;
+	// Ignore light if it's too close
+	float d2 = DistanceSquared(p, vl.p);
+	Vector wi = Normalize(vl.p - p);
+	float G = AbsDot(wi, vl.n) / d2;
+	G = min(G, gLimit);
+	// Compute virtual light's tentative contribution _Llight_
+	SWCSpectrum f(bsdf->F(sw, wi, wo, true,
+		BxDFType(~BSDF_SPECULAR)));
+	if (!(G > 0.f) || f.Black())
+		return SWCSpectrum(0.f);
+	SWCSpectrum Llight = f * vl.GetSWCSpectrum(sw) *
+		(G / nLightPaths);
+	if (!scene.Connect(sample, bsdf->GetVolume(wi),
+		scattered, false, p, vl.p, false, &Llight, NULL,
+		NULL))
+		return SWCSpectrum(0.f);
+	return Llight;
+}
+
+SWCSpectrum IGIIntegrator::LightcutsL(const Scene &scene,
+	const Sample &sample, const BSDF *bsdf, const Vector &wo,
+	bool scattered, u_int lSet) const
+{
+	const vector<VirtualLightCluster> &clusters(lightTrees[lSet]);
+	if (clusters.empty())
+		return SWCSpectrum(0.f);
+	const vector<VirtualLight> &vls(virtualLights[lSet]);
+	const SpectrumWavelengths &sw(sample.swl);
+	const Point &p = bsdf->dgShading.p;
+	const Normal &n = bsdf->dgShading.nn;
+	// The material term is bounded as if the surface was diffuse
+	const float materialBound = bsdf->rho(sw, wo,
+		BxDFType(~BSDF_SPECULAR)).Filter(sw) * INV_PI / nLightPaths;
+
+	// The cut is a heap ordered by error bound, start with the root
+	CutCluster *cut = static_cast<CutCluster *>(alloca(maxCutSize *
+		sizeof(CutCluster)));
+	u_int cutSize = 1;
+	cut[0].node = 0;
+	cut[0].representativeL = VirtualLightL(scene, sample, bsdf, wo,
+		scattered, vls[clusters[0].representative]);
+	cut[0].L = cut[0].representativeL * (clusters[0].intensity /
+		vls[clusters[0].representative].intensity);
+	cut[0].error = clusters[0].secondChild == 0 ? 0.f :
+		clusters[0].intensity * materialBound *
+		ClusterBound(p, n, gLimit, clusters[0].bound);
+	SWCSpectrum L(cut[0].L);
+
+	// Refine the cluster with the highest error bound until all bounds
+	// are below the relative error threshold
+	while (cutSize < maxCutSize && cut[0].error > 0.f &&
+		cut[0].error > cutError * L.Filter(sw)) {
+		std::pop_heap(cut, cut + cutSize, CompareCutError());
+		const CutCluster parent(cut[--cutSize]);
+		const VirtualLightCluster &node(clusters[parent.node]);
+		L -= parent.L;
+		const u_int children[2] = { parent.node + 1, node.secondChild };
+		for (u_int i = 0; i < 2; ++i) {
+			const VirtualLightCluster &child(clusters[children[i]]);
+			CutCluster &c(cut[cutSize++]);
+			c.node = children[i];
+			// One of the children shares the representative of
+			// its parent, its visibility is already known
+			if (child.representative == node.representative)
+				c.representativeL = parent.representativeL;
+			else
+				c.representativeL = VirtualLightL(scene, sample,
+					bsdf, wo, scattered,
+					vls[child.representative]);
+			c.L = c.representativeL * (child.intensity /
+				vls[child.representative].intensity);
+			c.error = child.secondChild == 0 ? 0.f :
+				child.intensity * materialBound *
+				ClusterBound(p, n, gLimit, child.bound);
+			std::push_heap(cut, cut + cutSize, CompareCutError());
+			L += c.L;
+		}
+	}
+	return L;
 }
 u_int IGIIntegrator::Li(const Scene &scene, const Sample &sample) const
 {
@@ -246,25 +477,14 @@ u_int IGIIntegrator::Li(const Scene &scene, const Sample &sample) const
 		// Compute indirect illumination with virtual lights
 		size_t lSet = min<size_t>(Floor2UInt(sample.sampler->GetOneD(sample,
 			vlSetOffset, 0) * nLightSets), nLightSets - 1U);
-		for (u_int i = 0; i < virtualLights[lSet].size(); ++i) {
-			const VirtualLight &vl = virtualLights[lSet][i];
-			// Add contribution from _VirtualLight_ _vl_
-			// Ignore light if it's too close
-			float d2 = DistanceSquared(p, vl.p);
-			Vector wi = Normalize(vl.p - p);
-			float G = AbsDot(wi, vl.n) / d2;
-			G = min(G, gLimit);
-			// Compute virtual light's tentative contribution _Llight_
-			SWCSpectrum f(bsdf->F(sw, wi, wo, true,
-				BxDFType(~BSDF_SPECULAR)));
-			if (!(G > 0.f) || f.Black())
-				continue;
-			SWCSpectrum Llight = f * vl.GetSWCSpectrum(sw) *
-				(G / nLightPaths);
-			if (scene.Connect(sample, bsdf->GetVolume(wi),
-				scattered, false, p, vl.p, false, &Llight, NULL,
-				NULL)) {
-				L += pathThroughput * Llight;
+		if (lightcuts)
+			L += pathThroughput * LightcutsL(scene, sample, bsdf,
+				wo, scattered, lSet);
+		else {
+			for (u_int i = 0; i < virtualLights[lSet].size(); ++i) {
+				// Add contribution from _VirtualLight_ _vl_
+				L += pathThroughput * VirtualLightL(scene, sample,
+					bsdf, wo, scattered, virtualLights[lSet][i]);
 			}
 		}
 		if (depth >= maxSpecularDepth)
@@ -293,7 +513,13 @@ SurfaceIntegrator* IGIIntegrator::CreateSurfaceIntegrator(const ParamSet &params
 	int maxDepth = params.FindOneInt("maxdepth", 5);
 	float maxG = params.FindOneFloat("glimit",
 		1.f / params.FindOneFloat("mindist", .1f));
-	return new IGIIntegrator(max(nLightPaths, 0), max(nLightSets, 0), max(maxDepth, 0), maxG);
+	// Lightcuts evaluate clusters of virtual lights instead of every
+	// virtual light
+	bool lightcuts = params.FindOneBool("lightcuts", false);
+	float cutError = params.FindOneFloat("cuterror", .02f);
+	int maxCutSize = params.FindOneInt("maxcutsize", 64);
+	return new IGIIntegrator(max(nLightPaths, 0), max(nLightSets, 0), max(maxDepth, 0), maxG,
+		lightcuts, max(cutError, 0.f), max(maxCutSize, 1));
 }
 
 static DynamicLoader::RegisterSurfaceIntegrator<IGIIntegrator> r("igi");
@@ -27,6 +27,8 @@
 using luxrays::Point;
 #include "luxrays/core/geometry/normal.h"
 using luxrays::Normal;
+#include "luxrays/core/geometry/bbox.h"
+using luxrays::BBox;
 #include "luxrays/core/color/spectrumwavelengths.h"
 
 namespace lux
@@ -37,21 +39,35 @@ struct VirtualLight {
 	VirtualLight() { }
 	VirtualLight(const SpectrumWavelengths &sw, const Point &pp,
 		const Normal &nn, const SWCSpectrum &le)
-		: Le(le), p(pp), n(nn) {
+		: Le(le), intensity(le.Filter(sw)), p(pp), n(nn) {
 		for (u_int i = 0; i < WAVELENGTH_SAMPLES; ++i)
 			w[i] = sw.w[i];
 	}
 	SWCSpectrum GetSWCSpectrum(const SpectrumWavelengths &sw) const;
 	SWCSpectrum Le;
+	float intensity;
 	float w[WAVELENGTH_SAMPLES];
 	Point p;
 	Normal n;
 };
 
+// Node of the light tree used by lightcuts, the contribution of a cluster
+// is estimated by the one of its representative light scaled by the ratio
+// of their intensities. Nodes are stored depth first, the first child of
+// a node is the following one.
+struct VirtualLightCluster {
+	BBox bound;
+	float intensity;
+	u_int representative;
+	// 0 for leaves
+	u_int secondChild;
+};
+
 class IGIIntegrator : public SurfaceIntegrator {
 public:
 	// IGIIntegrator Public Methods
-	IGIIntegrator(u_int nl, u_int ns, u_int d, float md);
+	IGIIntegrator(u_int nl, u_int ns, u_int d, float md, bool lc,
+		float ce, u_int mc);
 	virtual ~IGIIntegrator () {
 		delete[] lightSampleOffset;
 		delete[] bsdfSampleOffset;
@@ -62,11 +78,28 @@ public:
 	virtual void Preprocess(const RandomGenerator &rng, const Scene &scene);
 	static SurfaceIntegrator *CreateSurfaceIntegrator(const ParamSet &params);
 private:
+	// IGI Private Methods
+	u_int BuildClusters(const RandomGenerator &rng, u_int lSet,
+		vector<u_int> &lights, u_int start, u_int end);
+	// Contribution of a virtual light, including its visibility
+	SWCSpectrum VirtualLightL(const Scene &scene, const Sample &sample,
+		const BSDF *bsdf, const Vector &wo, bool scattered,
+		const VirtualLight &vl) const;
+	SWCSpectrum LightcutsL(const Scene &scene, const Sample &sample,
+		const BSDF *bsdf, const Vector &wo, bool scattered,
+		u_int lSet) const;
+
 	// IGI Private Data
 	u_int nLightPaths, nLightSets;
 	vector<vector<VirtualLight> > virtualLights;
+	vector<vector<VirtualLightCluster> > lightTrees;
 	u_int maxSpecularDepth;
 	float gLimit;
+	// Lightcuts parameters: relative error threshold and maximum number
+	// of clusters evaluated per shading point
+	bool lightcuts;
+	float cutError;
+	u_int maxCutSize;
 	u_int vlSetOffset, bufferId, sampleOffset;
 
 	u_int *lightSampleOffset, *lightSampleNumber;
@@ -252,7 +252,11 @@ u_int PathIntegrator::Li(const Scene &scene, const Sample &sample) const
 // DataParallel integrator PathState code
 //------------------------------------------------------------------------------
 
-PathState::PathState(const Scene &scene, ContributionBuffer *contribBuffer, RandomGenerator *rng) {
+// The BSDFs only live for one path vertex, the arena is emptied before
+// each intersection so a small block is enough, it grows for the rare
+// materials that need more
+PathState::PathState(const Scene &scene, ContributionBuffer *contribBuffer,
+	RandomGenerator *rng, SurfaceIntegratorStateSlab &slab) : sample(512) {
 	SetState(TO_INIT);
 
 	// Some sampler may have to use the RandomNumber generator in InitSample()
@@ -263,21 +267,21 @@ PathState::PathState(const Scene &scene, ContributionBuffer *contribBuffer, Rand
 	sample.realTime = 0.f;
 
 	const u_int lightGroupCount = scene.lightGroups.size();
-	L = new SWCSpectrum[lightGroupCount];
-	V = new float[lightGroupCount];
-
 	PathIntegrator *pi = (PathIntegrator *)scene.surfaceIntegrator;
 	const u_int shadowRaysCount = pi->hints.GetShadowRaysCount() *
 		pi->hints.GetSamplingLimit(scene);
 
-	Ld = new SWCSpectrum[shadowRaysCount];
-	Vd = new float[shadowRaysCount];
-	LdGroup = new u_int[shadowRaysCount];
-	lightPdfd = new float[shadowRaysCount];
-	bsdfPdfd = new float[shadowRaysCount];
-	shadowRay = new Ray[shadowRaysCount];
-	currentShadowRayIndex = new u_int[shadowRaysCount];
-	shadowVolume = new const Volume *[shadowRaysCount];
+	// The arrays are allocated by the SurfaceIntegratorStateBuffer
+	slab.Add(&L, lightGroupCount);
+	slab.Add(&V, lightGroupCount);
+	slab.Add(&Ld, shadowRaysCount);
+	slab.Add(&Vd, shadowRaysCount);
+	slab.Add(&LdGroup, shadowRaysCount);
+	slab.Add(&lightPdfd, shadowRaysCount);
+	slab.Add(&bsdfPdfd, shadowRaysCount);
+	slab.Add(&shadowRay, shadowRaysCount);
+	slab.Add(&currentShadowRayIndex, shadowRaysCount);
+	slab.Add(&shadowVolume, shadowRaysCount);
 }
 
 bool PathState::Init(const Scene &scene) {
@@ -326,16 +330,6 @@ bool PathState::Init(const Scene &scene) {
 }
 
 void PathState::Free(const Scene &scene) {
-	delete[] L;
-	delete[] V;
-	delete[] Ld;
-	delete[] Vd;
-	delete[] LdGroup;
-	delete[] lightPdfd;
-	delete[] bsdfPdfd;
-	delete[] shadowRay;
-	delete[] currentShadowRayIndex;
-	delete[] shadowVolume;
 	scene.sampler->FreeSample(&sample);
 }
 
@@ -372,8 +366,9 @@ bool PathState::TerminatePath(const Scene &scene, const u_int bufferId,
 //------------------------------------------------------------------------------
 
 SurfaceIntegratorState *PathIntegrator::NewState(const Scene &scene,
-		ContributionBuffer *contribBuffer, RandomGenerator *rng) {
-	return new PathState(scene, contribBuffer, rng);
+		ContributionBuffer *contribBuffer, RandomGenerator *rng,
+		SurfaceIntegratorStateSlab &slab) {
+	return new PathState(scene, contribBuffer, rng, slab);
 }
 
 bool PathIntegrator::GenerateRays(const Scene &,
@@ -433,8 +428,8 @@ void PathIntegrator::BuildShadowRays(const Scene &scene, PathState *pathState, B
 		const u_int offset = j * (1 + shadowRaysCount * 3);
 		float lc = sampleData[offset];
 		float lightSelectionPdf;
-		const Light *light = hints.SampleLight(scene, j, &lc,
-			&lightSelectionPdf);
+		const Light *light = hints.SampleLight(scene, j,
+			bsdf->dgShading.p, &lc, &lightSelectionPdf);
 		if (!light)
 			break;
 		lightSelectionPdf *= shadowRaysCount;
@@ -579,6 +574,8 @@ bool PathIntegrator::NextState(const Scene &scene, SurfaceIntegratorState *s, lu
 
 	const float *data = pathState->sample.sampler->GetLazyValues(pathState->sample,
 			sampleOffset, pathState->pathLength);
+	// The BSDFs of the previous vertex aren't used anymore
+	pathState->sample.arena.FreeAll();
 	BSDF *bsdf;
 	Intersection isect;
 	float spdf;
@@ -602,9 +599,11 @@ bool PathIntegrator::NextState(const Scene &scene, SurfaceIntegratorState *s, lu
 				if (!light->Le(scene, pathState->sample,
 					pathState->pathRay, &ibsdf, NULL, &pdf, &Le))
 					continue;
+				// lastBounce is the dgShading.p the lights were
+				// sampled from in BuildShadowRays
 				if (enableDirectLightSampling &&
 					!pathState->GetSpecularBounce())
-					Le *= PowerHeuristic(1, pathState->bouncePdf, 1, pdf * hints.Pdf(scene, i) * shadowRaysCount * DistanceSquared(pathState->pathRay.o, ibsdf->dgShading.p) / (AbsDot(pathState->pathRay.d, ibsdf->ng)));
+					Le *= PowerHeuristic(1, pathState->bouncePdf, 1, pdf * hints.Pdf(scene, pathState->lastBounce, i) * shadowRaysCount * DistanceSquared(pathState->lastBounce, ibsdf->dgShading.p) / (AbsDot(pathState->pathRay.d, ibsdf->ng)));
 				pathState->L[light->group] += Le;
 				pathState->V[light->group] += Le.Filter(sw) * pathState->VContrib;
 				++(*nrContribs);
@@ -635,9 +634,11 @@ bool PathIntegrator::NextState(const Scene &scene, SurfaceIntegratorState *s, lu
 	SWCSpectrum Le(pathState->pathThroughput);
 	if (isect.Le(pathState->sample, pathState->pathRay, &ibsdf, NULL, &pdf,
 		&Le)) {
+		// lastBounce is the dgShading.p the lights were sampled
+		// from in BuildShadowRays
 		if (enableDirectLightSampling &&
 			!pathState->GetSpecularBounce())
-			Le *= PowerHeuristic(1, pathState->bouncePdf, 1, pdf * hints.Pdf(scene, isect.arealight) * shadowRaysCount * DistanceSquared(pathState->pathRay.o, ibsdf->dgShading.p) / (AbsDot(pathState->pathRay.d, ibsdf->ng)));
+			Le *= PowerHeuristic(1, pathState->bouncePdf, 1, pdf * hints.Pdf(scene, pathState->lastBounce, isect.arealight) * shadowRaysCount * DistanceSquared(pathState->lastBounce, ibsdf->dgShading.p) / (AbsDot(pathState->pathRay.d, ibsdf->ng)));
 		pathState->L[isect.arealight->group] += Le;
 		pathState->V[isect.arealight->group] += Le.Filter(sw) * pathState->VContrib;
 		++(*nrContribs);
@@ -34,7 +34,8 @@ public:
 		TO_INIT, EYE_VERTEX, NEXT_VERTEX, CONTINUE_SHADOWRAY, TERMINATE
 	};
 
-	PathState(const Scene &scene, ContributionBuffer *contribBuffer, RandomGenerator *rng);
+	PathState(const Scene &scene, ContributionBuffer *contribBuffer,
+		RandomGenerator *rng, SurfaceIntegratorStateSlab &slab);
 	~PathState() { }
 
 	bool Init(const Scene &scene);
@@ -124,6 +125,7 @@ private:
 
 	float bouncePdf;
 	Point lastBounce;
+	float xi, yi; // Hold the image coordinates of the sample
 
 	u_short pathLength;
 	u_short vertexIndex;
@@ -136,7 +138,6 @@ private:
 	//  scattered (1bit)
 	// Use Get/SetState to access this
 	u_short flags;
-	float xi, yi; // Hold the image coordinates of the sample
 };
 
 // PathIntegrator Declarations
@@ -164,7 +165,8 @@ public:
 		return true;
 	}
 	virtual SurfaceIntegratorState *NewState(const Scene &scene,
-		ContributionBuffer *contribBuffer, RandomGenerator *rng);
+		ContributionBuffer *contribBuffer, RandomGenerator *rng,
+		SurfaceIntegratorStateSlab &slab);
 	virtual bool GenerateRays(const Scene &scene,
 		SurfaceIntegratorState *state, luxrays::RayBuffer *rayBuffer);
 	virtual bool NextState(const Scene &scene, SurfaceIntegratorState *state,
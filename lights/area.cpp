@@ -202,6 +202,11 @@ float AreaLightImpl::Power(const Scene &scene) const
 	return gain * area * M_PI * Le->Y();
 }
 
+BBox AreaLightImpl::WorldBound() const
+{
+	return prim->WorldBound();
+}
+
 float AreaLightImpl::Pdf(const Point &p, const PartialDifferentialGeometry &dg) const
 {
 	return prim->Pdf(p, dg);
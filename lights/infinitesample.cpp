@@ -28,12 +28,155 @@
 #include "singlebsdf.h"
 #include "sampling.h"
 #include "dynload.h"
+#include "osfunc.h"
+#include "tigerhash.h"
 
-#include "luxrays/utils/mcdistribution.h"
+#include <cstring>
+#include <fstream>
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+#include <boost/filesystem.hpp>
 
 using namespace luxrays;
 using namespace lux;
 
+// Computes the importance map of an environment map. Each thread
+// handles every step-th row of the map so that expensive and cheap rows
+// (near the poles with most mappings) are evenly spread.
+class ImportanceMapBuilder {
+public:
+	ImportanceMapBuilder(const MIPMap *map, const EnvironmentMapping *m,
+		u_int nu, u_int nv, u_int dnu, u_int dnv, u_int samples,
+		float *img) : radianceMap(map), mapping(m), nu(nu), nv(nv),
+		dnu(dnu), dnv(dnv), samples(samples), img(img) { }
+
+	void Build(u_int start, u_int step, double *sum) const {
+		const float us = static_cast<float>(nu) / (dnu * samples);
+		const float vs = static_cast<float>(nv) / (dnv * samples);
+		const float filter = 1.f / max(nu, nv);
+		double ySum = 0.;
+		for (u_int iy = start; iy < dnv; iy += step) {
+			for (u_int y = iy * samples; y < (iy + 1) * samples; ++y) {
+				const float yp = (y * vs + .5f) / nv;
+				for (u_int x = 0; x < dnu * samples; ++x) {
+					const float xp = (x * us + .5f) / nu;
+					Vector dummy;
+					float pdf;
+					mapping->Map(xp, yp, &dummy, &pdf);
+					if (!(pdf > 0.f))
+						continue;
+					const float y = (radianceMap) ?
+						radianceMap->LookupFloat(CHANNEL_WMEAN, xp, yp, filter) : 1.f;
+					img[x / samples + iy * dnu] += y / (samples * samples * pdf);
+					ySum += y;
+				}
+			}
+		}
+		*sum = ySum;
+	}
+
+private:
+	const MIPMap *radianceMap;
+	const EnvironmentMapping *mapping;
+	u_int nu, nv, dnu, dnv, samples;
+	float *img;
+};
+
+// The importance map cache file is named after the hash of the
+// environment map content, the other parameters the importance map
+// depends on are stored in the header and checked when reading it back.
+// Values are stored with the native byte order, the flag allows
+// to detect files generated on a different architecture.
+static const char importanceMapMagic[8] = { 'L', 'U', 'X', 'I', 'M', 'A', 'P', '\0' };
+static const u_int importanceMapVersion = 1;
+
+static string ImportanceMapCachePath(const string &texmap,
+	const string &cacheDir)
+{
+	const string filename(AdjustFilename(texmap, true));
+	const boost::filesystem::path sourcePath(filename);
+	const string name(sourcePath.filename().string() + "." +
+		digest_string(file_hash<tigerhash>(filename)) + ".luximap");
+
+	if (!cacheDir.empty())
+		return (boost::filesystem::path(cacheDir) / name).string();
+	return (sourcePath.parent_path() / name).string();
+}
+
+static bool ReadImportanceMap(const string &cacheFile,
+	const string &mappingName, float gamma, u_int dnu, u_int dnv,
+	u_int samples, vector<float> &img, float *mean_y)
+{
+	std::ifstream is(cacheFile.c_str(), std::ios_base::in | std::ios_base::binary);
+	if (!is.is_open())
+		return false;
+
+	const bool isLittleEndian = osIsLittleEndian();
+	char magic[sizeof(importanceMapMagic)];
+	is.read(magic, sizeof(magic));
+	if (!is.good() || memcmp(magic, importanceMapMagic, sizeof(magic)))
+		return false;
+	if (osReadLittleEndianUInt(isLittleEndian, is) != importanceMapVersion)
+		return false;
+	if (osReadLittleEndianUInt(isLittleEndian, is) != (isLittleEndian ? 1U : 0U))
+		return false;
+	const u_int nameLength = osReadLittleEndianUInt(isLittleEndian, is);
+	if (!is.good() || nameLength != mappingName.length())
+		return false;
+	string name(nameLength, ' ');
+	is.read(&name[0], nameLength);
+	if (name != mappingName)
+		return false;
+	if (osReadLittleEndianFloat(isLittleEndian, is) != gamma ||
+		osReadLittleEndianUInt(isLittleEndian, is) != dnu ||
+		osReadLittleEndianUInt(isLittleEndian, is) != dnv ||
+		osReadLittleEndianUInt(isLittleEndian, is) != samples)
+		return false;
+	*mean_y = osReadLittleEndianFloat(isLittleEndian, is);
+	is.read(reinterpret_cast<char *>(&img[0]), img.size() * sizeof(float));
+
+	return is.good();
+}
+
+static void WriteImportanceMap(const string &cacheFile,
+	const string &mappingName, float gamma, u_int dnu, u_int dnv,
+	u_int samples, const vector<float> &img, float mean_y)
+{
+	// Write to a temporary file first so that another process
+	// never reads a partially written map
+	const string tmpFile(cacheFile + ".tmp");
+	bool ok;
+	{
+		std::ofstream os(tmpFile.c_str(), std::ios_base::out |
+			std::ios_base::binary | std::ios_base::trunc);
+		const bool isLittleEndian = osIsLittleEndian();
+		os.write(importanceMapMagic, sizeof(importanceMapMagic));
+		osWriteLittleEndianUInt(isLittleEndian, os, importanceMapVersion);
+		osWriteLittleEndianUInt(isLittleEndian, os, isLittleEndian ? 1 : 0);
+		osWriteLittleEndianUInt(isLittleEndian, os, mappingName.length());
+		os.write(mappingName.c_str(), mappingName.length());
+		osWriteLittleEndianFloat(isLittleEndian, os, gamma);
+		osWriteLittleEndianUInt(isLittleEndian, os, dnu);
+		osWriteLittleEndianUInt(isLittleEndian, os, dnv);
+		osWriteLittleEndianUInt(isLittleEndian, os, samples);
+		osWriteLittleEndianFloat(isLittleEndian, os, mean_y);
+		os.write(reinterpret_cast<const char *>(&img[0]), img.size() * sizeof(float));
+		ok = os.good();
+	}
+	try {
+		if (ok)
+			boost::filesystem::rename(tmpFile, cacheFile);
+		else
+			boost::filesystem::remove(tmpFile);
+	} catch (const boost::filesystem::filesystem_error &) {
+		ok = false;
+	}
+	if (!ok)
+		LOG(LUX_WARNING, LUX_SYSTEM) << "Unable to write importance map cache file '" << cacheFile << "'";
+	else
+		LOG(LUX_DEBUG, LUX_NOERROR) << "Importance map cached in '" << cacheFile << "'";
+}
+
 //FIXME - do proper sampling
 class  InfiniteISBSDF : public BSDF  {
 public:
@@ -118,7 +261,8 @@ InfiniteAreaLightIS::~InfiniteAreaLightIS() {
 }
 InfiniteAreaLightIS::InfiniteAreaLightIS(const Transform &light2world,
 	const RGBColor &l, u_int ns, const string &texmap, u_int immaxres,
-	EnvironmentMapping *m, float g, float gm)
+	EnvironmentMapping *m, float g, float gm, const string &mappingName,
+	bool imapCache, const string &imapCacheDir)
 	: Light("InfiniteAreaLightIS-" + boost::lexical_cast<string>(this), light2world, ns), SPDbase(l)
 {
 	lightColor = l;
@@ -157,34 +301,47 @@ InfiniteAreaLightIS::InfiniteAreaLightIS(const Transform &light2world,
 	const float uscale = static_cast<float>(nu) / dnu;
 	const float vscale = static_cast<float>(nv) / dnv;
 	const u_int samples = Ceil2UInt(max(uscale, vscale));
-	const float us = uscale / samples;
-	const float vs = vscale / samples;
 
-	const float filter = 1.f / max(nu, nv);
 	vector<float> img(dnu * dnv);
-	LOG(LUX_DEBUG, LUX_NOERROR) << "Computing importance sampling map";
-	mean_y = 0.f;
-	for (u_int y = 0; y < dnv*samples; ++y) {
-		const float yp = (y * vs + .5f) / nv;
-		u_int iy = y / samples;
-		for (u_int x = 0; x < dnu*samples; ++x) {
-			const float xp = (x * us + .5f) / nu;
-			Vector dummy;
-			float pdf;
-			mapping->Map(xp, yp, &dummy, &pdf);
-			u_int ix = x / samples;
-			if (!(pdf > 0.f))
-			//	img[ix + iy * dnu] += 0.f;
-				continue;
-			const float y = (radianceMap) ? 
-				radianceMap->LookupFloat(CHANNEL_WMEAN, xp, yp, filter) : 1.f;
-			img[ix + iy * dnu] += y / (samples*samples*pdf);
-			mean_y += y;
+	string cacheFile;
+	bool cached = false;
+	if (imapCache && radianceMap) {
+		try {
+			cacheFile = ImportanceMapCachePath(texmap, imapCacheDir);
+			cached = ReadImportanceMap(cacheFile, mappingName, gamma,
+				dnu, dnv, samples, img, &mean_y);
+		} catch (const boost::filesystem::filesystem_error &e) {
+			LOG(LUX_WARNING, LUX_SYSTEM) << "Unable to use importance map cache: " << e.what();
+			cacheFile = "";
 		}
+		if (cached)
+			LOG(LUX_DEBUG, LUX_NOERROR) << "Loaded importance sampling map from '" << cacheFile << "'";
 	}
-	mean_y /= dnu*samples * dnv*samples;
-	LOG(LUX_DEBUG, LUX_NOERROR) << "Finished computing importance sampling map";
-	uvDistrib = new Distribution2D(&img[0], dnu, dnv);
+	if (!cached) {
+		std::fill(img.begin(), img.end(), 0.f);
+		LOG(LUX_DEBUG, LUX_NOERROR) << "Computing importance sampling map";
+		const ImportanceMapBuilder builder(radianceMap, mapping, nu, nv,
+			dnu, dnv, samples, &img[0]);
+		const u_int threadCount = min(max(1U,
+			boost::thread::hardware_concurrency()), dnv);
+		vector<double> sums(threadCount, 0.);
+		boost::thread_group threads;
+		for (u_int i = 1; i < threadCount; ++i)
+			threads.create_thread(boost::bind(&ImportanceMapBuilder::Build,
+				&builder, i, threadCount, &sums[i]));
+		builder.Build(0, threadCount, &sums[0]);
+		threads.join_all();
+		double sum = 0.;
+		for (u_int i = 0; i < threadCount; ++i)
+			sum += sums[i];
+		mean_y = static_cast<float>(sum /
+			(static_cast<double>(dnu * samples) * dnv * samples));
+		LOG(LUX_DEBUG, LUX_NOERROR) << "Finished computing importance sampling map";
+		if (!cacheFile.empty())
+			WriteImportanceMap(cacheFile, mappingName, gamma, dnu, dnv,
+				samples, img, mean_y);
+	}
+	uvDistrib = new HierarchicalDistribution2D(&img[0], dnu, dnv);
 
 	AddFloatAttribute(*this, "gain", "InfiniteAreaLightIS gain", &InfiniteAreaLightIS::gain);
 	AddFloatAttribute(*this, "gamma", "InfiniteAreaLightIS gamma", &InfiniteAreaLightIS::gamma);
@@ -319,12 +476,19 @@ Light* InfiniteAreaLightIS::CreateLight(const Transform &light2world,
 		map = new AngularMapping();
 	else if (type == "vcross")
 		map = new VerticalCrossMapping();
+	// Default mapping name for the importance map cache
+	if (type == "")
+		type = "latlong";
 
 	// Initialize _ImageTexture_ parameters
 	float gain = paramSet.FindOneFloat("gain", 1.0f);
 	float gamma = paramSet.FindOneFloat("gamma", 1.0f);
 
-	InfiniteAreaLightIS *l = new InfiniteAreaLightIS(light2world, L, nSamples, texmap, imapmaxres, map, gain, gamma);
+	// Importance map caching
+	bool imapCache = paramSet.FindOneBool("imapcache", false);
+	string imapCacheDir = paramSet.FindOneString("imapcachedir", "");
+
+	InfiniteAreaLightIS *l = new InfiniteAreaLightIS(light2world, L, nSamples, texmap, imapmaxres, map, gain, gamma, type, imapCache, imapCacheDir);
 	l->hints.InitParam(paramSet);
 	return l;
 }
@@ -27,6 +27,7 @@ using luxrays::RGBIllumSPD;
 #include "light.h"
 #include "scene.h"
 #include "mipmap.h"
+#include "hierarchicaldistribution.h"
 
 namespace lux
 {
@@ -36,7 +37,8 @@ public:
 	// InfiniteAreaLightIS Public Methods
 	InfiniteAreaLightIS(const Transform &light2world, const RGBColor &l,
 		u_int ns, const string &texmap, u_int imr, EnvironmentMapping *m,
-		float gain, float gamma);
+		float gain, float gamma, const string &mappingName,
+		bool imapCache, const string &imapCacheDir);
 	virtual ~InfiniteAreaLightIS();
 	virtual float Power(const Scene &scene) const {
 		Point worldCenter;
@@ -75,7 +77,7 @@ private:
 
 	// InfiniteAreaLightIS Private Data
 	RGBIllumSPD SPDbase;
-	luxrays::Distribution2D *uvDistrib;
+	HierarchicalDistribution2D *uvDistrib;
 	float mean_y;
 };
 
@@ -38,6 +38,7 @@ public:
 	virtual bool IsDeltaLight() const { return true; }
 	virtual bool IsEnvironmental() const { return false; }
 	virtual float Power(const Scene &) const;
+	virtual BBox WorldBound() const { return BBox(lightPos); }
 	virtual float Pdf(const Point &p, const PartialDifferentialGeometry &dg) const;
 	virtual bool SampleL(const Scene &scene, const Sample &sample,
 		float u1, float u2, float u3, BSDF **bsdf, float *pdf,
@@ -24,23 +24,30 @@
 #define LUX_PYCONTEXT_H
 
 #include <vector>
+#include <list>
+#include <limits>
+#include <cctype>
 
 #include <boost/assert.hpp>
 #include <boost/foreach.hpp>
 #include <boost/pool/pool.hpp>
 #include <boost/thread.hpp>
 #include <boost/shared_array.hpp>
+#include <boost/cstdint.hpp>
 
 #include "context.h"
 #include "queryable.h"
 #include "api.h"
+#include "film.h"
+#include "osfunc.h"
 
 #include "pydoc_context.h"
 
 #define	EXTRACT_PARAMETERS(_params) \
 	std::vector<LuxToken> aTokens; \
 	std::vector<LuxPointer> aValues; \
-	int count = getParametersFromPython(_params, aTokens, aValues);
+	PythonBuffers aBuffers; \
+	int count = getParametersFromPython(_params, aTokens, aValues, aBuffers);
 
 #define PASS_PARAMETERS \
 	count, aTokens.size()>0?&aTokens[0]:0, aValues.size()>0?&aValues[0]:0
@@ -55,8 +62,86 @@ boost::once_flag luxInitFlag = BOOST_ONCE_INIT;
 //The memory pool handles temporary allocations and is freed after each C API Call
 boost::pool<> memoryPool(sizeof(char));
 
+//Keeps the buffers of the objects passed as parameters (NumPy arrays,
+//array.array, memoryviews, ...) until the end of the C API call
+struct PythonBuffers {
+	~PythonBuffers() {
+		BOOST_FOREACH(Py_buffer &view, views)
+			PyBuffer_Release(&view);
+	}
+
+	//A list since some exporters point into the Py_buffer itself
+	std::list<Py_buffer> views;
+};
+
+//Returns the struct module type code of a buffer made of native values,
+//0 otherwise
+char getBufferTypeCode(const Py_buffer &view)
+{
+	const char *format = view.format ? view.format : "B";
+	if (*format == '@' || *format == '=')
+		++format;
+	else if (*format == '<' || *format == '>' || *format == '!') {
+		if ((*format == '<') != osIsLittleEndian())
+			return 0;
+		++format;
+	}
+	if (format[0] == 0 || format[1] != 0)
+		return 0;
+	return format[0];
+}
+
+template <class T, class S> void convertBuffer(const Py_buffer &view, T *dst)
+{
+	const S *src = static_cast<const S *>(view.buf);
+	const Py_ssize_t n = view.len / view.itemsize;
+	for (Py_ssize_t i = 0; i < n; ++i)
+		dst[i] = static_cast<T>(src[i]);
+}
+
+//Converts the buffer to an array of T, returns NULL if its type isn't
+//supported. The buffer memory is used directly if it already holds T values.
+template <class T> T *getBufferData(const Py_buffer &view)
+{
+	const char type = getBufferTypeCode(view);
+	const bool isFloat = (type == 'f' || type == 'd');
+	const bool isInteger = (type == 'b' || type == 'B' || type == 'h' ||
+		type == 'H' || type == 'i' || type == 'I' || type == 'l' ||
+		type == 'L' || type == 'q' || type == 'Q');
+	if (!isFloat && !isInteger)
+		return NULL;
+	// float or int with the same size as T
+	if (view.itemsize == sizeof(T) && isFloat != std::numeric_limits<T>::is_integer)
+		return static_cast<T *>(view.buf);
+
+	T *data = (T *)memoryPool.ordered_malloc(view.len / view.itemsize * sizeof(T));
+	if (type == 'f')
+		convertBuffer<T, float>(view, data);
+	else if (type == 'd')
+		convertBuffer<T, double>(view, data);
+	else if (view.itemsize == 1 && isupper(type))
+		convertBuffer<T, boost::uint8_t>(view, data);
+	else if (view.itemsize == 1)
+		convertBuffer<T, boost::int8_t>(view, data);
+	else if (view.itemsize == 2 && isupper(type))
+		convertBuffer<T, boost::uint16_t>(view, data);
+	else if (view.itemsize == 2)
+		convertBuffer<T, boost::int16_t>(view, data);
+	else if (view.itemsize == 4 && isupper(type))
+		convertBuffer<T, boost::uint32_t>(view, data);
+	else if (view.itemsize == 4)
+		convertBuffer<T, boost::int32_t>(view, data);
+	else if (view.itemsize == 8 && isupper(type))
+		convertBuffer<T, boost::uint64_t>(view, data);
+	else if (view.itemsize == 8)
+		convertBuffer<T, boost::int64_t>(view, data);
+	else
+		return NULL;
+	return data;
+}
+
 //Here we transform a python list to lux C API parameter lists
-int getParametersFromPython(boost::python::list& pList, std::vector<LuxToken>& aTokens, std::vector<LuxPointer>& aValues )
+int getParametersFromPython(boost::python::list& pList, std::vector<LuxToken>& aTokens, std::vector<LuxPointer>& aValues, PythonBuffers& aBuffers )
 {
 	boost::python::ssize_t n = boost::python::len(pList);
 
@@ -128,6 +213,35 @@ int getParametersFromPython(boost::python::list& pList, std::vector<LuxToken>& a
 			aValues.push_back((LuxPointer)pString);
 			//std::cout<<"this is a STRING:"<<*pString<<std::endl;
 		}
+		else if(PyObject_CheckBuffer(parameter_value.ptr()))
+		{
+			// Objects with the buffer protocol are read without
+			// extracting each item, integer parameters get ints,
+			// all the other ones floats
+			aBuffers.views.push_back(Py_buffer());
+			Py_buffer &view(aBuffers.views.back());
+			if (PyObject_GetBuffer(parameter_value.ptr(), &view, PyBUF_ND | PyBUF_FORMAT) != 0)
+			{
+				PyErr_Clear();
+				aBuffers.views.pop_back();
+				LOG( LUX_SEVERE,LUX_CONSISTENCY)<< "Passing non contiguous buffer to Python API for '"<<tokenString<<"' token.";
+				aTokens.pop_back();
+				continue;
+			}
+
+			LuxPointer data;
+			if (tokenString.compare(0, 8, "integer ") == 0)
+				data = (LuxPointer)getBufferData<int>(view);
+			else
+				data = (LuxPointer)getBufferData<float>(view);
+			if (!data)
+			{
+				LOG( LUX_SEVERE,LUX_CONSISTENCY)<< "Passing unrecognised buffer format '"<<(view.format ? view.format : "B")<<"' to Python API for '"<<tokenString<<"' token.";
+				aTokens.pop_back();
+				continue;
+			}
+			aValues.push_back(data);
+		}
 		else if(tupleExtractor.check())
 		{
 			boost::python::tuple t=tupleExtractor();
@@ -219,14 +333,83 @@ int getParametersFromPython(boost::python::list& pList, std::vector<LuxToken>& a
 		}
 
 	}
-	return(n);
+	return(aTokens.size());
 }
 
+// Read-only view over one of the buffers of a published display image,
+// the exporter holds a reference to the snapshot so that the buffer stays
+// valid and unchanged for as long as it is in use
+struct framebuffer_buffer {
+	framebuffer_buffer(const boost::shared_ptr<const FramebufferSnapshot> &fb, bool isFloat)
+		: snapshot(fb), float_pixels(isFloat), buffer_nelms(3 * fb->width * fb->height) {
+	}
+
+	framebuffer_buffer()
+		: float_pixels(false), buffer_nelms(0) {
+	}
+
+private:
+	boost::shared_ptr<const FramebufferSnapshot> snapshot;
+	bool float_pixels;
+	Py_ssize_t buffer_nelms;
+
+	friend int framebuffer_getbuffer(PyObject *, Py_buffer *, int);
+};
+
 int framebuffer_getbuffer(PyObject *exporter, Py_buffer *view, int flags) {
+
+	boost::python::extract<framebuffer_buffer&> b(exporter);
+
+	if (!b.check()) {
+		PyErr_SetString(PyExc_BufferError, "Invalid buffer exporter instance");
+		view->obj = NULL;
+		return -1;
+	}
+
+	framebuffer_buffer& buf = b();
+
+	if (!buf.snapshot) {
+		PyErr_SetString(PyExc_BufferError, "Buffer exporter not initialized");
+		view->obj = NULL;
+		return -1;
+	}
+
+	if (view == NULL)
+		return 0;
+	if ((flags & PyBUF_WRITABLE) == PyBUF_WRITABLE) {
+		PyErr_SetString(PyExc_BufferError, "Object is not writable.");
+		view->obj = NULL;
+		return -1;
+	}
+
+	view->obj = exporter;
+	Py_INCREF(view->obj);
+	if (buf.float_pixels) {
+		view->buf = const_cast<float *>(&(buf.snapshot->floatPixels[0]));
+		view->itemsize = sizeof(float);
+	} else {
+		view->buf = const_cast<unsigned char *>(&(buf.snapshot->pixels[0]));
+		view->itemsize = sizeof(unsigned char);
+	}
+	view->len = view->itemsize * buf.buffer_nelms;
+	view->readonly = 1;
+	view->format = NULL;
+	if ((flags & PyBUF_FORMAT) == PyBUF_FORMAT)
+		view->format = const_cast<char *>(buf.float_pixels ? "f" : "B");
+	view->ndim = 1;
+	view->shape = NULL;
+	if ((flags & PyBUF_ND) == PyBUF_ND)
+		view->shape = &buf.buffer_nelms;
+	view->strides = NULL;
+	if ((flags & PyBUF_STRIDES) == PyBUF_STRIDES)
+		view->strides = &(view->itemsize);
+	view->suboffsets = NULL;
+	view->internal = NULL;
 	return 0;
 }
 
 void framebuffer_releasebuffer(PyObject *exporter, Py_buffer *view) {
+	// The snapshot is released with the exporter
 }
 
 // for debugging
@@ -909,6 +1092,35 @@ public:
 		return pyFrameBuffer;
 	}
 
+	unsigned int framebufferVersion()
+	{
+		checkActiveContext();
+		return context->FramebufferVersion();
+	}
+
+	boost::python::object mapFramebuffer()
+	{
+		checkActiveContext();
+		boost::shared_ptr<const FramebufferSnapshot> snapshot(context->GetFramebufferSnapshot());
+		if (!snapshot)
+			return boost::python::object();
+
+		boost::python::list dirtyRects;
+		for (size_t i = 0; i + 3 < snapshot->dirtyRects.size(); i += 4)
+			dirtyRects.append(boost::python::make_tuple(
+				snapshot->dirtyRects[i], snapshot->dirtyRects[i + 1],
+				snapshot->dirtyRects[i + 2], snapshot->dirtyRects[i + 3]));
+
+		boost::python::dict mapping;
+		mapping["version"] = snapshot->version;
+		mapping["width"] = snapshot->width;
+		mapping["height"] = snapshot->height;
+		mapping["framebuffer"] = boost::python::object(framebuffer_buffer(snapshot, false));
+		mapping["floatFramebuffer"] = boost::python::object(framebuffer_buffer(snapshot, true));
+		mapping["dirtyRects"] = dirtyRects;
+		return mapping;
+	}
+
 	boost::python::list alphaBuffer()
 	{
 		boost::python::list pyFrameBuffer;
@@ -1361,6 +1573,27 @@ void export_float_buffer()
 		float_buffer_item       /* sq_item */     // needed for PySequence_Check to succeed
 	};
 	fb_type->tp_as_sequence = &float_buffer_as_sequence;
+
+	// register framebuffer_buffer, it only implements the buffer protocol
+	class_<framebuffer_buffer>("framebuffer_buffer");
+
+	const converter::registration& fbb_reg(converter::registry::lookup(type_id<framebuffer_buffer>()));
+	PyTypeObject* fbb_type = fbb_reg.get_class_object();
+
+	static PyBufferProcs framebuffer_buffer_as_buffer = {
+#if (PY_MAJOR_VERSION >= 3)
+		framebuffer_getbuffer,		/* bf_getbuffer */
+		framebuffer_releasebuffer	/* bf_releasebuffer */
+#else
+		NULL,						/* bf_getreadbuffer */
+		NULL,						/* bf_getwritebuffer */
+		NULL,						/* bf_getsegcount */
+		NULL,						/* bf_getcharbuffer */
+		framebuffer_getbuffer,		/* bf_getbuffer */
+		framebuffer_releasebuffer	/* bf_releasebuffer */
+#endif
+	};
+	fbb_type->tp_as_buffer = &framebuffer_buffer_as_buffer;
 }
 
 // Add PyContext class to pylux module definition
@@ -1483,6 +1716,16 @@ void export_PyContext()
 			args("Context"),
 			ds_pylux_Context_floatframebuffer
 		)
+		.def("framebufferVersion",
+			&PyContext::framebufferVersion,
+			args("Context"),
+			ds_pylux_Context_framebufferVersion
+		)
+		.def("mapFramebuffer",
+			&PyContext::mapFramebuffer,
+			args("Context"),
+			ds_pylux_Context_mapFramebuffer
+		)
 		.def("alphaBuffer",
 			&PyContext::alphaBuffer,
 			args("Context"),
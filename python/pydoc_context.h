@@ -108,6 +108,17 @@ const char * ds_pylux_Context_floatframebuffer =
 "Returns the current post-processed LDR framebuffer in float format as a list.\n"
 "It is advisable to call updateFramebuffer() before calling this function.";
 
+const char * ds_pylux_Context_framebufferVersion =
+"Returns the version of the last published framebuffer, it is incremented\n"
+"each time updateFramebuffer() or the renderer publishes a new image.";
+
+const char * ds_pylux_Context_mapFramebuffer =
+"Returns the last published framebuffer without copying it, as a dict with\n"
+"'version', 'width', 'height', 'framebuffer' (RGB888) and 'floatFramebuffer'\n"
+"(RGB float) read-only buffer objects, and 'dirtyRects', the list of\n"
+"(x, y, width, height) regions that changed since the previous version.\n"
+"The buffers are never modified and stay valid while they are referenced.";
+
 const char * ds_pylux_Context_alphabuffer =
 "Returns the current alpha buffer in float format as a list.\n"
 "It is advisable to call updateFramebuffer() before calling this function.";
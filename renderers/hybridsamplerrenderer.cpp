@@ -20,6 +20,7 @@
  *   Lux Renderer website : http://www.luxrender.net                       *
  ***************************************************************************/
 
+#include <algorithm>
 #include <boost/foreach.hpp>
 
 #include "api.h"
@@ -46,19 +47,30 @@ using namespace lux;
 // SurfaceIntegratorStateBuffer
 //------------------------------------------------------------------------------
 
+// Spreads the 10 lower bits of v so that there are 2 zero bits between
+// each of them
+static inline u_int SpreadBits(u_int v)
+{
+	v &= 0x3ffU;
+	v = (v | (v << 16)) & 0x030000ffU;
+	v = (v | (v << 8)) & 0x0300f00fU;
+	v = (v | (v << 4)) & 0x030c30c3U;
+	v = (v | (v << 2)) & 0x09249249U;
+	return v;
+}
+
 SurfaceIntegratorStateBuffer::SurfaceIntegratorStateBuffer(
 		const Scene &scn, ContributionBuffer *contribBuf,
-		RandomGenerator *rngGen, luxrays::RayBuffer *rayBuf) :
-		scene(scn), integratorState(128) {
+		RandomGenerator *rngGen, luxrays::RayBuffer *rayBuf,
+		bool sort) :
+		scene(scn) {
 	contribBuffer = contribBuf;
 	rng = rngGen;
 	rayBuffer = rayBuf;
+	sortRays = sort;
 
 	// Initialize the first set SurfaceIntegratorState
-	for (size_t i = 0; i < integratorState.size(); ++i) {
-		integratorState[i] = scene.surfaceIntegrator->NewState(scene, contribBuffer, rng);
-		integratorState[i]->Init(scene);
-	}
+	AddStates(128);
 
 	firstStateIndex = 0;
 }
@@ -69,10 +81,30 @@ SurfaceIntegratorStateBuffer::~SurfaceIntegratorStateBuffer() {
 		integratorState[i]->Free(scene);
 		delete integratorState[i];
 	}
+	for (size_t i = 0; i < stateMemory.size(); ++i)
+		FreeAligned(stateMemory[i]);
 	// don't delete contribBuffer as references might still be held in the pool
 	delete rayBuffer;
 }
 
+void SurfaceIntegratorStateBuffer::AddStates(size_t count) {
+	const size_t first = integratorState.size();
+	integratorState.resize(first + count);
+	SurfaceIntegratorStateSlab slab;
+	for (size_t i = first; i < integratorState.size(); ++i) {
+		slab.BeginState();
+		integratorState[i] = scene.surfaceIntegrator->NewState(scene,
+			contribBuffer, rng, slab);
+	}
+	size_t size;
+	stateMemory.push_back(slab.Allocate(&size));
+	for (size_t i = first; i < integratorState.size(); ++i)
+		integratorState[i]->Init(scene);
+
+	LOG(LUX_DEBUG, LUX_NOERROR) << "IntegratorState arrays: " <<
+		size / count << " bytes per state";
+}
+
 void SurfaceIntegratorStateBuffer::GenerateRays() {
 	//--------------------------------------------------------------------------
 	// File the RayBuffer with the generated rays
@@ -99,40 +131,97 @@ void SurfaceIntegratorStateBuffer::GenerateRays() {
 
 	if (usedAllStates) {
 		// Need to add more paths
-		size_t newStateCount = 0;
 
 		// To limit the number of new SurfaceIntegratorState generated at first run
 		const size_t maxNewPaths = max<size_t>(64, rayBuffer->GetSize() >> 4);
 
-		for (;;) {
-			// Add more SurfaceIntegratorState
-			SurfaceIntegratorState *s = scene.surfaceIntegrator->NewState(scene, contribBuffer, rng);
-			s->Init(scene);
-			integratorState.push_back(s);
+		// Add more SurfaceIntegratorState, the ones that don't fit in
+		// the RayBuffer anymore are used by the next runs
+		const size_t first = integratorState.size();
+		AddStates(maxNewPaths);
+		size_t newStateCount = 0;
+		for (size_t i = first; i < integratorState.size(); ++i) {
 			newStateCount++;
 
-			if (!scene.surfaceIntegrator->GenerateRays(scene, s, rayBuffer)) {
+			if (!scene.surfaceIntegrator->GenerateRays(scene, integratorState[i], rayBuffer)) {
 				// The RayBuffer is full
 				firstStateIndex = 0;
-				// -2 because the addition of the last SurfaceIntegratorState failed
-				lastStateIndex = integratorState.size() - 2;
+				// -1 because the addition of the last SurfaceIntegratorState failed
+				lastStateIndex = i - 1;
 				break;
 			}
 
 			if (newStateCount >= maxNewPaths) {
 				firstStateIndex = 0;
-				lastStateIndex = integratorState.size() - 1;
+				lastStateIndex = i;
 				break;
 			}
 		}
 
-		integratorState.resize(integratorState.size());
 		LOG(LUX_DEBUG, LUX_NOERROR) << "New allocated IntegratorStates: " << newStateCount << " => " <<
 				integratorState.size() << " [RayBuffer size = " << rayBuffer->GetSize() << "]";
 	}
+
+	if (sortRays)
+		SortRays();
+}
+
+void SurfaceIntegratorStateBuffer::SortRays() {
+	const u_int rayCount = rayBuffer->GetRayCount();
+	rayOrder.resize(rayCount);
+	if (rayCount == 0)
+		return;
+
+	// The key is made of the direction octant followed by the Morton code
+	// of the origin quantized on a 1024^3 grid over the scene bounds,
+	// the ray index is kept in the lower bits so that a plain sort of the
+	// keys gives the new order
+	const BBox &bound(scene.WorldBound());
+	const Vector extent(bound.pMax - bound.pMin);
+	const float invX = extent.x > 0.f ? 1023.f / extent.x : 0.f;
+	const float invY = extent.y > 0.f ? 1023.f / extent.y : 0.f;
+	const float invZ = extent.z > 0.f ? 1023.f / extent.z : 0.f;
+	luxrays::Ray *rays = rayBuffer->GetRayBuffer();
+	sortKeys.resize(rayCount);
+	for (u_int i = 0; i < rayCount; ++i) {
+		const luxrays::Ray &ray(rays[i]);
+		const u_int octant = (ray.d.x < 0.f ? 4U : 0U) |
+			(ray.d.y < 0.f ? 2U : 0U) | (ray.d.z < 0.f ? 1U : 0U);
+		const u_int x = Clamp(Float2UInt((ray.o.x - bound.pMin.x) * invX), 0U, 1023U);
+		const u_int y = Clamp(Float2UInt((ray.o.y - bound.pMin.y) * invY), 0U, 1023U);
+		const u_int z = Clamp(Float2UInt((ray.o.z - bound.pMin.z) * invZ), 0U, 1023U);
+		const u_int code = (SpreadBits(x) << 2) | (SpreadBits(y) << 1) | SpreadBits(z);
+		sortKeys[i] = (((static_cast<boost::uint64_t>(octant) << 30) | code) << 32) | i;
+	}
+	std::sort(sortKeys.begin(), sortKeys.end());
+
+	raysCopy.assign(rays, rays + rayCount);
+	for (u_int i = 0; i < rayCount; ++i) {
+		const u_int index = static_cast<u_int>(sortKeys[i] & 0xffffffffU);
+		rayOrder[i] = index;
+		rays[i] = raysCopy[index];
+	}
+}
+
+void SurfaceIntegratorStateBuffer::RestoreRayHitsOrder() {
+	const u_int rayCount = rayOrder.size();
+	if (rayCount == 0)
+		return;
+
+	luxrays::RayHit *hits = rayBuffer->GetHitBuffer();
+	hitsCopy.assign(hits, hits + rayCount);
+	for (u_int i = 0; i < rayCount; ++i)
+		hits[rayOrder[i]] = hitsCopy[i];
+
+	// The rays are read back by the integrators (e.g. to build the
+	// bidirectional connection rays), restore them too
+	std::copy(raysCopy.begin(), raysCopy.end(), rayBuffer->GetRayBuffer());
 }
 
 bool SurfaceIntegratorStateBuffer::NextState(u_int &nrContribs, u_int &nrSamples) {
+	if (sortRays)
+		RestoreRayHitsOrder();
+
 	//----------------------------------------------------------------------
 	// Advance the next step
 	//----------------------------------------------------------------------
@@ -166,7 +255,7 @@ bool SurfaceIntegratorStateBuffer::NextState(u_int &nrContribs, u_int &nrSamples
 HybridSamplerRenderer::HybridSamplerRenderer(const int oclPlatformIndex, bool useGPUs,
 		const u_int forceGPUWorkGroupSize, const string &deviceSelection,
 		const u_int rayBufSize, const u_int stateBufCount,
-		const u_int qbvhStackSize) : HybridRenderer() {
+		const u_int qbvhStackSize, bool raySorting) : HybridRenderer() {
 	state = INIT;
 
 	if (!IsPowerOf2(rayBufSize)) {
@@ -176,6 +265,7 @@ HybridSamplerRenderer::HybridSamplerRenderer(const int oclPlatformIndex, bool us
 		rayBufferSize = rayBufSize;
 
 	stateBufferCount = stateBufCount;
+	sortRays = raySorting;
 
 	// Create the LuxRays context
 	ctx = new luxrays::Context(LuxRaysDebugHandler, luxrays::Properties() <<
@@ -569,7 +659,8 @@ void HybridSamplerRenderer::RenderThread::RenderImpl(RenderThread *renderThread)
 			luxrays::RayBuffer *rayBuffer = intersectionDevice->NewRayBuffer(renderer->rayBufferSize);
 			rayBuffer->PushUserData(i);
 
-			stateBuffers[i] = new SurfaceIntegratorStateBuffer(scene, contribBuffer, &rng, rayBuffer);
+			stateBuffers[i] = new SurfaceIntegratorStateBuffer(scene, contribBuffer, &rng, rayBuffer,
+					renderer->sortRays);
 			stateBuffers[i]->GenerateRays();
 			intersectionDevice->PushRayBuffer(rayBuffer, threadIndex);
 		}
@@ -679,6 +770,9 @@ Renderer *HybridSamplerRenderer::CreateRenderer(const ParamSet &params) {
 
 	const u_int rayBufferSize = params.FindOneInt("raybuffersize", 8192);
 	const u_int stateBufferCount = max(1, params.FindOneInt("statebuffercount", 1));
+	// Sorting the rays of each buffer before tracing them makes the
+	// traversal of incoherent bounces much more cache friendly
+	const bool raySorting = params.FindOneBool("raysorting", true);
 
 	string deviceSelection = configParams.FindOneString("opencl.devices.select", "");
 	int platformIndex = configParams.FindOneInt("opencl.platform.index", -1);
@@ -700,7 +794,7 @@ Renderer *HybridSamplerRenderer::CreateRenderer(const ParamSet &params) {
 	params.MarkUsed(configParams);
 	return new HybridSamplerRenderer(platformIndex, useGPUs,
 			forceGPUWorkGroupSize, deviceSelection, rayBufferSize,
-			stateBufferCount, qbvhStackSize);
+			stateBufferCount, qbvhStackSize, raySorting);
 }
 
 static DynamicLoader::RegisterRenderer<HybridSamplerRenderer> r("hybrid");
@@ -25,6 +25,7 @@
 
 #include <vector>
 #include <boost/thread.hpp>
+#include <boost/cstdint.hpp>
 
 #include "lux.h"
 #include "renderer.h"
@@ -48,7 +49,8 @@ namespace lux
 class SurfaceIntegratorStateBuffer {
 public:
 	SurfaceIntegratorStateBuffer(const Scene &scn, ContributionBuffer *contribBuf,
-			RandomGenerator *rngGen, luxrays::RayBuffer *rayBuf);
+			RandomGenerator *rngGen, luxrays::RayBuffer *rayBuf,
+			bool sortRays);
 	~SurfaceIntegratorStateBuffer();
 
 	void GenerateRays();
@@ -57,14 +59,35 @@ public:
 	luxrays::RayBuffer *GetRayBuffer() { return rayBuffer; }
 
 private:
+	// Creates count new states, their arrays share a single allocation
+	void AddStates(size_t count);
+	// Reorders the rays of the RayBuffer so that rays with the same
+	// direction octant and close origins are traced together, the
+	// intersection device then walks the same QBVH nodes for consecutive
+	// rays instead of jumping around the tree on incoherent bounces
+	void SortRays();
+	// Moves the rays and hits back to the indices the states have been
+	// given, integrators read both when they advance
+	void RestoreRayHitsOrder();
+
 	const Scene &scene;
 	ContributionBuffer *contribBuffer;
 	RandomGenerator *rng;
 	luxrays::RayBuffer *rayBuffer;
 
 	vector<SurfaceIntegratorState *> integratorState;
+	// Arrays of the states, one allocation per AddStates() call
+	vector<char *> stateMemory;
 	size_t firstStateIndex;
 	size_t lastStateIndex;
+
+	// Original index of each ray of the sorted RayBuffer
+	vector<u_int> rayOrder;
+	vector<boost::uint64_t> sortKeys;
+	// Rays in their original order
+	vector<luxrays::Ray> raysCopy;
+	vector<luxrays::RayHit> hitsCopy;
+	bool sortRays;
 };
 
 //------------------------------------------------------------------------------
@@ -76,7 +99,7 @@ public:
 	HybridSamplerRenderer(const int oclPlatformIndex, bool useGPUs,
 			const u_int forceGPUWorkGroupSize, const string &deviceSelection,
 			const u_int rayBufferSize, const u_int stateBufferCount,
-			const u_int qbvhStackSize);
+			const u_int qbvhStackSize, bool raySorting);
 	~HybridSamplerRenderer();
 
 	RendererType GetType() const;
@@ -129,6 +152,7 @@ private:
 
 	u_int rayBufferSize;
 	u_int stateBufferCount;
+	bool sortRays;
 	vector<RenderThread *> renderThreads;
 	Scene *scene;
 	u_long lastUsedSeed;
@@ -323,6 +323,11 @@ void SamplerRenderer::RenderThread::RenderImpl(RenderThread *myThread) {
 	sample.camera = scene.camera()->Clone();
 	sample.realTime = 0.f;
 
+	Film *film = scene.camera()->film;
+	// Samples falling in converged tiles are dropped, the thread moves on
+	// to the unconverged ones
+	const bool skipConverged = sampler->CanSkipSamples();
+
 	// Trace rays: The main loop
 	while (true) {
 		if (!sampler->GetNextSample(&sample)) {
@@ -358,6 +363,9 @@ void SamplerRenderer::RenderThread::RenderImpl(RenderThread *myThread) {
 		if ((renderer->state == TERMINATE) || boost::this_thread::interruption_requested())
 			break;
 
+		if (skipConverged && film->IsConverged(sample.imageX, sample.imageY))
+			continue;
+
 		// Evaluate radiance along camera ray
 		// Jeanphi - Hijack statistics until volume integrator revamp
 		{
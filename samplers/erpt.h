@@ -83,6 +83,7 @@ public:
 	virtual float *GetLazyValues(const Sample &sample, u_int num, u_int pos);
 	//void AddSample(float imageX, float imageY, const Sample &sample, const Ray &ray, const XYZColor &L, float alpha, int id=0);
 	virtual void AddSample(const Sample &sample);
+	virtual bool CanSkipSamples() const { return false; }
 	static Sampler *CreateSampler(const ParamSet &params, Film *film);
 
 	u_int totalMutations;
@@ -37,6 +37,8 @@ static const u_int rngA = 884;
 MetropolisSampler::MetropolisData::MetropolisData(const MetropolisSampler &sampler) :
 	consecRejects(0), stamp(0), currentStamp(0), weight(0.f),
 	LY(0.f), alpha(0.f), totalLY(0.f), sampleCount(0.f),
+	bootstrapLeft(sampler.bootstrapSamples), bootstrapLY(0.),
+	seedStamp(0), seedLY(0.f),
 	noiseAwareMapVersion(0), userSamplingMapVersion(0),
 	large(true), cooldown(sampler.cooldownTime > 0)
 {
@@ -65,6 +67,8 @@ MetropolisSampler::MetropolisData::MetropolisData(const MetropolisSampler &sampl
 	currentImage = AllocAligned<float>(totalSamples);
 	timeImage = AllocAligned<int>(totalTimes);
 	currentTimeImage = AllocAligned<int>(totalTimes);
+	seedImage = AllocAligned<float>(totalSamples);
+	seedTimeImage = AllocAligned<int>(totalTimes);
 
 	// Compute best offset between sample vectors in the rng
 	// TODO use the smallest gcf of totalSamples and rngN that is greater
@@ -82,6 +86,8 @@ MetropolisSampler::MetropolisData::MetropolisData(const MetropolisSampler &sampl
 MetropolisSampler::MetropolisData::~MetropolisData()
 {
 	FreeAligned(rngRotation);
+	FreeAligned(seedTimeImage);
+	FreeAligned(seedImage);
 	FreeAligned(currentTimeImage);
 	FreeAligned(timeImage);
 	FreeAligned(currentImage);
@@ -131,9 +137,10 @@ static float fracf(const float &v) {
 
 // Metropolis method definitions
 MetropolisSampler::MetropolisSampler(int xStart, int xEnd, int yStart, int yEnd,
-	u_int maxRej, float largeProb, float rng, bool useV, bool useC, bool useNoise) :
+	u_int maxRej, float largeProb, float rng, bool useV, bool useC, bool useNoise,
+	u_int bootstrap) :
 	Sampler(xStart, xEnd, yStart, yEnd, 1, useNoise), maxRejects(maxRej),
-	pLarge(largeProb), range(rng), useVariance(useV) {
+	pLarge(largeProb), range(rng), bootstrapSamples(bootstrap), useVariance(useV) {
 	// Allocate and compute all values of the rng
 	rngSamples = AllocAligned<float>(rngN);
 	rngSamples[0] = 0.f;
@@ -219,14 +226,38 @@ bool MetropolisSampler::GetNextSample(Sample *sample)
 			}
 		}
 
+		// The bootstrap samples are stratified over the image
+		float u0, u1;
+		if (data->bootstrapLeft > 0) {
+			if (data->bootstrapPositions.empty()) {
+				// Every stratum is used, the few samples left
+				// over by the grid are uniformly distributed
+				const u_int xStrata = max(1U, Floor2UInt(sqrtf(bootstrapSamples)));
+				const u_int yStrata = bootstrapSamples / xStrata;
+				data->bootstrapPositions.resize(2 * bootstrapSamples);
+				StratifiedSample2D(*(sample->rng), &data->bootstrapPositions[0],
+					xStrata, yStrata);
+				for (u_int i = 2 * xStrata * yStrata; i < 2 * bootstrapSamples; ++i)
+					data->bootstrapPositions[i] = sample->rng->floatValue();
+				Shuffle(*(sample->rng), &data->bootstrapPositions[0],
+					bootstrapSamples, 2);
+			}
+			const u_int index = 2 * (bootstrapSamples - data->bootstrapLeft);
+			u0 = data->bootstrapPositions[index];
+			u1 = data->bootstrapPositions[index + 1];
+		} else {
+			u0 = rngGet(0);
+			u1 = rngGet(1);
+		}
+
 		if ((data->noiseAwareMapVersion > 0) || (data->userSamplingMapVersion > 0)) {
 			float uv[2], pdf;
-			data->samplingDistribution2D->SampleContinuous(rngGet(0), rngGet(1), uv, &pdf);
+			data->samplingDistribution2D->SampleContinuous(u0, u1, uv, &pdf);
 			data->currentImage[0] = uv[0] * (xPixelEnd - xPixelStart) + xPixelStart;
 			data->currentImage[1] = uv[1] * (yPixelEnd - yPixelStart) + yPixelStart;
 		} else {
-			data->currentImage[0] = rngGet(0) * (xPixelEnd - xPixelStart) + xPixelStart;
-			data->currentImage[1] = rngGet(1) * (yPixelEnd - yPixelStart) + yPixelStart;
+			data->currentImage[0] = u0 * (xPixelEnd - xPixelStart) + xPixelStart;
+			data->currentImage[1] = u1 * (yPixelEnd - yPixelStart) + yPixelStart;
 		}
 
 		sample->imageX = data->currentImage[0];
@@ -386,8 +417,25 @@ void MetropolisSampler::AddSample(const Sample &sample)
 	sample.contribBuffer->AddSampleCount(1.f);
 
 	// Define the probability of large mutations. It is 50% if we are still
-	// inside the cooldown phase.
-	const float largeMutationProb = (data->cooldown) ? .5f : pLarge;
+	// inside the cooldown phase and every mutation is large during the
+	// bootstrap.
+	const float largeMutationProb = (data->bootstrapLeft > 0) ? 1.f :
+		((data->cooldown) ? .5f : pLarge);
+
+	// Keep one of the bootstrap samples, each one being chosen with a
+	// probability proportional to its luminance (reservoir sampling)
+	if (data->bootstrapLeft > 0 && newLY > 0.f) {
+		data->bootstrapLY += newLY;
+		if (sample.rng->floatValue() * data->bootstrapLY < newLY) {
+			std::copy(data->currentImage, data->currentImage + data->totalSamples,
+				data->seedImage);
+			std::copy(data->currentTimeImage, data->currentTimeImage + data->totalTimes,
+				data->seedTimeImage);
+			data->seedStamp = data->currentStamp;
+			data->seedLY = newLY;
+			data->seedContributions = newContributions;
+		}
+	}
 
 	// calculate accept probability from old and new image sample
 	float accProb;
@@ -405,10 +453,11 @@ void MetropolisSampler::AddSample(const Sample &sample)
 			for(u_int i = 0; i < data->oldContributions.size(); ++i)
 				sample.contribBuffer->Add(data->oldContributions[i], norm);
 		}
-		// Save new contributions for reference
+		// Save new contributions for reference, the old ones are
+		// cleared below
 		data->weight = newWeight;
 		data->LY = newLY;
-		data->oldContributions = newContributions;
+		data->oldContributions.swap(newContributions);
 		swap(data->currentImage, data->sampleImage);
 		swap(data->currentTimeImage, data->timeImage);
 		data->stamp = data->currentStamp;
@@ -428,8 +477,31 @@ void MetropolisSampler::AddSample(const Sample &sample)
 	}
 	newContributions.clear();
 
+	if (data->bootstrapLeft > 0 && --(data->bootstrapLeft) == 0) {
+		data->bootstrapPositions.clear();
+		if (data->seedLY > 0.f) {
+			// Add accumulated contribution of the current reference
+			// sample and restart the chain from the chosen seed
+			const float norm = data->weight / (data->LY / meanIntensity + largeMutationProb);
+			if (norm > 0.f) {
+				for(u_int i = 0; i < data->oldContributions.size(); ++i)
+					sample.contribBuffer->Add(data->oldContributions[i], norm);
+			}
+			swap(data->seedImage, data->sampleImage);
+			swap(data->seedTimeImage, data->timeImage);
+			data->stamp = data->seedStamp;
+			data->LY = data->seedLY;
+			data->weight = 0.f;
+			data->oldContributions.swap(data->seedContributions);
+			data->seedContributions.clear();
+			data->consecRejects = 0;
+		}
+	}
+
 	const float mutationSelector = sample.rng->floatValue();
-	if (data->cooldown) {
+	if (data->bootstrapLeft > 0)
+		data->large = true;
+	else if (data->cooldown) {
 		if (data->sampleCount >= cooldownTime) {
 			data->cooldown = false;
 			LOG(LUX_DEBUG, LUX_NOERROR) << "Cooldown process has now ended";
@@ -450,6 +522,7 @@ Sampler* MetropolisSampler::CreateSampler(const ParamSet &params, Film *film)
 	bool useCooldown = params.FindOneBool("usecooldown", true);
 	bool useNoiseAware = params.FindOneBool("noiseaware", false);
 	float range = params.FindOneFloat("mutationrange", (xEnd - xStart + yEnd - yStart) / 32.f);	// maximum distance in pixel for a small mutation
+	int bootstrapSamples = params.FindOneInt("bootstrapsamples", 1024);	// number of large mutations used to choose the starting point of each chain
 
 	if (useNoiseAware) {
 		// Enable Film noise-aware map generation
@@ -457,7 +530,8 @@ Sampler* MetropolisSampler::CreateSampler(const ParamSet &params, Film *film)
 	}
 
 	return new MetropolisSampler(xStart, xEnd, yStart, yEnd, max(maxConsecRejects, 0),
-		largeMutationProb, range, useVariance, useCooldown, useNoiseAware);
+		largeMutationProb, range, useVariance, useCooldown, useNoiseAware,
+		max(bootstrapSamples, 0));
 }
 
 static DynamicLoader::RegisterSampler<MetropolisSampler> r("metropolis");
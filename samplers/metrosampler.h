@@ -53,6 +53,18 @@ public:
 		vector <Contribution> oldContributions;
 		double totalLY, sampleCount;
 
+		// Bootstrap: the first large mutations are stratified over the
+		// image and the chain then restarts from one of them chosen
+		// proportionally to its luminance
+		u_int bootstrapLeft;
+		vector<float> bootstrapPositions;
+		double bootstrapLY;
+		float *seedImage;
+		int *seedTimeImage;
+		int seedStamp;
+		float seedLY;
+		vector<Contribution> seedContributions;
+
 		boost::shared_array<float> samplingMap;
 		u_int noiseAwareMapVersion;
 		u_int userSamplingMapVersion;
@@ -63,7 +75,7 @@ public:
 
 	MetropolisSampler(int xStart, int xEnd, int yStart, int yEnd,
 		u_int maxRej, float largeProb, float rng,
-		bool useV, bool useC, bool useNoise);
+		bool useV, bool useC, bool useNoise, u_int bootstrap);
 	virtual ~MetropolisSampler();
 
 	virtual void InitSample(Sample *sample) const {
@@ -81,6 +93,7 @@ public:
 		float u[2]);
 	virtual float *GetLazyValues(const Sample &sample, u_int num, u_int pos);
 	virtual void AddSample(const Sample &sample);
+	virtual bool CanSkipSamples() const { return false; }
 
 	// Used by Queryable interface
 	u_int GetMaxRejects() { return maxRejects; }
@@ -90,6 +103,7 @@ public:
 	u_int maxRejects;
 	float pLarge, range;
 	u_int cooldownTime;
+	u_int bootstrapSamples;
 	float *rngSamples;
 	bool useVariance;
 };
@@ -29,21 +29,72 @@
 #include "dynload.h"
 #include "error.h"
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define LUX_SOBOL_SSE2
+#include <emmintrin.h>
+#endif
+
 using namespace lux;
 
-SobolSampler::SobolData::SobolData(const Sampler &sampler, const Sample &sample) :
-		rng0(sample.rng->floatValue()), rng1(sample.rng->floatValue()), pass(SOBOL_STARTOFFSET),
+static inline u_int ReverseBits(u_int x) {
+	x = (x << 16) | (x >> 16);
+	x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+	x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+	x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+	x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+	return x;
+}
+
+// Hash based nested uniform (Owen) scrambling, see "Practical Hash-based
+// Owen Scrambling" by Brent Burley. Each bit is flipped according to
+// a hash of the more significant bits.
+static inline u_int OwenScramble(u_int x, u_int seed) {
+	x = ReverseBits(x);
+	x ^= x * 0x3d20adeau;
+	x += seed;
+	x *= (seed >> 16) | 1;
+	x ^= x * 0x05526c56u;
+	x ^= x * 0x53a22864u;
+	return ReverseBits(x);
+}
+
+// Decorrelates the scrambling seeds of the dimensions
+static inline u_int DimensionSeed(u_int seed, u_int dimension) {
+	u_int h = seed ^ (dimension * 0x9e3779b9u);
+	h ^= h >> 16;
+	h *= 0x85ebca6bu;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35u;
+	h ^= h >> 16;
+	return h;
+}
+
+SobolSampler::SobolData::SobolData(const SobolSampler &sampler, const Sample &sample) :
+		rng0(sample.rng->floatValue()), rng1(sample.rng->floatValue()),
+		seed(sample.rng->uintValue()), pass(SOBOL_STARTOFFSET), values(NULL),
 		noiseAwareMapVersion(0), userSamplingMapVersion(0) {
 	nxD = sampler.nxD.size();
 	xD = new float *[nxD];
 	for (u_int i = 0; i < nxD; ++i)
 		xD[i] = new float[sampler.dxD[i]];
+
+	if (sampler.owenScrambling) {
+		// Points are generated in Gray code order, the next pass
+		// only differs by one direction number in each dimension
+		values = AllocAligned<u_int>(sampler.paddedSampleCount);
+		const u_int gray = pass ^ (pass >> 1);
+		for (u_int i = 0; i < sampler.paddedSampleCount; ++i)
+			values[i] = (i < sampler.sampleCount) ?
+				SobolDimension(sampler, gray, i) : 0;
+	}
 }
 
 SobolSampler::SobolData::~SobolData() {
 	for (u_int i = 0; i < nxD; ++i)
 		delete[] xD[i];
 	delete[] xD;
+	if (values)
+		FreeAligned(values);
 }
 
 u_int SobolSampler::SobolData::SobolDimension(const SobolSampler &sampler,
@@ -61,6 +112,12 @@ u_int SobolSampler::SobolData::SobolDimension(const SobolSampler &sampler,
 }
 
 float SobolSampler::SobolData::GetSample(const SobolSampler &sampler, const u_int index) const {
+	if (values) {
+		const u_int result = OwenScramble(values[index],
+			DimensionSeed(seed, index));
+		return min(result * (1.f / 4294967296.f), OneMinusEpsilon);
+	}
+
 	const u_int result = SobolDimension(sampler, pass, index);
 	const float r = result * (1.f / 0xffffffffu);
 
@@ -70,9 +127,33 @@ float SobolSampler::SobolData::GetSample(const SobolSampler &sampler, const u_in
 	return r + shift - floorf(r + shift);
 }
 
+void SobolSampler::SobolData::NextPass(const SobolSampler &sampler) {
+	++pass;
+	if (!values)
+		return;
+
+	// Gray code of pass differs from the previous one by the bit
+	// of the lowest set bit of pass
+	u_int bit = 0;
+	for (u_int n = pass; n && !(n & 1); n >>= 1)
+		++bit;
+	const u_int *v = sampler.directionsByBit + bit * sampler.paddedSampleCount;
+#if defined(LUX_SOBOL_SSE2)
+	for (u_int i = 0; i < sampler.paddedSampleCount; i += 4) {
+		__m128i *x = reinterpret_cast<__m128i *>(values + i);
+		_mm_store_si128(x, _mm_xor_si128(_mm_load_si128(x),
+			_mm_load_si128(reinterpret_cast<const __m128i *>(v + i))));
+	}
+#else
+	for (u_int i = 0; i < sampler.paddedSampleCount; ++i)
+		values[i] ^= v[i];
+#endif
+}
+
 SobolSampler::SobolSampler(int xstart, int xend, int ystart, int yend,
-		bool useNoise) : Sampler(xstart, xend, ystart, yend, 1, useNoise),
-		directions(NULL) {
+		bool useNoise, bool owen) : Sampler(xstart, xend, ystart, yend, 1, useNoise),
+		directions(NULL), sampleCount(0), directionsByBit(NULL),
+		paddedSampleCount(0), owenScrambling(owen) {
 	totalPixels = (xPixelEnd - xPixelStart) * (yPixelEnd - yPixelStart);
 
 	AddStringConstant(*this, "name", "Name of current sampler", "sobol");
@@ -80,6 +161,8 @@ SobolSampler::SobolSampler(int xstart, int xend, int ystart, int yend,
 
 SobolSampler::~SobolSampler() {
 	delete[] directions;
+	if (directionsByBit)
+		FreeAligned(directionsByBit);
 }
 
 void SobolSampler::InitSample(Sample *sample) const {
@@ -113,8 +196,22 @@ void SobolSampler::InitSample(Sample *sample) const {
 			LOG(LUX_DEBUG, LUX_NOERROR) << "Total sample count: " << sampleCount;
 
 			// Initialize Sobol data
-			directions = new u_int[sampleCount * SOBOL_BITS];
-			slg::SobolGenerateDirectionVectors(directions, sampleCount);
+			u_int *dirs = new u_int[sampleCount * SOBOL_BITS];
+			slg::SobolGenerateDirectionVectors(dirs, sampleCount);
+			this->sampleCount = sampleCount;
+
+			if (owenScrambling) {
+				// Transpose the direction numbers so that all
+				// dimensions can be updated together for each pass
+				paddedSampleCount = (sampleCount + 3) & ~3U;
+				directionsByBit = AllocAligned<u_int>(SOBOL_BITS * paddedSampleCount);
+				for (u_int j = 0; j < SOBOL_BITS; ++j) {
+					for (u_int i = 0; i < paddedSampleCount; ++i)
+						directionsByBit[j * paddedSampleCount + i] =
+							(i < sampleCount) ? dirs[i * SOBOL_BITS + j] : 0;
+				}
+			}
+			directions = dirs;
 		}
 	}
 
@@ -181,7 +278,7 @@ bool SobolSampler::GetNextSample(Sample *sample) {
 	sample->time = data->GetSample(*this, 4);
 	sample->wavelengths = data->GetSample(*this, 5);
 
-	++(data->pass);
+	data->NextPass(*this);
 
 	return haveMoreSamples;
 }
@@ -218,10 +315,17 @@ Sampler *SobolSampler::CreateSampler(const ParamSet &params, Film *film) {
 		film->EnableNoiseAwareMap();
 	}
 
+	bool owen = false;
+	const string scrambling = params.FindOneString("scrambling", "cranleypatterson");
+	if (scrambling == "owen")
+		owen = true;
+	else if (scrambling != "cranleypatterson")
+		LOG(LUX_WARNING, LUX_BADTOKEN) << "Sobol scrambling '" << scrambling << "' unknown. Using \"cranleypatterson\".";
+
     int xstart, xend, ystart, yend;
     film->GetSampleExtent(&xstart, &xend, &ystart, &yend);
 
-    return new SobolSampler(xstart, xend, ystart, yend, useNoiseAware);
+    return new SobolSampler(xstart, xend, ystart, yend, useNoiseAware, owen);
 }
 
 static DynamicLoader::RegisterSampler<SobolSampler> r("sobol");
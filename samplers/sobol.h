@@ -32,15 +32,22 @@ class SobolSampler : public Sampler
 public:
 	class SobolData {
 	public:
-		SobolData(const Sampler &sampler, const Sample &sample);
+		SobolData(const SobolSampler &sampler, const Sample &sample);
 		~SobolData();
 
 		u_int SobolDimension(const SobolSampler &sampler,
 			const u_int index, const u_int dimension) const;
 		float GetSample(const SobolSampler &sampler, const u_int index) const;
+		// Moves all dimensions to the next pass at once, only used
+		// with Owen scrambling
+		void NextPass(const SobolSampler &sampler);
 
 		float rng0, rng1;
+		u_int seed;
 		u_int pass;
+		// Unscrambled values of all dimensions for the current pass,
+		// only used with Owen scrambling
+		u_int *values;
 
 		u_int nxD;
 		float **xD;
@@ -51,7 +58,8 @@ public:
 		boost::shared_ptr<luxrays::Distribution2D> samplingDistribution2D;
 	};
 
-	SobolSampler(int xstart, int xend, int ystart, int yend, bool useNoise);
+	SobolSampler(int xstart, int xend, int ystart, int yend, bool useNoise,
+		bool owen);
 	virtual ~SobolSampler();
 
 	virtual void InitSample(Sample *sample) const;
@@ -74,6 +82,13 @@ private:
 	mutable fast_mutex initDirectionsMutex;
 	mutable u_int *directions;
 	mutable vector<u_int> offset1D, offset2D, offsetxD;
+	mutable u_int sampleCount;
+	// Direction numbers stored bit after bit with sampleCount rounded
+	// up to a multiple of 4 dimensions, only used with Owen scrambling
+	mutable u_int *directionsByBit;
+	mutable u_int paddedSampleCount;
+
+	bool owenScrambling;
 
 	u_int totalPixels;
 };
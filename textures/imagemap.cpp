@@ -26,6 +26,9 @@
 #include "filedata.h"
 #include "geometry/raydifferential.h"
 
+#include <boost/filesystem.hpp>
+#include <boost/thread.hpp>
+
 using namespace lux;
 
 void NormalMapTexture::GetDuv(const SpectrumWavelengths &sw,
@@ -35,7 +38,7 @@ void NormalMapTexture::GetDuv(const SpectrumWavelengths &sw,
 	mapping->Map(dg, &s, &t);
 
 	// normal from normal map
-	Vector n(mipmap->LookupRGBAColor(s, t).c);
+	Vector n(GetMIPMap()->LookupRGBAColor(s, t).c);
 
 	// TODO - implement different methods for decoding normal
 	n = 2.f * n - Vector(1.f, 1.f, 1.f);
@@ -143,7 +146,12 @@ Texture<float> *ImageFloatTexture::CreateFloatTexture(const Transform &tex2world
 		ch = CHANNEL_MEAN;
 	}
 
-	TexInfo texInfo(filterType, filename, discardmm, maxAniso, wrapMode, gain, gamma);
+	bool tiled;
+	string tileCacheDir;
+	GetTileParams(tp, &tiled, &tileCacheDir);
+
+	TexInfo texInfo(filterType, filename, discardmm, maxAniso, wrapMode,
+		gain, gamma, tiled, tileCacheDir);
 	ImageFloatTexture *tex = new ImageFloatTexture(texInfo, TextureMapping2D::Create(tex2world, tp), ch);
 
 	return tex;
@@ -186,7 +194,12 @@ Texture<SWCSpectrum> *ImageSpectrumTexture::CreateSWCSpectrumTexture(const Trans
 	string filename = tp.FindOneString("filename", "");
 	int discardmm = tp.FindOneInt("discardmipmaps", 0);
 
-	TexInfo texInfo(filterType, filename, discardmm, maxAniso, wrapMode, gain, gamma);
+	bool tiled;
+	string tileCacheDir;
+	GetTileParams(tp, &tiled, &tileCacheDir);
+
+	TexInfo texInfo(filterType, filename, discardmm, maxAniso, wrapMode,
+		gain, gamma, tiled, tileCacheDir);
 	ImageSpectrumTexture *tex = new ImageSpectrumTexture(texInfo, TextureMapping2D::Create(tex2world, tp));
 
 	return tex;
@@ -227,13 +240,226 @@ Texture<float> *NormalMapTexture::CreateFloatTexture(const Transform &tex2world,
 	string filename = tp.FindOneString("filename", "");
 	int discardmm = tp.FindOneInt("discardmipmaps", 0);
 
-	TexInfo texInfo(filterType, filename, discardmm, maxAniso, wrapMode, gain, gamma);
+	bool tiled;
+	string tileCacheDir;
+	GetTileParams(tp, &tiled, &tileCacheDir);
+
+	TexInfo texInfo(filterType, filename, discardmm, maxAniso, wrapMode,
+		gain, gamma, tiled, tileCacheDir);
 	NormalMapTexture *tex = new NormalMapTexture(texInfo, TextureMapping2D::Create(tex2world, tp));
 
 	return tex;
 }
 
-map<TexInfo, boost::shared_ptr<MIPMap> > ImageTexture::textures;
+map<TexInfo, boost::shared_ptr<ImageTextureLoad> > ImageTexture::textures;
+std::set<ImageTexture *> ImageTexture::pendingTextures;
+boost::mutex ImageTexture::pendingMutex;
+boost::mutex ImageTexture::loadQueueMutex;
+std::deque<boost::shared_ptr<ImageTextureLoad> > ImageTexture::loadQueue;
+u_int ImageTexture::loadThreadCount = 0;
+
+void ImageTextureLoad::Run()
+{
+	boost::shared_ptr<MIPMap> ret(ImageTexture::LoadTexture(info));
+
+	boost::mutex::scoped_lock lock(mutex);
+	mipmap = ret;
+	done = true;
+	condition.notify_all();
+}
+
+boost::shared_ptr<MIPMap> ImageTextureLoad::Wait()
+{
+	boost::mutex::scoped_lock lock(mutex);
+	while (!done)
+		condition.wait(lock);
+	return mipmap;
+}
+
+boost::shared_ptr<ImageTextureLoad> ImageTexture::GetTexture(const TexInfo &texInfo)
+{
+	// Look for texture in texture cache
+	map<TexInfo, boost::shared_ptr<ImageTextureLoad> >::iterator t = textures.find(texInfo);
+	if (t != textures.end()) {
+		LOG(LUX_INFO, LUX_NOERROR) << "Reusing data for imagemap '" <<
+			texInfo.filename << "'";
+		return (*t).second;
+	}
+
+	boost::shared_ptr<ImageTextureLoad> ret(new ImageTextureLoad(texInfo));
+	textures[texInfo] = ret;
+
+	// Queue the load and start a new thread if all are busy
+	boost::mutex::scoped_lock lock(loadQueueMutex);
+	loadQueue.push_back(ret);
+	if (loadThreadCount < max(1U, boost::thread::hardware_concurrency())) {
+		++loadThreadCount;
+		boost::thread loader(&ImageTexture::LoadThread);
+		loader.detach();
+	}
+
+	return ret;
+}
+
+void ImageTexture::LoadThread()
+{
+	for (;;) {
+		boost::shared_ptr<ImageTextureLoad> load;
+		{
+			boost::mutex::scoped_lock lock(loadQueueMutex);
+			// Threads exit as soon as there is nothing left to load
+			if (loadQueue.empty()) {
+				--loadThreadCount;
+				return;
+			}
+			load = loadQueue.front();
+			loadQueue.pop_front();
+		}
+		load->Run();
+	}
+}
+
+void ImageTexture::WaitTexture() const
+{
+	boost::shared_ptr<MIPMap> map(load->Wait());
+	boost::mutex::scoped_lock lock(pendingMutex);
+	if (!atomic_read32(&mipmapReady)) {
+		mipmap = map;
+		atomic_write32(&mipmapReady, 1);
+	}
+	pendingTextures.erase(const_cast<ImageTexture *>(this));
+}
+
+void ImageTexture::WaitPendingTextures()
+{
+	{
+		boost::mutex::scoped_lock lock(pendingMutex);
+		if (pendingTextures.empty())
+			return;
+		LOG(LUX_INFO, LUX_NOERROR) << "Waiting for " <<
+			pendingTextures.size() << " imagemaps to be loaded";
+	}
+	for (;;) {
+		const ImageTexture *texture;
+		{
+			boost::mutex::scoped_lock lock(pendingMutex);
+			if (pendingTextures.empty())
+				break;
+			texture = *pendingTextures.begin();
+		}
+		texture->WaitTexture();
+	}
+}
+
+MIPMap *ImageTexture::LoadTexture(const TexInfo &texInfo)
+{
+	MIPMap *ret = NULL;
+	if (texInfo.tiled) {
+		ret = GetTiledTexture(texInfo);
+		if (!ret)
+			LOG(LUX_WARNING, LUX_NOERROR) << "Unable to use a tiled file for imagemap '" <<
+				texInfo.filename << "', loading it in memory";
+	}
+	if (!ret) {
+		std::auto_ptr<ImageData> imgdata(ReadImage(texInfo.filename));
+		if (imgdata.get() != NULL) {
+			ret = imgdata->createMIPMap(texInfo.filterType,
+				texInfo.maxAniso, texInfo.wrapMode, texInfo.gain,
+				texInfo.gamma);
+		} else {
+			// Create one-valued _MIPMap_
+			TextureColor<float, 1> oneVal(1.f);
+
+			ret = new MIPMapFastImpl<TextureColor<float, 1> >(
+				texInfo.filterType, 1, 1, &oneVal);
+		}
+	}
+	if (ret) {
+		if (texInfo.discardmm > 0 && (texInfo.filterType == MIPMAP_TRILINEAR ||
+			texInfo.filterType == MIPMAP_EWA)) {
+			ret->DiscardMipmaps(texInfo.discardmm);
+
+			LOG(LUX_INFO, LUX_NOERROR) << "Discarded " <<
+				texInfo.discardmm << " mipmap levels";
+		}
+
+		LOG(LUX_INFO, LUX_NOERROR) << "Memory used for imagemap '" <<
+			texInfo.filename << "': " << (ret->GetMemoryUsed() / 1024) <<
+			"KBytes";
+	} else
+		LOG(LUX_ERROR, LUX_SYSTEM) << "Creation of imagemap '" <<
+			texInfo.filename << "' failed";
+
+	return ret;
+}
+
+void ImageTexture::GetTileParams(const ParamSet &tp, bool *tiled,
+	string *tileCacheDir)
+{
+	*tiled = tp.FindOneBool("tiled", false);
+	*tileCacheDir = tp.FindOneString("tilecachedir", "");
+	// The tile cache is shared by all tiled textures,
+	// keep the largest requested budget
+	const int cacheSize = tp.FindOneInt("tilecachesize", 0);
+	if (cacheSize > 0) {
+		const size_t bytes = static_cast<size_t>(cacheSize) * 1024 * 1024;
+		if (bytes > TextureTileCache::GetMaxMemory())
+			TextureTileCache::SetMaxMemory(bytes);
+	}
+}
+
+MIPMap *ImageTexture::GetTiledTexture(const TexInfo &texInfo)
+{
+	boost::uint64_t sourceSize;
+	boost::int64_t sourceTime;
+	if (!TiledImageFile::SourceStamp(texInfo.filename, &sourceSize, &sourceTime))
+		return NULL;
+
+	// The tiled file is next to the image, or in the temporary directory
+	// when the image directory is read only
+	vector<string> tiledNames;
+	tiledNames.push_back(TiledImageFile::CachePath(texInfo.filename,
+		texInfo.wrapMode, texInfo.filterType, texInfo.tileCacheDir));
+	if (texInfo.tileCacheDir.empty()) {
+		try {
+			tiledNames.push_back(TiledImageFile::CachePath(texInfo.filename,
+				texInfo.wrapMode, texInfo.filterType,
+				boost::filesystem::temp_directory_path().string()));
+		} catch (const boost::filesystem::filesystem_error &) {
+		}
+	}
+
+	boost::shared_ptr<TiledImageFile> file;
+	for (u_int i = 0; i < tiledNames.size(); ++i) {
+		file.reset(new TiledImageFile(tiledNames[i]));
+		if (file->IsValid() && file->IsUpToDate(texInfo.filename) &&
+			file->GetHeader().filterType == static_cast<u_int>(texInfo.filterType)) {
+			LOG(LUX_INFO, LUX_NOERROR) << "Using tiled file '" << tiledNames[i] << "'";
+			return CreateTiledMIPMap(file, texInfo.filterType,
+				texInfo.maxAniso, texInfo.gain, texInfo.gamma);
+		}
+	}
+	file.reset();
+
+	// (Re)build the tiled file, this is the only time the full
+	// image has to be decoded
+	std::auto_ptr<ImageData> imgdata(ReadImage(texInfo.filename));
+	if (imgdata.get() == NULL)
+		return NULL;
+	for (u_int i = 0; i < tiledNames.size(); ++i) {
+		LOG(LUX_INFO, LUX_NOERROR) << "Writing tiled file '" << tiledNames[i] << "'";
+		if (!imgdata->writeTiledImage(tiledNames[i], texInfo.filterType,
+			texInfo.wrapMode, TILED_IMAGE_TILE_SIZE, sourceSize, sourceTime))
+			continue;
+		file.reset(new TiledImageFile(tiledNames[i]));
+		if (!file->IsValid())
+			return NULL;
+		return CreateTiledMIPMap(file, texInfo.filterType, texInfo.maxAniso,
+			texInfo.gain, texInfo.gamma);
+	}
+
+	return NULL;
+}
 
 static DynamicLoader::RegisterFloatTexture<ImageFloatTexture> r1("imagemap");
 static DynamicLoader::RegisterSWCSpectrumTexture<ImageSpectrumTexture> r2("imagemap");
@@ -30,8 +30,13 @@ using luxrays::RGBIllumSPD;
 #include "imagereader.h"
 #include "paramset.h"
 #include "error.h"
+#include "osfunc.h"
 #include <map>
 using std::map;
+#include <set>
+#include <deque>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
 
 // TODO - radiance - add methods for Power and Illuminant propagation
 
@@ -41,9 +46,11 @@ namespace lux
 class TexInfo {
 public:
 	TexInfo(ImageTextureFilterType type, const string &f, int dm,
-		float ma, ImageWrap wm, float ga, float gam) :
+		float ma, ImageWrap wm, float ga, float gam, bool t = false,
+		const string &tcd = "") :
 		filterType(type), filename(f), discardmm(dm),
-		maxAniso(ma), wrapMode(wm), gain(ga), gamma(gam) { }
+		maxAniso(ma), wrapMode(wm), gain(ga), gamma(gam), tiled(t),
+		tileCacheDir(tcd) { }
 
 	ImageTextureFilterType filterType;
 	string filename;
@@ -52,6 +59,9 @@ public:
 	ImageWrap wrapMode;
 	float gain;
 	float gamma;
+	// Load texels on demand from a pre-tiled file
+	bool tiled;
+	string tileCacheDir;
 
 	bool operator<(const TexInfo &t2) const {
 		if (filterType != t2.filterType)
@@ -66,44 +76,106 @@ public:
 			return wrapMode < t2.wrapMode;
 		if (gain != t2.gain)
 			return gain < t2.gain;
-		return gamma < t2.gamma;
+		if (gamma != t2.gamma)
+			return gamma < t2.gamma;
+		if (tiled != t2.tiled)
+			return tiled < t2.tiled;
+		return tileCacheDir < t2.tileCacheDir;
 	}
 };
 
+// Image loading and MIPMap construction run in a pool of background
+// threads so that they overlap with the rest of the scene parsing.
+// The same load is shared by all textures using the same image with
+// the same parameters.
+class ImageTextureLoad {
+public:
+	ImageTextureLoad(const TexInfo &texInfo) : info(texInfo), done(false) { }
+
+	// Loads the image and signals waiting threads
+	void Run();
+	// Blocks until the map is available
+	boost::shared_ptr<MIPMap> Wait();
+
+	const TexInfo info;
+
+private:
+	boost::mutex mutex;
+	boost::condition_variable condition;
+	bool done;
+	boost::shared_ptr<MIPMap> mipmap;
+};
+
 class ImageTexture {
 public:
 	// ImageTexture Public Methods
-	ImageTexture(const TexInfo &texInfo, TextureMapping2D *m) : info(texInfo) {
+	ImageTexture(const TexInfo &texInfo, TextureMapping2D *m) :
+		mipmapReady(0), info(texInfo) {
 		mapping = m;
-		mipmap = GetTexture(info);
+		load = GetTexture(info);
+		boost::mutex::scoped_lock lock(pendingMutex);
+		pendingTextures.insert(this);
 	}
 	virtual ~ImageTexture() {
+		// Don't leave a loading thread behind
+		if (!atomic_read32(&mipmapReady))
+			WaitTexture();
 		// If the map isn't used anymore, remove it from the cache
 		// The last user still has 2 references:
 		// 1 from the texture and 1 from the dictionary
-		for (map<TexInfo, boost::shared_ptr<MIPMap> >::iterator t = textures.begin(); t != textures.end(); ++t) {
-			if ((*t).second.get() == mipmap.get() &&
-				(*t).second.use_count() == 2) {
-				textures.erase(t);
-				break;
-			}
-		}
+		map<TexInfo, boost::shared_ptr<ImageTextureLoad> >::iterator t = textures.find(info);
+		if (t != textures.end() && (*t).second == load &&
+			(*t).second.use_count() == 2)
+			textures.erase(t);
 		delete mapping;
 	}
 
-	const MIPMap *GetMIPMap() const { return mipmap.get(); }
+	const MIPMap *GetMIPMap() const {
+		// Once published the map is only read
+		if (!atomic_read32(&mipmapReady))
+			WaitTexture();
+		return mipmap.get();
+	}
 	const TextureMapping2D *GetTextureMapping2D() const { return mapping; }
 	const TexInfo &GetInfo() const { return info; }
 
+	// Waits for all image textures still being loaded,
+	// must be called before rendering starts
+	static void WaitPendingTextures();
+
+	// Loads an image and builds its MIPMap, called by the loading threads
+	static MIPMap *LoadTexture(const TexInfo &texInfo);
+
 private:
-	static map<TexInfo, boost::shared_ptr<MIPMap> > textures;
+	static map<TexInfo, boost::shared_ptr<ImageTextureLoad> > textures;
+	// Textures whose map has not been retrieved yet, rendering threads
+	// may retrieve a map too so the set and the map publication are
+	// protected by pendingMutex
+	static std::set<ImageTexture *> pendingTextures;
+	static boost::mutex pendingMutex;
+
+	// Loading thread pool
+	static boost::mutex loadQueueMutex;
+	static std::deque<boost::shared_ptr<ImageTextureLoad> > loadQueue;
+	static u_int loadThreadCount;
 
 	// ImageTexture Private Methods
-	static boost::shared_ptr<MIPMap> GetTexture(const TexInfo &texInfo);
+	static boost::shared_ptr<ImageTextureLoad> GetTexture(const TexInfo &texInfo);
+	static MIPMap *GetTiledTexture(const TexInfo &texInfo);
+	static void LoadThread();
+	void WaitTexture() const;
 
 protected:
+	// Reads the "tiled", "tilecachesize" and "tilecachedir" parameters
+	static void GetTileParams(const ParamSet &tp, bool *tiled,
+		string *tileCacheDir);
+
 	// ImageTexture Protected Data
-	boost::shared_ptr<MIPMap> mipmap;
+	// Set by WaitTexture() once the load is over, mipmapReady is then
+	// set to 1
+	mutable boost::shared_ptr<MIPMap> mipmap;
+	mutable boost::uint32_t mipmapReady;
+	boost::shared_ptr<ImageTextureLoad> load;
 	TextureMapping2D *mapping;
 	TexInfo info;
 };
@@ -122,10 +194,10 @@ public:
 		const DifferentialGeometry &dg) const {
 		float s, t;
 		mapping->Map(dg, &s, &t);
-		return mipmap->LookupFloat(channel, s, t);
+		return GetMIPMap()->LookupFloat(channel, s, t);
 	}
 	virtual float Y() const {
-		return mipmap->LookupFloat(channel, .5f, .5f, .5f);
+		return GetMIPMap()->LookupFloat(channel, .5f, .5f, .5f);
 	}
 	virtual void GetDuv(const SpectrumWavelengths &sw,
 		const DifferentialGeometry &dg, float delta,
@@ -133,13 +205,13 @@ public:
 		float s, t, dsdu, dtdu, dsdv, dtdv;
 		mapping->MapDuv(dg, &s, &t, &dsdu, &dtdu, &dsdv, &dtdv);
 		float ds, dt;
-		mipmap->GetDifferentials(channel, s, t, &ds, &dt);
+		GetMIPMap()->GetDifferentials(channel, s, t, &ds, &dt);
 		*du = ds * dsdu + dt * dtdu;
 		*dv = ds * dsdv + dt * dtdv;
 	}
 
 	virtual void GetMinMaxFloat(float *minValue, float *maxValue) const {
-		mipmap->GetMinMaxFloat(channel, minValue, maxValue);
+		GetMIPMap()->GetMinMaxFloat(channel, minValue, maxValue);
 	}
 
 	Channel GetChannel() const { return channel; }
@@ -165,17 +237,17 @@ public:
 		float s, t;
 		mapping->Map(dg, &s, &t);
 		if (isIlluminant)
-			return SWCSpectrum(sw, whiteRGBIllum) * mipmap->LookupSpectrum(sw, s, t);
+			return SWCSpectrum(sw, whiteRGBIllum) * GetMIPMap()->LookupSpectrum(sw, s, t);
 		else
-			return mipmap->LookupSpectrum(sw, s, t);
+			return GetMIPMap()->LookupSpectrum(sw, s, t);
 	}
 	virtual float Y() const {
 		return (isIlluminant ? whiteRGBIllum.Y() : 1.f) * 
-			mipmap->LookupFloat(CHANNEL_WMEAN, .5f, .5f, .5f);
+			GetMIPMap()->LookupFloat(CHANNEL_WMEAN, .5f, .5f, .5f);
 	}
 	virtual float Filter() const {
 		return (isIlluminant ? whiteRGBIllum.Filter() : 1.f) *
-			mipmap->LookupFloat(CHANNEL_MEAN, .5f, .5f, .5f);
+			GetMIPMap()->LookupFloat(CHANNEL_MEAN, .5f, .5f, .5f);
 	}
 	virtual void GetDuv(const SpectrumWavelengths &sw,
 		const DifferentialGeometry &dg, float delta,
@@ -183,7 +255,7 @@ public:
 		float s, t, dsdu, dtdu, dsdv, dtdv;
 		mapping->MapDuv(dg, &s, &t, &dsdu, &dtdu, &dsdv, &dtdv);
 		float ds, dt;
-		mipmap->GetDifferentials(sw, s, t, &ds, &dt);
+		GetMIPMap()->GetDifferentials(sw, s, t, &ds, &dt);
 		*du = ds * dsdu + dt * dtdu;
 		*dv = ds * dsdv + dt * dtdv;
 	}
@@ -230,46 +302,4 @@ private:
 	// NormalMapTexture Private Data
 };
 
-// ImageTexture Method Definitions
-inline boost::shared_ptr<MIPMap> ImageTexture::GetTexture(const TexInfo &texInfo) {
-	// Look for texture in texture cache
-	if (textures.find(texInfo) != textures.end()) {
-		LOG(LUX_INFO, LUX_NOERROR) << "Reusing data for imagemap '" <<
-			texInfo.filename << "'";
-		return textures[texInfo];
-	}
-	std::auto_ptr<ImageData> imgdata(ReadImage(texInfo.filename));
-	boost::shared_ptr<MIPMap> ret;
-	if (imgdata.get() != NULL) {
-		ret = boost::shared_ptr<MIPMap>(imgdata->createMIPMap(
-				texInfo.filterType, texInfo.maxAniso, texInfo.wrapMode, texInfo.gain, texInfo.gamma));
-	} else {
-		// Create one-valued _MIPMap_
-		TextureColor<float, 1> oneVal(1.f);
-
-		ret = boost::shared_ptr<MIPMap>(new MIPMapFastImpl<TextureColor<float, 1> >(
-				texInfo.filterType, 1, 1, &oneVal));
-	}
-	if (ret) {
-		if (texInfo.discardmm > 0 && (texInfo.filterType == MIPMAP_TRILINEAR ||
-			texInfo.filterType == MIPMAP_EWA)) {
-			ret->DiscardMipmaps(texInfo.discardmm);
-
-			LOG(LUX_INFO, LUX_NOERROR) << "Discarded " <<
-				texInfo.discardmm << " mipmap levels";
-		}
-
-		LOG(LUX_INFO, LUX_NOERROR) << "Memory used for imagemap '" <<
-			texInfo.filename << "': " << (ret->GetMemoryUsed() / 1024) <<
-			"KBytes";
-
-		textures[texInfo] = ret;
-		return textures[texInfo];
-	}
-	LOG(LUX_ERROR, LUX_SYSTEM) << "Creation of imagemap '" << texInfo.filename <<
-		"' failed";
-
-	return boost::shared_ptr<MIPMap>();
-}
-
 }//namespace lux
@@ -0,0 +1,93 @@
+/***************************************************************************
+ *   Copyright (C) 1998-2013 by authors (see AUTHORS.txt)                  *
+ *                                                                         *
+ *   This file is part of LuxRender.                                       *
+ *                                                                         *
+ *   Lux Renderer is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   Lux Renderer is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+ *                                                                         *
+ *   This project is based on PBRT ; see http://www.pbrt.org               *
+ *   Lux Renderer website : http://www.luxrender.net                       *
+ ***************************************************************************/
+
+
+
+// Converts a text scene (.lxs) to a binary scene (.lxb). The scene is read
+// with the regular parser, so included files are flattened into the output.
+
+#include <iostream>
+
+#include "lux.h"
+#include "api.h"
+
+#include <boost/program_options.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+namespace po = boost::program_options;
+
+int main(int ac, char *av[])
+{
+	try {
+		po::options_description generic("Allowed options");
+		generic.add_options()
+			("help,h", "Produce help message")
+			("input,i", po::value<std::string>(), "Scene file to convert")
+			("output,o", po::value<std::string>(), "Binary scene file, defaults to the input file with the .lxb extension")
+			;
+
+		po::positional_options_description positional;
+		positional.add("input", 1);
+		positional.add("output", 1);
+
+		po::variables_map vm;
+		po::store(po::command_line_parser(ac, av).options(generic).
+			positional(positional).run(), vm);
+		po::notify(vm);
+
+		if (vm.count("help") || !vm.count("input")) {
+			std::cout << "Usage: luxbinexport [options] input.lxs [output.lxb]" << std::endl;
+			std::cout << generic << std::endl;
+			return vm.count("help") ? 0 : 1;
+		}
+
+		const std::string input(vm["input"].as<std::string>());
+		std::string output;
+		if (vm.count("output"))
+			output = vm["output"].as<std::string>();
+		else
+			output = boost::filesystem::path(input).replace_extension(".lxb").string();
+
+		luxInit();
+
+		const boost::posix_time::ptime start(boost::posix_time::microsec_clock::universal_time());
+		const int ok = luxExportBinaryScene(input.c_str(), output.c_str());
+		const double elapsed = (boost::posix_time::microsec_clock::universal_time() -
+			start).total_microseconds() / 1e6;
+
+		luxCleanup();
+
+		if (!ok) {
+			std::cout << "Conversion of '" << input << "' failed" << std::endl;
+			return 1;
+		}
+		std::cout << "Wrote '" << output << "' (" <<
+			boost::filesystem::file_size(output) / (1024. * 1024.) <<
+			" MB) in " << elapsed << " s" << std::endl;
+	} catch (std::exception &e) {
+		std::cout << e.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
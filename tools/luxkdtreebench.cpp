@@ -0,0 +1,316 @@
+/***************************************************************************
+ *   Copyright (C) 1998-2013 by authors (see AUTHORS.txt)                  *
+ *                                                                         *
+ *   This file is part of LuxRender.                                       *
+ *                                                                         *
+ *   Lux Renderer is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   Lux Renderer is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+ *                                                                         *
+ *   This project is based on PBRT ; see http://www.pbrt.org               *
+ *   Lux Renderer website : http://www.luxrender.net                       *
+ ***************************************************************************/
+
+// Photon map kd-tree benchmark: builds the implicit kd-tree used by the
+// photon maps and the previous pointer based one over the same random
+// points, then compares their k nearest neighbour lookup times. The
+// distances found by both trees are checked against each other.
+
+#include <iostream>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+
+#include "api.h"
+#include "kdtree.h"
+#include "photonmap.h"
+#include "randomgen.h"
+
+#include <boost/program_options.hpp>
+#include <boost/scoped_array.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+using namespace lux;
+namespace po = boost::program_options;
+
+// Seconds elapsed since start
+static double Elapsed(const boost::posix_time::ptime &start)
+{
+	return (boost::posix_time::microsec_clock::universal_time() -
+		start).total_microseconds() / 1e6;
+}
+
+struct BenchPoint {
+	Point p;
+	u_int id;
+};
+
+// The kd-tree used by the photon maps before the implicit layout: one
+// point per node, built recursively and searched recursively
+struct ReferenceKdNode {
+	void init(float p, u_int a) {
+		splitPos = p;
+		splitAxis = a;
+		rightChild = ~0U;
+		hasLeftChild = 0;
+	}
+	void initLeaf() {
+		init(0.0f, 3);
+	}
+	float splitPos;
+	u_int splitAxis:2;
+	u_int hasLeftChild:1;
+	u_int rightChild:29;
+};
+
+template <class LookupProc> class ReferenceKdTree {
+public:
+	ReferenceKdTree(const vector<BenchPoint> &d) : nNodes(d.size()),
+		nextFreeNode(1), nodes(new ReferenceKdNode[nNodes]),
+		nodeData(new BenchPoint[nNodes]) {
+		vector<const BenchPoint *> buildNodes;
+		for (u_int i = 0; i < nNodes; ++i)
+			buildNodes.push_back(&d[i]);
+		if (nNodes > 0)
+			recursiveBuild(0, 0, nNodes, buildNodes);
+	}
+
+	void Lookup(const Point &p, const LookupProc &process,
+		float &maxDistSquared) const {
+		if (nNodes > 0)
+			privateLookup(0, p, process, maxDistSquared);
+	}
+
+private:
+	struct CompareNode {
+		CompareNode(int a) : axis(a) { }
+		int axis;
+		bool operator()(const BenchPoint *d1, const BenchPoint *d2) const {
+			return d1->p[axis] == d2->p[axis] ? (d1 < d2) :
+				d1->p[axis] < d2->p[axis];
+		}
+	};
+
+	void recursiveBuild(u_int nodeNum, u_int start, u_int end,
+		vector<const BenchPoint *> &buildNodes) {
+		if (start + 1 == end) {
+			nodes[nodeNum].initLeaf();
+			nodeData[nodeNum] = *buildNodes[start];
+			return;
+		}
+		BBox bound;
+		for (u_int i = start; i < end; ++i)
+			bound = Union(bound, buildNodes[i]->p);
+		const u_int splitAxis = bound.MaximumExtent();
+		const u_int splitPos = (start + end) / 2;
+		std::nth_element(buildNodes.begin() + start,
+			buildNodes.begin() + splitPos, buildNodes.begin() + end,
+			CompareNode(splitAxis));
+		nodes[nodeNum].init(buildNodes[splitPos]->p[splitAxis], splitAxis);
+		nodeData[nodeNum] = *buildNodes[splitPos];
+		if (start < splitPos) {
+			nodes[nodeNum].hasLeftChild = 1;
+			const u_int childNum = nextFreeNode++;
+			recursiveBuild(childNum, start, splitPos, buildNodes);
+		}
+		if (splitPos + 1 < end) {
+			nodes[nodeNum].rightChild = nextFreeNode++;
+			recursiveBuild(nodes[nodeNum].rightChild, splitPos + 1,
+				end, buildNodes);
+		}
+	}
+
+	void privateLookup(u_int nodeNum, const Point &p,
+		const LookupProc &process, float &maxDistSquared) const {
+		const ReferenceKdNode &node(nodes[nodeNum]);
+		const u_int axis = node.splitAxis;
+		if (axis != 3) {
+			const float dist = p[axis] - node.splitPos;
+			const float dist2 = dist * dist;
+			if (p[axis] <= node.splitPos) {
+				if (node.hasLeftChild)
+					privateLookup(nodeNum + 1, p, process,
+						maxDistSquared);
+				if (dist2 < maxDistSquared && node.rightChild < nNodes)
+					privateLookup(node.rightChild, p, process,
+						maxDistSquared);
+			} else {
+				if (node.rightChild < nNodes)
+					privateLookup(node.rightChild, p, process,
+						maxDistSquared);
+				if (dist2 < maxDistSquared && node.hasLeftChild)
+					privateLookup(nodeNum + 1, p, process,
+						maxDistSquared);
+			}
+		}
+		const float dist2 = DistanceSquared(nodeData[nodeNum].p, p);
+		if (dist2 < maxDistSquared)
+			process(nodeData[nodeNum], dist2, maxDistSquared);
+	}
+
+	u_int nNodes, nextFreeNode;
+	boost::scoped_array<ReferenceKdNode> nodes;
+	boost::scoped_array<BenchPoint> nodeData;
+};
+
+// The k nearest point set management used with the reference tree,
+// with a pop_heap/push_heap pair for each replaced point
+class ReferenceNearSetProcess {
+public:
+	ReferenceNearSetProcess(u_int mp) : photons(NULL), nLookup(mp),
+		foundPhotons(0) { }
+
+	void operator()(const BenchPoint &photon, float distSquared,
+		float &maxDistSquared) const {
+		if (foundPhotons < nLookup) {
+			photons[foundPhotons++] = ClosePhoton<BenchPoint>(&photon,
+				distSquared);
+			if (foundPhotons == nLookup) {
+				std::make_heap(&photons[0], &photons[nLookup]);
+				maxDistSquared = photons[0].distanceSquared;
+			}
+		} else {
+			std::pop_heap(&photons[0], &photons[nLookup]);
+			photons[nLookup - 1] = ClosePhoton<BenchPoint>(&photon,
+				distSquared);
+			std::push_heap(&photons[0], &photons[nLookup]);
+			maxDistSquared = photons[0].distanceSquared;
+		}
+	}
+
+	ClosePhoton<BenchPoint> *photons;
+	u_int nLookup;
+	mutable u_int foundPhotons;
+};
+
+// Sum of the distances found for a query, independent of their order
+static double DistanceSum(const ClosePhoton<BenchPoint> *photons, u_int count)
+{
+	double sum = 0.;
+	for (u_int i = 0; i < count; ++i)
+		sum += photons[i].distanceSquared;
+	return sum;
+}
+
+static void Bench(const vector<BenchPoint> &points,
+	const vector<Point> &queries, u_int nLookup, float radius)
+{
+	typedef KdTree<BenchPoint, NearSetPhotonProcess<BenchPoint> > Tree;
+	typedef ReferenceKdTree<ReferenceNearSetProcess> ReferenceTree;
+
+	boost::posix_time::ptime start(boost::posix_time::microsec_clock::universal_time());
+	boost::scoped_ptr<ReferenceTree> referenceTree(new ReferenceTree(points));
+	const double referenceBuildTime = Elapsed(start);
+	start = boost::posix_time::microsec_clock::universal_time();
+	boost::scoped_ptr<Tree> tree(new Tree(points));
+	const double buildTime = Elapsed(start);
+
+	const u_int nQueries = queries.size();
+	boost::scoped_array<ClosePhoton<BenchPoint> > found(
+		new ClosePhoton<BenchPoint>[nLookup]);
+	vector<double> referenceSums(nQueries);
+	vector<u_int> referenceCounts(nQueries);
+
+	double referenceChecksum = 0.;
+	start = boost::posix_time::microsec_clock::universal_time();
+	for (u_int i = 0; i < nQueries; ++i) {
+		ReferenceNearSetProcess proc(nLookup);
+		proc.photons = found.get();
+		float maxDistSquared = radius * radius;
+		referenceTree->Lookup(queries[i], proc, maxDistSquared);
+		referenceCounts[i] = proc.foundPhotons;
+		referenceSums[i] = DistanceSum(found.get(), proc.foundPhotons);
+		referenceChecksum += referenceSums[i];
+	}
+	const double referenceTime = Elapsed(start);
+
+	double checksum = 0.;
+	u_int mismatches = 0;
+	start = boost::posix_time::microsec_clock::universal_time();
+	for (u_int i = 0; i < nQueries; ++i) {
+		NearSetPhotonProcess<BenchPoint> proc(nLookup, queries[i]);
+		proc.photons = found.get();
+		float maxDistSquared = radius * radius;
+		tree->Lookup(queries[i], proc, maxDistSquared);
+		const double sum = DistanceSum(found.get(), proc.foundPhotons);
+		checksum += sum;
+		if (proc.foundPhotons != referenceCounts[i] ||
+			fabs(sum - referenceSums[i]) > 1e-5 * max(sum, 1e-6))
+			++mismatches;
+	}
+	const double time = Elapsed(start);
+
+	std::cout << "k=" << nLookup << ", " << nQueries << " lookups" << std::endl;
+	std::cout << "  build:  " << referenceBuildTime << "s -> " <<
+		buildTime << "s" << std::endl;
+	std::cout << "  lookup: " << referenceTime << "s -> " << time <<
+		"s (x" << referenceTime / max(time, 1e-9) << ")" << std::endl;
+	std::cout << "  checksum: " << referenceChecksum << " / " << checksum <<
+		", " << mismatches << " mismatching lookups" << std::endl;
+}
+
+int main(int ac, char *av[])
+{
+	try {
+		po::options_description generic("Allowed options");
+		generic.add_options()
+			("help,h", "Produce help message")
+			("points,p", po::value<u_int>()->default_value(500000), "Number of points in the tree")
+			("queries,q", po::value<u_int>()->default_value(200000), "Number of lookups")
+			("nearest,k", po::value<u_int>()->default_value(50), "Number of nearest points looked up")
+			("radius,r", po::value<float>()->default_value(.2f), "Maximum lookup distance")
+			;
+
+		po::variables_map vm;
+		po::store(po::parse_command_line(ac, av, generic), vm);
+		po::notify(vm);
+
+		if (vm.count("help")) {
+			std::cout << "Usage: luxkdtreebench [options]" << std::endl;
+			std::cout << generic << std::endl;
+			return 0;
+		}
+
+		luxInit();
+		luxErrorFilter(LUX_WARNING);
+
+		// Points in the unit cube, clustered on a few planes like
+		// photons stored on the surfaces of a scene
+		RandomGenerator rng(1);
+		vector<BenchPoint> points(vm["points"].as<u_int>());
+		for (u_int i = 0; i < points.size(); ++i) {
+			points[i].p = Point(rng.floatValue(), rng.floatValue(),
+				rng.floatValue());
+			points[i].p[i % 3] = .25f * (i % 5);
+			points[i].id = i;
+		}
+		vector<Point> queries(vm["queries"].as<u_int>());
+		for (u_int i = 0; i < queries.size(); ++i) {
+			queries[i] = Point(rng.floatValue(), rng.floatValue(),
+				rng.floatValue());
+			queries[i][i % 3] = .25f * (i % 5);
+		}
+
+		const float radius = vm["radius"].as<float>();
+		Bench(points, queries, 1, radius);
+		if (vm["nearest"].as<u_int>() > 1)
+			Bench(points, queries, vm["nearest"].as<u_int>(), radius);
+
+		luxCleanup();
+	} catch (std::exception &e) {
+		std::cout << e.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
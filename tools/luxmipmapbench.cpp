@@ -0,0 +1,191 @@
+/***************************************************************************
+ *   Copyright (C) 1998-2013 by authors (see AUTHORS.txt)                  *
+ *                                                                         *
+ *   This file is part of LuxRender.                                       *
+ *                                                                         *
+ *   Lux Renderer is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   Lux Renderer is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+ *                                                                         *
+ *   This project is based on PBRT ; see http://www.pbrt.org               *
+ *   Lux Renderer website : http://www.luxrender.net                       *
+ ***************************************************************************/
+
+// Micro-benchmark of the EWA texture filtering code: compares the
+// vectorized and the scalar footprint weight kernels and measures the
+// throughput of MIPMapFastImpl EWA lookups for footprints inside the
+// map and crossing its border.
+
+#include <iostream>
+#include <cstdlib>
+
+#include "api.h"
+#include "mipmap.h"
+#include "texturecolor.h"
+#include "randomgen.h"
+
+#include <boost/program_options.hpp>
+#include <boost/scoped_array.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+using namespace lux;
+namespace po = boost::program_options;
+
+// Seconds elapsed since start
+static double Elapsed(const boost::posix_time::ptime &start)
+{
+	return (boost::posix_time::microsec_clock::universal_time() -
+		start).total_microseconds() / 1e6;
+}
+
+struct Footprint {
+	float A, B, C, ss0, tt;
+	u_int count;
+};
+
+static void BenchWeights(u_int count)
+{
+	float lut[WEIGHT_LUT_SIZE];
+	for (u_int i = 0; i < WEIGHT_LUT_SIZE; ++i) {
+		const float alpha = 2.f;
+		const float r2 = static_cast<float>(i) / static_cast<float>(WEIGHT_LUT_SIZE - 1);
+		lut[i] = expf(-alpha * r2) - expf(-alpha);
+	}
+
+	// Random ellipses with the same shape as the ones built by EWA()
+	RandomGenerator rng(1);
+	boost::scoped_array<Footprint> footprints(new Footprint[count]);
+	for (u_int i = 0; i < count; ++i) {
+		Footprint &f(footprints[i]);
+		const float ds0 = 8.f * rng.floatValue();
+		const float dt0 = 8.f * rng.floatValue();
+		const float ds1 = rng.floatValue();
+		const float dt1 = rng.floatValue();
+		f.A = dt0 * dt0 + dt1 * dt1 + 1.f;
+		f.B = -2.f * (ds0 * dt0 + ds1 * dt1);
+		f.C = ds0 * ds0 + ds1 * ds1 + 1.f;
+		const float invF = 1.f / (f.A * f.C - f.B * f.B * 0.25f);
+		const float du = sqrtf(f.C), dv = sqrtf(f.A);
+		f.A *= invF;
+		f.B *= invF;
+		f.C *= invF;
+		f.ss0 = -du + rng.floatValue();
+		f.tt = dv * (2.f * rng.floatValue() - 1.f);
+		f.count = min(static_cast<u_int>(2.f * du) + 1, static_cast<u_int>(EWA_ROW_CHUNK));
+	}
+
+	float weights[EWA_ROW_CHUNK], check[EWA_ROW_CHUNK];
+	float maxError = 0.f;
+	for (u_int i = 0; i < count; ++i) {
+		const Footprint &f(footprints[i]);
+		EWARowWeightsScalar(lut, f.A, f.B, f.C, f.ss0, f.tt, f.count, check);
+		EWARowWeights(lut, f.A, f.B, f.C, f.ss0, f.tt, f.count, weights);
+		for (u_int j = 0; j < f.count; ++j)
+			maxError = max(maxError, fabsf(weights[j] - check[j]));
+	}
+
+	float sum = 0.f;
+	boost::posix_time::ptime start(boost::posix_time::microsec_clock::universal_time());
+	for (u_int i = 0; i < count; ++i) {
+		const Footprint &f(footprints[i]);
+		sum += EWARowWeightsScalar(lut, f.A, f.B, f.C, f.ss0, f.tt, f.count, weights);
+	}
+	const double scalarTime = Elapsed(start);
+	start = boost::posix_time::microsec_clock::universal_time();
+	for (u_int i = 0; i < count; ++i) {
+		const Footprint &f(footprints[i]);
+		sum += EWARowWeights(lut, f.A, f.B, f.C, f.ss0, f.tt, f.count, weights);
+	}
+	const double simdTime = Elapsed(start);
+
+	std::cout << "EWA row weights, " << count << " rows" << std::endl;
+	std::cout << "  scalar:     " << scalarTime << "s" << std::endl;
+	std::cout << "  vectorized: " << simdTime << "s (x" <<
+		scalarTime / max(simdTime, 1e-9) << ")" << std::endl;
+	std::cout << "  max difference: " << maxError <<
+		" (checksum " << sum << ")" << std::endl;
+}
+
+static void BenchLookups(u_int resolution, u_int count, float footprint,
+	bool border)
+{
+	RandomGenerator rng(2);
+	boost::scoped_array<TextureColor<float, 3> > img(
+		new TextureColor<float, 3>[resolution * resolution]);
+	for (u_int i = 0; i < resolution * resolution; ++i) {
+		img[i].c[0] = rng.floatValue();
+		img[i].c[1] = rng.floatValue();
+		img[i].c[2] = rng.floatValue();
+	}
+	boost::scoped_ptr<MIPMapFastImpl<TextureColor<float, 3> > > mipmap(
+		new MIPMapFastImpl<TextureColor<float, 3> >(MIPMAP_EWA,
+		resolution, resolution, img.get(), 8.f, TEXTURE_REPEAT));
+
+	float sum = 0.f;
+	const boost::posix_time::ptime start(boost::posix_time::microsec_clock::universal_time());
+	for (u_int i = 0; i < count; ++i) {
+		// Footprints centered near an edge cross the map border
+		const float s = border ? 0.f : .25f + .5f * rng.floatValue();
+		const float t = .25f + .5f * rng.floatValue();
+		const float angle = 2.f * M_PI * rng.floatValue();
+		const float major = footprint * (1.f + 7.f * rng.floatValue());
+		sum += mipmap->LookupFloat(CHANNEL_MEAN, s, t,
+			major * cosf(angle), major * sinf(angle),
+			-footprint * sinf(angle), footprint * cosf(angle));
+	}
+	const double time = Elapsed(start);
+
+	std::cout << "EWA lookups, " << (border ? "border" : "interior") <<
+		" footprints: " << count / max(time, 1e-9) <<
+		" lookups/s (checksum " << sum << ")" << std::endl;
+}
+
+int main(int ac, char *av[])
+{
+	try {
+		po::options_description generic("Allowed options");
+		generic.add_options()
+			("help,h", "Produce help message")
+			("resolution,r", po::value<u_int>()->default_value(2048), "Texture resolution")
+			("count,n", po::value<u_int>()->default_value(1000000), "Number of lookups")
+			("footprint,f", po::value<float>()->default_value(.002f), "Minor axis of the filter footprint")
+			;
+
+		po::variables_map vm;
+		po::store(po::parse_command_line(ac, av, generic), vm);
+		po::notify(vm);
+
+		if (vm.count("help")) {
+			std::cout << "Usage: luxmipmapbench [options]" << std::endl;
+			std::cout << generic << std::endl;
+			return 0;
+		}
+
+		luxInit();
+		luxErrorFilter(LUX_WARNING);
+
+		const u_int count = vm["count"].as<u_int>();
+		BenchWeights(count);
+		BenchLookups(vm["resolution"].as<u_int>(), count,
+			vm["footprint"].as<float>(), false);
+		BenchLookups(vm["resolution"].as<u_int>(), count,
+			vm["footprint"].as<float>(), true);
+
+		luxCleanup();
+	} catch (std::exception &e) {
+		std::cout << e.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,191 @@
+/***************************************************************************
+ *   Copyright (C) 1998-2013 by authors (see AUTHORS.txt)                  *
+ *                                                                         *
+ *   This file is part of LuxRender.                                       *
+ *                                                                         *
+ *   Lux Renderer is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   Lux Renderer is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+ *                                                                         *
+ *   This project is based on PBRT ; see http://www.pbrt.org               *
+ *   Lux Renderer website : http://www.luxrender.net                       *
+ ***************************************************************************/
+
+
+// Scene parsing throughput benchmark: writes (or reads) a scene file
+// holding a large inline triangle mesh, measures the time needed to
+// parse it and the throughput of the number conversion alone compared
+// to atof.
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <cstdlib>
+
+#include "lux.h"
+#include "api.h"
+#include "numparse.h"
+#include "randomgen.h"
+
+#include <boost/program_options.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+using namespace lux;
+namespace po = boost::program_options;
+
+// Seconds elapsed since start
+static double Elapsed(const boost::posix_time::ptime &start)
+{
+	return (boost::posix_time::microsec_clock::universal_time() -
+		start).total_microseconds() / 1e6;
+}
+
+// Writes a grid mesh the way exporters do, one value per 6 decimals float
+static void WriteScene(const std::string &filename, u_int size)
+{
+	std::ofstream os(filename.c_str());
+	RandomGenerator rng(1);
+	char buf[64];
+
+	os << "WorldBegin\nAttributeBegin\nShape \"trianglemesh\"\n";
+	os << "\"integer indices\" [\n";
+	for (u_int y = 0; y < size - 1; ++y) {
+		for (u_int x = 0; x < size - 1; ++x) {
+			const u_int i = x + y * size;
+			os << i << " " << i + 1 << " " << i + size << " " <<
+				i + 1 << " " << i + size + 1 << " " << i + size << "\n";
+		}
+	}
+	os << "]\n\"point P\" [\n";
+	for (u_int y = 0; y < size; ++y) {
+		for (u_int x = 0; x < size; ++x) {
+			sprintf(buf, "%.6f %.6f %.6f\n", x - size * .5f,
+				y - size * .5f, rng.floatValue() - .5f);
+			os << buf;
+		}
+	}
+	os << "]\n\"float uv\" [\n";
+	for (u_int y = 0; y < size; ++y) {
+		for (u_int x = 0; x < size; ++x) {
+			sprintf(buf, "%.6f %.6f\n", static_cast<float>(x) / size,
+				static_cast<float>(y) / size);
+			os << buf;
+		}
+	}
+	os << "]\nAttributeEnd\n";
+}
+
+static void BenchConversion(const std::string &filename)
+{
+	std::ifstream is(filename.c_str(), std::ios_base::in | std::ios_base::binary);
+	std::stringstream ss;
+	ss << is.rdbuf();
+	const std::string text(ss.str());
+	const double size = text.size() / (1024. * 1024.);
+
+	// Only convert the characters that can start a number
+	boost::posix_time::ptime start(boost::posix_time::microsec_clock::universal_time());
+	double sum = 0.;
+	u_int count = 0;
+	for (const char *p = text.c_str(); *p; ) {
+		double value;
+		const char *next = ParseNumber(p, &value);
+		if (next) {
+			sum += value;
+			++count;
+			p = next;
+		} else
+			++p;
+	}
+	double elapsed = Elapsed(start);
+	std::cout << "ParseNumber: " << count << " numbers, " <<
+		size / elapsed << " MB/s" << std::endl;
+
+	start = boost::posix_time::microsec_clock::universal_time();
+	double sumRef = 0.;
+	for (const char *p = text.c_str(); *p; ) {
+		char *next;
+		const double value = strtod(p, &next);
+		if (next != p) {
+			sumRef += value;
+			p = next;
+		} else
+			++p;
+	}
+	elapsed = Elapsed(start);
+	std::cout << "strtod: " << size / elapsed << " MB/s" << std::endl;
+	if (sum != sumRef)
+		std::cout << "Checksum mismatch: " << sum << " " << sumRef << std::endl;
+}
+
+static void BenchParse(const std::string &filename)
+{
+	const double size = boost::filesystem::file_size(filename) / (1024. * 1024.);
+
+	const boost::posix_time::ptime start(boost::posix_time::microsec_clock::universal_time());
+	const int ok = luxParsePartial(filename.c_str());
+	const double elapsed = Elapsed(start);
+	if (!ok)
+		std::cout << "Parsing of '" << filename << "' failed" << std::endl;
+	std::cout << "Parse: " << size << " MB in " << elapsed << " s, " <<
+		size / elapsed << " MB/s" << std::endl;
+}
+
+int main(int ac, char *av[])
+{
+	try {
+		po::options_description generic("Allowed options");
+		generic.add_options()
+			("help,h", "Produce help message")
+			("scene,s", po::value<std::string>(), "Scene file to parse instead of a generated one")
+			("grid,g", po::value<u_int>()->default_value(1000), "Vertex count along the edge of the generated mesh")
+			("output,o", po::value<std::string>()->default_value("luxparsebench.lxs"), "Generated scene file")
+			("keep,k", "Keep the generated scene file")
+			;
+
+		po::variables_map vm;
+		po::store(po::parse_command_line(ac, av, generic), vm);
+		po::notify(vm);
+
+		if (vm.count("help")) {
+			std::cout << "Usage: luxparsebench [options]" << std::endl;
+			std::cout << generic << std::endl;
+			return 0;
+		}
+
+		std::string filename;
+		if (vm.count("scene"))
+			filename = vm["scene"].as<std::string>();
+		else {
+			filename = vm["output"].as<std::string>();
+			WriteScene(filename, std::max(2U, vm["grid"].as<u_int>()));
+		}
+
+		luxInit();
+		luxErrorFilter(LUX_WARNING);
+
+		BenchConversion(filename);
+		BenchParse(filename);
+
+		luxCleanup();
+
+		if (!vm.count("scene") && !vm.count("keep"))
+			boost::filesystem::remove(filename);
+	} catch (std::exception &e) {
+		std::cout << e.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}